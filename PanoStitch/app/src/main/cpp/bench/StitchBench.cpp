@@ -0,0 +1,824 @@
+/************************************************************************/
+/* Headless benchmark of the fisheye stitcher                           */
+/* times table and warp mesh generation, software warp, color adjust,  */
+/* the multi band blend and the GLES stitch at several pano sizes on synthetic lenses, and   */
+/* compares the outputs with golden images by PSNR. the tiled stitcher  */
+/* also renders cubemap and EAC faces, checked against the software     */
+/* pano resampled onto them                                             */
+/*                                                                      */
+/* stitchBench [--sizes 1440x720,2880x1440] [--fisheye 1024]            */
+/*             [--iterations 10] [--threads N] [--no-gles]              */
+/*             [--golden-dir DIR [--write-golden] [--min-psnr 40]]      */
+/*             [--trace trace.json]   (STITCH_PROFILING builds)         */
+/*             [--tiled-pano 12288x6144 [--tiled-out pano.ppm]]         */
+/************************************************************************/
+#include "SyntheticScene.h"
+#include "FisheyePanoStitcherComp.h"
+#include "FisheyeTiledStitcher.h"
+#include "ImageBlender.h"
+#include "ImageIOConverter.h"
+#include "ThreadPool.h"
+#include "StitchProfiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+using namespace YiPanorama;
+using namespace YiPanorama::fisheyePano;
+using namespace YiPanorama::bench;
+
+#define BENCH_MAX_SIZES     8
+#define BENCH_PATH_LEN      512
+#define BENCH_BACK_GAIN     0.85f   // exposure of the back lens against the front one
+#define BENCH_PREVIEW_W     1280
+#define BENCH_PREVIEW_H     720
+#define BENCH_PREVIEW_FOV   90.0f   // horizontal, degrees
+#define BENCH_TILE_W        1024    // divides none of the default sizes, so the narrow last tiles are covered
+#define BENCH_TILE_H        384
+#define BENCH_MESH_ADAPTIVE -1.0f   // tolerance of the adaptive meshes, the worst error of the grid, see setWarpMeshTolerance
+#define BENCH_BLEND_BANDS   5       // pyramid levels of the software multi band blend
+#define BENCH_BLEND_SIGMA   1.0f
+#define BENCH_MIN_BAND_PSNR 35.0    // multi band against the feather blend: the scene is the same on both sides of the
+                                    // seam, only the exposure step left over by the color adjust is spread differently
+
+struct benchOptions
+{
+    int panoW[BENCH_MAX_SIZES];
+    int panoH[BENCH_MAX_SIZES];
+    int sizeNum;
+    int fisheyeSize;
+    int iterations;
+    int threadNum;          // 0 keeps the default pool
+    bool useGLES;
+    const char *goldenDir;  // NULL: no golden images
+    bool writeGolden;
+    double minPsnr;
+    const char *tracePath;
+    int tiledPanoW;         // 0: no extra tiled run
+    int tiledPanoH;
+    const char *tiledOutPath;
+};
+
+struct benchTimes
+{// milliseconds over the iterations
+    double minMs;
+    double medianMs;
+    double maxMs;
+};
+
+template <typename Func>
+static int timeRuns(int iterations, benchTimes *pTimes, Func func)
+{// -1 as soon as a run fails
+    std::vector<double> durations;
+    for (int k = 0; k != iterations; ++k)
+    {
+        double startUs = StitchProfiler::nowUs();
+        if (func() != 0)
+            return -1;
+        durations.push_back((StitchProfiler::nowUs() - startUs) / 1000.0);
+    }
+
+    std::sort(durations.begin(), durations.end());
+    pTimes->minMs = durations.front();
+    pTimes->medianMs = durations[durations.size() / 2];
+    pTimes->maxMs = durations.back();
+    return 0;
+}
+
+static void printTimes(const char *stage, int panoW, int panoH, benchTimes *pTimes)
+{
+    printf("stitchBench: %-16s %5dx%-5d %9.2f %9.2f %9.2f\n", stage, panoW, panoH, pTimes->minMs, pTimes->medianMs, pTimes->maxMs);
+}
+
+static double psnrRGB(imageFrame imageA, imageFrame imageB)
+{// over the visible pixels of two RGB frames, strides may differ. identical frames give INFINITY
+    double sum = 0.0;
+    for (int y = 0; y != imageA.imageH; ++y)
+    {
+        const unsigned char *pA = imageA.plane[0] + y * imageA.strides[0];
+        const unsigned char *pB = imageB.plane[0] + y * imageB.strides[0];
+        for (int x = 0; x != imageA.imageW * 3; ++x)
+        {
+            double diff = (double)pA[x] - pB[x];
+            sum += diff * diff;
+        }
+    }
+
+    double mse = sum / ((double)imageA.imageW * imageA.imageH * 3);
+    return (mse == 0.0) ? INFINITY : 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+static int checkGolden(benchOptions *pOptions, const char *name, imageFrame image)
+{// write or compare the golden image of one output, -1 for a failed write, a missing golden or a failed comparison
+    if (pOptions->goldenDir == NULL)
+        return 0;
+
+    char goldenPath[BENCH_PATH_LEN];
+    snprintf(goldenPath, BENCH_PATH_LEN, "%s/%s_%dx%d.png", pOptions->goldenDir, name, image.imageW, image.imageH);
+
+    if (pOptions->writeGolden)
+    {
+        if (saveImage(goldenPath, image) != 0)
+        {
+            printf("stitchBench: golden %-24s can not write %s\n", name, goldenPath);
+            return -1;
+        }
+        printf("stitchBench: golden %-24s written to %s\n", name, goldenPath);
+        return 0;
+    }
+
+    imageFrame golden;
+    initImageFrame(&golden, image.imageW, image.imageH, PIXELCOLORSPACE_RGB);
+    if (loadImageData(goldenPath, golden) != 0)
+    {
+        printf("stitchBench: golden %-24s missing, %s FAILED\n", name, goldenPath);
+        dinitImageFrame(&golden);
+        return -1;
+    }
+
+    double psnr = psnrRGB(image, golden);
+    bool isPassed = (psnr >= pOptions->minPsnr);
+    printf("stitchBench: golden %-24s %5dx%-5d PSNR %6.2f dB %s\n", name, image.imageW, image.imageH, psnr, isPassed ? "ok" : "FAILED");
+    dinitImageFrame(&golden);
+    return isPassed ? 0 : -1;
+}
+
+static int composePanoSoftware(imageFrame warpedImage[8], imageFrame panoImage)
+{// per pixel mix of the front and back quadrants by the synthetic blend weight, the reference of the GLES stitch.
+ // the GLES warp shader swaps red and blue (color.bgra), so does this to stay comparable
+    int quadW = panoImage.imageW / 2;
+    int quadH = panoImage.imageH / 2;
+
+    util::ThreadPool::getDefault()->parallelFor(0, panoImage.imageH, [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y != rowEnd; ++y)
+        {
+            unsigned char *pPano = panoImage.plane[0] + y * panoImage.strides[0];
+            for (int x = 0; x != panoImage.imageW; ++x)
+            {
+                int quadrant = (y / quadH) * 2 + x / quadW;
+                const unsigned char *pFront = warpedImage[quadrant].plane[0] + (y % quadH) * warpedImage[quadrant].strides[0] + 3 * (x % quadW);
+                const unsigned char *pBack = warpedImage[quadrant + 4].plane[0] + (y % quadH) * warpedImage[quadrant + 4].strides[0] + 3 * (x % quadW);
+                int weight = syntheticBackWeight(x + 0.5, y + 0.5, panoImage.imageW, panoImage.imageH);
+                for (int c = 0; c != 3; ++c)
+                    pPano[3 * x + 2 - c] = (unsigned char)((pFront[c] * (255 - weight) + pBack[c] * weight + 127) / 255);
+            }
+        }
+    }, 16);
+    return 0;
+}
+
+static int initQuadrantBlenders(imageFrame warpedImage[8], imageRoi seamRois[8], util::ImageBlender blenders[4])
+{// the synthetic blend weight as the mask of each quadrant, and the pyramids of its seam roi
+    int quadW = warpedImage[0].imageW;
+    int quadH = warpedImage[0].imageH;
+    for (int q = 0; q != 4; ++q)
+    {
+        blenders[q].init(quadW, quadH);
+        for (int y = 0; y != quadH; ++y)
+            for (int x = 0; x != quadW; ++x)
+                blenders[q].pMaskY[y * quadW + x] = syntheticBackWeight((q % 2) * quadW + x + 0.5, (q / 2) * quadH + y + 0.5, 2 * quadW, 2 * quadH);
+        if (blenders[q].initMultiBand(seamRois[q], BENCH_BLEND_BANDS, BENCH_BLEND_SIGMA, util::gaukernel) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int composePanoMultiBand(imageFrame warpedImage[8], util::ImageBlender blenders[4], imageFrame blendedImage[4], imageFrame panoImage)
+{// ImageBlender::blendMultiBand of the back (mask 255) and front quadrants, laid out and swapped as composePanoSoftware
+    int quadW = panoImage.imageW / 2;
+    int quadH = panoImage.imageH / 2;
+    for (int q = 0; q != 4; ++q)
+    {
+        if (blenders[q].blendMultiBand(warpedImage[q + 4], warpedImage[q], blendedImage[q]) != 0)
+            return -1;
+    }
+
+    for (int y = 0; y != panoImage.imageH; ++y)
+    {
+        unsigned char *pPano = panoImage.plane[0] + y * panoImage.strides[0];
+        for (int x = 0; x != panoImage.imageW; ++x)
+        {
+            int quadrant = (y / quadH) * 2 + x / quadW;
+            const unsigned char *pBlended = blendedImage[quadrant].plane[0] + (y % quadH) * blendedImage[quadrant].strides[0] + 3 * (x % quadW);
+            for (int c = 0; c != 3; ++c)
+                pPano[3 * x + 2 - c] = pBlended[c];
+        }
+    }
+    return 0;
+}
+
+static void samplePano(imageFrame panoImage, const double dir[3], unsigned char *pRGB)
+{// bilinear at the direction dir of the sphere, wrapping around the pano edges
+    int panoW = panoImage.imageW;
+    int panoH = panoImage.imageH;
+    double norm = sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+    double u = atan2(-dir[0], dir[2]) / (2 * M_PI);
+    double srcX = (u - floor(u)) * panoW - 0.5;
+    double srcY = (0.5 - asin(dir[1] / norm) / M_PI) * panoH - 0.5;
+    srcY = std::min(std::max(srcY, 0.0), panoH - 1.0);
+
+    int x0 = (int)floor(srcX);
+    int y0 = std::min((int)srcY, panoH - 2);
+    double fx = srcX - x0;
+    double fy = srcY - y0;
+    int xs[2] = { (x0 + panoW) % panoW, (x0 + 1) % panoW };
+    const unsigned char *pTop = panoImage.plane[0] + y0 * panoImage.strides[0];
+    const unsigned char *pBottom = pTop + panoImage.strides[0];
+    for (int c = 0; c != 3; ++c)
+    {
+        double top = pTop[xs[0] * 3 + c] * (1 - fx) + pTop[xs[1] * 3 + c] * fx;
+        double bottom = pBottom[xs[0] * 3 + c] * (1 - fx) + pBottom[xs[1] * 3 + c] * fx;
+        pRGB[c] = (unsigned char)(top * (1 - fy) + bottom * fy + 0.5);
+    }
+}
+
+static int reprojectPano(imageFrame panoImage, imageFrame viewImage, float yaw, float pitch, float fovX)
+{// the rectilinear view of fisheyePanoStitcherComp::previewStitch sampled bilinearly from a stitched pano
+    double lon = M_PI + yaw * M_PI / 180.0;
+    double lat = pitch * M_PI / 180.0;
+    double right[3] = { -cos(lon), 0.0, -sin(lon) };
+    double up[3] = { sin(lat) * sin(lon), cos(lat), -sin(lat) * cos(lon) };
+    double forward[3] = { -cos(lat) * sin(lon), sin(lat), cos(lat) * cos(lon) };
+    double tanX = tan(fovX * M_PI / 360.0);
+    double tanY = tanX * viewImage.imageH / viewImage.imageW;
+
+    for (int y = 0; y != viewImage.imageH; ++y)
+    {
+        double py = (1.0 - 2.0 * (y + 0.5) / viewImage.imageH) * tanY;
+        unsigned char *pView = viewImage.plane[0] + y * viewImage.strides[0];
+        for (int x = 0; x != viewImage.imageW; ++x)
+        {
+            double px = (2.0 * (x + 0.5) / viewImage.imageW - 1.0) * tanX;
+            double dir[3];
+            for (int k = 0; k != 3; ++k)
+                dir[k] = right[k] * px + up[k] * py + forward[k];
+            samplePano(panoImage, dir, pView + x * 3);
+        }
+    }
+    return 0;
+}
+
+static int reprojectPanoFaces(imageFrame panoImage, imageFrame facesImage, warpProjection projection)
+{// the 3 x 2 cube faces of imageWarpTable sampled bilinearly from a stitched pano, at the pixel centers
+    int faceW = facesImage.imageW / 3;
+    for (int y = 0; y != facesImage.imageH; ++y)
+    {
+        unsigned char *pFaces = facesImage.plane[0] + y * facesImage.strides[0];
+        for (int x = 0; x != facesImage.imageW; ++x)
+        {
+            const double *pAxes = imageWarpTable::cubeFaceAxes((y / faceW) * 3 + x / faceW);
+            double a = 2.0 * (x % faceW + 0.5) / faceW - 1.0;
+            double b = 2.0 * (y % faceW + 0.5) / faceW - 1.0;
+            if (projection == warpEAC)
+            {
+                a = tan(M_PI / 4 * a);
+                b = tan(M_PI / 4 * b);
+            }
+            double dir[3];
+            for (int k = 0; k != 3; ++k)
+                dir[k] = a * pAxes[k] + b * pAxes[3 + k] + pAxes[6 + k];
+            samplePano(panoImage, dir, pFaces + x * 3);
+        }
+    }
+    return 0;
+}
+
+static int benchPreview(benchOptions *pOptions, fisheyePanoStitcherComp *pStitcher, imageFrame fisheyeImage[2], imageFrame panoImage)
+{// previewStitch at the pano center and across the seam, against the view reprojected from the GLES pano.
+ // the preview skips the seam gains, the seam view shows what that costs
+    const char *names[2] = { "gles_preview_center", "gles_preview_seam" };
+    float yaws[2] = { 0.0f, 90.0f };
+    imageFrame viewImage, refImage;
+    benchTimes times;
+    int failures = 0;
+
+    initImageFrame(&viewImage, BENCH_PREVIEW_W, BENCH_PREVIEW_H, PIXELCOLORSPACE_RGB);
+    initImageFrame(&refImage, BENCH_PREVIEW_W, BENCH_PREVIEW_H, PIXELCOLORSPACE_RGB);
+    for (int i = 0; i != 2; ++i)
+    {
+        int result = timeRuns(pOptions->iterations, &times, [&]() {
+            return pStitcher->previewStitch(fisheyeImage, viewImage, yaws[i], 10.0f, BENCH_PREVIEW_FOV);
+        });
+        if (result != 0)
+        {
+            printf("stitchBench: %s previewStitch failed\n", names[i]);
+            failures++;
+            continue;
+        }
+        printTimes((i == 0) ? "preview center" : "preview seam", BENCH_PREVIEW_W, BENCH_PREVIEW_H, &times);
+
+        reprojectPano(panoImage, refImage, yaws[i], 10.0f, BENCH_PREVIEW_FOV);
+        printf("stitchBench: %-31s %5dx%-5d PSNR %6.2f dB against the reprojected pano\n", names[i],
+            BENCH_PREVIEW_W, BENCH_PREVIEW_H, psnrRGB(viewImage, refImage));
+        if (checkGolden(pOptions, names[i], viewImage) != 0)
+            failures++;
+    }
+
+    dinitImageFrame(&viewImage);
+    dinitImageFrame(&refImage);
+    return failures;
+}
+
+static int benchMeshes(benchOptions *pOptions, ImageWarper imageWarper[8], cameraMetadata camera[2], int sphereRadius, int panoW, int panoH)
+{// GLES warp meshes of the 8 quadrants, the uniform table grid against the adaptive mesh: sizes, worst and mean error
+    const char *names[2] = { "mesh uniform", "mesh adaptive" };
+    float tolerances[2] = { 0.0f, BENCH_MESH_ADAPTIVE };
+    warpMesh mesh;
+
+    for (int k = 0; k != 2; ++k)
+    {
+        int vertexNum = 0, triangleNum = 0, measured = 0;
+        float maxError = 0.0f;
+        double errorSum = 0.0;
+        for (int i = 0; i != 8; ++i)
+        {
+            ImageWarper *pWarper = &imageWarper[i];
+            imageWarpTable *pTable = pWarper;
+            cameraMetadata *pCamera = &camera[i / 4];
+            if (genWarpMeshGLES(&pWarper, &pCamera, 1, sphereRadius, tolerances[k], &mesh) != 0)
+                return -1;
+            if (tolerances[k] == 0.0f)
+                mesh.measureError(&pTable, &pCamera, sphereRadius);
+            vertexNum += mesh.mStats.vertexNum;
+            triangleNum += mesh.mStats.triangleNum;
+            maxError = (mesh.mStats.maxError > maxError) ? mesh.mStats.maxError : maxError;
+            errorSum += (double)mesh.mStats.meanError * mesh.mStats.measuredTriangles;
+            measured += mesh.mStats.measuredTriangles;
+        }
+        printf("stitchBench: %-16s %5dx%-5d %7d vertices %7d triangles, error max %.3f mean %.3f px\n", names[k], panoW, panoH,
+            vertexNum, triangleNum, maxError, (measured > 0) ? errorSum / measured : 0.0);
+    }
+
+    benchTimes times;
+    if (timeRuns(pOptions->iterations, &times, [&]() {
+            for (int i = 0; i != 8; ++i)
+            {
+                ImageWarper *pWarper = &imageWarper[i];
+                cameraMetadata *pCamera = &camera[i / 4];
+                if (genWarpMeshGLES(&pWarper, &pCamera, 1, sphereRadius, BENCH_MESH_ADAPTIVE, &mesh) != 0)
+                    return -1;
+            }
+            return 0;
+        }) != 0)
+        return -1;
+    printTimes("mesh adaptive", panoW, panoH, &times);
+    return 0;
+}
+
+static int benchSoftware(benchOptions *pOptions, fisheyePanoParams *pParams, imageFrame fisheyeImage[2], imageFrame swPanoImage, int *pFailures)
+{// tables, software warp, color adjust and multi band blend of the 8 quadrants; swPanoImage gets the software stitch
+ // with the feather blend, the multi band one is checked against it
+    int panoW = swPanoImage.imageW;
+    int panoH = swPanoImage.imageH;
+    ImageWarper imageWarper[8];
+    cameraMetadata camera[2];
+    imageFrame warpedImage[8];
+    imageFrame blendedImage[4];
+    imageFrame bandPanoImage;
+    imageRoi seamRois[8];
+    colorAdjusterPair adjusterPair;
+    util::ImageBlender blenders[4];
+    benchTimes times;
+    int result = 0;
+
+    camera[0].setFromFisheyePanoParams(pParams, 0);
+    camera[1].setFromFisheyePanoParams(pParams, 1);
+    if (initQuadrantWarpers(imageWarper, panoW, panoH) != 0)
+        return -1;
+
+    if (timeRuns(pOptions->iterations, &times, [&]() {
+            for (int i = 0; i != 8; ++i)
+                imageWarper[i].genWarperCam(&camera[i / 4], pParams->stFisheyePanoParamsCore.sphereRadius);
+            return 0;
+        }) != 0)
+        return -1;
+    printTimes("tables", panoW, panoH, &times);
+    if (benchMeshes(pOptions, imageWarper, camera, pParams->stFisheyePanoParamsCore.sphereRadius, panoW, panoH) != 0)
+        return -1;
+
+    for (int i = 0; i != 8; ++i)
+        initImageFrame(&warpedImage[i], imageWarper[i].mWarpImageW, imageWarper[i].mWarpImageH, PIXELCOLORSPACE_RGB);
+
+    // the reference output: one warp, one color adjust
+    for (int i = 0; i != 8 && result == 0; ++i)
+        result = imageWarper[i].warpImage(fisheyeImage[i / 4], warpedImage[i]);
+
+    // seam rois centered in the quadrants, as in fisheyePanoStitcherComp::setWorkMems
+    initSeamRois(pParams, warpedImage, seamRois);
+    if (result == 0)
+    {
+        adjusterPair.init(8, warpedImage, 1, seamRois, 1, vertical, interleaved);
+        adjusterPair.colorCoeffs();
+        result = adjusterPair.colorAdjust();
+    }
+    if (result == 0)
+        result = composePanoSoftware(warpedImage, swPanoImage);
+
+    // the multi band blend of the same quadrants
+    for (int q = 0; q != 4; ++q)
+        initImageFrame(&blendedImage[q], warpedImage[q].imageW, warpedImage[q].imageH, PIXELCOLORSPACE_RGB);
+    initImageFrame(&bandPanoImage, panoW, panoH, PIXELCOLORSPACE_RGB);
+    if (result == 0)
+        result = initQuadrantBlenders(warpedImage, seamRois, blenders);
+    if (result == 0)
+        result = timeRuns(pOptions->iterations, &times, [&]() { return composePanoMultiBand(warpedImage, blenders, blendedImage, bandPanoImage); });
+    if (result == 0)
+    {
+        printTimes("blend multiband", panoW, panoH, &times);
+        double psnr = psnrRGB(bandPanoImage, swPanoImage);
+        bool isPassed = (psnr >= BENCH_MIN_BAND_PSNR);
+        printf("stitchBench: %-31s %5dx%-5d PSNR %6.2f dB against the feather blend %s\n", "software_multiband", panoW, panoH, psnr, isPassed ? "ok" : "FAILED");
+        if (!isPassed)
+            (*pFailures)++;
+    }
+
+    // timings, the quadrants are only scratch from here on
+    if (result == 0)
+    {
+        result = timeRuns(pOptions->iterations, &times, [&]() {
+            for (int i = 0; i != 8; ++i)
+            {
+                if (imageWarper[i].warpImage(fisheyeImage[i / 4], warpedImage[i]) != 0)
+                    return -1;
+            }
+            return 0;
+        });
+        if (result == 0)
+            printTimes("warp software", panoW, panoH, &times);
+    }
+    if (result == 0)
+    {
+        result = timeRuns(pOptions->iterations, &times, [&]() { return adjusterPair.colorAdjust(); });
+        if (result == 0)
+            printTimes("color adjust", panoW, panoH, &times);
+    }
+
+    adjusterPair.dinit();
+    dinitImageFrame(&bandPanoImage);
+    for (int q = 0; q != 4; ++q)
+    {
+        dinitImageFrame(&blendedImage[q]);
+        blenders[q].dinit();
+    }
+    for (int i = 0; i != 8; ++i)
+    {
+        dinitImageFrame(&warpedImage[i]);
+        imageWarper[i].dinit();
+    }
+    return result;
+}
+
+static int benchGLES(benchOptions *pOptions, fisheyePanoParams *pParams, glesRenderMode renderMode,
+    imageFrame fisheyeImage[2], imageFrame swPanoImage, int *pFailures)
+{// one persistent session: init, a warm up frame, then the timed frames. -1 when GLES is not available
+    static bool isRendererPrinted = false;
+    int panoW = swPanoImage.imageW;
+    int panoH = swPanoImage.imageH;
+    const char *name = (renderMode == glesFullPano) ? "gles_fullpano" : "gles_quadrants";
+    fisheyePanoStitcherComp *pStitcher = new fisheyePanoStitcherComp();
+    imageFrame panoImage;
+    benchTimes times;
+
+    pStitcher->setGLESSessionMode(glesPersistent);
+    pStitcher->setGLESRenderMode(renderMode);
+    // the generated masks match syntheticBackWeight: linear over SYNTHETIC_MAX_FOV - 90 degrees across the seam
+    pStitcher->setBlendFeather(blendFeatherLinear, (SYNTHETIC_MAX_FOV - 90.0f) / seamOverlapAngle(pParams, panoW));
+    if (renderMode == glesFullPano)
+        pStitcher->setPreviewSize(BENCH_PREVIEW_W, BENCH_PREVIEW_H);
+
+    double startUs = StitchProfiler::nowUs();
+    if (pStitcher->init(pParams, normal, panoW, panoH, NULL) != 0)
+    {
+        printf("stitchBench: %s can not start a GLES session\n", name);
+        pStitcher->dinit();
+        delete pStitcher;
+        return -1;
+    }
+    times.minMs = times.medianMs = times.maxMs = (StitchProfiler::nowUs() - startUs) / 1000.0;
+    printTimes((renderMode == glesFullPano) ? "init fullpano" : "init quadrants", panoW, panoH, &times);
+
+    if (!isRendererPrinted)
+    {
+        printf("stitchBench: GLES renderer %s, %s\n", (const char *)glGetString(GL_RENDERER), (const char *)glGetString(GL_VERSION));
+        isRendererPrinted = true;
+    }
+
+    initImageFrame(&panoImage, panoW, panoH, PIXELCOLORSPACE_RGB);
+    int result = pStitcher->imageStitch(fisheyeImage, panoImage);
+    if (result == 0)
+    {
+        result = timeRuns(pOptions->iterations, &times, [&]() { return pStitcher->imageStitch(fisheyeImage, panoImage); });
+        if (result == 0)
+            printTimes((renderMode == glesFullPano) ? "stitch fullpano" : "stitch quadrants", panoW, panoH, &times);
+    }
+
+    if (result == 0)
+    {
+        printf("stitchBench: %-31s %5dx%-5d PSNR %6.2f dB against the software stitch\n", name, panoW, panoH, psnrRGB(panoImage, swPanoImage));
+        if (checkGolden(pOptions, name, panoImage) != 0)
+            (*pFailures)++;
+        if (renderMode == glesFullPano)
+            (*pFailures) += benchPreview(pOptions, pStitcher, fisheyeImage, panoImage);
+    }
+    else
+    {
+        printf("stitchBench: %s imageStitch failed\n", name);
+        (*pFailures)++;
+    }
+
+    dinitImageFrame(&panoImage);
+    pStitcher->dinit();
+    delete pStitcher;
+    return 0;
+}
+
+static int benchTiled(benchOptions *pOptions, fisheyePanoParams *pParams, imageFrame fisheyeImage[2], int panoW, int panoH,
+    imageFrame *pSwPanoImage, int *pFailures)
+{// the strips are copied into a whole pano only to compare it with the software stitch; without pSwPanoImage (the
+ // --tiled-pano run) they are dropped or streamed to --tiled-out. -1 when GLES is not available
+    fisheyeTiledStitcher *pStitcher = new fisheyeTiledStitcher();
+    imageFrame panoImage;
+    panoStripFileWriter writer;
+    benchTimes times;
+
+    pStitcher->setTileSize(BENCH_TILE_W, BENCH_TILE_H);
+    pStitcher->setBlendFeather(blendFeatherLinear, (SYNTHETIC_MAX_FOV - 90.0f) / seamOverlapAngle(pParams, panoW));
+
+    double startUs = StitchProfiler::nowUs();
+    if (pStitcher->init(pParams, panoW, panoH) != 0)
+    {
+        printf("stitchBench: gles_tiled can not start a GLES session\n");
+        delete pStitcher;
+        return -1;
+    }
+    times.minMs = times.medianMs = times.maxMs = (StitchProfiler::nowUs() - startUs) / 1000.0;
+    printTimes("init tiled", panoW, panoH, &times);
+
+    panoStripSink sink = [](imageFrame /*strip*/, int /*stripY*/) { return 0; };
+    if (pSwPanoImage != NULL)
+    {
+        initImageFrame(&panoImage, panoW, panoH, PIXELCOLORSPACE_RGB);
+        sink = [&](imageFrame strip, int stripY) {
+            for (int h = 0; h != strip.imageH; ++h)
+                memcpy(panoImage.plane[0] + (stripY + h) * panoImage.strides[0], strip.plane[0] + h * strip.strides[0], panoW * 3);
+            return 0;
+        };
+    }
+
+    int result = timeRuns(pOptions->iterations, &times, [&]() { return pStitcher->imageStitch(fisheyeImage, sink); });
+    if (result == 0)
+        printTimes("stitch tiled", panoW, panoH, &times);
+    if (result == 0 && pSwPanoImage == NULL && pOptions->tiledOutPath != NULL)
+    {
+        result = writer.open(pOptions->tiledOutPath, panoW, panoH);
+        if (result == 0)
+            result = pStitcher->imageStitch(fisheyeImage, writer.sink());
+        if (writer.close() != 0 || result != 0)
+            result = -1;
+        else
+            printf("stitchBench: gles_tiled %dx%d written to %s\n", panoW, panoH, pOptions->tiledOutPath);
+    }
+
+    if (result != 0)
+    {
+        printf("stitchBench: gles_tiled imageStitch failed\n");
+        (*pFailures)++;
+    }
+    else if (pSwPanoImage != NULL)
+    {
+        printf("stitchBench: %-31s %5dx%-5d PSNR %6.2f dB against the software stitch\n", "gles_tiled", panoW, panoH,
+            psnrRGB(panoImage, *pSwPanoImage));
+        if (checkGolden(pOptions, "gles_tiled", panoImage) != 0)
+            (*pFailures)++;
+    }
+
+    if (pSwPanoImage != NULL)
+        dinitImageFrame(&panoImage);
+    pStitcher->dinit();
+    delete pStitcher;
+    return 0;
+}
+
+static int benchTiledFaces(benchOptions *pOptions, fisheyePanoParams *pParams, imageFrame fisheyeImage[2], imageFrame swPanoImage,
+    int *pFailures)
+{// cubemap and EAC faces of the equator resolution of the pano, straight from the fisheye frames: 6 faces of
+ // (panoW / 4)^2 are 3 / 4 of the equirect pixels. compared with the software pano resampled onto the faces,
+ // so the PSNR carries that second resample too
+    const char *names[2] = { "gles_tiled_cubemap", "gles_tiled_eac" };
+    warpProjection projections[2] = { warpCubemap, warpEAC };
+    int panoW = swPanoImage.imageW;
+    int facesW = panoW / 4 * 3;
+    int facesH = panoW / 4 * 2;
+    imageFrame facesImage, refImage;
+    benchTimes times;
+
+    initImageFrame(&facesImage, facesW, facesH, PIXELCOLORSPACE_RGB);
+    initImageFrame(&refImage, facesW, facesH, PIXELCOLORSPACE_RGB);
+    for (int i = 0; i != 2; ++i)
+    {
+        fisheyeTiledStitcher *pStitcher = new fisheyeTiledStitcher();
+        pStitcher->setTileSize(BENCH_TILE_W, BENCH_TILE_H);
+        pStitcher->setBlendFeather(blendFeatherLinear, (SYNTHETIC_MAX_FOV - 90.0f) / seamOverlapAngle(pParams, panoW));
+        pStitcher->setOutputProjection(projections[i]);
+        if (pStitcher->init(pParams, facesW, facesH) != 0)
+        {
+            printf("stitchBench: %s init failed\n", names[i]);
+            (*pFailures)++;
+            delete pStitcher;
+            continue;
+        }
+
+        panoStripSink sink = [&](imageFrame strip, int stripY) {
+            for (int h = 0; h != strip.imageH; ++h)
+                memcpy(facesImage.plane[0] + (stripY + h) * facesImage.strides[0], strip.plane[0] + h * strip.strides[0], facesW * 3);
+            return 0;
+        };
+        int result = timeRuns(pOptions->iterations, &times, [&]() { return pStitcher->imageStitch(fisheyeImage, sink); });
+        pStitcher->dinit();
+        delete pStitcher;
+        if (result != 0)
+        {
+            printf("stitchBench: %s imageStitch failed\n", names[i]);
+            (*pFailures)++;
+            continue;
+        }
+        printTimes((i == 0) ? "stitch cubemap" : "stitch eac", facesW, facesH, &times);
+
+        reprojectPanoFaces(swPanoImage, refImage, projections[i]);
+        printf("stitchBench: %-31s %5dx%-5d PSNR %6.2f dB against the resampled software stitch, %.0f%% of the pano pixels\n",
+            names[i], facesW, facesH, psnrRGB(facesImage, refImage), 100.0 * facesW * facesH / ((double)panoW * swPanoImage.imageH));
+        if (checkGolden(pOptions, names[i], facesImage) != 0)
+            (*pFailures)++;
+    }
+
+    dinitImageFrame(&facesImage);
+    dinitImageFrame(&refImage);
+    return 0;
+}
+
+static int parseSizes(const char *arg, benchOptions *pOptions)
+{// "1440x720,2880x1440"; quadrants and their seams need sizes in multiples of 4
+    pOptions->sizeNum = 0;
+    while (*arg != '\0' && pOptions->sizeNum != BENCH_MAX_SIZES)
+    {
+        int panoW = 0, panoH = 0, length = 0;
+        if (sscanf(arg, "%dx%d%n", &panoW, &panoH, &length) != 2 || panoW <= 0 || panoH <= 0 || panoW % 4 != 0 || panoH % 4 != 0)
+            return -1;
+        pOptions->panoW[pOptions->sizeNum] = panoW;
+        pOptions->panoH[pOptions->sizeNum] = panoH;
+        pOptions->sizeNum++;
+        arg += length;
+        if (*arg == ',')
+            arg++;
+    }
+    return (pOptions->sizeNum > 0) ? 0 : -1;
+}
+
+static int parseOptions(int argc, char **argv, benchOptions *pOptions)
+{
+    static const int defaultW[] = { 1440, 2880, 3840 };
+    static const int defaultH[] = { 720, 1440, 1920 };
+
+    memset(pOptions, 0, sizeof(benchOptions));
+    pOptions->sizeNum = 3;
+    memcpy(pOptions->panoW, defaultW, sizeof(defaultW));
+    memcpy(pOptions->panoH, defaultH, sizeof(defaultH));
+    pOptions->fisheyeSize = 1024;
+    pOptions->iterations = 10;
+    pOptions->useGLES = true;
+    pOptions->minPsnr = 40.0;
+
+    for (int k = 1; k < argc; ++k)
+    {
+        const char *value = (k + 1 < argc) ? argv[k + 1] : NULL;
+        if (strcmp(argv[k], "--no-gles") == 0)
+            pOptions->useGLES = false;
+        else if (strcmp(argv[k], "--write-golden") == 0)
+            pOptions->writeGolden = true;
+        else if (value == NULL)
+            return -1;
+        else if (strcmp(argv[k], "--sizes") == 0 && parseSizes(value, pOptions) == 0)
+            k++;
+        else if (strcmp(argv[k], "--fisheye") == 0 && (pOptions->fisheyeSize = atoi(value)) >= 64)
+            k++;
+        else if (strcmp(argv[k], "--iterations") == 0 && (pOptions->iterations = atoi(value)) > 0)
+            k++;
+        else if (strcmp(argv[k], "--threads") == 0 && (pOptions->threadNum = atoi(value)) > 0)
+            k++;
+        else if (strcmp(argv[k], "--golden-dir") == 0)
+            pOptions->goldenDir = argv[++k];
+        else if (strcmp(argv[k], "--min-psnr") == 0)
+            pOptions->minPsnr = atof(argv[++k]);
+        else if (strcmp(argv[k], "--trace") == 0)
+            pOptions->tracePath = argv[++k];
+        else if (strcmp(argv[k], "--tiled-pano") == 0 && sscanf(value, "%dx%d", &pOptions->tiledPanoW, &pOptions->tiledPanoH) == 2 &&
+            pOptions->tiledPanoW > 0 && pOptions->tiledPanoH > 0)
+            k++;
+        else if (strcmp(argv[k], "--tiled-out") == 0)
+            pOptions->tiledOutPath = argv[++k];
+        else
+            return -1;
+    }
+    return (pOptions->writeGolden && pOptions->goldenDir == NULL) ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    benchOptions options;
+    if (parseOptions(argc, argv, &options) != 0)
+    {
+        printf("usage: stitchBench [--sizes WxH[,WxH...]] [--fisheye N] [--iterations N] [--threads N] [--no-gles]\n"
+               "                   [--golden-dir DIR [--write-golden] [--min-psnr dB]] [--trace FILE]\n"
+               "                   [--tiled-pano WxH [--tiled-out FILE]]\n");
+        return 2;
+    }
+
+    // without a display Mesa renders through its surfaceless platform, llvmpipe when there is no GPU
+    setenv("EGL_PLATFORM", "surfaceless", 0);
+
+    if (options.threadNum > 0)
+        util::ThreadPool::getDefault()->init(options.threadNum);
+
+    printf("stitchBench: fisheye %dx%d, %d iterations, %d threads\n", options.fisheyeSize, options.fisheyeSize,
+        options.iterations, util::ThreadPool::getDefault()->getThreadNum());
+    printf("stitchBench: stage            pano size       min    median       max (ms)\n");
+
+    int failures = 0;
+    bool hasGLES = options.useGLES;
+    for (int s = 0; s != options.sizeNum; ++s)
+    {
+        int panoW = options.panoW[s];
+        int panoH = options.panoH[s];
+        fisheyePanoParams params;
+        imageFrame fisheyeImage[2];
+        imageFrame swPanoImage;
+
+        genSyntheticParams(&params, options.fisheyeSize, panoW, panoH);
+        for (int i = 0; i != 2; ++i)
+        {
+            initImageFrame(&fisheyeImage[i], options.fisheyeSize, options.fisheyeSize, PIXELCOLORSPACE_RGB);
+            renderSyntheticFisheye(&params, i, (i == 0) ? 1.0f : BENCH_BACK_GAIN, fisheyeImage[i]);
+        }
+        initImageFrame(&swPanoImage, panoW, panoH, PIXELCOLORSPACE_RGB);
+        StitchProfiler::getDefault()->reset();
+
+        if (benchSoftware(&options, &params, fisheyeImage, swPanoImage, &failures) != 0)
+        {
+            printf("stitchBench: software stages failed at %dx%d\n", panoW, panoH);
+            failures++;
+        }
+        else if (checkGolden(&options, "software", swPanoImage) != 0)
+        {
+            failures++;
+        }
+
+        if (hasGLES && benchGLES(&options, &params, glesQuadrants, fisheyeImage, swPanoImage, &failures) != 0)
+            hasGLES = false;    // no context, no point in trying the other sizes
+        if (hasGLES)
+            benchGLES(&options, &params, glesFullPano, fisheyeImage, swPanoImage, &failures);
+        if (hasGLES)
+            benchTiled(&options, &params, fisheyeImage, panoW, panoH, &swPanoImage, &failures);
+        if (hasGLES)
+            benchTiledFaces(&options, &params, fisheyeImage, swPanoImage, &failures);
+
+#if STITCH_PROFILING
+        StitchProfiler::getDefault()->printStats();
+#endif
+
+        dinitImageFrame(&swPanoImage);
+        dinitImageFrame(&fisheyeImage[0]);
+        dinitImageFrame(&fisheyeImage[1]);
+    }
+
+    // a pano past the texture limits and the software stitch, only the tiled stitcher runs there
+    if (hasGLES && options.tiledPanoW > 0)
+    {
+        fisheyePanoParams params;
+        imageFrame fisheyeImage[2];
+        genSyntheticParams(&params, options.fisheyeSize, options.tiledPanoW, options.tiledPanoH);
+        for (int i = 0; i != 2; ++i)
+        {
+            initImageFrame(&fisheyeImage[i], options.fisheyeSize, options.fisheyeSize, PIXELCOLORSPACE_RGB);
+            renderSyntheticFisheye(&params, i, (i == 0) ? 1.0f : BENCH_BACK_GAIN, fisheyeImage[i]);
+        }
+        benchTiled(&options, &params, fisheyeImage, options.tiledPanoW, options.tiledPanoH, NULL, &failures);
+        dinitImageFrame(&fisheyeImage[0]);
+        dinitImageFrame(&fisheyeImage[1]);
+    }
+
+#if STITCH_PROFILING
+    if (options.tracePath != NULL)
+        StitchProfiler::getDefault()->dumpChromeTrace(options.tracePath);
+#else
+    if (options.tracePath != NULL)
+        printf("stitchBench: no trace, build with -DSTITCH_PROFILING=ON\n");
+#endif
+
+    if (failures != 0)
+        printf("stitchBench: %d check(s) failed\n", failures);
+    return (failures != 0) ? 1 : 0;
+}
@@ -0,0 +1,506 @@
+/************************************************************************/
+/* Checks of the stitch library that need no golden images, run by     */
+/* ctest one at a time                                                  */
+/*                                                                      */
+/* stitchTests <test>, or no argument for all of them                   */
+/************************************************************************/
+#include "SyntheticScene.h"
+#include "FisheyePanoStitcherComp.h"
+#include "ImageColorAdjuster.h"
+#include "ImageBlender.h"
+#include "ImageIOConverter.h"
+#include "CalibrationResiduals.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+using namespace YiPanorama;
+using namespace YiPanorama::util;
+using namespace YiPanorama::fisheyePano;
+using namespace YiPanorama::bench;
+using namespace YiPanorama::calibration;
+
+#define TEST_QUAD_W     97      // 291 byte rows, pooled frames pad them to 320
+#define TEST_QUAD_H     60
+#define TEST_SEAM_W     40
+#define TEST_PANO_W     1440
+#define TEST_PANO_H     720
+#define TEST_FISHEYE    768
+#define TEST_GAIN_TOL   0.001f
+#define TEST_RAMP_W     128
+#define TEST_RAMP_H     96
+#define TEST_RAMP_LEVELS 3
+#define TEST_RAMP_MARGIN 12     // pixels of a level next to its borders, where the clamped kernels bend the ramp
+#define TEST_RAMP_TOL   0.05f
+#define TEST_JAC_STEP   1e-6    // central difference step, in the magnified lev-mar parameters
+#define TEST_JAC_TOL    1e-5    // relative to the larger of 1 and the analytic derivative
+#define TEST_JAC_POINTS 24
+
+static unsigned char testPixel(int image, int x, int y, int c)
+{// a pattern that differs by row, so reading the wrong rows shows up, and a darker back lens
+    int value = (x * 7 + y * 13 + c * 29 + image * 17) % 160 + 40;
+    return (unsigned char)((image < 4) ? value : value * 3 / 4);
+}
+
+static int colorSummaryStride()
+{// the color adjuster on pooled frames, padding bytes set to 255, against the same pixels in tight frames
+ // and against the section means summed up here
+    imageFrame pooled[8], tight[8];
+    imageRoi seamRois[8];
+    int failures = 0;
+
+    for (int i = 0; i != 8; ++i)
+    {
+        initImageFrame(&pooled[i], TEST_QUAD_W, TEST_QUAD_H, PIXELCOLORSPACE_RGB);
+        memset(pooled[i].plane[0], 255, pooled[i].strides[0] * TEST_QUAD_H);
+        tight[i] = pooled[i];
+        tight[i].strides[0] = TEST_QUAD_W * 3;
+        tight[i].plane[0] = new unsigned char[TEST_QUAD_W * 3 * TEST_QUAD_H];
+        for (int y = 0; y != TEST_QUAD_H; ++y)
+        {
+            for (int x = 0; x != TEST_QUAD_W; ++x)
+            {
+                for (int c = 0; c != 3; ++c)
+                {
+                    pooled[i].plane[0][y * pooled[i].strides[0] + 3 * x + c] = testPixel(i, x, y, c);
+                    tight[i].plane[0][y * tight[i].strides[0] + 3 * x + c] = testPixel(i, x, y, c);
+                }
+            }
+        }
+        seamRois[i].imgW = TEST_QUAD_W;
+        seamRois[i].imgH = TEST_QUAD_H;
+        seamRois[i].roiX = (TEST_QUAD_W - TEST_SEAM_W) / 2;
+        seamRois[i].roiY = 0;
+        seamRois[i].roiW = TEST_SEAM_W;
+        seamRois[i].roiH = TEST_QUAD_H;
+    }
+    if (pooled[0].strides[0] == TEST_QUAD_W * 3)
+    {
+        printf("stitchTests: colorSummaryStride needs padded rows, the pool gives %d bytes\n", pooled[0].strides[0]);
+        return -1;
+    }
+
+    colorAdjusterPair adjusters[2];
+    adjusters[0].init(8, pooled, 1, seamRois, 1, vertical, interleaved);
+    adjusters[1].init(8, tight, 1, seamRois, 1, vertical, interleaved);
+    adjusters[0].colorCoeffs();
+    adjusters[1].colorCoeffs();
+
+    for (int i = 0; i != 8; ++i)
+    {
+        for (int c = 0; c != 3; ++c)
+        {
+            double sum = 0.0;
+            for (int y = 0; y != TEST_QUAD_H; ++y)
+                for (int x = seamRois[i].roiX; x != seamRois[i].roiX + TEST_SEAM_W; ++x)
+                    sum += testPixel(i, x, y, c);
+            double mean = sum / (TEST_SEAM_W * TEST_QUAD_H);
+            float pooledMean = adjusters[0].mSummaryTargets[i].mAverages[c][0];
+            float tightMean = adjusters[1].mSummaryTargets[i].mAverages[c][0];
+            if (fabs(pooledMean - mean) > 1e-3 || pooledMean != tightMean)
+            {
+                printf("stitchTests: colorSummaryStride quadrant %d channel %d mean %.4f, tight rows %.4f, expected %.4f\n",
+                    i, c, pooledMean, tightMean, mean);
+                failures++;
+            }
+        }
+    }
+    for (int t = 0; t != 4; ++t)
+    {
+        for (int c = 0; c != 3; ++c)
+        {
+            if (memcmp(adjusters[0].mAdjustTargets[t].coeffs[c], adjusters[1].mAdjustTargets[t].coeffs[c], sizeof(float) * TEST_QUAD_H) != 0)
+            {
+                printf("stitchTests: colorSummaryStride coefficients of target %d channel %d differ from the tight rows\n", t, c);
+                failures++;
+            }
+        }
+    }
+
+    adjusters[0].dinit();
+    adjusters[1].dinit();
+    for (int i = 0; i != 8; ++i)
+    {
+        delete[] tight[i].plane[0];
+        dinitImageFrame(&pooled[i]);
+    }
+    return (failures == 0) ? 0 : -1;
+}
+
+static void fillLensHalves(imageFrame image, const unsigned char north[3], const unsigned char south[3], const float gain[3])
+{// image rows of the synthetic lenses point down, so the top half of a frame is the north of its lens
+    for (int y = 0; y != image.imageH; ++y)
+    {
+        const unsigned char *pColor = (y < image.imageH / 2) ? north : south;
+        for (int x = 0; x != image.imageW; ++x)
+            for (int c = 0; c != 3; ++c)
+                image.plane[0][y * image.strides[0] + 3 * x + c] = (unsigned char)(pColor[c] * gain[c] + 0.5f);
+    }
+}
+
+static int colorAdjustGLES()
+{// the seam gains of the GLES stitch against colorAdjusterPair on the software warped quadrants of the same frames.
+ // flat colors, so both warps see the same seams however they sample; a darker back lens with a different exposure
+ // per channel, since the gains are in the channel order of the pano and the GLES warp swaps red and blue
+    static const unsigned char north[3] = { 200, 150, 100 };
+    static const unsigned char south[3] = { 90, 160, 120 };
+    static const float lensGains[2][3] = { { 1.0f, 1.0f, 1.0f }, { 0.8f, 0.85f, 0.9f } };
+    fisheyePanoParams params;
+    imageFrame fisheyeImage[2], warpedImage[8], panoImage;
+    ImageWarper imageWarper[8];
+    cameraMetadata camera[2];
+    imageRoi seamRois[8];
+    colorAdjusterPair adjusterPair;
+    int quadH = TEST_PANO_H / 2;
+    int result = 0;
+
+    memset(warpedImage, 0, sizeof(warpedImage));    // no planes yet, for the cleanup after a failed warper
+    genSyntheticParams(&params, TEST_FISHEYE, TEST_PANO_W, TEST_PANO_H);
+    for (int i = 0; i != 2; ++i)
+    {
+        initImageFrame(&fisheyeImage[i], TEST_FISHEYE, TEST_FISHEYE, PIXELCOLORSPACE_RGB);
+        fillLensHalves(fisheyeImage[i], north, south, lensGains[i]);
+    }
+
+    camera[0].setFromFisheyePanoParams(&params, 0);
+    camera[1].setFromFisheyePanoParams(&params, 1);
+    result = initQuadrantWarpers(imageWarper, TEST_PANO_W, TEST_PANO_H);
+    for (int i = 0; i != 8 && result == 0; ++i)
+    {
+        imageWarper[i].genWarperCam(&camera[i / 4], params.stFisheyePanoParamsCore.sphereRadius);
+        initImageFrame(&warpedImage[i], imageWarper[i].mWarpImageW, imageWarper[i].mWarpImageH, PIXELCOLORSPACE_RGB);
+        result = imageWarper[i].warpImage(fisheyeImage[i / 4], warpedImage[i]);
+    }
+    if (result == 0)
+    {
+        initSeamRois(&params, warpedImage, seamRois);
+        adjusterPair.init(8, warpedImage, 1, seamRois, 1, vertical, interleaved);
+        adjusterPair.colorCoeffs();
+    }
+
+    fisheyePanoStitcherComp *pStitcher = new fisheyePanoStitcherComp();
+    std::vector<float> gains(2 * quadH * 3);
+    bool isBackAdjusted = false;
+    pStitcher->setGLESSessionMode(glesPersistent);
+    pStitcher->setGLESRenderMode(glesQuadrants);
+    pStitcher->setColorAdjust(true);
+    initImageFrame(&panoImage, TEST_PANO_W, TEST_PANO_H, PIXELCOLORSPACE_RGB);
+    if (result == 0 && (pStitcher->init(&params, normal, TEST_PANO_W, TEST_PANO_H, NULL) != 0 ||
+        pStitcher->imageStitch(fisheyeImage, panoImage) != 0 || pStitcher->getColorAdjustGains(&gains[0], &isBackAdjusted) != 0))
+    {
+        printf("stitchTests: colorAdjustGLES has no GLES stitch\n");
+        result = -1;
+    }
+
+    if (result == 0)
+    {
+        float maxDiff = 0.0f;
+        for (int s = 0; s != 2; ++s)
+            for (int row = 0; row != quadH; ++row)
+                for (int c = 0; c != 3; ++c)
+                    maxDiff = std::max(maxDiff, (float)fabs(gains[(s * quadH + row) * 3 + c] - adjusterPair.mAdjustTargets[2 * s].coeffs[2 - c][row]));
+        printf("stitchTests: colorAdjustGLES top gains %.4f %.4f %.4f, software %.4f %.4f %.4f, largest difference %.5f\n",
+            gains[0], gains[1], gains[2], adjusterPair.mAdjustTargets[0].coeffs[2][0], adjusterPair.mAdjustTargets[0].coeffs[1][0],
+            adjusterPair.mAdjustTargets[0].coeffs[0][0], maxDiff);
+        if (isBackAdjusted != (adjusterPair.mAdjustIdx == 1) || maxDiff > TEST_GAIN_TOL)
+        {
+            printf("stitchTests: colorAdjustGLES adjusts the %s lens, the software the %s one\n",
+                isBackAdjusted ? "back" : "front", (adjusterPair.mAdjustIdx == 1) ? "back" : "front");
+            result = -1;
+        }
+    }
+
+    pStitcher->dinit();
+    delete pStitcher;
+    dinitImageFrame(&panoImage);
+    adjusterPair.dinit();
+    for (int i = 0; i != 8; ++i)
+    {
+        dinitImageFrame(&warpedImage[i]);
+        imageWarper[i].dinit();
+    }
+    dinitImageFrame(&fisheyeImage[0]);
+    dinitImageFrame(&fisheyeImage[1]);
+    return result;
+}
+
+static int pyramidPhase()
+{// a linear ramp has no detail, so every band but the top one of its laplacian pyramid is 0 away from the borders.
+ // a level decimated off the centers that expand assumes leaves half a ramp step in each band
+    std::vector<unsigned char> ramp(TEST_RAMP_W * TEST_RAMP_H * 3);
+    for (int y = 0; y != TEST_RAMP_H; ++y)
+    {
+        for (int x = 0; x != TEST_RAMP_W; ++x)
+        {
+            ramp[(y * TEST_RAMP_W + x) * 3] = (unsigned char)(x + y);     // diagonal, and along each axis
+            ramp[(y * TEST_RAMP_W + x) * 3 + 1] = (unsigned char)x;
+            ramp[(y * TEST_RAMP_W + x) * 3 + 2] = (unsigned char)(2 * y);
+        }
+    }
+
+    pyramidLOG pyramid;
+    if (pyramid.init(TEST_RAMP_LEVELS, TEST_RAMP_W, TEST_RAMP_H, 3, 1.0f, gaukernel) != 0 || pyramid.pyraBuild(&ramp[0], TEST_RAMP_W * 3) != 0)
+    {
+        printf("stitchTests: pyramidPhase has no pyramid\n");
+        return -1;
+    }
+
+    int failures = 0;
+    for (int l = 0; l + 1 < pyramid.mPyramidInfo.levelNum; ++l)
+    {
+        int w = pyramid.mPyramidInfo.width[l];
+        int h = pyramid.mPyramidInfo.height[l];
+        for (int c = 0; c != 3; ++c)
+        {
+            const float *pBand = pyramid.levelPlane(l, c);
+            float maxBand = 0.0f;
+            for (int y = TEST_RAMP_MARGIN; y < h - TEST_RAMP_MARGIN; ++y)
+                for (int x = TEST_RAMP_MARGIN; x < w - TEST_RAMP_MARGIN; ++x)
+                    maxBand = std::max(maxBand, (float)fabs(pBand[y * w + x]));
+            if (maxBand > TEST_RAMP_TOL)
+            {
+                printf("stitchTests: pyramidPhase band %d channel %d is %.3f inside, expected 0\n", l, c, maxBand);
+                failures++;
+            }
+        }
+    }
+
+    // and the collapse gives the ramp back
+    std::vector<unsigned char> collapsed(ramp.size());
+    pyramid.pyraReconstuct(&collapsed[0], TEST_RAMP_W * 3);
+    if (collapsed != ramp)
+    {
+        printf("stitchTests: pyramidPhase collapses to another image\n");
+        failures++;
+    }
+    pyramid.dinit();
+    return (failures == 0) ? 0 : -1;
+}
+
+typedef void (*levmarFunc)(double *p, double *x, int m, int n, void *data);
+
+static int checkJacobian(const char *name, levmarFunc error, levmarFunc jacobian, double *p, int m, int n, void *data)
+{// the analytic n x m jacobian against central differences of the residuals
+    std::vector<double> jac(n * m), xPlus(n), xMinus(n);
+    double maxDiff = 0.0;
+    int maxRow = 0, maxCol = 0;
+
+    jacobian(p, &jac[0], m, n, data);
+    for (int j = 0; j != m; ++j)
+    {
+        double pj = p[j];
+        p[j] = pj + TEST_JAC_STEP;
+        error(p, &xPlus[0], m, n, data);
+        p[j] = pj - TEST_JAC_STEP;
+        error(p, &xMinus[0], m, n, data);
+        p[j] = pj;
+
+        for (int i = 0; i != n; ++i)
+        {
+            double numeric = (xPlus[i] - xMinus[i]) / (2 * TEST_JAC_STEP);
+            double diff = fabs(jac[i * m + j] - numeric) / std::max(1.0, fabs(jac[i * m + j]));
+            if (diff > maxDiff)
+            {
+                maxDiff = diff;
+                maxRow = i;
+                maxCol = j;
+            }
+        }
+    }
+
+    printf("stitchTests: %s largest relative difference %.2e, residual %d parameter %d\n", name, maxDiff, maxRow, maxCol);
+    return (maxDiff <= TEST_JAC_TOL) ? 0 : -1;
+}
+
+static int jacobianChessboard()
+{// a 6 x 6 board in front of camera A, its corners detected off their projections so every residual has a slope
+    fisheyePanoParams params;
+    cameraMetadata camera;
+    optiDataCentExt optiData;
+    std::vector<chessboardCorner> corners;
+
+    genSyntheticParams(&params, TEST_FISHEYE, TEST_PANO_W, TEST_PANO_H);
+    camera.setFromFisheyePanoParams(&params, 0);
+    memset(&optiData, 0, sizeof(optiData));
+    camera.getOcamModel(&optiData.stOcamModel);
+    optiData.pCamera = &camera;
+
+    for (int y = 0; y != 6; ++y)
+    {
+        for (int x = 0; x != 6; ++x)
+        {
+            chessboardCorner corner;
+            corner.iX = x * 30;
+            corner.iY = y * 30;
+            corner.dU = optiData.stOcamModel.uc + (x - 3) * 40 + (y % 3) * 7;
+            corner.dV = optiData.stOcamModel.vc + (y - 3) * 40 - (x % 2) * 11;
+            corners.push_back(corner);
+        }
+    }
+    optiData.pChessboardCorner = &corners[0];
+
+    double p[IMAGE_CENTER_NUM + ROT_VEC_DIM + EXT_PARAM_T_VEC_NUM] = {
+        (optiData.stOcamModel.uc + 3.5) / IMAGE_CENTER_MAGNIFY, (optiData.stOcamModel.vc - 2.0) / IMAGE_CENTER_MAGNIFY,
+        0.1, -0.05, 0.02,
+        75.0 / TRAN_VEC_MAGNIFY, 60.0 / TRAN_VEC_MAGNIFY, 300.0 / TRAN_VEC_MAGNIFY };
+    return checkJacobian("jacobianChessboard", errorChessboardPoint, jacobianChessboardPoint,
+        p, IMAGE_CENTER_NUM + ROT_VEC_DIM + EXT_PARAM_T_VEC_NUM, (int)corners.size(), &optiData);
+}
+
+static int jacobianMatchPoints()
+{// each matched point mode, points at 95% of the image circle where the lenses overlap. the synthetic lenses sit at
+ // the sphere center, they are moved off it so the translations and the radius have a slope
+    static const matchPointOptiMode modes[4] = { optiExtrinsic, optiExtrinsicFixT, optiExtrnAndIntrn, optiSphereRadius };
+    static const char *names[4] = { "jacobianMatchPoints extrinsic", "jacobianMatchPoints rotation",
+        "jacobianMatchPoints polynomial", "jacobianMatchPoints radius" };
+    static const double offsets[2][EXT_PARAM_T_VEC_NUM] = { { 8.0, -5.0, 3.0 }, { -12.0, 6.0, -9.0 } };
+    fisheyePanoParams params;
+    cameraMetadata camera[2];
+    ImageWarper imageWarper[2];
+    ocamModel stOcamModel, stOcamCalib;
+    matchPoint matchPoints[TEST_JAC_POINTS];
+    int failures = 0;
+
+    genSyntheticParams(&params, TEST_FISHEYE, TEST_PANO_W, TEST_PANO_H);
+    int sphereRadius = params.stFisheyePanoParamsCore.sphereRadius;
+    camera[0].setFromFisheyePanoParams(&params, 0);
+    camera[1].setFromFisheyePanoParams(&params, 1);
+    camera[0].getOcamModel(&stOcamModel);
+    for (int c = 0; c != 2; ++c)
+    {// only the warp destination size is read
+        imageWarper[c].mWarpImgDstRoi.imgW = TEST_PANO_W;
+        imageWarper[c].mWarpImgDstRoi.imgH = TEST_PANO_H;
+    }
+
+    // a calibrated polynomial a little off the design one
+    memcpy(&stOcamCalib, &stOcamModel, sizeof(ocamModel));
+    stOcamCalib.pol[0] *= 0.98;
+    for (int i = 1; i < stOcamCalib.length_pol; i++)
+    {
+        stOcamCalib.pol[i] *= 1.02;
+    }
+
+    double circle = 0.95 * std::min(stOcamModel.width, stOcamModel.height) / 2;
+    for (int k = 0; k != TEST_JAC_POINTS; ++k)
+    {
+        double angle = 2 * M_PI * (k + 0.3) / TEST_JAC_POINTS;
+        matchPoints[k].coordsInA[0] = stOcamModel.uc + circle * cos(angle);
+        matchPoints[k].coordsInA[1] = stOcamModel.vc + circle * sin(angle);
+        matchPoints[k].coordsInB[0] = stOcamModel.uc + circle * cos(angle) + (k % 5) - 2;
+        matchPoints[k].coordsInB[1] = stOcamModel.vc - circle * sin(angle) + (k % 3) - 1;
+    }
+
+    for (int mode = 0; mode != 4; ++mode)
+    {
+        optiDataMatch optiData;
+        matchPoint points[TEST_JAC_POINTS];
+        double p[ROT_VEC_DIM + EXT_PARAM_T_VEC_NUM] = { 0 };
+        int m = 0;
+
+        memcpy(points, matchPoints, sizeof(points));
+        if (modes[mode] == optiExtrinsic || modes[mode] == optiExtrinsicFixT)
+        {// the points in A are pano coordinates, spread over the seams
+            for (int k = 0; k != TEST_JAC_POINTS; ++k)
+            {
+                points[k].coordsInA[0] = TEST_PANO_H * (k + 0.5) / TEST_JAC_POINTS;
+                points[k].coordsInA[1] = (k % 2) ? TEST_PANO_W / 4 + 9.0 : TEST_PANO_W * 3 / 4 - 7.0;
+            }
+        }
+
+        if (initOptiDataMatch(&optiData, modes[mode], TEST_JAC_POINTS, points, sphereRadius,
+            (modes[mode] == optiExtrinsic || modes[mode] == optiExtrinsicFixT) ? &imageWarper[1] : imageWarper,
+            (modes[mode] == optiExtrinsic || modes[mode] == optiExtrinsicFixT) ? &camera[1] : camera,
+            (modes[mode] == optiExtrnAndIntrn) ? &stOcamCalib : NULL) != 0)
+        {
+            printf("stitchTests: %s has no optimization data\n", names[mode]);
+            failures++;
+            continue;
+        }
+        for (int c = 0; c != 2; ++c)
+        {
+            for (int k = 0; k != EXT_PARAM_T_VEC_NUM; ++k)
+            {
+                optiData.transVec[c][k] = offsets[c][k];
+            }
+        }
+
+        switch (modes[mode])
+        {
+        case optiExtrinsic:
+            p[ROT_VEC_DIM] = offsets[1][0] / TRAN_VEC_MAGNIFY;
+            p[ROT_VEC_DIM + 1] = offsets[1][1] / TRAN_VEC_MAGNIFY;
+            p[ROT_VEC_DIM + 2] = offsets[1][2] / TRAN_VEC_MAGNIFY;
+            m = ROT_VEC_DIM + EXT_PARAM_T_VEC_NUM;
+            break;
+        case optiExtrinsicFixT:
+            m = ROT_VEC_DIM;
+            break;
+        case optiExtrnAndIntrn:
+            p[ROT_VEC_DIM] = 0.3;
+            p[ROT_VEC_DIM + 1] = 0.6;
+            m = ROT_VEC_DIM + OCAM_MODEL_WEIGHTS;
+            break;
+        case optiSphereRadius:
+            p[0] = (double)sphereRadius / SPHERE_RADIUS_MAGNIFY;
+            m = 1;
+            break;
+        }
+        if (modes[mode] != optiSphereRadius)
+        {// camera B turned half a turn about the vertical, and a little off it
+            p[0] = 0.03;
+            p[1] = M_PI - 0.02;
+            p[2] = -0.04;
+        }
+
+        if (checkJacobian(names[mode], errorMatchPoints, YiPanorama::calibration::jacobianMatchPoints, p, m, TEST_JAC_POINTS, &optiData) != 0)
+        {
+            failures++;
+        }
+        cleanOptiDataMatch(&optiData);
+    }
+    return (failures == 0) ? 0 : -1;
+}
+
+struct stitchTest
+{
+    const char *name;
+    int (*run)();
+};
+
+static const stitchTest tests[] = {
+    { "colorSummaryStride", colorSummaryStride },
+    { "colorAdjustGLES", colorAdjustGLES },
+    { "pyramidPhase", pyramidPhase },
+    { "jacobianChessboard", jacobianChessboard },
+    { "jacobianMatchPoints", jacobianMatchPoints },
+};
+
+int main(int argc, char **argv)
+{
+    // without a display Mesa renders through its surfaceless platform, llvmpipe when there is no GPU
+    setenv("EGL_PLATFORM", "surfaceless", 0);
+
+    int testNum = sizeof(tests) / sizeof(tests[0]);
+    int failures = 0;
+    int ran = 0;
+    for (int k = 0; k != testNum; ++k)
+    {
+        if (argc > 1 && strcmp(argv[1], tests[k].name) != 0)
+            continue;
+        int result = tests[k].run();
+        printf("stitchTests: %-24s %s\n", tests[k].name, (result == 0) ? "ok" : "FAILED");
+        failures += (result == 0) ? 0 : 1;
+        ran++;
+    }
+
+    if (ran == 0)
+    {
+        printf("stitchTests: no test %s\n", argv[1]);
+        return 2;
+    }
+    return (failures != 0) ? 1 : 0;
+}
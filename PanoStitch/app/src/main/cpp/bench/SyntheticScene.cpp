@@ -0,0 +1,178 @@
+#include "SyntheticScene.h"
+#include "ThreadPool.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+namespace YiPanorama {
+namespace bench {
+
+#define SCENE_WAVES_H   12      // periods of the scene pattern around the pano
+#define SCENE_WAVES_V   6       // and from pole to pole
+
+int genSyntheticParams(fisheyePanoParams *pParams, int fisheyeSize, int panoW, int panoH)
+{// world to camera rotations: camera x (image rows) points down, camera y (columns) right and the lens looks along -z
+    static const double rotationMtx[2][EXT_PARAM_R_MTX_NUM] =
+    {
+        { 0, -1, 0,     1, 0, 0,    0, 0, 1 },      // looks at world -z, the pano center
+        { 0, -1, 0,    -1, 0, 0,    0, 0, -1 }      // turned around the north axis, looks at the pano edges
+    };
+
+    if (pParams == NULL || fisheyeSize < 64 || panoW <= 0 || panoH <= 0)
+        return -1;
+
+    memset(pParams, 0, sizeof(fisheyePanoParams));
+    pParams->stFisheyePanoParamsCore.fisheyeImgW = fisheyeSize;
+    pParams->stFisheyePanoParamsCore.fisheyeImgH = fisheyeSize;
+    pParams->stFisheyePanoParamsCore.panoImgW = panoW;
+    pParams->stFisheyePanoParamsCore.panoImgH = panoH;
+    pParams->stFisheyePanoParamsCore.sphereRadius = SYNTHETIC_SPHERE_RADIUS;
+    pParams->stFisheyePanoParamsCore.maxFovAngle = SYNTHETIC_MAX_FOV;
+
+    // equidistant lens, rho = f * angle off the axis. cam2img takes theta = angle - pi / 2, so the inverse
+    // polynomial is exact; the forward one is its series near the axis, only the calibration tools use it
+    double f = (fisheyeSize / 2.0 - 1.0) / (SYNTHETIC_MAX_FOV * M_PI / 180.0);
+    for (int k = 0; k != 2; ++k)
+    {
+        ocamModel *pModel = &pParams->staOcamModels[k];
+        pModel->length_pol = 5;
+        pModel->pol[0] = -f;
+        pModel->pol[2] = 1.0 / (3.0 * f);
+        pModel->pol[4] = 1.0 / (45.0 * f * f * f);
+        pModel->length_invpol = 2;
+        pModel->invpol[0] = f * M_PI / 2.0;
+        pModel->invpol[1] = f;
+        pModel->uc = (fisheyeSize - 1) / 2.0;
+        pModel->vc = (fisheyeSize - 1) / 2.0;
+        pModel->c = 1.0;
+        pModel->d = 0.0;
+        pModel->e = 0.0;
+        pModel->width = fisheyeSize;
+        pModel->height = fisheyeSize;
+
+        memcpy(pParams->staExtParam[k].rotationMtx, rotationMtx[k], sizeof(double) * EXT_PARAM_R_MTX_NUM);
+    }
+
+    return 0;
+}
+
+static void sceneColor(double u, double v, float gain, unsigned char rgb[3])
+{// smooth hues around the pano with a wave pattern on top, u and v are the pano position in 0 ~ 1
+    double wave = sin(2 * M_PI * SCENE_WAVES_H * u) * sin(2 * M_PI * SCENE_WAVES_V * v);
+    double bright = (0.6 + 0.4 * wave) * gain;
+    double color[3] =
+    {
+        0.55 + 0.35 * cos(2 * M_PI * u),
+        0.55 + 0.35 * sin(2 * M_PI * u),
+        0.3 + 0.6 * v
+    };
+
+    for (int c = 0; c != 3; ++c)
+    {
+        double value = 255.0 * color[c] * bright;
+        rgb[c] = (unsigned char)(value < 0.0 ? 0.0 : (value > 255.0 ? 255.0 : value + 0.5));
+    }
+}
+
+int renderSyntheticFisheye(fisheyePanoParams *pParams, int camIdx, float gain, imageFrame image)
+{
+    if (pParams == NULL || camIdx < 0 || camIdx > 1 || image.pxlColorFormat != PIXELCOLORSPACE_RGB)
+        return -1;
+
+    const ocamModel *pModel = &pParams->staOcamModels[camIdx];
+    const double *R = pParams->staExtParam[camIdx].rotationMtx;
+    if (image.imageW != pModel->width || image.imageH != pModel->height)
+        return -1;
+
+    double f = pModel->invpol[1];
+    double maxAngle = pParams->stFisheyePanoParamsCore.maxFovAngle * M_PI / 180.0;
+
+    util::ThreadPool::getDefault()->parallelFor(0, image.imageH, [&](int rowBegin, int rowEnd) {
+        for (int r = rowBegin; r != rowEnd; ++r)
+        {
+            unsigned char *pRow = image.plane[0] + r * image.strides[0];
+            for (int c = 0; c != image.imageW; ++c)
+            {
+                double x = r - pModel->uc;
+                double y = c - pModel->vc;
+                double rho = sqrt(x * x + y * y);
+                double angle = rho / f;
+                if (angle > maxAngle)
+                {
+                    pRow[3 * c] = pRow[3 * c + 1] = pRow[3 * c + 2] = 0;
+                    continue;
+                }
+
+                double sinA = (rho > 0.0) ? sin(angle) / rho : 0.0;
+                double cam[3] = { x * sinA, y * sinA, -cos(angle) };
+
+                // camera to world is the transposed rotation, the lenses sit at the sphere center
+                double world[3];
+                for (int j = 0; j != 3; ++j)
+                    world[j] = R[j] * cam[0] + R[3 + j] * cam[1] + R[6 + j] * cam[2];
+
+                // the pano mapping of the warp tables: latitude from the north pole down, longitude from +z
+                double lat = asin(world[1] < -1.0 ? -1.0 : (world[1] > 1.0 ? 1.0 : world[1]));
+                double lon = atan2(-world[0], world[2]);
+                if (lon < 0.0)
+                    lon += 2 * M_PI;
+                sceneColor(lon / (2 * M_PI), 0.5 - lat / M_PI, gain, pRow + 3 * c);
+            }
+        }
+    }, 8);
+
+    return 0;
+}
+
+unsigned char syntheticBackWeight(double x, double y, int panoW, int panoH)
+{// angle off the front lens axis (-z), the back lens takes over across the middle of the overlap
+    double lat = M_PI_2 - M_PI * y / panoH;
+    double lon = 2 * M_PI * x / panoW;
+    double z = cos(lat) * cos(lon);
+    double angle = acos(-z) * 180.0 / M_PI;
+
+    double halfRamp = (SYNTHETIC_MAX_FOV - 90.0) / 2.0;
+    double weight = (angle - (90.0 - halfRamp)) / (2.0 * halfRamp);
+    weight = (weight < 0.0) ? 0.0 : ((weight > 1.0) ? 1.0 : weight);
+    return (unsigned char)(255.0 * weight + 0.5);
+}
+
+int initQuadrantWarpers(ImageWarper imageWarper[8], int panoW, int panoH)
+{
+    for (int i = 0; i != 8; ++i)
+    {
+        int quadrant = i % 4;
+        int up = (quadrant < 2) ? 0 : panoH / 2;
+        int left = (quadrant % 2 == 0) ? 0 : panoW / 2;
+        if (imageWarper[i].init(panoW, panoH, up, up + panoH / 2, left, left + panoW / 2, true, SYNTHETIC_SPARSE_STEP, SYNTHETIC_SPARSE_STEP, false) != 0)
+            return -1;
+        imageWarper[i].setWarpDevice(useSoftware);
+    }
+    return 0;
+}
+
+float seamOverlapAngle(fisheyePanoParams *pParams, int panoW)
+{
+    float anglesPerStep = 360.0f / (panoW / SYNTHETIC_SPARSE_STEP);
+    return floor(2 * pParams->stFisheyePanoParamsCore.maxFovAngle / anglesPerStep) * anglesPerStep - 180.0f;
+}
+
+int initSeamRois(fisheyePanoParams *pParams, imageFrame warpedImage[8], imageRoi seamRois[8])
+{
+    int panoW = pParams->stFisheyePanoParamsCore.panoImgW;
+    int seamWidth = (int)(panoW * seamOverlapAngle(pParams, panoW) / 360.0f);
+    for (int i = 0; i != 8; ++i)
+    {
+        seamRois[i].imgW = warpedImage[i].imageW;
+        seamRois[i].imgH = warpedImage[i].imageH;
+        seamRois[i].roiX = (warpedImage[i].imageW - seamWidth) / 2;
+        seamRois[i].roiY = 0;
+        seamRois[i].roiW = seamWidth;
+        seamRois[i].roiH = warpedImage[i].imageH;
+    }
+    return 0;
+}
+
+}   // namespace bench
+}   // namespace YiPanorama
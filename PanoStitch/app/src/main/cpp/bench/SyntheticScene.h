@@ -0,0 +1,44 @@
+/************************************************************************/
+/* Synthetic calibration and fisheye frames for the stitch benchmark    */
+/* two back to back equidistant lenses look at a procedural scene, so   */
+/* the frames, the tables and the pano agree without any real camera    */
+/************************************************************************/
+#pragma once
+#ifndef _SYNTHETIC_SCENE_H
+#define _SYNTHETIC_SCENE_H
+
+#include "FisheyePanoParams.h"
+#include "YiPanoramaTypes.h"
+#include "ImageWarper.h"
+
+#define SYNTHETIC_MAX_FOV       100.0f  // half fov of the synthetic lenses, degrees
+#define SYNTHETIC_SPHERE_RADIUS 2000    // the lenses share the sphere center, so the radius doesn't change the tables
+#define SYNTHETIC_SPARSE_STEP   40      // table step of the stitcher, SPARSE_STEP in FisheyePanoStitcherComp.cpp
+
+namespace YiPanorama {
+namespace bench {
+
+using namespace util;
+using namespace warper;
+
+// equidistant lenses of fisheyeSize x fisheyeSize pixels, image circle at SYNTHETIC_MAX_FOV.
+// lens 0 looks at the pano center, lens 1 at the pano edges, both upright
+int genSyntheticParams(fisheyePanoParams *pParams, int fisheyeSize, int panoW, int panoH);
+
+// the scene as lens camIdx sees it into an RGB frame of the lens size, outside the image circle is black.
+// gain scales the lens exposure, so that the color adjuster has something to correct
+int renderSyntheticFisheye(fisheyePanoParams *pParams, int camIdx, float gain, imageFrame image);
+
+// weight of the back lens (0 ~ 255) at pano position x, y of a panoW x panoH pano, ramped over the overlap of the lenses
+unsigned char syntheticBackWeight(double x, double y, int panoW, int panoH);
+
+// the layout of fisheyePanoStitcherComp for the software references: the 8 quadrant warpers of setWarpers, warpers
+// 0 ~ 3 front and 4 ~ 7 back, and the seam rois of setWorkMems, centered in the quadrants
+int initQuadrantWarpers(ImageWarper imageWarper[8], int panoW, int panoH);
+float seamOverlapAngle(fisheyePanoParams *pParams, int panoW);    // degrees, rounded to the table step as setWarpers does
+int initSeamRois(fisheyePanoParams *pParams, imageFrame warpedImage[8], imageRoi seamRois[8]);
+
+}   // namespace bench
+}   // namespace YiPanorama
+
+#endif  // !_SYNTHETIC_SCENE_H
@@ -0,0 +1,40 @@
+/************************************************************************/
+/* Desktop stand-in for the NDK logcat api                              */
+/* warnings and errors go to stderr, the per frame info logs are        */
+/* dropped so that they don't disturb the timings                       */
+/************************************************************************/
+#pragma once
+#ifndef _ANDROID_LOG_COMPAT_H
+#define _ANDROID_LOG_COMPAT_H
+
+#include <stdio.h>
+#include <stdarg.h>
+
+enum android_LogPriority
+{
+    ANDROID_LOG_UNKNOWN = 0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+    ANDROID_LOG_SILENT
+};
+
+static inline int __android_log_print(int prio, const char *tag, const char *fmt, ...)
+{
+    if (prio < ANDROID_LOG_WARN)
+        return 0;
+
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s: ", tag);
+    int result = vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    return result;
+}
+
+#endif  // !_ANDROID_LOG_COMPAT_H
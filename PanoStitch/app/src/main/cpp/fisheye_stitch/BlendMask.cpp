@@ -0,0 +1,148 @@
+#include "BlendMask.h"
+
+#include "ThreadPool.h"
+
+#include <math.h>
+#include <string.h>
+
+namespace YiPanorama {
+namespace util {
+
+#define M_PI       3.14159265358979323846   // pi
+
+static unsigned long long hashBytes(unsigned long long hash, const void *pData, size_t size)
+{// 64 bit FNV-1a
+    const unsigned char *p = (const unsigned char *)pData;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static double featherWeight(blendFeather feather, double t)
+{// t is -1 ~ 1 across the ramp, towards the back lens
+    switch (feather)
+    {
+    case blendFeatherCosine:
+        return 0.5 - 0.5 * cos((t + 1.0) * M_PI / 2);
+    case blendFeatherGaussian:  // scaled so the ends reach 0 and 1
+        return 0.5 + 0.5 * erf(2.0 * t) / erf(2.0);
+    default:
+        return (t + 1.0) / 2;
+    }
+}
+
+int genBlendMask(const blendMaskGeometry *pGeometry, unsigned char *pMask)
+{
+    const imageRoi *pRoi = &pGeometry->seamRoi;
+    if (pMask == NULL || pGeometry->panoW <= 0 || pGeometry->panoH <= 0 || pRoi->imgW <= 0 || pRoi->imgH <= 0 ||
+        pRoi->roiW <= 0 || pGeometry->featherWidth <= 0.0f || pGeometry->feather == blendFeatherFile)
+        return -1;
+
+    // quadrant origin in the pano, seam meridian and half the ramp as angles
+    int quadX = (pGeometry->quadrant % 2) * pRoi->imgW;
+    int quadY = (pGeometry->quadrant / 2) * pRoi->imgH;
+    double seamLon = 2 * M_PI * (quadX + pRoi->roiX + pRoi->roiW / 2.0) / pGeometry->panoW;
+    double halfRamp = M_PI * pGeometry->featherWidth * pRoi->roiW / pGeometry->panoW;
+    halfRamp = (halfRamp < M_PI / 2) ? halfRamp : M_PI / 2;
+    double backSide = (seamLon < M_PI) ? -1.0 : 1.0;    // the back lens is on the side away from the pano center
+
+    // the sine of the longitude off the seam per column, the angle off the seam plane is asin(cos(lat) * it)
+    std::vector<double> lonSines(pRoi->imgW);
+    for (int x = 0; x != pRoi->imgW; ++x)
+        lonSines[x] = backSide * sin(2 * M_PI * (quadX + x + 0.5) / pGeometry->panoW - seamLon);
+
+    // most of the quadrant is off the ramp, there the ends are set without the asin
+    double sinHalfRamp = sin(halfRamp);
+    unsigned char frontEnd = (unsigned char)(255.0 * featherWeight(pGeometry->feather, -1.0) + 0.5);
+    unsigned char backEnd = (unsigned char)(255.0 * featherWeight(pGeometry->feather, 1.0) + 0.5);
+
+    ThreadPool::getDefault()->parallelFor(0, pRoi->imgH, [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y != rowEnd; ++y)
+        {
+            double cosLat = cos(M_PI / 2 - M_PI * (quadY + y + 0.5) / pGeometry->panoH);
+            unsigned char *pRow = pMask + y * pRoi->imgW;
+            for (int x = 0; x != pRoi->imgW; ++x)
+            {
+                double sinAngle = cosLat * lonSines[x];
+                if (sinAngle <= -sinHalfRamp)
+                    pRow[x] = frontEnd;
+                else if (sinAngle >= sinHalfRamp)
+                    pRow[x] = backEnd;
+                else
+                    pRow[x] = (unsigned char)(255.0 * featherWeight(pGeometry->feather, asin(sinAngle) / halfRamp) + 0.5);
+            }
+        }
+    }, 16);
+
+    return 0;
+}
+
+// ====================================================================
+blendMaskCache::blendMaskCache()
+{
+}
+
+blendMaskCache::~blendMaskCache()
+{
+}
+
+unsigned long long blendMaskCache::maskKey(const blendMaskGeometry *pGeometry)
+{// fields are hashed one by one, the structures may carry padding
+    int geometry[9] = { pGeometry->panoW, pGeometry->panoH, pGeometry->quadrant, pGeometry->seamRoi.imgW, pGeometry->seamRoi.imgH,
+        pGeometry->seamRoi.roiX, pGeometry->seamRoi.roiW, (int)pGeometry->feather, 0 };
+    memcpy(&geometry[8], &pGeometry->featherWidth, sizeof(float));
+
+    return hashBytes(14695981039346656037ULL, geometry, sizeof(geometry));
+}
+
+int blendMaskCache::getMask(const blendMaskGeometry *pGeometry, unsigned char *pMask)
+{
+    unsigned long long key = maskKey(pGeometry);
+    size_t size = (size_t)pGeometry->seamRoi.imgW * pGeometry->seamRoi.imgH;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (std::list<maskEntry>::iterator it = mEntries.begin(); it != mEntries.end(); ++it)
+    {
+        if (it->key == key && it->mask.size() == size)
+        {
+            mEntries.splice(mEntries.begin(), mEntries, it);
+            memcpy(pMask, mEntries.front().mask.data(), size);
+            return 0;
+        }
+    }
+
+    if (genBlendMask(pGeometry, pMask) != 0)
+        return -1;
+
+    maskEntry entry;
+    entry.key = key;
+    entry.mask.assign(pMask, pMask + size);
+    mEntries.push_front(entry);
+    if (mEntries.size() > BLEND_MASK_CACHE_NUM)
+        mEntries.pop_back();
+
+    return 0;
+}
+
+int blendMaskCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.clear();
+    return 0;
+}
+
+blendMaskCache *blendMaskCache::getDefault()
+{// never destroyed, like the default frame pool
+    static blendMaskCache *pCache = NULL;
+    static std::once_flag flag;
+    std::call_once(flag, []() {
+        pCache = new blendMaskCache();
+    });
+    return pCache;
+}
+
+}   // namespace util
+}   // namespace YiPanorama
@@ -0,0 +1,73 @@
+/************************************************************************/
+/* Blend masks of the pano quadrants generated from the seam geometry,  */
+/* and an in memory cache of them                                       */
+/************************************************************************/
+#pragma once
+#ifndef _BLEND_MASK_H
+#define _BLEND_MASK_H
+
+#include "YiPanoramaTypes.h"
+
+#include <vector>
+#include <list>
+#include <mutex>
+
+namespace YiPanorama {
+namespace util {
+
+#define BLEND_MASK_CACHE_NUM 8      // masks kept by blendMaskCache, the least recently used one is dropped first
+
+enum blendFeather
+{// profile of the back lens weight across the seam
+    blendFeatherLinear = 0,
+    blendFeatherCosine,     // raised cosine, no slope jump where the ramp meets 0 and 255
+    blendFeatherGaussian,   // blurred step, as the pre-generated mask files
+    blendFeatherFile        // no generation, the 1440 x 360 mask file given to fisheyePanoStitcherComp::init
+};
+
+struct blendMaskGeometry
+{// one quadrant of the 2 x 2 pano layout. the front lens looks at the pano center, the back one at the left and
+ // right edges, and the seam is the meridian through the middle of the seam roi
+    int panoW;
+    int panoH;
+    int quadrant;           // 0 ~ 3, row major
+    imageRoi seamRoi;       // in the quadrant image, the mask has its imgW x imgH
+    blendFeather feather;
+    float featherWidth;     // ramp width in seam roi widths, measured on the equator
+};
+
+// the back lens weight of every quadrant pixel into pMask (imgW x imgH), rows in parallel on the default thread pool.
+// the ramp follows the angle off the seam meridian, so it widens in pano pixels towards the poles as the overlap does
+int genBlendMask(const blendMaskGeometry *pGeometry, unsigned char *pMask);
+
+class blendMaskCache
+{// generated masks by a hash of their geometry, so a re-init at a size seen before doesn't generate again
+public:
+    blendMaskCache();
+    ~blendMaskCache();
+
+    // copy the mask of the geometry into pMask (imgW x imgH), generated and kept on a miss
+    int getMask(const blendMaskGeometry *pGeometry, unsigned char *pMask);
+
+    int clear();
+
+    static unsigned long long maskKey(const blendMaskGeometry *pGeometry);
+
+    // process wide cache, created on first use
+    static blendMaskCache *getDefault();
+
+private:
+    struct maskEntry
+    {
+        unsigned long long key;
+        std::vector<unsigned char> mask;
+    };
+
+    std::mutex mMutex;
+    std::list<maskEntry> mEntries;      // most recently used first
+};
+
+}   // namespace util
+}   // namespace YiPanorama
+
+#endif  // !_BLEND_MASK_H
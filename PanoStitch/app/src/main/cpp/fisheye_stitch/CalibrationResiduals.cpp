@@ -0,0 +1,431 @@
+#include "CalibrationResiduals.h"
+#include "ThreadPool.h"
+#include "DualNumber.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+namespace YiPanorama {
+namespace calibration {
+
+using namespace util;
+
+template <typename T>
+struct chessboardModel
+{// the camera as seen by one lev-mar evaluation
+    T imgCenter[IMAGE_CENTER_NUM];
+    T rotMtx[EXT_PARAM_R_MTX_NUM];      // camera to world
+    T transVec[EXT_PARAM_T_VEC_NUM];
+};
+
+template <typename T>
+struct matchPointModel
+{// both cameras as seen by one lev-mar evaluation
+    T rotMtx[2][EXT_PARAM_R_MTX_NUM];
+    T transVec[2][EXT_PARAM_T_VEC_NUM];
+    T weights[2];   // of the calibrated ocam polynomial
+    T radius;
+};
+
+inline int matchOptiFirstCamera(matchPointOptiMode mode)
+{// camera A is only projected when its points are fisheye coordinates
+    return (mode == optiExtrinsic || mode == optiExtrinsicFixT) ? 1 : 0;
+}
+
+// functions definitions ===============================================
+template <typename T>
+void rotVecToMtx(T rotMtx[EXT_PARAM_R_MTX_NUM], const T rotVec[ROT_VEC_DIM])
+{// rodrigues formula as in cvRodrigues2, in double and for dual numbers
+    T theta2 = rotVec[0] * rotVec[0] + rotVec[1] * rotVec[1] + rotVec[2] * rotVec[2];
+
+    if (dualValue(theta2) < 1E-24)
+    {// first order around the identity, its derivative is exact there
+        rotMtx[0] = 1;          rotMtx[1] = -rotVec[2]; rotMtx[2] = rotVec[1];
+        rotMtx[3] = rotVec[2];  rotMtx[4] = 1;          rotMtx[5] = -rotVec[0];
+        rotMtx[6] = -rotVec[1]; rotMtx[7] = rotVec[0];  rotMtx[8] = 1;
+        return;
+    }
+
+    T theta = sqrt(theta2);
+    T s = sin(theta);
+    T c = cos(theta);
+    T c1 = 1 - c;
+    T k0 = rotVec[0] / theta;
+    T k1 = rotVec[1] / theta;
+    T k2 = rotVec[2] / theta;
+
+    rotMtx[0] = c + c1 * k0 * k0;
+    rotMtx[1] = c1 * k0 * k1 - s * k2;
+    rotMtx[2] = c1 * k0 * k2 + s * k1;
+    rotMtx[3] = c1 * k1 * k0 + s * k2;
+    rotMtx[4] = c + c1 * k1 * k1;
+    rotMtx[5] = c1 * k1 * k2 - s * k0;
+    rotMtx[6] = c1 * k2 * k0 - s * k1;
+    rotMtx[7] = c1 * k2 * k1 + s * k0;
+    rotMtx[8] = c + c1 * k2 * k2;
+}
+
+void rotVecToMtx(double rotMtx[EXT_PARAM_R_MTX_NUM], const double rotVec[ROT_VEC_DIM])
+{
+    rotVecToMtx<double>(rotMtx, rotVec);
+}
+
+template <typename T>
+void camToImage(T img[2], const T cam[3], const T imgCenter[IMAGE_CENTER_NUM], const ocamModel *pOcamModel)
+{// cam2img of cameraMetadata with the image center as a variable
+    const double *invpol = pOcamModel->invpol;
+    T norm = sqrt(cam[0] * cam[0] + cam[1] * cam[1]);
+
+    if (dualValue(norm) == 0)
+    {
+        img[0] = imgCenter[0];
+        img[1] = imgCenter[1];
+        return;
+    }
+
+    T theta = atan(cam[2] / norm);
+    T rho = invpol[0];
+    T t_i = 1;
+    for (int i = 1; i < pOcamModel->length_invpol; i++)
+    {
+        t_i = t_i * theta;
+        rho = rho + t_i * invpol[i];
+    }
+
+    T x = cam[0] / norm * rho;
+    T y = cam[1] / norm * rho;
+
+    img[0] = x * pOcamModel->c + y * pOcamModel->d + imgCenter[0];
+    img[1] = x * pOcamModel->e + y + imgCenter[1];
+}
+
+template <typename T>
+void setChessboardModel(chessboardModel<T> *pModel, const T *p)
+{
+    pModel->imgCenter[0] = p[0] * IMAGE_CENTER_MAGNIFY;
+    pModel->imgCenter[1] = p[1] * IMAGE_CENTER_MAGNIFY;
+    rotVecToMtx(pModel->rotMtx, p + IMAGE_CENTER_NUM);
+    for (int k = 0; k < EXT_PARAM_T_VEC_NUM; k++)
+    {
+        pModel->transVec[k] = p[IMAGE_CENTER_NUM + ROT_VEC_DIM + k] * TRAN_VEC_MAGNIFY;
+    }
+}
+
+template <typename T>
+T chessboardPointResidual(const chessboardModel<T> *pModel, const chessboardCorner *pCorner, const ocamModel *pOcamModel)
+{// chess2cam and cam2img of one corner, against its detected image coordinates
+    T world[3], cam[3], img[2], dis[2];
+
+    world[0] = pCorner->iX - pModel->transVec[0];
+    world[1] = pCorner->iY - pModel->transVec[1];
+    world[2] = -pModel->transVec[2];
+    for (int k = 0; k < 3; k++)
+    {// world to camera rotation is the transpose of camera to world
+        cam[k] = pModel->rotMtx[k] * world[0] + pModel->rotMtx[3 + k] * world[1] + pModel->rotMtx[6 + k] * world[2];
+    }
+    camToImage(img, cam, pModel->imgCenter, pOcamModel);
+
+    dis[0] = img[0] - pCorner->dU;
+    dis[1] = img[1] - pCorner->dV;
+    return sqrt(dis[0] * dis[0] + dis[1] * dis[1]);
+}
+
+void errorChessboardPoint(double *p, double *x, int m, int n, void *data)
+{// bands of corners run on the thread pool
+    optiDataCentExt *pOptiData = (optiDataCentExt*)data;
+    chessboardModel<double> model;
+
+    setChessboardModel(&model, p);
+    ThreadPool::getDefault()->parallelFor(0, n, [&](int begin, int end) {
+        for (int k = begin; k < end; k++)
+        {
+            x[k] = chessboardPointResidual(&model, pOptiData->pChessboardCorner + k, &pOptiData->stOcamModel);
+        }
+    }, MATCH_POINT_BAND);
+
+    pOptiData->errSum = 0;
+    for (int k = 0; k < n; k++)
+    {
+        pOptiData->errSum += x[k];
+    }
+}
+
+void jacobianChessboardPoint(double *p, double *jac, int m, int n, void *data)
+{// the n x m jacobian of errorChessboardPoint, row major
+    const int N = IMAGE_CENTER_NUM + ROT_VEC_DIM + EXT_PARAM_T_VEC_NUM;
+    optiDataCentExt *pOptiData = (optiDataCentExt*)data;
+    dualNumber<N> params[N];
+    chessboardModel<dualNumber<N> > model;
+
+    for (int i = 0; i < N; i++)
+    {
+        params[i] = dualNumber<N>::variable(p[i], i);
+    }
+    setChessboardModel(&model, params);
+
+    ThreadPool::getDefault()->parallelFor(0, n, [&](int begin, int end) {
+        for (int k = begin; k < end; k++)
+        {
+            dualNumber<N> residual = chessboardPointResidual(&model, pOptiData->pChessboardCorner + k, &pOptiData->stOcamModel);
+            memcpy(jac + k * N, residual.d, sizeof(double) * N);
+        }
+    }, MATCH_POINT_BAND);
+}
+
+// ------------------------------------------------------------------------
+// the match point residuals are written once for double and dualNumber, so that the lev-mar jacobian is the
+// same code evaluated with dual numbers. the fisheye points are lifted to camera rays once per optimization,
+// between evaluations only the extrinsic parameters, the ocam polynomial weights or the radius change
+void liftImagePoint(liftedPoint *pLifted, double img[2], ocamModel *pOcamDesign, ocamModel *pOcamCalib)
+{// img2cam of cameraMetadata without the normalization, for both polynomials.
+ // the center and affine parameters are the design ones, as in weightCameraModel
+    double c = pOcamDesign->c;
+    double d = pOcamDesign->d;
+    double e = pOcamDesign->e;
+    double invdet = 1 / (c - d*e);
+    double r, r_i;
+
+    pLifted->xp = invdet*((img[0] - pOcamDesign->uc) - d*(img[1] - pOcamDesign->vc));
+    pLifted->yp = invdet*(-e*(img[0] - pOcamDesign->uc) + c*(img[1] - pOcamDesign->vc));
+    r = sqrt(pLifted->xp * pLifted->xp + pLifted->yp * pLifted->yp);
+
+    pLifted->zDesign = pOcamDesign->pol[0];
+    pLifted->zCalib = pOcamCalib->pol[0];
+    r_i = 1;
+    for (int i = 1; i < pOcamDesign->length_pol; i++)
+    {
+        r_i *= r;
+        pLifted->zDesign += r_i * pOcamDesign->pol[i];
+        pLifted->zCalib += r_i * pOcamCalib->pol[i];
+    }
+}
+
+template <typename T>
+void camRayToPano(T panoCoords[2], const T cam[3], const T rotMtx[EXT_PARAM_R_MTX_NUM], const T transVec[EXT_PARAM_T_VEC_NUM], const T &radius, int panoW, int panoH)
+{// cam2sph of cameraMetadata and the rest of coordTransFisheyeToPano
+    T norm = sqrt(cam[0] * cam[0] + cam[1] * cam[1] + cam[2] * cam[2]);
+    T camera[3] = { cam[0] / norm, cam[1] / norm, cam[2] / norm };
+    T midCam[3], sph[3];
+
+    for (int k = 0; k < 3; k++)
+    {
+        midCam[k] = rotMtx[k * 3] * camera[0] + rotMtx[k * 3 + 1] * camera[1] + rotMtx[k * 3 + 2] * camera[2];
+    }
+
+    T a = midCam[0] * midCam[0] + midCam[1] * midCam[1] + midCam[2] * midCam[2];
+    T b = 2 * (midCam[0] * transVec[0] + midCam[1] * transVec[1] + midCam[2] * transVec[2]);
+    T c = transVec[0] * transVec[0] + transVec[1] * transVec[1] + transVec[2] * transVec[2] - radius * radius;
+    T delta = b * b - 4 * a * c;
+    if (dualValue(delta) < 0)
+    {// the camera is outside the sphere and the ray misses it, take the closest point
+        delta = 0;
+    }
+    T d1 = (-b + sqrt(delta)) / (2 * a);
+
+    for (int k = 0; k < 3; k++)
+    {
+        sph[k] = d1 * midCam[k] + transVec[k];
+    }
+
+    // the same angles as asin / acos in coordTransFisheyeToPano, but with derivatives at the poles too
+    T theta = atan2(sph[1], sqrt(sph[0] * sph[0] + sph[2] * sph[2]));
+    T phi = atan2(-sph[0], sph[2]);
+    if (dualValue(phi) < 0)
+    {
+        phi = phi + 2 * M_PI;
+    }
+
+    panoCoords[1] = panoW * phi / (2 * M_PI);           // x
+    panoCoords[0] = panoH * (M_PI_2 - theta) / M_PI;    // y
+}
+
+template <typename T>
+void setMatchPointModel(matchPointModel<T> *pModel, const T *p, const optiDataMatch *pOptiData)
+{// the cameras of one evaluation, the ones not optimized keep their current extrinsic parameters
+    for (int c = 0; c < 2; c++)
+    {
+        for (int k = 0; k < EXT_PARAM_R_MTX_NUM; k++)
+        {
+            pModel->rotMtx[c][k] = pOptiData->rotMtx[c][k];
+        }
+        for (int k = 0; k < EXT_PARAM_T_VEC_NUM; k++)
+        {
+            pModel->transVec[c][k] = pOptiData->transVec[c][k];
+        }
+        pModel->weights[c] = 0;
+    }
+    pModel->radius = pOptiData->sphereRadius;
+
+    switch (pOptiData->mode)
+    {
+    case optiExtrinsic:
+        rotVecToMtx(pModel->rotMtx[1], p);
+        for (int k = 0; k < EXT_PARAM_T_VEC_NUM; k++)
+        {
+            pModel->transVec[1][k] = p[ROT_VEC_DIM + k] * TRAN_VEC_MAGNIFY;
+        }
+        break;
+
+    case optiExtrinsicFixT:
+        rotVecToMtx(pModel->rotMtx[1], p);
+        break;
+
+    case optiExtrnAndIntrn:
+        rotVecToMtx(pModel->rotMtx[1], p);
+        pModel->weights[0] = p[ROT_VEC_DIM];
+        pModel->weights[1] = p[ROT_VEC_DIM + 1];
+        break;
+
+    case optiSphereRadius:
+        pModel->radius = p[0] * SPHERE_RADIUS_MAGNIFY;
+        break;
+
+    default:
+        break;
+    }
+}
+
+template <typename T>
+T matchPointResidual(const matchPointModel<T> *pModel, int k, const optiDataMatch *pOptiData)
+{// distance of the matched pair in the pano
+    T cam[3], panoCoords[2][2], dis[2];
+    int first = matchOptiFirstCamera(pOptiData->mode);
+
+    if (first == 1)
+    {// the points in A are pano coordinates already
+        panoCoords[0][0] = pOptiData->pMatchedPoints[k].coordsInA[0];
+        panoCoords[0][1] = pOptiData->pMatchedPoints[k].coordsInA[1];
+    }
+
+    for (int c = first; c < 2; c++)
+    {
+        const liftedPoint *pLifted = pOptiData->pLifted[c] + k;
+        cam[0] = pLifted->xp;
+        cam[1] = pLifted->yp;
+        cam[2] = pLifted->zDesign + pModel->weights[c] * (pLifted->zCalib - pLifted->zDesign);
+        camRayToPano(panoCoords[c], cam, pModel->rotMtx[c], pModel->transVec[c], pModel->radius, pOptiData->panoW[c], pOptiData->panoH[c]);
+    }
+
+    dis[0] = panoCoords[1][0] - panoCoords[0][0];
+    dis[1] = panoCoords[1][1] - panoCoords[0][1];
+    return sqrt(dis[0] * dis[0] + dis[1] * dis[1]);
+}
+
+void errorMatchPoints(double *p, double *x, int m, int n, void *data)
+{// calculate the RMS error of each pair of matched points, bands of points run on the thread pool
+    optiDataMatch *pOptiData = (optiDataMatch*)data;
+    matchPointModel<double> model;
+
+    setMatchPointModel(&model, p, pOptiData);
+    ThreadPool::getDefault()->parallelFor(0, n, [&](int begin, int end) {
+        for (int k = begin; k < end; k++)
+        {
+            x[k] = matchPointResidual(&model, k, pOptiData);
+        }
+    }, MATCH_POINT_BAND);
+}
+
+template <int N>
+void jacobianMatchPointsN(double *p, double *jac, int n, optiDataMatch *pOptiData)
+{
+    dualNumber<N> params[N];
+    matchPointModel<dualNumber<N> > model;
+
+    for (int i = 0; i < N; i++)
+    {
+        params[i] = dualNumber<N>::variable(p[i], i);
+    }
+    setMatchPointModel(&model, params, pOptiData);
+
+    ThreadPool::getDefault()->parallelFor(0, n, [&](int begin, int end) {
+        for (int k = begin; k < end; k++)
+        {
+            dualNumber<N> residual = matchPointResidual(&model, k, pOptiData);
+            memcpy(jac + k * N, residual.d, sizeof(double) * N);
+        }
+    }, MATCH_POINT_BAND);
+}
+
+void jacobianMatchPoints(double *p, double *jac, int m, int n, void *data)
+{// the n x m jacobian of errorMatchPoints, row major
+    optiDataMatch *pOptiData = (optiDataMatch*)data;
+
+    switch (m)
+    {
+    case 1:
+        jacobianMatchPointsN<1>(p, jac, n, pOptiData);
+        break;
+    case ROT_VEC_DIM:
+        jacobianMatchPointsN<ROT_VEC_DIM>(p, jac, n, pOptiData);
+        break;
+    case ROT_VEC_DIM + OCAM_MODEL_WEIGHTS:
+        jacobianMatchPointsN<ROT_VEC_DIM + OCAM_MODEL_WEIGHTS>(p, jac, n, pOptiData);
+        break;
+    case ROT_VEC_DIM + EXT_PARAM_T_VEC_NUM:
+        jacobianMatchPointsN<ROT_VEC_DIM + EXT_PARAM_T_VEC_NUM>(p, jac, n, pOptiData);
+        break;
+    default:
+        break;
+    }
+}
+
+void cleanOptiDataMatch(optiDataMatch *pOptiData)
+{
+    for (int c = 0; c < 2; c++)
+    {
+        if (pOptiData->pLifted[c] != NULL)
+        {
+            delete[] pOptiData->pLifted[c];
+            pOptiData->pLifted[c] = NULL;
+        }
+    }
+}
+
+int initOptiDataMatch(optiDataMatch *pOptiData, matchPointOptiMode mode, int pointNum, matchPoint *pMatchPoints, int sphereRadius,
+    ImageWarper *pImageWarpers, cameraMetadata *pCameras, ocamModel *pOcamCalib)
+{// pImageWarpers and pCameras hold camera B only, when the points in A are pano coordinates already
+    ocamModel stOcamDesign, stOcamCalib;
+    int first = matchOptiFirstCamera(mode);
+
+    memset(pOptiData, 0, sizeof(optiDataMatch));
+    pOptiData->mode = mode;
+    pOptiData->sphereRadius = sphereRadius;
+    pOptiData->pMatchedPoints = pMatchPoints;
+
+    for (int c = first; c < 2; c++)
+    {
+        cameraMetadata *pCamera = &pCameras[c - first];
+
+        pCamera->getOcamModel(&stOcamDesign);
+        if (pOcamCalib != NULL)
+        {
+            memcpy(&stOcamCalib, pOcamCalib, sizeof(ocamModel));
+        }
+        else
+        {
+            memcpy(&stOcamCalib, &stOcamDesign, sizeof(ocamModel));
+        }
+        if (stOcamCalib.length_pol != stOcamDesign.length_pol)
+        {
+            printf("initOptiDataMatch: the calibrated and design ocam models don't match\n");
+            cleanOptiDataMatch(pOptiData);
+            return -1;
+        }
+
+        pCamera->getCam2WorldRotMtx(pOptiData->rotMtx[c]);
+        pCamera->getCam2WorldTransVec(pOptiData->transVec[c]);
+        pOptiData->panoW[c] = pImageWarpers[c - first].mWarpImgDstRoi.imgW;
+        pOptiData->panoH[c] = pImageWarpers[c - first].mWarpImgDstRoi.imgH;
+
+        pOptiData->pLifted[c] = new liftedPoint[pointNum];
+        for (int k = 0; k < pointNum; k++)
+        {
+            liftImagePoint(&pOptiData->pLifted[c][k], c == 0 ? pMatchPoints[k].coordsInA : pMatchPoints[k].coordsInB, &stOcamDesign, &stOcamCalib);
+        }
+    }
+    return 0;
+}
+
+}   // namespace calibration
+}   // namespace YiPanorama
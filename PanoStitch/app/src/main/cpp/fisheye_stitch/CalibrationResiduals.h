@@ -0,0 +1,87 @@
+/************************************************************************/
+/* residuals of the lev-mar calibrations and their analytic jacobians   */
+/* 1. chessboard corners: image center and the board's extrinsics       */
+/* 2. matched points: camera B's extrinsics, the ocam polynomial        */
+/*    weights or the sphere radius                                      */
+/* no levmar and no opencv here, so they build and are checked alone    */
+/************************************************************************/
+#pragma once
+#ifndef _CALIBRATION_RESIDUALS_H
+#define _CALIBRATION_RESIDUALS_H
+
+#include "FeatureBasedOptimization.h"
+
+namespace YiPanorama {
+namespace calibration {
+
+#define IMAGE_CENTER_NUM 2
+#define OCAM_MODEL_WEIGHTS 2
+#define ROT_VEC_DIM 3
+#define IMAGE_CENTER_MAGNIFY 1000
+#define TRAN_VEC_MAGNIFY 1000
+#define SPHERE_RADIUS_MAGNIFY 1000
+
+#define MATCH_POINT_BAND 64     // matched points or corners per thread pool band
+
+enum matchPointOptiMode
+{
+    optiExtrinsic,          // camera B's rotation and translation, B's points against the pano coordinates in A
+    optiExtrinsicFixT,      // camera B's rotation only, the same points
+    optiExtrnAndIntrn,      // camera B's rotation and both cameras' ocam polynomial weights
+    optiSphereRadius        // the sphere radius only
+};
+
+struct liftedPoint
+{// a fisheye point lifted to its camera ray by img2cam, not normalized. z is linear in the weight of the
+ // calibrated polynomial against the design one: z = zDesign + w * (zCalib - zDesign)
+    double xp;
+    double yp;
+    double zDesign;
+    double zCalib;
+};
+
+struct optiDataMatch
+{// extra data needed in the matched point optimizations, [0] for camera A and [1] for camera B
+    matchPointOptiMode mode;
+    double sphereRadius;
+    matchPoint *pMatchedPoints;
+    liftedPoint *pLifted[2];                    // each matched point lifted in both cameras
+    double rotMtx[2][EXT_PARAM_R_MTX_NUM];      // camera to world, before the optimization
+    double transVec[2][EXT_PARAM_T_VEC_NUM];
+    int panoW[2];                               // warp destination sizes
+    int panoH[2];
+};
+
+struct optiDataCentExt
+{// extra data needed in the intrinsic parameter optimization
+    chessboardCorner *pChessboardCorner;
+    cameraMetadata *pCamera;
+    ocamModel stOcamModel;  // the camera's model, only its image centers are optimized
+    double errSum;
+};
+
+// rodrigues formula as in cvRodrigues2, without the float CvMat
+void rotVecToMtx(double rotMtx[EXT_PARAM_R_MTX_NUM], const double rotVec[ROT_VEC_DIM]);
+
+// lev-mar callbacks of the chessboard optimization, data is an optiDataCentExt. p is the image center over
+// IMAGE_CENTER_MAGNIFY, the rotation vector and the translation over TRAN_VEC_MAGNIFY; x the distance of each corner
+// to its projection. the jacobian is n x m, row major
+void errorChessboardPoint(double *p, double *x, int m, int n, void *data);
+void jacobianChessboardPoint(double *p, double *jac, int m, int n, void *data);
+
+// the points are lifted to camera rays here, once per optimization. pImageWarpers and pCameras hold camera B only
+// when the points in A are pano coordinates already (optiExtrinsic, optiExtrinsicFixT), pOcamCalib NULL uses the design model
+int initOptiDataMatch(optiDataMatch *pOptiData, matchPointOptiMode mode, int pointNum, matchPoint *pMatchPoints, int sphereRadius,
+    ImageWarper *pImageWarpers, cameraMetadata *pCameras, ocamModel *pOcamCalib);
+void cleanOptiDataMatch(optiDataMatch *pOptiData);
+
+// lev-mar callbacks of the matched point optimizations, data is an optiDataMatch. p follows its mode: the rotation
+// vector, then the translation over TRAN_VEC_MAGNIFY or the 2 polynomial weights; or the radius over
+// SPHERE_RADIUS_MAGNIFY alone. x is the pano distance of each pair, the jacobian n x m, row major
+void errorMatchPoints(double *p, double *x, int m, int n, void *data);
+void jacobianMatchPoints(double *p, double *jac, int m, int n, void *data);
+
+}   // namespace calibration
+}   // namespace YiPanorama
+
+#endif  //!_CALIBRATION_RESIDUALS_H
@@ -0,0 +1,880 @@
+#include "ColorConverter.h"
+#include "ThreadPool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONVERTER_USE_NEON
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define CONVERTER_USE_SSSE3
+#endif
+
+namespace YiPanorama {
+namespace util {
+
+#define COLOR_CONVERT_BAND  8       // row pairs (rows for YUV -> RGB) per band
+#define RGB_TO_YUV_SHIFT    8
+#define YUV_TO_RGB_SHIFT    12
+#define YUV_TO_RGB_ROUND    (1 << (YUV_TO_RGB_SHIFT - 1))
+#define CHROMA_BIAS         ((128 << RGB_TO_YUV_SHIFT) + 128)
+
+struct rgbToYUVCoefs
+{// Q8, Y = (y[0] * R + y[1] * G + y[2] * B + (yOffset << 8) + 128) >> 8, U and V the same around 128.
+ // the Y sums stay below 65536 for every table, so they fit unsigned 16 bit lanes
+    short y[3];
+    short u[3];
+    short v[3];
+    short yOffset;
+};
+
+struct yuvToRGBCoefs
+{// Q12 on (Y - yOffset), (U - 128) and (V - 128), rounded
+    short y;
+    short rv;
+    short gu;
+    short gv;
+    short bu;
+    short yOffset;
+};
+
+// [yuvMatrix][yuvRange]
+static const rgbToYUVCoefs rgbToYUVTable[2][2] =
+{
+    {// BT.601, the limited range row is the one RGBtoYUV420YV and the GLES YUV readback always used
+        { { 66, 129, 25 }, { -38, -74, 112 }, { 112, -94, -18 }, 16 },
+        { { 77, 150, 29 }, { -43, -85, 128 }, { 128, -107, -21 }, 0 }
+    },
+    {// BT.709
+        { { 47, 157, 16 }, { -26, -86, 112 }, { 112, -102, -10 }, 16 },
+        { { 54, 183, 19 }, { -29, -99, 128 }, { 128, -116, -12 }, 0 }
+    }
+};
+
+static const yuvToRGBCoefs yuvToRGBTable[2][2] =
+{
+    {// BT.601
+        { 4769, 6537, -1605, -3330, 8263, 16 },
+        { 4096, 5743, -1410, -2925, 7258, 0 }
+    },
+    {// BT.709
+        { 4769, 7343, -873, -2183, 8652, 16 },
+        { 4096, 6450, -767, -1917, 7601, 0 }
+    }
+};
+
+// =============================================================================
+// scalar kernels, the reference and the tails of the fast rows
+//------------------------------------------------------------------------------
+static inline unsigned char clampToByte(int value)
+{
+    return (unsigned char)(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+static void rgbToLumaRowScalar(const unsigned char *pRgb, int pixelBytes, unsigned char *pY, int xBegin, int width, const rgbToYUVCoefs *pC)
+{
+    const int bias = (pC->yOffset << RGB_TO_YUV_SHIFT) + 128;
+    for (int x = xBegin; x < width; x++)
+    {
+        const unsigned char *p = pRgb + x * pixelBytes;
+        pY[x] = clampToByte((pC->y[0] * p[0] + pC->y[1] * p[1] + pC->y[2] * p[2] + bias) >> RGB_TO_YUV_SHIFT);
+    }
+}
+
+static void rgbToYUVRowPairScalar(const unsigned char *pRgb0, const unsigned char *pRgb1, int pixelBytes, unsigned char *pY0, unsigned char *pY1,
+    unsigned char *pU, unsigned char *pV, int chromaStep, int xBegin, int width, const rgbToYUVCoefs *pC)
+{// xBegin is even, U / V of each 2 x 2 block come from its rounded average
+    rgbToLumaRowScalar(pRgb0, pixelBytes, pY0, xBegin, width, pC);
+    rgbToLumaRowScalar(pRgb1, pixelBytes, pY1, xBegin, width, pC);
+
+    for (int x = xBegin; x < width; x += 2)
+    {
+        const unsigned char *p0 = pRgb0 + x * pixelBytes;
+        const unsigned char *p1 = pRgb1 + x * pixelBytes;
+        int r = (p0[0] + p0[pixelBytes] + p1[0] + p1[pixelBytes] + 2) >> 2;
+        int g = (p0[1] + p0[pixelBytes + 1] + p1[1] + p1[pixelBytes + 1] + 2) >> 2;
+        int b = (p0[2] + p0[pixelBytes + 2] + p1[2] + p1[pixelBytes + 2] + 2) >> 2;
+        int c = (x / 2) * chromaStep;
+
+        pU[c] = clampToByte((pC->u[0] * r + pC->u[1] * g + pC->u[2] * b + CHROMA_BIAS) >> RGB_TO_YUV_SHIFT);
+        pV[c] = clampToByte((pC->v[0] * r + pC->v[1] * g + pC->v[2] * b + CHROMA_BIAS) >> RGB_TO_YUV_SHIFT);
+    }
+}
+
+static void yuvToRGBRowScalar(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, int chromaStep,
+    unsigned char *pRgb, int pixelBytes, int xBegin, int width, const yuvToRGBCoefs *pC)
+{
+    for (int x = xBegin; x < width; x++)
+    {
+        int c = (x / 2) * chromaStep;
+        int y = pC->y * (pY[x] - pC->yOffset) + YUV_TO_RGB_ROUND;
+        int u = pU[c] - 128;
+        int v = pV[c] - 128;
+        unsigned char *p = pRgb + x * pixelBytes;
+
+        p[0] = clampToByte((y + pC->rv * v) >> YUV_TO_RGB_SHIFT);
+        p[1] = clampToByte((y + pC->gu * u + pC->gv * v) >> YUV_TO_RGB_SHIFT);
+        p[2] = clampToByte((y + pC->bu * u) >> YUV_TO_RGB_SHIFT);
+        if (pixelBytes == 4)
+        {
+            p[3] = 255;
+        }
+    }
+}
+
+// =============================================================================
+// fast kernels, 16 pixels per step; they return the first column left to the scalar tail
+#if defined(CONVERTER_USE_NEON)
+//------------------------------------------------------------------------------
+template <int pixelBytes>
+static inline void loadRGB16(const unsigned char *p, uint8x16_t rgb[3])
+{
+    if (pixelBytes == 4)
+    {
+        uint8x16x4_t px = vld4q_u8(p);
+        rgb[0] = px.val[0];
+        rgb[1] = px.val[1];
+        rgb[2] = px.val[2];
+    }
+    else
+    {
+        uint8x16x3_t px = vld3q_u8(p);
+        rgb[0] = px.val[0];
+        rgb[1] = px.val[1];
+        rgb[2] = px.val[2];
+    }
+}
+
+static inline uint8x16_t luma16(const uint8x16_t rgb[3], const rgbToYUVCoefs *pC)
+{
+    const uint8x8_t cr = vdup_n_u8((unsigned char)pC->y[0]);
+    const uint8x8_t cg = vdup_n_u8((unsigned char)pC->y[1]);
+    const uint8x8_t cb = vdup_n_u8((unsigned char)pC->y[2]);
+    const uint16x8_t bias = vdupq_n_u16((unsigned short)((pC->yOffset << RGB_TO_YUV_SHIFT) + 128));
+
+    uint16x8_t lo = vmlal_u8(vmlal_u8(vmlal_u8(bias, vget_low_u8(rgb[0]), cr), vget_low_u8(rgb[1]), cg), vget_low_u8(rgb[2]), cb);
+    uint16x8_t hi = vmlal_u8(vmlal_u8(vmlal_u8(bias, vget_high_u8(rgb[0]), cr), vget_high_u8(rgb[1]), cg), vget_high_u8(rgb[2]), cb);
+    return vcombine_u8(vshrn_n_u16(lo, RGB_TO_YUV_SHIFT), vshrn_n_u16(hi, RGB_TO_YUV_SHIFT));
+}
+
+static inline int16x8_t average2x2(uint8x16_t row0, uint8x16_t row1)
+{// 8 lanes of (sum of the 2 x 2 block + 2) >> 2
+    return vreinterpretq_s16_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(row0), vpaddlq_u8(row1)), 2));
+}
+
+static inline uint8x8_t chroma8(const int16x8_t rgb[3], const short coefs[3])
+{
+    const int32x4_t bias = vdupq_n_s32(CHROMA_BIAS);
+    int32x4_t lo = vmlal_n_s16(vmlal_n_s16(vmlal_n_s16(bias, vget_low_s16(rgb[0]), coefs[0]), vget_low_s16(rgb[1]), coefs[1]), vget_low_s16(rgb[2]), coefs[2]);
+    int32x4_t hi = vmlal_n_s16(vmlal_n_s16(vmlal_n_s16(bias, vget_high_s16(rgb[0]), coefs[0]), vget_high_s16(rgb[1]), coefs[1]), vget_high_s16(rgb[2]), coefs[2]);
+    return vqmovn_u16(vcombine_u16(vqshrun_n_s32(lo, RGB_TO_YUV_SHIFT), vqshrun_n_s32(hi, RGB_TO_YUV_SHIFT)));
+}
+
+static inline uint8x8_t yuvToChannel8(int16x8_t y, int16x8_t u, int16x8_t v, short cy, short cu, short cv)
+{
+    int32x4_t lo = vmlal_n_s16(vmlal_n_s16(vmull_n_s16(vget_low_s16(y), cy), vget_low_s16(u), cu), vget_low_s16(v), cv);
+    int32x4_t hi = vmlal_n_s16(vmlal_n_s16(vmull_n_s16(vget_high_s16(y), cy), vget_high_s16(u), cu), vget_high_s16(v), cv);
+    return vqmovn_u16(vcombine_u16(vqrshrun_n_s32(lo, YUV_TO_RGB_SHIFT), vqrshrun_n_s32(hi, YUV_TO_RGB_SHIFT)));
+}
+
+template <int pixelBytes>
+static int rgbToLumaRowFast(const unsigned char *pRgb, unsigned char *pY, int width, const rgbToYUVCoefs *pC)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t rgb[3];
+        loadRGB16<pixelBytes>(pRgb + x * pixelBytes, rgb);
+        vst1q_u8(pY + x, luma16(rgb, pC));
+    }
+    return x;
+}
+
+template <int pixelBytes>
+static int rgbToYUVRowPairFast(const unsigned char *pRgb0, const unsigned char *pRgb1, unsigned char *pY0, unsigned char *pY1,
+    unsigned char *pU, unsigned char *pV, int chromaStep, int width, const rgbToYUVCoefs *pC)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t rgb0[3], rgb1[3];
+        int16x8_t avg[3];
+        loadRGB16<pixelBytes>(pRgb0 + x * pixelBytes, rgb0);
+        loadRGB16<pixelBytes>(pRgb1 + x * pixelBytes, rgb1);
+        vst1q_u8(pY0 + x, luma16(rgb0, pC));
+        vst1q_u8(pY1 + x, luma16(rgb1, pC));
+
+        for (int k = 0; k < 3; k++)
+        {
+            avg[k] = average2x2(rgb0[k], rgb1[k]);
+        }
+        uint8x8_t u = chroma8(avg, pC->u);
+        uint8x8_t v = chroma8(avg, pC->v);
+
+        if (chromaStep == 1)
+        {
+            vst1_u8(pU + x / 2, u);
+            vst1_u8(pV + x / 2, v);
+        }
+        else if (pU < pV)
+        {
+            uint8x8x2_t uv = { { u, v } };
+            vst2_u8(pU + x, uv);
+        }
+        else
+        {
+            uint8x8x2_t vu = { { v, u } };
+            vst2_u8(pV + x, vu);
+        }
+    }
+    return x;
+}
+
+template <int pixelBytes>
+static int yuvToRGBRowFast(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, int chromaStep,
+    unsigned char *pRgb, int width, const yuvToRGBCoefs *pC)
+{
+    const uint8x8_t yOffset = vdup_n_u8((unsigned char)pC->yOffset);
+    const uint8x8_t cOffset = vdup_n_u8(128);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t y8 = vld1q_u8(pY + x);
+        uint8x8_t u8, v8;
+        if (chromaStep == 1)
+        {
+            u8 = vld1_u8(pU + x / 2);
+            v8 = vld1_u8(pV + x / 2);
+        }
+        else if (pU < pV)
+        {
+            uint8x8x2_t uv = vld2_u8(pU + x);
+            u8 = uv.val[0];
+            v8 = uv.val[1];
+        }
+        else
+        {
+            uint8x8x2_t vu = vld2_u8(pV + x);
+            v8 = vu.val[0];
+            u8 = vu.val[1];
+        }
+
+        // u8 - offset wraps in 16 bits, which is the signed difference
+        int16x8_t y[2] = { vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(y8), yOffset)), vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(y8), yOffset)) };
+        int16x8_t u1 = vreinterpretq_s16_u16(vsubl_u8(u8, cOffset));
+        int16x8_t v1 = vreinterpretq_s16_u16(vsubl_u8(v8, cOffset));
+        int16x8x2_t u = vzipq_s16(u1, u1);     // each chroma sample for 2 pixels
+        int16x8x2_t v = vzipq_s16(v1, v1);
+
+        uint8x8_t rgb[3][2];
+        for (int h = 0; h < 2; h++)
+        {
+            rgb[0][h] = yuvToChannel8(y[h], u.val[h], v.val[h], pC->y, 0, pC->rv);
+            rgb[1][h] = yuvToChannel8(y[h], u.val[h], v.val[h], pC->y, pC->gu, pC->gv);
+            rgb[2][h] = yuvToChannel8(y[h], u.val[h], v.val[h], pC->y, pC->bu, 0);
+        }
+
+        if (pixelBytes == 4)
+        {
+            uint8x16x4_t px;
+            px.val[0] = vcombine_u8(rgb[0][0], rgb[0][1]);
+            px.val[1] = vcombine_u8(rgb[1][0], rgb[1][1]);
+            px.val[2] = vcombine_u8(rgb[2][0], rgb[2][1]);
+            px.val[3] = vdupq_n_u8(255);
+            vst4q_u8(pRgb + x * 4, px);
+        }
+        else
+        {
+            uint8x16x3_t px;
+            px.val[0] = vcombine_u8(rgb[0][0], rgb[0][1]);
+            px.val[1] = vcombine_u8(rgb[1][0], rgb[1][1]);
+            px.val[2] = vcombine_u8(rgb[2][0], rgb[2][1]);
+            vst3q_u8(pRgb + x * 3, px);
+        }
+    }
+    return x;
+}
+
+#elif defined(CONVERTER_USE_SSSE3)
+//------------------------------------------------------------------------------
+template <int pixelBytes>
+struct rgbShuffles
+{// pshufb masks between pixelBytes x 16 interleaved bytes and 16 byte channel vectors, 0x80 picks 0
+    __m128i gather[3][pixelBytes];              // channel c from block k
+    __m128i scatter[pixelBytes][pixelBytes];    // block k from channel c, channel 3 is alpha
+
+    rgbShuffles()
+    {
+        char bytes[16];
+        for (int c = 0; c < 3; c++)
+        {
+            for (int k = 0; k < pixelBytes; k++)
+            {
+                for (int j = 0; j < 16; j++)
+                {
+                    int s = pixelBytes * j + c;
+                    bytes[j] = (s / 16 == k) ? (char)(s % 16) : (char)0x80;
+                }
+                gather[c][k] = _mm_loadu_si128((const __m128i *)bytes);
+            }
+        }
+        for (int k = 0; k < pixelBytes; k++)
+        {
+            for (int c = 0; c < pixelBytes; c++)
+            {
+                for (int j = 0; j < 16; j++)
+                {
+                    int s = 16 * k + j;
+                    bytes[j] = (s % pixelBytes == c) ? (char)(s / pixelBytes) : (char)0x80;
+                }
+                scatter[k][c] = _mm_loadu_si128((const __m128i *)bytes);
+            }
+        }
+    }
+
+    void load(const unsigned char *p, __m128i rgb[3]) const
+    {
+        __m128i blocks[pixelBytes];
+        for (int k = 0; k < pixelBytes; k++)
+        {
+            blocks[k] = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            rgb[c] = _mm_shuffle_epi8(blocks[0], gather[c][0]);
+            for (int k = 1; k < pixelBytes; k++)
+            {
+                rgb[c] = _mm_or_si128(rgb[c], _mm_shuffle_epi8(blocks[k], gather[c][k]));
+            }
+        }
+    }
+
+    void store(unsigned char *p, const __m128i chn[4]) const
+    {
+        for (int k = 0; k < pixelBytes; k++)
+        {
+            __m128i block = _mm_shuffle_epi8(chn[0], scatter[k][0]);
+            for (int c = 1; c < pixelBytes; c++)
+            {
+                block = _mm_or_si128(block, _mm_shuffle_epi8(chn[c], scatter[k][c]));
+            }
+            _mm_storeu_si128((__m128i *)(p + 16 * k), block);
+        }
+    }
+};
+
+template <int pixelBytes>
+static const rgbShuffles<pixelBytes> &getRGBShuffles()
+{
+    static const rgbShuffles<pixelBytes> shuffles;
+    return shuffles;
+}
+
+static inline __m128i luma16(const __m128i rgb[3], const rgbToYUVCoefs *pC)
+{// the sums wrap as signed 16 bit but are below 65536, so the logical shift gets them right
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i cr = _mm_set1_epi16(pC->y[0]);
+    const __m128i cg = _mm_set1_epi16(pC->y[1]);
+    const __m128i cb = _mm_set1_epi16(pC->y[2]);
+    const __m128i bias = _mm_set1_epi16((short)((pC->yOffset << RGB_TO_YUV_SHIFT) + 128));
+
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(rgb[0], zero), cr), _mm_mullo_epi16(_mm_unpacklo_epi8(rgb[1], zero), cg));
+    lo = _mm_add_epi16(_mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(rgb[2], zero), cb)), bias);
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(rgb[0], zero), cr), _mm_mullo_epi16(_mm_unpackhi_epi8(rgb[1], zero), cg));
+    hi = _mm_add_epi16(_mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(rgb[2], zero), cb)), bias);
+    return _mm_packus_epi16(_mm_srli_epi16(lo, RGB_TO_YUV_SHIFT), _mm_srli_epi16(hi, RGB_TO_YUV_SHIFT));
+}
+
+static inline __m128i average2x2(__m128i row0, __m128i row1)
+{// 8 16 bit lanes of (sum of the 2 x 2 block + 2) >> 2
+    const __m128i ones = _mm_set1_epi8(1);
+    __m128i sum = _mm_add_epi16(_mm_maddubs_epi16(row0, ones), _mm_maddubs_epi16(row1, ones));
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+static inline __m128i chroma8(const __m128i rgb[3], const short coefs[3])
+{// (r, g) and (b, 0) pairs through pmaddwd, the 8 results in the low 8 bytes
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgCoefs = _mm_setr_epi16(coefs[0], coefs[1], coefs[0], coefs[1], coefs[0], coefs[1], coefs[0], coefs[1]);
+    const __m128i bCoefs = _mm_set1_epi32((unsigned short)coefs[2]);
+    const __m128i bias = _mm_set1_epi32(CHROMA_BIAS);
+
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(rgb[0], rgb[1]), rgCoefs), _mm_madd_epi16(_mm_unpacklo_epi16(rgb[2], zero), bCoefs));
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(rgb[0], rgb[1]), rgCoefs), _mm_madd_epi16(_mm_unpackhi_epi16(rgb[2], zero), bCoefs));
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, bias), RGB_TO_YUV_SHIFT);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, bias), RGB_TO_YUV_SHIFT);
+    __m128i words = _mm_packs_epi32(lo, hi);
+    return _mm_packus_epi16(words, words);
+}
+
+static inline __m128i yuvToChannel8(__m128i y, __m128i u, __m128i v, short cy, short cu, short cv)
+{// (y, u) and (v, 1) pairs through pmaddwd, the rounding rides on the 1; 8 signed 16 bit results
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i yuCoefs = _mm_setr_epi16(cy, cu, cy, cu, cy, cu, cy, cu);
+    const __m128i vCoefs = _mm_setr_epi16(cv, YUV_TO_RGB_ROUND, cv, YUV_TO_RGB_ROUND, cv, YUV_TO_RGB_ROUND, cv, YUV_TO_RGB_ROUND);
+
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(y, u), yuCoefs), _mm_madd_epi16(_mm_unpacklo_epi16(v, one), vCoefs));
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(y, u), yuCoefs), _mm_madd_epi16(_mm_unpackhi_epi16(v, one), vCoefs));
+    return _mm_packs_epi32(_mm_srai_epi32(lo, YUV_TO_RGB_SHIFT), _mm_srai_epi32(hi, YUV_TO_RGB_SHIFT));
+}
+
+template <int pixelBytes>
+static int rgbToLumaRowFast(const unsigned char *pRgb, unsigned char *pY, int width, const rgbToYUVCoefs *pC)
+{
+    const rgbShuffles<pixelBytes> &shuffles = getRGBShuffles<pixelBytes>();
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i rgb[3];
+        shuffles.load(pRgb + x * pixelBytes, rgb);
+        _mm_storeu_si128((__m128i *)(pY + x), luma16(rgb, pC));
+    }
+    return x;
+}
+
+template <int pixelBytes>
+static int rgbToYUVRowPairFast(const unsigned char *pRgb0, const unsigned char *pRgb1, unsigned char *pY0, unsigned char *pY1,
+    unsigned char *pU, unsigned char *pV, int chromaStep, int width, const rgbToYUVCoefs *pC)
+{
+    const rgbShuffles<pixelBytes> &shuffles = getRGBShuffles<pixelBytes>();
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i rgb0[3], rgb1[3], avg[3];
+        shuffles.load(pRgb0 + x * pixelBytes, rgb0);
+        shuffles.load(pRgb1 + x * pixelBytes, rgb1);
+        _mm_storeu_si128((__m128i *)(pY0 + x), luma16(rgb0, pC));
+        _mm_storeu_si128((__m128i *)(pY1 + x), luma16(rgb1, pC));
+
+        for (int k = 0; k < 3; k++)
+        {
+            avg[k] = average2x2(rgb0[k], rgb1[k]);
+        }
+        __m128i u = chroma8(avg, pC->u);
+        __m128i v = chroma8(avg, pC->v);
+
+        if (chromaStep == 1)
+        {
+            _mm_storel_epi64((__m128i *)(pU + x / 2), u);
+            _mm_storel_epi64((__m128i *)(pV + x / 2), v);
+        }
+        else if (pU < pV)
+        {
+            _mm_storeu_si128((__m128i *)(pU + x), _mm_unpacklo_epi8(u, v));
+        }
+        else
+        {
+            _mm_storeu_si128((__m128i *)(pV + x), _mm_unpacklo_epi8(v, u));
+        }
+    }
+    return x;
+}
+
+template <int pixelBytes>
+static int yuvToRGBRowFast(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, int chromaStep,
+    unsigned char *pRgb, int width, const yuvToRGBCoefs *pC)
+{
+    const rgbShuffles<pixelBytes> &shuffles = getRGBShuffles<pixelBytes>();
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lowBytes = _mm_set1_epi16(0xff);
+    const __m128i yOffset = _mm_set1_epi16(pC->yOffset);
+    const __m128i cOffset = _mm_set1_epi16(128);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i y8 = _mm_loadu_si128((const __m128i *)(pY + x));
+        __m128i u, v;
+        if (chromaStep == 1)
+        {
+            u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pU + x / 2)), zero);
+            v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pV + x / 2)), zero);
+        }
+        else
+        {
+            __m128i pairs = _mm_loadu_si128((const __m128i *)((pU < pV ? pU : pV) + x));
+            __m128i first = _mm_and_si128(pairs, lowBytes);
+            __m128i second = _mm_srli_epi16(pairs, 8);
+            u = (pU < pV) ? first : second;
+            v = (pU < pV) ? second : first;
+        }
+        u = _mm_sub_epi16(u, cOffset);
+        v = _mm_sub_epi16(v, cOffset);
+
+        __m128i y[2] = { _mm_sub_epi16(_mm_unpacklo_epi8(y8, zero), yOffset), _mm_sub_epi16(_mm_unpackhi_epi8(y8, zero), yOffset) };
+        __m128i uu[2] = { _mm_unpacklo_epi16(u, u), _mm_unpackhi_epi16(u, u) };     // each chroma sample for 2 pixels
+        __m128i vv[2] = { _mm_unpacklo_epi16(v, v), _mm_unpackhi_epi16(v, v) };
+
+        __m128i rgb[3][2];
+        for (int h = 0; h < 2; h++)
+        {
+            rgb[0][h] = yuvToChannel8(y[h], uu[h], vv[h], pC->y, 0, pC->rv);
+            rgb[1][h] = yuvToChannel8(y[h], uu[h], vv[h], pC->y, pC->gu, pC->gv);
+            rgb[2][h] = yuvToChannel8(y[h], uu[h], vv[h], pC->y, pC->bu, 0);
+        }
+
+        __m128i chn[4];
+        for (int c = 0; c < 3; c++)
+        {
+            chn[c] = _mm_packus_epi16(rgb[c][0], rgb[c][1]);
+        }
+        chn[3] = _mm_set1_epi8((char)0xff);
+        shuffles.store(pRgb + x * pixelBytes, chn);
+    }
+    return x;
+}
+
+#else
+//------------------------------------------------------------------------------
+template <int pixelBytes>
+static int rgbToLumaRowFast(const unsigned char *pRgb, unsigned char *pY, int width, const rgbToYUVCoefs *pC)
+{
+    return 0;
+}
+
+template <int pixelBytes>
+static int rgbToYUVRowPairFast(const unsigned char *pRgb0, const unsigned char *pRgb1, unsigned char *pY0, unsigned char *pY1,
+    unsigned char *pU, unsigned char *pV, int chromaStep, int width, const rgbToYUVCoefs *pC)
+{
+    return 0;
+}
+
+template <int pixelBytes>
+static int yuvToRGBRowFast(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, int chromaStep,
+    unsigned char *pRgb, int width, const yuvToRGBCoefs *pC)
+{
+    return 0;
+}
+#endif
+
+// =============================================================================
+//------------------------------------------------------------------------------
+static bool isValidConversion(int pixelBytes, int width, int height, yuvMatrix matrix, yuvRange range)
+{
+    return (pixelBytes == 3 || pixelBytes == 4) && width > 0 && height > 0
+        && (matrix == yuvBT601 || matrix == yuvBT709) && (range == yuvLimitedRange || range == yuvFullRange);
+}
+
+static bool isValidYUV420(const yuv420Planes &planes, int width, int height)
+{
+    return planes.pY != NULL && planes.pU != NULL && planes.pV != NULL && width % 2 == 0 && height % 2 == 0
+        && (planes.chromaStep == 1 || planes.chromaStep == 2);
+}
+
+int setYUV420Planes(yuv420Planes *pPlanes, unsigned char *yuvBuf, int width, int height, yuv420Layout layout)
+{
+    int lumaSize = width * height;
+
+    if (yuvBuf == NULL || width % 2 != 0 || height % 2 != 0)
+    {
+        return -1;
+    }
+
+    pPlanes->pY = yuvBuf;
+    pPlanes->strideY = width;
+    switch (layout)
+    {
+    case yuvI420:
+    case yuvYV12:
+        pPlanes->pU = yuvBuf + lumaSize + ((layout == yuvI420) ? 0 : lumaSize / 4);
+        pPlanes->pV = yuvBuf + lumaSize + ((layout == yuvI420) ? lumaSize / 4 : 0);
+        pPlanes->strideC = width / 2;
+        pPlanes->chromaStep = 1;
+        break;
+
+    case yuvNV12:
+    case yuvNV21:
+        pPlanes->pU = yuvBuf + lumaSize + ((layout == yuvNV12) ? 0 : 1);
+        pPlanes->pV = yuvBuf + lumaSize + ((layout == yuvNV12) ? 1 : 0);
+        pPlanes->strideC = width;
+        pPlanes->chromaStep = 2;
+        break;
+
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+int setYUV420Planes(yuv420Planes *pPlanes, imageFrame image)
+{
+    pPlanes->pY = image.plane[0];
+    pPlanes->strideY = image.strides[0];
+    switch (image.pxlColorFormat)
+    {
+    case PIXELCOLORSPACE_YUV420PYV:
+        pPlanes->pU = image.plane[1];
+        pPlanes->pV = image.plane[2];
+        pPlanes->strideC = image.strides[1];
+        pPlanes->chromaStep = 1;
+        break;
+
+    case PIXELCOLORSPACE_NV12:
+        pPlanes->pU = image.plane[1];
+        pPlanes->pV = (image.plane[1] != NULL) ? image.plane[1] + 1 : NULL;
+        pPlanes->strideC = image.strides[1];
+        pPlanes->chromaStep = 2;
+        break;
+
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+int convertRGBToYUV420(const unsigned char *pRgb, int rgbStride, int pixelBytes, yuv420Planes dst, int width, int height, yuvMatrix matrix, yuvRange range)
+{// bands of row pairs, each chroma row belongs to one band
+    if (pRgb == NULL || !isValidConversion(pixelBytes, width, height, matrix, range) || !isValidYUV420(dst, width, height))
+    {
+        return -1;
+    }
+
+    const rgbToYUVCoefs *pC = &rgbToYUVTable[matrix][range];
+    ThreadPool::getDefault()->parallelFor(0, height / 2, [&](int begin, int end) {
+        for (int k = begin; k < end; k++)
+        {
+            const unsigned char *pRgb0 = pRgb + 2 * k * rgbStride;
+            unsigned char *pY0 = dst.pY + 2 * k * dst.strideY;
+            unsigned char *pU = dst.pU + k * dst.strideC;
+            unsigned char *pV = dst.pV + k * dst.strideC;
+            int x = (pixelBytes == 4)
+                ? rgbToYUVRowPairFast<4>(pRgb0, pRgb0 + rgbStride, pY0, pY0 + dst.strideY, pU, pV, dst.chromaStep, width, pC)
+                : rgbToYUVRowPairFast<3>(pRgb0, pRgb0 + rgbStride, pY0, pY0 + dst.strideY, pU, pV, dst.chromaStep, width, pC);
+            rgbToYUVRowPairScalar(pRgb0, pRgb0 + rgbStride, pixelBytes, pY0, pY0 + dst.strideY, pU, pV, dst.chromaStep, x, width, pC);
+        }
+    }, COLOR_CONVERT_BAND);
+
+    return 0;
+}
+
+int convertYUV420ToRGB(yuv420Planes src, unsigned char *pRgb, int rgbStride, int pixelBytes, int width, int height, yuvMatrix matrix, yuvRange range)
+{
+    if (pRgb == NULL || !isValidConversion(pixelBytes, width, height, matrix, range) || !isValidYUV420(src, width, height))
+    {
+        return -1;
+    }
+
+    const yuvToRGBCoefs *pC = &yuvToRGBTable[matrix][range];
+    ThreadPool::getDefault()->parallelFor(0, height, [&](int begin, int end) {
+        for (int k = begin; k < end; k++)
+        {
+            const unsigned char *pY = src.pY + k * src.strideY;
+            const unsigned char *pU = src.pU + (k / 2) * src.strideC;
+            const unsigned char *pV = src.pV + (k / 2) * src.strideC;
+            unsigned char *pRow = pRgb + k * rgbStride;
+            int x = (pixelBytes == 4)
+                ? yuvToRGBRowFast<4>(pY, pU, pV, src.chromaStep, pRow, width, pC)
+                : yuvToRGBRowFast<3>(pY, pU, pV, src.chromaStep, pRow, width, pC);
+            yuvToRGBRowScalar(pY, pU, pV, src.chromaStep, pRow, pixelBytes, x, width, pC);
+        }
+    }, 2 * COLOR_CONVERT_BAND);
+
+    return 0;
+}
+
+int convertRGBToLuma(const unsigned char *pRgb, int rgbStride, int pixelBytes, unsigned char *pGray, int grayStride, int width, int height, yuvMatrix matrix, yuvRange range)
+{
+    if (pRgb == NULL || pGray == NULL || !isValidConversion(pixelBytes, width, height, matrix, range))
+    {
+        return -1;
+    }
+
+    const rgbToYUVCoefs *pC = &rgbToYUVTable[matrix][range];
+    ThreadPool::getDefault()->parallelFor(0, height, [&](int begin, int end) {
+        for (int k = begin; k < end; k++)
+        {
+            const unsigned char *pRow = pRgb + k * rgbStride;
+            unsigned char *pY = pGray + k * grayStride;
+            int x = (pixelBytes == 4) ? rgbToLumaRowFast<4>(pRow, pY, width, pC) : rgbToLumaRowFast<3>(pRow, pY, width, pC);
+            rgbToLumaRowScalar(pRow, pixelBytes, pY, x, width, pC);
+        }
+    }, 2 * COLOR_CONVERT_BAND);
+
+    return 0;
+}
+
+int convertImageFrameColor(imageFrame srcImage, imageFrame dstImage, yuvMatrix matrix, yuvRange range)
+{
+    yuv420Planes planes;
+    bool isSrcRGB = (srcImage.pxlColorFormat == PIXELCOLORSPACE_RGB || srcImage.pxlColorFormat == PIXELCOLORSPACE_RGBA);
+    bool isDstRGB = (dstImage.pxlColorFormat == PIXELCOLORSPACE_RGB || dstImage.pxlColorFormat == PIXELCOLORSPACE_RGBA);
+
+    if (srcImage.imageW != dstImage.imageW || srcImage.imageH != dstImage.imageH)
+    {
+        return -1;
+    }
+
+    if (isSrcRGB && dstImage.pxlColorFormat == PIXELCOLORSPACE_MONO)
+    {
+        return convertRGBToLuma(srcImage.plane[0], srcImage.strides[0], (srcImage.pxlColorFormat == PIXELCOLORSPACE_RGBA) ? 4 : 3,
+            dstImage.plane[0], dstImage.strides[0], srcImage.imageW, srcImage.imageH, matrix, range);
+    }
+    if (isSrcRGB && setYUV420Planes(&planes, dstImage) == 0)
+    {
+        return convertRGBToYUV420(srcImage.plane[0], srcImage.strides[0], (srcImage.pxlColorFormat == PIXELCOLORSPACE_RGBA) ? 4 : 3,
+            planes, srcImage.imageW, srcImage.imageH, matrix, range);
+    }
+    if (isDstRGB && setYUV420Planes(&planes, srcImage) == 0)
+    {
+        return convertYUV420ToRGB(planes, dstImage.plane[0], dstImage.strides[0], (dstImage.pxlColorFormat == PIXELCOLORSPACE_RGBA) ? 4 : 3,
+            dstImage.imageW, dstImage.imageH, matrix, range);
+    }
+    return -1;
+}
+
+// =============================================================================
+//------------------------------------------------------------------------------
+int convertRGBToYUV420Ref(const unsigned char *pRgb, int rgbStride, int pixelBytes, yuv420Planes dst, int width, int height, yuvMatrix matrix, yuvRange range)
+{
+    if (pRgb == NULL || !isValidConversion(pixelBytes, width, height, matrix, range) || !isValidYUV420(dst, width, height))
+    {
+        return -1;
+    }
+
+    const rgbToYUVCoefs *pC = &rgbToYUVTable[matrix][range];
+    for (int k = 0; k < height / 2; k++)
+    {
+        const unsigned char *pRgb0 = pRgb + 2 * k * rgbStride;
+        unsigned char *pY0 = dst.pY + 2 * k * dst.strideY;
+        rgbToYUVRowPairScalar(pRgb0, pRgb0 + rgbStride, pixelBytes, pY0, pY0 + dst.strideY,
+            dst.pU + k * dst.strideC, dst.pV + k * dst.strideC, dst.chromaStep, 0, width, pC);
+    }
+    return 0;
+}
+
+int convertYUV420ToRGBRef(yuv420Planes src, unsigned char *pRgb, int rgbStride, int pixelBytes, int width, int height, yuvMatrix matrix, yuvRange range)
+{
+    if (pRgb == NULL || !isValidConversion(pixelBytes, width, height, matrix, range) || !isValidYUV420(src, width, height))
+    {
+        return -1;
+    }
+
+    const yuvToRGBCoefs *pC = &yuvToRGBTable[matrix][range];
+    for (int k = 0; k < height; k++)
+    {
+        yuvToRGBRowScalar(src.pY + k * src.strideY, src.pU + (k / 2) * src.strideC, src.pV + (k / 2) * src.strideC, src.chromaStep,
+            pRgb + k * rgbStride, pixelBytes, 0, width, pC);
+    }
+    return 0;
+}
+
+int convertRGBToLumaRef(const unsigned char *pRgb, int rgbStride, int pixelBytes, unsigned char *pGray, int grayStride, int width, int height, yuvMatrix matrix, yuvRange range)
+{
+    if (pRgb == NULL || pGray == NULL || !isValidConversion(pixelBytes, width, height, matrix, range))
+    {
+        return -1;
+    }
+
+    const rgbToYUVCoefs *pC = &rgbToYUVTable[matrix][range];
+    for (int k = 0; k < height; k++)
+    {
+        rgbToLumaRowScalar(pRgb + k * rgbStride, pixelBytes, pGray + k * grayStride, 0, width, pC);
+    }
+    return 0;
+}
+
+// =============================================================================
+//------------------------------------------------------------------------------
+static double converterTimeMs()
+{// monotonic clock in milliseconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int benchmarkColorConverter(int width, int height, int loops)
+{// the rgb rows are padded so the strides are exercised too, the padding must come out untouched by both paths
+    const char *layoutNames[4] = { "I420", "YV12", "NV12", "NV21" };
+    const char *matrixNames[2] = { "BT.601", "BT.709" };
+    const char *rangeNames[2] = { "limited", "full" };
+    int mismatches = 0;
+
+    if (width <= 0 || height <= 0 || width % 2 != 0 || height % 2 != 0 || loops <= 0)
+    {
+        return -1;
+    }
+
+    int rgbStride = width * 4 + 16;
+    int yuvSize = width * height * 3 / 2;
+    std::vector<unsigned char> rgb(rgbStride * height);
+    std::vector<unsigned char> rgbFast(rgbStride * height), rgbRef(rgbStride * height);
+    std::vector<unsigned char> yuvFast(yuvSize), yuvRef(yuvSize);
+    std::vector<unsigned char> grayFast(width * height), grayRef(width * height);
+
+    // gradients with noise, so both the clamps and the chroma averaging are hit
+    unsigned int seed = 12345;
+    for (int j = 0; j < height; j++)
+    {
+        for (int i = 0; i < rgbStride; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            rgb[j * rgbStride + i] = (unsigned char)((i + j + ((seed >> 16) & 0x3f)) & 0xff);
+        }
+    }
+
+    for (int pixelBytes = 3; pixelBytes <= 4; pixelBytes++)
+    {
+        for (int m = 0; m < 2; m++)
+        {
+            for (int r = 0; r < 2; r++)
+            {
+                yuvMatrix matrix = (yuvMatrix)m;
+                yuvRange range = (yuvRange)r;
+                double t0, t1, t2;
+
+                for (int l = 0; l < 4; l++)
+                {
+                    yuv420Planes planesFast, planesRef;
+                    setYUV420Planes(&planesFast, &yuvFast[0], width, height, (yuv420Layout)l);
+                    setYUV420Planes(&planesRef, &yuvRef[0], width, height, (yuv420Layout)l);
+
+                    t0 = converterTimeMs();
+                    for (int k = 0; k < loops; k++)
+                        convertRGBToYUV420(&rgb[0], rgbStride, pixelBytes, planesFast, width, height, matrix, range);
+                    t1 = converterTimeMs();
+                    for (int k = 0; k < loops; k++)
+                        convertRGBToYUV420Ref(&rgb[0], rgbStride, pixelBytes, planesRef, width, height, matrix, range);
+                    t2 = converterTimeMs();
+                    bool isExact = (yuvFast == yuvRef);
+                    mismatches += isExact ? 0 : 1;
+                    printf("RGB%s -> %s %s %s: %.3f ms, reference %.3f ms%s\n", (pixelBytes == 4) ? "A" : "", layoutNames[l], matrixNames[m], rangeNames[r],
+                        (t1 - t0) / loops, (t2 - t1) / loops, isExact ? "" : "\tMISMATCH");
+
+                    memset(&rgbFast[0], 0, rgbFast.size());
+                    memset(&rgbRef[0], 0, rgbRef.size());
+                    t0 = converterTimeMs();
+                    for (int k = 0; k < loops; k++)
+                        convertYUV420ToRGB(planesRef, &rgbFast[0], rgbStride, pixelBytes, width, height, matrix, range);
+                    t1 = converterTimeMs();
+                    for (int k = 0; k < loops; k++)
+                        convertYUV420ToRGBRef(planesRef, &rgbRef[0], rgbStride, pixelBytes, width, height, matrix, range);
+                    t2 = converterTimeMs();
+                    isExact = (rgbFast == rgbRef);
+                    mismatches += isExact ? 0 : 1;
+                    printf("%s -> RGB%s %s %s: %.3f ms, reference %.3f ms%s\n", layoutNames[l], (pixelBytes == 4) ? "A" : "", matrixNames[m], rangeNames[r],
+                        (t1 - t0) / loops, (t2 - t1) / loops, isExact ? "" : "\tMISMATCH");
+                }
+
+                t0 = converterTimeMs();
+                for (int k = 0; k < loops; k++)
+                    convertRGBToLuma(&rgb[0], rgbStride, pixelBytes, &grayFast[0], width, width, height, matrix, range);
+                t1 = converterTimeMs();
+                for (int k = 0; k < loops; k++)
+                    convertRGBToLumaRef(&rgb[0], rgbStride, pixelBytes, &grayRef[0], width, width, height, matrix, range);
+                t2 = converterTimeMs();
+                bool isExact = (grayFast == grayRef);
+                mismatches += isExact ? 0 : 1;
+                printf("RGB%s -> Y %s %s: %.3f ms, reference %.3f ms%s\n", (pixelBytes == 4) ? "A" : "", matrixNames[m], rangeNames[r],
+                    (t1 - t0) / loops, (t2 - t1) / loops, isExact ? "" : "\tMISMATCH");
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+}   // namespace util
+}   // namespace YiPanorama
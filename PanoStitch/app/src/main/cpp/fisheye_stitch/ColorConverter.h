@@ -0,0 +1,76 @@
+/************************************************************************/
+/* RGB <-> YUV 4:2:0 conversion of strided frames                       */
+/* NEON / SSSE3 kernels on bands of row pairs, with a scalar reference  */
+/************************************************************************/
+
+#pragma once
+#ifndef _COLOR_CONVERTER_H
+#define _COLOR_CONVERTER_H
+
+#include "YiPanoramaTypes.h"
+
+namespace YiPanorama {
+namespace util {
+
+enum yuvMatrix
+{
+    yuvBT601,
+    yuvBT709
+};
+
+enum yuvRange
+{
+    yuvLimitedRange,    // Y 16 ~ 235, U / V 16 ~ 240
+    yuvFullRange        // Y, U and V 0 ~ 255
+};
+
+enum yuv420Layout
+{// memory order of a contiguous 4:2:0 buffer, Y plane first
+    yuvI420,    // U plane, V plane
+    yuvYV12,    // V plane, U plane
+    yuvNV12,    // interleaved U / V plane
+    yuvNV21     // interleaved V / U plane, the android camera preview
+};
+
+struct yuv420Planes
+{// U and V are read / written at pU[(x / 2) * chromaStep], so semi planar chroma is two planes with step 2
+    unsigned char *pY;
+    unsigned char *pU;
+    unsigned char *pV;
+    int strideY;
+    int strideC;        // bytes from one chroma row to the next, the same for U and V
+    int chromaStep;     // 1: planar, 2: interleaved
+};
+
+// planes of a contiguous width x height buffer
+int setYUV420Planes(yuv420Planes *pPlanes, unsigned char *yuvBuf, int width, int height, yuv420Layout layout);
+
+// planes of a PIXELCOLORSPACE_YUV420PYV (I420) or PIXELCOLORSPACE_NV12 frame
+int setYUV420Planes(yuv420Planes *pPlanes, imageFrame image);
+
+// rgb rows are pixelBytes (3: RGB, 4: RGBA) per pixel, width and height must be even.
+// chroma is taken from the rounded average of each 2 x 2 block, as the GLES YUV readback does
+int convertRGBToYUV420(const unsigned char *pRgb, int rgbStride, int pixelBytes, yuv420Planes dst, int width, int height, yuvMatrix matrix, yuvRange range);
+
+// alpha is set to 255 for pixelBytes 4
+int convertYUV420ToRGB(yuv420Planes src, unsigned char *pRgb, int rgbStride, int pixelBytes, int width, int height, yuvMatrix matrix, yuvRange range);
+
+// Y only, e.g. yuvBT601 / yuvFullRange for the gray of an RGB(A) image
+int convertRGBToLuma(const unsigned char *pRgb, int rgbStride, int pixelBytes, unsigned char *pGray, int grayStride, int width, int height, yuvMatrix matrix, yuvRange range);
+
+// RGB / RGBA <-> YUV420PYV / NV12, and RGB / RGBA -> MONO, between frames of the same size
+int convertImageFrameColor(imageFrame srcImage, imageFrame dstImage, yuvMatrix matrix, yuvRange range);
+
+// scalar single threaded versions of the above, the fast paths are bit exact to them
+int convertRGBToYUV420Ref(const unsigned char *pRgb, int rgbStride, int pixelBytes, yuv420Planes dst, int width, int height, yuvMatrix matrix, yuvRange range);
+int convertYUV420ToRGBRef(yuv420Planes src, unsigned char *pRgb, int rgbStride, int pixelBytes, int width, int height, yuvMatrix matrix, yuvRange range);
+int convertRGBToLumaRef(const unsigned char *pRgb, int rgbStride, int pixelBytes, unsigned char *pGray, int grayStride, int width, int height, yuvMatrix matrix, yuvRange range);
+
+// time the fast paths against the references on a synthetic width x height frame, for every layout, matrix and range,
+// and print the milliseconds per frame of both. returns the number of conversions which are not bit exact
+int benchmarkColorConverter(int width, int height, int loops);
+
+}   // namespace util
+}   // namespace YiPanorama
+
+#endif  // !_COLOR_CONVERTER_H
@@ -0,0 +1,160 @@
+/************************************************************************/
+/* Forward mode automatic differentiation: a value and its derivatives  */
+/* against N parameters, for the analytic jacobians of lev-mar          */
+/************************************************************************/
+#pragma once
+#ifndef _DUAL_NUMBER_H
+#define _DUAL_NUMBER_H
+
+#include <math.h>
+
+namespace YiPanorama {
+namespace util {
+
+template <int N>
+struct dualNumber
+{// v is the value, d[i] its derivative against parameter i. a function templated on its number type
+ // evaluated with dualNumber<N> instead of double gives the jacobian row together with the value
+    double v;
+    double d[N];
+
+    dualNumber() : v(0)
+    {
+        for (int i = 0; i < N; i++)
+            d[i] = 0;
+    }
+
+    dualNumber(double value) : v(value)
+    {
+        for (int i = 0; i < N; i++)
+            d[i] = 0;
+    }
+
+    // the idx-th parameter itself
+    static dualNumber variable(double value, int idx)
+    {
+        dualNumber r(value);
+        r.d[idx] = 1;
+        return r;
+    }
+
+    dualNumber &operator+=(const dualNumber &b) { *this = *this + b; return *this; }
+    dualNumber &operator-=(const dualNumber &b) { *this = *this - b; return *this; }
+    dualNumber &operator*=(const dualNumber &b) { *this = *this * b; return *this; }
+    dualNumber &operator/=(const dualNumber &b) { *this = *this / b; return *this; }
+
+    // friends are only found through the argument type, so the double versions from math.h stay visible
+    // to unqualified calls in templates working on both
+    friend dualNumber sqrt(const dualNumber &a)
+    {// the derivative at 0 is taken as 0, e.g. for the length of a zero residual
+        double s = ::sqrt(a.v);
+        return chain(a, s, s > 0 ? 0.5 / s : 0);
+    }
+
+    friend dualNumber sin(const dualNumber &a)
+    {
+        return chain(a, ::sin(a.v), ::cos(a.v));
+    }
+
+    friend dualNumber cos(const dualNumber &a)
+    {
+        return chain(a, ::cos(a.v), -::sin(a.v));
+    }
+
+    friend dualNumber atan(const dualNumber &a)
+    {
+        return chain(a, ::atan(a.v), 1 / (1 + a.v * a.v));
+    }
+
+    friend dualNumber atan2(const dualNumber &y, const dualNumber &x)
+    {
+        dualNumber r;
+        double inv = x.v * x.v + y.v * y.v;
+        inv = inv > 0 ? 1 / inv : 0;
+        r.v = ::atan2(y.v, x.v);
+        for (int i = 0; i < N; i++)
+            r.d[i] = (x.v * y.d[i] - y.v * x.d[i]) * inv;
+        return r;
+    }
+
+private:
+    // r = f(a), r' = df * a'
+    static dualNumber chain(const dualNumber &a, double f, double df)
+    {
+        dualNumber r;
+        r.v = f;
+        for (int i = 0; i < N; i++)
+            r.d[i] = df * a.d[i];
+        return r;
+    }
+};
+
+// value of a double or a dualNumber, for branches
+inline double dualValue(double a) { return a; }
+template <int N> inline double dualValue(const dualNumber<N> &a) { return a.v; }
+
+template <int N>
+inline dualNumber<N> operator-(const dualNumber<N> &a)
+{
+    dualNumber<N> r;
+    r.v = -a.v;
+    for (int i = 0; i < N; i++)
+        r.d[i] = -a.d[i];
+    return r;
+}
+
+template <int N>
+inline dualNumber<N> operator+(const dualNumber<N> &a, const dualNumber<N> &b)
+{
+    dualNumber<N> r;
+    r.v = a.v + b.v;
+    for (int i = 0; i < N; i++)
+        r.d[i] = a.d[i] + b.d[i];
+    return r;
+}
+
+template <int N>
+inline dualNumber<N> operator-(const dualNumber<N> &a, const dualNumber<N> &b)
+{
+    dualNumber<N> r;
+    r.v = a.v - b.v;
+    for (int i = 0; i < N; i++)
+        r.d[i] = a.d[i] - b.d[i];
+    return r;
+}
+
+template <int N>
+inline dualNumber<N> operator*(const dualNumber<N> &a, const dualNumber<N> &b)
+{
+    dualNumber<N> r;
+    r.v = a.v * b.v;
+    for (int i = 0; i < N; i++)
+        r.d[i] = a.d[i] * b.v + a.v * b.d[i];
+    return r;
+}
+
+template <int N>
+inline dualNumber<N> operator/(const dualNumber<N> &a, const dualNumber<N> &b)
+{
+    dualNumber<N> r;
+    double inv = 1 / b.v;
+    r.v = a.v * inv;
+    for (int i = 0; i < N; i++)
+        r.d[i] = (a.d[i] - r.v * b.d[i]) * inv;
+    return r;
+}
+
+// mixed with plain doubles
+template <int N> inline dualNumber<N> operator+(const dualNumber<N> &a, double b) { return a + dualNumber<N>(b); }
+template <int N> inline dualNumber<N> operator+(double a, const dualNumber<N> &b) { return dualNumber<N>(a) + b; }
+template <int N> inline dualNumber<N> operator-(const dualNumber<N> &a, double b) { return a - dualNumber<N>(b); }
+template <int N> inline dualNumber<N> operator-(double a, const dualNumber<N> &b) { return dualNumber<N>(a) - b; }
+template <int N> inline dualNumber<N> operator*(const dualNumber<N> &a, double b) { return a * dualNumber<N>(b); }
+template <int N> inline dualNumber<N> operator*(double a, const dualNumber<N> &b) { return dualNumber<N>(a) * b; }
+template <int N> inline dualNumber<N> operator/(const dualNumber<N> &a, double b) { return a * (1 / b); }
+template <int N> inline dualNumber<N> operator/(double a, const dualNumber<N> &b) { return dualNumber<N>(a) / b; }
+
+}   // namespace util
+}   // namespace YiPanorama
+
+#endif  //!_DUAL_NUMBER_H
@@ -1,9 +1,11 @@
 
 #include "FeatureBasedOptimization.h"
+#include "CalibrationResiduals.h"
 #include "MatrixVectors.h"
 #include "ImageIOConverter.h"
 #include "ImageWarpTable.h"
 #include "ImageTailor.h"
+#include "ThreadPool.h"
 #include <math.h>
 
 #include <opencv.hpp>
@@ -26,7 +28,6 @@ using namespace std;
 #define SIG(a,b) ((b) > 0 ? fabs(a) : -fabs(a))
 #define SIGN(x) ((x)<0?-1:((x)>0?1:0))
 
-#define IMAGE_CENTER_NUM 2
 #define AFFINE_PARAM_NUM 3
 
 #define ASSEMBLE_ERR    2*120   // um
@@ -36,42 +37,17 @@ using namespace std;
 #define THRESHOLD_CENTER_DIS 20.0
 #define THRESHOLD_BLUR 50.0
 
-#define OCAM_MODEL_WEIGHTS 2
-#define ROT_VEC_DIM 3	
-#define IMAGE_CENTER_MAGNIFY 1000
-#define TRAN_VEC_MAGNIFY 1000
-#define SPHERE_RADIUS_MAGNIFY 1000
-
 enum RotationMtxVecTrans
 {
     rtMtx2Vec,   // convert rotation matrix to vector
     rtVec2Mtx    // convert rotation vector to matrix
 };
 
-struct optiDataExtrnAndIntrn
-{// extra data needed in the extrinsic parameter optimization
-    int sphereRadius;
-    double polParamWeights[2];       // for both cameras' intrinsic polynomial interpolation coefficients
-    matchPoint *pMatchedPoints;
-    ImageWarper *pImgWarper;  // pointer to the warp table(s)
-    cameraMetadata *pCamera;        // pointer to the camera model(s)
-    ocamModel stOcamModelDesign[2];  // ocam model from design table(curves too much at fov range of 80-100)
-    ocamModel stOcamModelCalib; // ocam model from calibrated result(curves too straight at fov range of 80-100)
-};
-
-struct optiDataCentExt
-{// extra data needed in the intrinsic parameter optimization
-    chessboardCorner *pChessboardCorner;
-    cameraMetadata *pCamera;
-    double errSum;
-};
-
-struct optiDataRadius
-{// extra data needed in the sphere radius optimization
-    matchPoint *pMatchedPoints; // matched points
-    ImageWarper *pImgWarper;    // pointer to the warp table(s)
-    cameraMetadata *pCamera;    // pointer to the camera model(s)
-};
+#define FEATURE_BAND_MIN_ROWS 128   // feature detection bands are at least this high
+#define FEATURE_BAND_MARGIN 48      // rows read around a detection band for the neighborhood of its keypoints
+#define FLANN_KD_TREES 4            // randomized kd-trees of the descriptor index
+#define FLANN_CHECKS 64             // leaves visited per query, more is closer to the exact nearest neighbor
+#define MATCH_RATIO 0.8f            // a nearest neighbor has to be this much closer than the second one
 
 // functions definitions ===============================================
 bool findCornersMat(Mat gray, Size board_size, vector<Point2f>& corners)
@@ -1055,32 +1031,6 @@ double SSREChessboardCorners(cameraMetadata *pCamera, int cornerNum, chessboardC
     return dResult;
 }
 
-void errorChessboardPoint(double *p, double *x, int m, int n, void *data)
-{
-    double imgCenter[IMAGE_CENTER_NUM], rotMtx[EXT_PARAM_R_MTX_NUM], rotVec[ROT_VEC_DIM], transVec[EXT_PARAM_T_VEC_NUM];
-    double img[2], cam[3], chess[2], dis[2];
-    optiDataCentExt *pOptiData = (optiDataCentExt*)data;
-
-    // set camera parameters
-    memcpy(imgCenter, p, sizeof(double)*IMAGE_CENTER_NUM);
-    imgCenter[0] *= IMAGE_CENTER_MAGNIFY;
-    imgCenter[1] *= IMAGE_CENTER_MAGNIFY;
-    pOptiData->pCamera->setImageCenters(imgCenter); // image center
-
-    memcpy(rotVec, p + IMAGE_CENTER_NUM, sizeof(double)*ROT_VEC_DIM);
-    rotationMtxVecTrans(rotMtx, rotVec, rtVec2Mtx);
-    pOptiData->pCamera->setRotMtx(rotMtx, extCam2World);  // camera 2 world rotation matrix
-
-    memcpy(transVec, p + IMAGE_CENTER_NUM + ROT_VEC_DIM, sizeof(double) * EXT_PARAM_T_VEC_NUM);
-    transVec[0] *= TRAN_VEC_MAGNIFY;
-    transVec[1] *= TRAN_VEC_MAGNIFY;
-    transVec[2] *= TRAN_VEC_MAGNIFY;
-    pOptiData->pCamera->setTransVec(transVec, extCam2World);  // camera 2 world translation vector
-
-    pOptiData->errSum = SSREChessboardCorners(pOptiData->pCamera, n, pOptiData->pChessboardCorner, x);
-    return;
-}
-
 void errorChessboardPointWithExtGuess(double *p, double *x, int m, int n, void *data)
 {
     double imgCenter[IMAGE_CENTER_NUM];
@@ -1129,10 +1079,10 @@ double optimizeImageCenterAndExt(cameraMetadata *pCamera, int pointNum, chessboa
     optiDataCentExt stOptiData;
 
     opts[0] = LM_INIT_MU; opts[1] = 1E-15; opts[2] = 1E-15; opts[3] = 1E-20;
-    opts[4] = LM_DIFF_DELTA; // relevant only if the Jacobian is approximated using finite differences; specifies forward differencing 
 
     stOptiData.pChessboardCorner = pChessboardCorners;
     stOptiData.pCamera = pCamera;
+    pCamera->getOcamModel(&stOptiData.stOcamModel);
 
     // set initial values -----
     m = IMAGE_CENTER_NUM + ROT_VEC_DIM + EXT_PARAM_T_VEC_NUM;
@@ -1160,16 +1110,15 @@ double optimizeImageCenterAndExt(cameraMetadata *pCamera, int pointNum, chessboa
     transVec[2] /= TRAN_VEC_MAGNIFY;
     memcpy(pParams + IMAGE_CENTER_NUM + ROT_VEC_DIM, transVec, sizeof(double) * EXT_PARAM_T_VEC_NUM);
 
-    // dlevmar_dif
-    ret = dlevmar_dif(errorChessboardPoint, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void*)&stOptiData);  // no Jacobian
+    // dlevmar_der, jacobian from the dual number evaluation of the residuals
+    ret = dlevmar_der(errorChessboardPoint, jacobianChessboardPoint, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void*)&stOptiData);
 
     // check center result
     imgCenterAfter[0] = pParams[0] * IMAGE_CENTER_MAGNIFY;
     imgCenterAfter[1] = pParams[1] * IMAGE_CENTER_MAGNIFY;
     pCamera->setImageCenters(imgCenterAfter);
 
-    memcpy(rotVec, pParams + IMAGE_CENTER_NUM, sizeof(double)*ROT_VEC_DIM);
-    rotationMtxVecTrans(rotMtx, rotVec, rtVec2Mtx);
+    rotVecToMtx(rotMtx, pParams + IMAGE_CENTER_NUM);
     pCamera->setRotMtx(rotMtx, extCam2World);  // camera 2 world rotation matrix
 
     memcpy(transVec, pParams + IMAGE_CENTER_NUM + ROT_VEC_DIM, sizeof(double) * EXT_PARAM_T_VEC_NUM);
@@ -1186,6 +1135,9 @@ double optimizeImageCenterAndExt(cameraMetadata *pCamera, int pointNum, chessboa
     {
         dRet = -1;
     }
+
+    delete[] pParams;
+    delete[] pTrueValues;
     return dRet;
 }
 
@@ -1229,143 +1181,299 @@ int refineMatchesWithHomography(const vector<KeyPoint>& queryKeypoints, const ve
     return 0;
 }
 
-int getMatchedPoints(imageFrame imgA, imageFrame imgB, matchPoint *pMatchPoints, int &matchPointsMinNum, bool useRansac, int neighborThreshold)
-{// giving a pair of YUV image data, detect SIFT feature points, and get the matched points.
- // at most matchPointsMinNum pairs will be obtained.
-
- // NOTICE1: all points coordinates are restricted in the image frame range, no matter how this image is obtained(cut or projected), and related coordinates
- // operation should be done after this function. 
+bool warpTableValidAt(ImageWarper *pImageWarper, int panoX, int panoY)
+{// if the nearest table node of a pano pixel maps into the fisheye image, nodes falling out of it point to (0, 0)
+    imageRoi *pRoi = &pImageWarper->mWarpImgDstRoi;
+    int x = ((panoX - pRoi->roiX) % pRoi->imgW + pRoi->imgW) % pRoi->imgW;  // the pano wraps around horizontally
+    int y = panoY - pRoi->roiY;
+    int m, k;
 
- // NOTICE2: using neighborThreshold to filter out the points too close to existing points, to avoid points locate in small region;
- // using RANSAC to filter out bad matches, which will effect the optimization of the extrinsic parameters of the cameras.
- // and horizontal area separation is optional only for fisheye image detection, this is also to spread out the points into larger region. 
+    if (x > pRoi->roiW || y < 0 || y > pRoi->roiH)
+    {
+        return false;
+    }
 
-    int iResult = 0;
-    int maxNum;
+    m = (x + pImageWarper->mProStepX / 2) / pImageWarper->mProStepX;
+    k = (y + pImageWarper->mProStepY / 2) / pImageWarper->mProStepY;
+    m = (m < pImageWarper->mTableW) ? m : pImageWarper->mTableW - 1;
+    k = (k < pImageWarper->mTableH) ? k : pImageWarper->mTableH - 1;
 
-    Mat img_a, img_b;
-    img_a.create(Size(imgA.imageW, imgA.imageH), CV_8UC3);
-    img_b.create(Size(imgB.imageW, imgB.imageH), CV_8UC3);
+    return (pImageWarper->mPmapX[k * pImageWarper->mTableW + m] != 0) || (pImageWarper->mPmapY[k * pImageWarper->mTableW + m] != 0);
+}
 
-    // covert to rgb, and transform to mat
-    convertImageFrametoCvMat(imgA, img_a);
-    convertImageFrametoCvMat(imgB, img_b);
+int genOverlapMask(ImageWarper *pImageWarperA, ImageWarper *pImageWarperB, unsigned char *pMask)
+{// 255 where both cameras see the pixel of A's warped image, 0 elsewhere
+    imageRoi *pRoi = &pImageWarperA->mWarpImgDstRoi;
 
-    // for feature detection
-    vector<KeyPoint> kp_a, kp_b;
-    vector<DMatch> matches;
-    Mat descriptor_a, descriptor_b;
+    if (pImageWarperA->mPmapX == NULL || pImageWarperB->mPmapX == NULL)
+    {
+        return -1;
+    }
 
-    //features detection;
-    //SiftFeatureDetector detector;                 // opencv2410
-    //detector.detect(img_a, kp_a);
-    //detector.detect(img_b, kp_b);
-    //generate feature descriptor;
-    //SiftDescriptorExtractor extractor;
-    //extractor.compute(img_a, kp_a, descriptor_a);
-    //extractor.compute(img_b, kp_b, descriptor_b);
+    ThreadPool::getDefault()->parallelFor(0, pRoi->roiH, [&](int rowBegin, int rowEnd) {
+        for (int k = rowBegin; k < rowEnd; k++)
+        {
+            unsigned char *pRow = pMask + k * pRoi->roiW;
+            for (int m = 0; m < pRoi->roiW; m++)
+            {
+                bool isOverlap = warpTableValidAt(pImageWarperA, pRoi->roiX + m, pRoi->roiY + k)
+                    && warpTableValidAt(pImageWarperB, pRoi->roiX + m, pRoi->roiY + k);
+                pRow[m] = isOverlap ? 255 : 0;
+            }
+        }
+    }, 16);
 
-    Ptr<Feature2D> detector = xfeatures2d::SIFT::create();  // opencv 310
-    detector->detect(img_a, kp_a);
-    detector->detect(img_b, kp_b);
-    detector->compute(img_a, kp_a, descriptor_a);
-    detector->compute(img_b, kp_b, descriptor_b);
+    return 0;
+}
 
+int convertImageFrameToGray(imageFrame image, Mat &gray)
+{// a header on the luma plane when there is one, SIFT only looks at the gray image anyway
+    switch (image.pxlColorFormat)
+    {
+    case PIXELCOLORSPACE_MONO:
+    case PIXELCOLORSPACE_YUV420PYV:
+    case PIXELCOLORSPACE_NV12:
+        gray = Mat(image.imageH, image.imageW, CV_8UC1, image.plane[0], image.strides[0]);
+        break;
 
-    //feature points matching;
-    BFMatcher matcher(NORM_L2, true);
-    matcher.match(descriptor_a, descriptor_b, matches);
+    case PIXELCOLORSPACE_RGB:
+        cvtColor(Mat(image.imageH, image.imageW, CV_8UC3, image.plane[0], image.strides[0]), gray, COLOR_RGB2GRAY);
+        break;
 
-    Mat matHomo;
-    float ransacThreshold = 10.0;   // this threshold determine if the point is inlier or outliers, usually set between 1 to 10
+    case PIXELCOLORSPACE_RGBA:
+        cvtColor(Mat(image.imageH, image.imageW, CV_8UC4, image.plane[0], image.strides[0]), gray, COLOR_RGBA2GRAY);
+        break;
 
-    if (useRansac)
-    {// using RANSAC to filter out some bad matches, this may not appropriate to fisheye panorama, but jump panorama is OK
-        if(matches.size() < 9)
+    default:
         return -1;
-        refineMatchesWithHomography(kp_a, kp_b, ransacThreshold, matches, matHomo);
-        // and the effect should be checked after RANSAC
     }
+    return 0;
+}
 
-    //sort the matched points by euclidean distance;
-    vector<DMatch>::iterator iterator_begin = matches.begin();
-    vector<DMatch>::iterator iterator_end = matches.end();
-    sort(iterator_begin, iterator_end, comparep);
+void detectFeatureBand(Mat gray, Mat mask, int bandIdx, int bandNum, vector<KeyPoint> &keypoints, Mat &descriptors)
+{// SIFT in one pass on a horizontal band. the band is read with a margin so keypoints near its border get their whole
+ // neighborhood, but only the ones centered inside the band are kept, the neighboring bands own the others
+    int bandH = (gray.rows + bandNum - 1) / bandNum;
+    int coreBegin = bandIdx * bandH;
+    int coreEnd = min(gray.rows, coreBegin + bandH);
+    int rowBegin = max(0, coreBegin - FEATURE_BAND_MARGIN);
+    int rowEnd = min(gray.rows, coreEnd + FEATURE_BAND_MARGIN);
+    vector<KeyPoint> bandKeypoints;
+    Mat bandDescriptors, bandMask;
+
+    keypoints.clear();
+    descriptors.release();
+    if (coreBegin >= coreEnd)
+    {
+        return;
+    }
+    if (!mask.empty())
+    {
+        bandMask = mask.rowRange(rowBegin, rowEnd);
+        if (countNonZero(mask.rowRange(coreBegin, coreEnd)) == 0)
+        {
+            return;
+        }
+    }
 
-    // filter out points using neighboring threshold
-    vector<DMatch> matches_fnl; // this is used to collect the final result points
-    int idx = 0;
-    int effectiveNum = 0;
+    Ptr<Feature2D> detector = xfeatures2d::SIFT::create();  // opencv 310, one per band since it is not reentrant
+    detector->detectAndCompute(gray.rowRange(rowBegin, rowEnd), bandMask, bandKeypoints, bandDescriptors);
 
-    maxNum = matches.size();
-    if (0 == maxNum)
-        iResult = -1;  // no matched points found.
-    else
+    for (size_t i = 0; i < bandKeypoints.size(); i++)
     {
-        if (matchPointsMinNum > maxNum)
-            matchPointsMinNum = maxNum; // collect maxNum points at most
+        float y = bandKeypoints[i].pt.y + rowBegin;
+        if (y >= coreBegin && y < coreEnd)
+        {
+            bandKeypoints[i].pt.y = y;
+            keypoints.push_back(bandKeypoints[i]);
+            descriptors.push_back(bandDescriptors.row((int)i));
+        }
+    }
+}
 
-        matchPoint Point_candidate;
-        matchPoint Point;
-        bool dist_flag;
-        double dist_x, dist_y, dist_ab;
+int matchFeatures(Mat descriptorA, Mat descriptorB, vector<DMatch> &matches)
+{// approximate nearest neighbors of A's descriptors among B's in a randomized kd-tree forest, the queries are split
+ // over the thread pool since the search only reads the index. a match has to pass the ratio test against the second
+ // neighbor, and a point in B is only kept in its best match, as the cross check of the brute force matcher did
+    matches.clear();
+    if (descriptorA.rows == 0 || descriptorB.rows < 2)
+    {
+        return -1;
+    }
+
+    flann::Index index(descriptorB, flann::KDTreeIndexParams(FLANN_KD_TREES));
+    Mat indices(descriptorA.rows, 2, CV_32S);
+    Mat dists(descriptorA.rows, 2, CV_32F);
 
-        while (effectiveNum < matchPointsMinNum && idx < maxNum)
+    ThreadPool::getDefault()->parallelFor(0, descriptorA.rows, [&](int begin, int end) {
+        Mat bandIndices = indices.rowRange(begin, end);
+        Mat bandDists = dists.rowRange(begin, end);
+        index.knnSearch(descriptorA.rowRange(begin, end), bandIndices, bandDists, 2, flann::SearchParams(FLANN_CHECKS));
+    }, 256);
+
+    vector<int> bestOfB(descriptorB.rows, -1);
+    for (int q = 0; q < descriptorA.rows; q++)
+    {
+        int t = indices.at<int>(q, 0);
+        float d0 = dists.at<float>(q, 0);   // squared L2
+        if (t < 0 || d0 >= MATCH_RATIO * MATCH_RATIO * dists.at<float>(q, 1))
         {
-            if (effectiveNum == 0)
-            {// put the first point into matches_fnl, and remove it from matches.
-                matches_fnl.push_back(matches[0]);
-                matches.erase(matches.begin());
-                effectiveNum++;
-            }
-            else
-            {
-                Point_candidate.coordsInA[1] = kp_a[matches[0].queryIdx].pt.x;  // currently the head of matches is the next point to verify
-                Point_candidate.coordsInA[0] = kp_a[matches[0].queryIdx].pt.y;
+            continue;
+        }
+        if (bestOfB[t] < 0 || d0 < dists.at<float>(bestOfB[t], 0))
+        {
+            bestOfB[t] = q;
+        }
+    }
 
-                dist_flag = true;
-                for (int j = 0; j < matches_fnl.size(); j++)
-                {// check the candidate point's distance to each point in the final result list 
-                    Point.coordsInA[1] = kp_a[matches_fnl[j].queryIdx].pt.x;
-                    Point.coordsInA[0] = kp_a[matches_fnl[j].queryIdx].pt.y;
+    for (int t = 0; t < descriptorB.rows; t++)
+    {
+        if (bestOfB[t] >= 0)
+        {
+            matches.push_back(DMatch(bestOfB[t], t, sqrt(dists.at<float>(bestOfB[t], 0))));
+        }
+    }
+    return 0;
+}
 
-                    dist_x = (Point_candidate.coordsInA[1] - Point.coordsInA[1])*(Point_candidate.coordsInA[1] - Point.coordsInA[1]);
-                    dist_y = (Point_candidate.coordsInA[0] - Point.coordsInA[0])*(Point_candidate.coordsInA[0] - Point.coordsInA[0]);
-                    dist_ab = sqrt(dist_x + dist_y);
+int filterMatchesNeighbor(vector<KeyPoint> &kp_a, vector<DMatch> &matches, int imageW, int imageH, int neighborThreshold, int maxNum, vector<DMatch> &matches_fnl)
+{// walk the matches from the best one on, skipping the points closer than neighborThreshold to a point already taken.
+ // the taken points are kept in a grid of neighborThreshold sized cells, so only the 3x3 cells around a candidate are checked
+    int cellSize = (neighborThreshold > 0) ? neighborThreshold : 1;
+    int gridW = imageW / cellSize + 1;
+    int gridH = imageH / cellSize + 1;
+    vector<int> cellHead(gridW * gridH, -1);  // last taken point of each cell
+    vector<int> cellNext;                     // the point taken before it in the same cell
+
+    matches_fnl.clear();
+    for (size_t i = 0; i < matches.size() && (int)matches_fnl.size() < maxNum; i++)
+    {
+        Point2f candidate = kp_a[matches[i].queryIdx].pt;
+        int cx = min(max((int)(candidate.x / cellSize), 0), gridW - 1);
+        int cy = min(max((int)(candidate.y / cellSize), 0), gridH - 1);
+        bool dist_flag = true;
 
+        for (int y = max(cy - 1, 0); dist_flag && y <= min(cy + 1, gridH - 1); y++)
+        {
+            for (int x = max(cx - 1, 0); dist_flag && x <= min(cx + 1, gridW - 1); x++)
+            {
+                for (int j = cellHead[y * gridW + x]; j >= 0; j = cellNext[j])
+                {
+                    Point2f taken = kp_a[matches_fnl[j].queryIdx].pt;
+                    double dist_ab = sqrt((candidate.x - taken.x) * (candidate.x - taken.x) + (candidate.y - taken.y) * (candidate.y - taken.y));
                     if (dist_ab < neighborThreshold)
                     {
                         dist_flag = false;
                         break;
                     }
                 }
-
-                if (dist_flag)
-                {
-                    matches_fnl.push_back(matches[0]);
-                    matches.erase(matches.begin());
-                    effectiveNum++;
-                }
-                else
-                {
-                    matches.erase(matches.begin());
-                }
             }
+        }
+
+        if (dist_flag)
+        {
+            cellNext.push_back(cellHead[cy * gridW + cx]);
+            cellHead[cy * gridW + cx] = (int)matches_fnl.size();
+            matches_fnl.push_back(matches[i]);
+        }
+    }
+    return (int)matches_fnl.size();
+}
+
+int getMatchedPoints(imageFrame imgA, imageFrame imgB, matchPoint *pMatchPoints, int &matchPointsMinNum, bool useRansac, int neighborThreshold,
+    const unsigned char *pMaskA, const unsigned char *pMaskB)
+{// giving a pair of YUV image data, detect SIFT feature points, and get the matched points.
+ // at most matchPointsMinNum pairs will be obtained.
+
+ // NOTICE1: all points coordinates are restricted in the image frame range, no matter how this image is obtained(cut or projected), and related coordinates
+ // operation should be done after this function.
+
+ // NOTICE2: using neighborThreshold to filter out the points too close to existing points, to avoid points locate in small region;
+ // using RANSAC to filter out bad matches, which will effect the optimization of the extrinsic parameters of the cameras.
+ // and horizontal area separation is optional only for fisheye image detection, this is also to spread out the points into larger region.
+
+ // NOTICE3: pMaskA / pMaskB (imageW x imageH, NULL for the whole image) restrict the detection, e.g. to the overlap from genOverlapMask
+
+    int bandNum;
+    Mat gray[2], mask[2];
+
+    if (convertImageFrameToGray(imgA, gray[0]) != 0 || convertImageFrameToGray(imgB, gray[1]) != 0)
+    {
+        matchPointsMinNum = 0;
+        return -1;
+    }
+    if (pMaskA != NULL)
+    {
+        mask[0] = Mat(imgA.imageH, imgA.imageW, CV_8UC1, (void*)pMaskA);
+    }
+    if (pMaskB != NULL)
+    {
+        mask[1] = Mat(imgB.imageH, imgB.imageW, CV_8UC1, (void*)pMaskB);
+    }
+
+    // for feature detection, both images are cut into bands and all bands are detected in parallel
+    bandNum = max(1, min(ThreadPool::getDefault()->getThreadNum(), max(imgA.imageH, imgB.imageH) / FEATURE_BAND_MIN_ROWS));
+    vector<vector<KeyPoint> > bandKeypoints(2 * bandNum);
+    vector<Mat> bandDescriptors(2 * bandNum);
 
-            idx++;
+    ThreadPool::getDefault()->parallelFor(0, 2 * bandNum, [&](int begin, int end) {
+        for (int b = begin; b < end; b++)
+        {
+            int img = b / bandNum;
+            detectFeatureBand(gray[img], mask[img], b % bandNum, bandNum, bandKeypoints[b], bandDescriptors[b]);
         }
+    });
+
+    vector<KeyPoint> kp_a, kp_b;
+    Mat descriptor_a, descriptor_b;
+    for (int b = 0; b < 2 * bandNum; b++)
+    {
+        vector<KeyPoint> &kp = (b < bandNum) ? kp_a : kp_b;
+        Mat &descriptor = (b < bandNum) ? descriptor_a : descriptor_b;
+        kp.insert(kp.end(), bandKeypoints[b].begin(), bandKeypoints[b].end());
+        descriptor.push_back(bandDescriptors[b]);
+    }
 
-        // output points to pMatchPoints
-        matchPointsMinNum = effectiveNum;
-        for (int i = 0; i < matches_fnl.size(); i++)
+    //feature points matching;
+    vector<DMatch> matches;
+    matchFeatures(descriptor_a, descriptor_b, matches);
+
+    Mat matHomo;
+    float ransacThreshold = 10.0;   // this threshold determine if the point is inlier or outliers, usually set between 1 to 10
+
+    if (useRansac)
+    {// using RANSAC to filter out some bad matches, this may not appropriate to fisheye panorama, but jump panorama is OK
+        if (matches.size() < 9)
         {
-            pMatchPoints[i].coordsInA[1] = kp_a[matches_fnl[i].queryIdx].pt.x;
-            pMatchPoints[i].coordsInA[0] = kp_a[matches_fnl[i].queryIdx].pt.y;
-            pMatchPoints[i].coordsInB[1] = kp_b[matches_fnl[i].trainIdx].pt.x;
-            pMatchPoints[i].coordsInB[0] = kp_b[matches_fnl[i].trainIdx].pt.y;
+            matchPointsMinNum = 0;
+            return -1;
         }
+        refineMatchesWithHomography(kp_a, kp_b, ransacThreshold, matches, matHomo);
+        // and the effect should be checked after RANSAC
+    }
 
+    if (matches.empty())
+    {// no matched points found.
+        matchPointsMinNum = 0;
+        return -1;
     }
+
+    //sort the matched points by euclidean distance;
+    sort(matches.begin(), matches.end(), comparep);
+
+    // filter out points using neighboring threshold
+    vector<DMatch> matches_fnl; // this is used to collect the final result points
+    matchPointsMinNum = filterMatchesNeighbor(kp_a, matches, imgA.imageW, imgA.imageH, neighborThreshold, matchPointsMinNum, matches_fnl);
+
+    // output points to pMatchPoints
+    for (size_t i = 0; i < matches_fnl.size(); i++)
+    {
+        pMatchPoints[i].coordsInA[1] = kp_a[matches_fnl[i].queryIdx].pt.x;
+        pMatchPoints[i].coordsInA[0] = kp_a[matches_fnl[i].queryIdx].pt.y;
+        pMatchPoints[i].coordsInB[1] = kp_b[matches_fnl[i].trainIdx].pt.x;
+        pMatchPoints[i].coordsInB[0] = kp_b[matches_fnl[i].trainIdx].pt.y;
+    }
+
     return 0;
 }
 
@@ -1397,118 +1505,6 @@ int weightCameraModel(ocamModel *pOcamCalib, ocamModel *pOcamDesign, ocamModel *
 }
 
 
-// ------------------------------------------------------------------------ 
-void errorMatchPoint(double *p, double *x, int m, int n, void *data)
-{// calculate the RMS error of each pair of matched points
-    double *rotVec = p;
-    double tranVec[EXT_PARAM_T_VEC_NUM];
-    double panoCoords[2], dis[2], rotMtx[EXT_PARAM_R_MTX_NUM];
-    optiDataExtrnAndIntrn *pOptiData = (optiDataExtrnAndIntrn*)data;
-
-    static int num = 0;
-    double x_sum = 0;
-    rotationMtxVecTrans(rotMtx, rotVec, rtVec2Mtx);
-    pOptiData->pCamera->setRotMtx(rotMtx, extCam2World);
-
-    tranVec[0] = *(p + ROT_VEC_DIM + 0) * TRAN_VEC_MAGNIFY;
-    tranVec[1] = *(p + ROT_VEC_DIM + 1) * TRAN_VEC_MAGNIFY;
-    tranVec[2] = *(p + ROT_VEC_DIM + 2) * TRAN_VEC_MAGNIFY;
-    pOptiData->pCamera->setTransVec(tranVec, extCam2World);
-
-    for (int k = 0; k < n; k++)
-    {// transform each point in image B to panorama coordinates
-        pOptiData->pImgWarper->coordTransFisheyeToPano(panoCoords, pOptiData->pMatchedPoints[k].coordsInB, pOptiData->sphereRadius, pOptiData->pCamera);
-        dis[0] = (panoCoords[0] - pOptiData->pMatchedPoints[k].coordsInA[0]) * (panoCoords[0] - pOptiData->pMatchedPoints[k].coordsInA[0]);
-        dis[1] = (panoCoords[1] - pOptiData->pMatchedPoints[k].coordsInA[1]) * (panoCoords[1] - pOptiData->pMatchedPoints[k].coordsInA[1]);
-        x[k] = sqrt(dis[0] + dis[1]);
-        x_sum += x[k];
-    }
-    printf("%d:\tx_average: %lf\n", num++, x_sum/n);
-    return;
-}
-void errorMatchPointFixT(double *p, double *x, int m, int n, void *data)
-{// calculate the RMS error of each pair of matched points
-    double *rotVec = p;
-    double panoCoords[2], dis[2], rotMtx[EXT_PARAM_R_MTX_NUM];
-    optiDataExtrnAndIntrn *pOptiData = (optiDataExtrnAndIntrn*)data;
-
-    static int num = 0;
-    double x_sum = 0;
-    rotationMtxVecTrans(rotMtx, rotVec, rtVec2Mtx);
-    pOptiData->pCamera->setRotMtx(rotMtx, extCam2World);
-
-    for (int k = 0; k < n; k++)
-    {// transform each point in image B to panorama coordinates
-        pOptiData->pImgWarper->coordTransFisheyeToPano(panoCoords, pOptiData->pMatchedPoints[k].coordsInB, pOptiData->sphereRadius, pOptiData->pCamera);
-        dis[0] = (panoCoords[0] - pOptiData->pMatchedPoints[k].coordsInA[0]) * (panoCoords[0] - pOptiData->pMatchedPoints[k].coordsInA[0]);
-        dis[1] = (panoCoords[1] - pOptiData->pMatchedPoints[k].coordsInA[1]) * (panoCoords[1] - pOptiData->pMatchedPoints[k].coordsInA[1]);
-        x[k] = sqrt(dis[0] + dis[1]);
-        x_sum += x[k];
-    }
-    printf("%d:\tx_average: %lf\n", num++, x_sum/n);
-    return;
-}
-void errorMatchPointExtrnAndIntrn(double *p, double *x, int m, int n, void *data)
-{// calculate the RMS error of each pair of matched points
-    double *rotVec = p;
-    double panoCoordsA[2], panoCoordsB[2], dis[2], rotMtx[EXT_PARAM_R_MTX_NUM], centers[2];
-    optiDataExtrnAndIntrn *pOptiData = (optiDataExtrnAndIntrn*)data;
-    ocamModel tmpOcamModel;
-
-    static int num = 0;
-    double x_sum = 0;
-    rotationMtxVecTrans(rotMtx, rotVec, rtVec2Mtx);
-    pOptiData->pCamera[1].setRotMtx(rotMtx, extCam2World);
-
-    // weight 2 cameras intrinsic polynomial curves
-    pOptiData->polParamWeights[0] = *(p + ROT_VEC_DIM);
-    weightCameraModel(&pOptiData->stOcamModelCalib, &pOptiData->stOcamModelDesign[0], &tmpOcamModel, pOptiData->polParamWeights[0]);
-    // set camera metadata
-    //pOptiData->pCamera[0].getImageCenters(centers);
-    pOptiData->pCamera[0].setOcamModel(&tmpOcamModel);
-    //pOptiData->pCamera[0].setImageCenters(centers);
-
-    pOptiData->polParamWeights[1] = *(p + ROT_VEC_DIM + 1);
-    weightCameraModel(&pOptiData->stOcamModelCalib, &pOptiData->stOcamModelDesign[1], &tmpOcamModel, pOptiData->polParamWeights[1]);
-    //pOptiData->pCamera[1].getImageCenters(centers);
-    pOptiData->pCamera[1].setOcamModel(&tmpOcamModel);
-    //pOptiData->pCamera[1].setImageCenters(centers);
-
-    for (int k = 0; k < n; k++)
-    {// transform each point in image B to panorama coordinates
-        pOptiData->pImgWarper[0].coordTransFisheyeToPano(panoCoordsA, pOptiData->pMatchedPoints[k].coordsInA, pOptiData->sphereRadius, &pOptiData->pCamera[0]);
-        pOptiData->pImgWarper[1].coordTransFisheyeToPano(panoCoordsB, pOptiData->pMatchedPoints[k].coordsInB, pOptiData->sphereRadius, &pOptiData->pCamera[1]);
-        dis[0] = (panoCoordsA[0] - panoCoordsB[0]) * (panoCoordsA[0] - panoCoordsB[0]);
-        dis[1] = (panoCoordsA[1] - panoCoordsB[1]) * (panoCoordsA[1] - panoCoordsB[1]);
-        x[k] = sqrt(dis[0] + dis[1]);
-        x_sum += x[k];
-    }
-    printf("%d:\tx_average: %lf\tweights: %lf\t%lf\n", num++, x_sum / n, pOptiData->polParamWeights[0], pOptiData->polParamWeights[1]);
-    return;
-}
-void errorMatchPointRadius(double *p, double *x, int m, int n, void *data)
-{// calculate the RMS error of each pair of matched points
-    int radius;
-    double *rotVec = p;
-    double panoCoordsA[2], panoCoordsB[2], dis[2], rotMtx[EXT_PARAM_R_MTX_NUM], centers[2];
-    optiDataRadius *pOptiData = (optiDataRadius*)data;
-
-    static int num = 0;
-    double x_sum = 0;
-    radius = p[0] * SPHERE_RADIUS_MAGNIFY;
-    for (int k = 0; k < n; k++)
-    {// transform each point in image B to panorama coordinates
-        pOptiData->pImgWarper[0].coordTransFisheyeToPano(panoCoordsA, pOptiData->pMatchedPoints[k].coordsInA, radius, &pOptiData->pCamera[0]);
-        pOptiData->pImgWarper[1].coordTransFisheyeToPano(panoCoordsB, pOptiData->pMatchedPoints[k].coordsInB, radius, &pOptiData->pCamera[1]);
-        dis[0] = (panoCoordsA[0] - panoCoordsB[0]) * (panoCoordsA[0] - panoCoordsB[0]);
-        dis[1] = (panoCoordsA[1] - panoCoordsB[1]) * (panoCoordsA[1] - panoCoordsB[1]);
-        x[k] = sqrt(dis[0] + dis[1]);
-        x_sum += x[k];
-    }
-    printf("%d:\tx_average: %lf\t radius: %d\n", num++, x_sum / n, radius);
-    return;
-}
-
 // =============================================================================
     intrinsicParamOptimizer::intrinsicParamOptimizer()
     {
@@ -1669,13 +1665,42 @@ int extrinsicParamOptimizer::setCameraMetadata()
     return 0;
 }
 
-int extrinsicParamOptimizer::findMatchPoints(imageFrame imgA, imageFrame imgB, matchPoint *pMatchPoints, int &matchPointsMinNum, bool useRansac, int neighborThreshold)
-{
+int extrinsicParamOptimizer::findMatchPoints(imageFrame imgA, imageFrame imgB, matchPoint *pMatchPoints, int &matchPointsMinNum, bool useRansac, int neighborThreshold,
+    ImageWarper *pImageWarperA, ImageWarper *pImageWarperB)
+{// imgA and imgB are warped by pImageWarperA and pImageWarperB, features are only detected where both cameras see the pano
     int iResult = 0;
-    iResult = getMatchedPoints(imgA, imgB, pMatchPoints, matchPointsMinNum, useRansac, neighborThreshold);
+    vector<unsigned char> maskA, maskB;
+
+    if (pImageWarperA != NULL && pImageWarperB != NULL)
+    {
+        imageRoi *pRoiA = &pImageWarperA->mWarpImgDstRoi;
+        imageRoi *pRoiB = &pImageWarperB->mWarpImgDstRoi;
+        if (imgA.imageW != pRoiA->roiW || imgA.imageH != pRoiA->roiH || imgB.imageW != pRoiB->roiW || imgB.imageH != pRoiB->roiH)
+        {
+            printf("findMatchPoints: the images are not the warped rois of their warpers\n");
+            matchPointsMinNum = 0;
+            return -1;
+        }
+
+        maskA.resize(pRoiA->roiW * pRoiA->roiH);
+        maskB.resize(pRoiB->roiW * pRoiB->roiH);
+        if (findOverlapMask(pImageWarperA, pImageWarperB, &maskA[0]) != 0 || findOverlapMask(pImageWarperB, pImageWarperA, &maskB[0]) != 0)
+        {
+            matchPointsMinNum = 0;
+            return -1;
+        }
+    }
+
+    iResult = getMatchedPoints(imgA, imgB, pMatchPoints, matchPointsMinNum, useRansac, neighborThreshold,
+        maskA.empty() ? NULL : &maskA[0], maskB.empty() ? NULL : &maskB[0]);
     return iResult;
 }
 
+int extrinsicParamOptimizer::findOverlapMask(ImageWarper *pImageWarperA, ImageWarper *pImageWarperB, unsigned char *pMask)
+{
+    return genOverlapMask(pImageWarperA, pImageWarperB, pMask);
+}
+
 int extrinsicParamOptimizer::drawPoints(char *folderPath, imageFrame imgA, imageFrame imgB, matchPoint *matchedPoints, int pointNum)
 {
     char fileName[512];
@@ -1711,9 +1736,9 @@ int extrinsicParamOptimizer::drawPoints(char *folderPath, imageFrame imgA, image
     }
 
 
-    sprintf_s(fileName, "%s\\matchPointsImgA.jpg", folderPath);
+    snprintf(fileName, sizeof(fileName), "%s/matchPointsImgA.jpg", folderPath);
     cvSaveImage(fileName, cvImgA);
-    sprintf_s(fileName, "%s\\matchPointsImgB.jpg", folderPath);
+    snprintf(fileName, sizeof(fileName), "%s/matchPointsImgB.jpg", folderPath);
     cvSaveImage(fileName, cvImgB);
 
     cvReleaseImage(&cvImgA);
@@ -1873,18 +1898,15 @@ int extrinsicParamOptimizer::optimizeExtrinsicParams(int sphereRadius, ImageWarp
     int m, n, iResult;
     double *pParams;
     double *pTrueValues;
-    //double *pWorkMem;
-    //double *Covar;
     double opts[LM_OPTS_SZ], info[LM_INFO_SZ];
-    optiDataExtrnAndIntrn stOptiData;
+    optiDataMatch stOptiData;
 
     opts[0] = LM_INIT_MU; opts[1] = 1E-15; opts[2] = 1E-15; opts[3] = 1E-20;
-    opts[4] = LM_DIFF_DELTA; // relevant only if the Jacobian is approximated using finite differences; specifies forward differencing 
 
-    stOptiData.sphereRadius = sphereRadius;
-    stOptiData.pMatchedPoints = pMatchPoints;
-    stOptiData.pImgWarper = pImageWarper;
-    stOptiData.pCamera = pCamera;
+    if (initOptiDataMatch(&stOptiData, optiExtrinsic, mPointNum, pMatchPoints, sphereRadius, pImageWarper, pCamera, NULL) != 0)
+    {
+        return -1;
+    }
 
     // set initial values -----
     m = ROT_VEC_DIM + EXT_PARAM_T_VEC_NUM;
@@ -1898,7 +1920,7 @@ int extrinsicParamOptimizer::optimizeExtrinsicParams(int sphereRadius, ImageWarp
     }
 
     // get camera B's rotation vector from its rotation matrix
-    pCamera->getCam2WorldRotMtx(rotMtx);        
+    pCamera->getCam2WorldRotMtx(rotMtx);
     rotationMtxVecTrans(rotMtx, rotVec, rtMtx2Vec);
     pCamera->getCam2WorldTransVec(transVec);
 
@@ -1911,10 +1933,11 @@ int extrinsicParamOptimizer::optimizeExtrinsicParams(int sphereRadius, ImageWarp
         pParams[k + ROT_VEC_DIM] = transVec[k] / TRAN_VEC_MAGNIFY;
     }
 
-    iResult = dlevmar_dif(errorMatchPoint, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void *)(&stOptiData));
+    iResult = dlevmar_der(errorMatchPoints, jacobianMatchPoints, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void *)(&stOptiData));
+    printf("optimizeExtrinsicParams: %d iterations\tx_rms: %lf\n", iResult, sqrt(info[1] / n));
 
     // apply the optimized parameters
-    rotationMtxVecTrans(rotMtx, pParams, rtVec2Mtx);
+    rotVecToMtx(rotMtx, pParams);
     pCamera->setRotMtx(rotMtx, extCam2World);
 
     memcpy(transVec, pParams + ROT_VEC_DIM, sizeof(double)*EXT_PARAM_T_VEC_NUM);
@@ -1924,6 +1947,7 @@ int extrinsicParamOptimizer::optimizeExtrinsicParams(int sphereRadius, ImageWarp
     pCamera->setTransVec(transVec, extCam2World);
 
     // optimization clean up --------------------------------------------------
+    cleanOptiDataMatch(&stOptiData);
     if (pParams != NULL)
     {
         delete[] pParams;
@@ -1946,18 +1970,15 @@ int extrinsicParamOptimizer::optimizeExtrinsicParamsFixT(int sphereRadius, Image
     int m, n, iResult;
     double *pParams;
     double *pTrueValues;
-    //double *pWorkMem;
-    //double *Covar;
     double opts[LM_OPTS_SZ], info[LM_INFO_SZ];
-    optiDataExtrnAndIntrn stOptiData;
+    optiDataMatch stOptiData;
 
     opts[0] = LM_INIT_MU; opts[1] = 1E-15; opts[2] = 1E-15; opts[3] = 1E-20;
-    opts[4] = LM_DIFF_DELTA; // relevant only if the Jacobian is approximated using finite differences; specifies forward differencing 
 
-    stOptiData.sphereRadius = sphereRadius;
-    stOptiData.pMatchedPoints = pMatchPoints;
-    stOptiData.pImgWarper = pImageWarper;
-    stOptiData.pCamera = pCamera;
+    if (initOptiDataMatch(&stOptiData, optiExtrinsicFixT, mPointNum, pMatchPoints, sphereRadius, pImageWarper, pCamera, NULL) != 0)
+    {
+        return -1;
+    }
 
     // set initial values -----
     m = ROT_VEC_DIM;
@@ -1980,14 +2001,16 @@ int extrinsicParamOptimizer::optimizeExtrinsicParamsFixT(int sphereRadius, Image
     }
 
 
-    iResult = dlevmar_dif(errorMatchPointFixT, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void *)(&stOptiData));
+    iResult = dlevmar_der(errorMatchPoints, jacobianMatchPoints, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void *)(&stOptiData));
+    printf("optimizeExtrinsicParamsFixT: %d iterations\tx_rms: %lf\n", iResult, sqrt(info[1] / n));
 
     // apply the optimized parameters
-    rotationMtxVecTrans(rotMtx, pParams, rtVec2Mtx);
+    rotVecToMtx(rotMtx, pParams);
     pCamera->setRotMtx(rotMtx, extCam2World);
 
 
     // optimization clean up --------------------------------------------------
+    cleanOptiDataMatch(&stOptiData);
     if (pParams != NULL)
     {
         delete[] pParams;
@@ -2005,29 +2028,22 @@ int extrinsicParamOptimizer::optimizeExtrnAndIntrnParams(int sphereRadius, Image
 {
     // local variables
     int itrMax = 10000;
-    double rotMtx[EXT_PARAM_R_MTX_NUM], rotVec[ROT_VEC_DIM], transVec[EXT_PARAM_T_VEC_NUM];
+    double rotMtx[EXT_PARAM_R_MTX_NUM], rotVec[ROT_VEC_DIM];
     // optimization initialization --------------------------------------------------
     int m, n, iResult;
     double *pParams;
     double *pTrueValues;
-    //double *pWorkMem;
-    //double *Covar;
     double opts[LM_OPTS_SZ], info[LM_INFO_SZ];
-    optiDataExtrnAndIntrn stOptiData;
+    optiDataMatch stOptiData;
+    ocamModel stOcamModelDesign, stOcamModelWeighted;
 
     opts[0] = LM_INIT_MU; opts[1] = 1E-15; opts[2] = 1E-15; opts[3] = 1E-20;
-    opts[4] = LM_DIFF_DELTA; // relevant only if the Jacobian is approximated using finite differences; specifies forward differencing 
 
-    stOptiData.polParamWeights[0] = 0.5;
-    stOptiData.polParamWeights[1] = 0.5;
-    stOptiData.sphereRadius = sphereRadius;
-    stOptiData.pMatchedPoints = pMatchPoints;
-    stOptiData.pImgWarper = pImageWarpers;
-    stOptiData.pCamera = pCameras;
-
-    memcpy(&stOptiData.stOcamModelCalib, pOcamCalibLinear, sizeof(ocamModel));  // save this ocam model as the interpolation input
-    pCameras[0].getOcamModel(&stOptiData.stOcamModelDesign[0]);  // save this ocam model also as the interpolation input
-    pCameras[1].getOcamModel(&stOptiData.stOcamModelDesign[1]);  // save this ocam model also as the interpolation input
+    // the points are lifted with both the design models (the cameras' current ones) and the calibrated one
+    if (initOptiDataMatch(&stOptiData, optiExtrnAndIntrn, mPointNum, pMatchPoints, sphereRadius, pImageWarpers, pCameras, pOcamCalibLinear) != 0)
+    {
+        return -1;
+    }
 
     // set initial values -----
     m = ROT_VEC_DIM + OCAM_MODEL_WEIGHTS;  // 3 for rotation vector and 2 for 2 cameras intrinsic weights
@@ -2050,16 +2066,25 @@ int extrinsicParamOptimizer::optimizeExtrnAndIntrnParams(int sphereRadius, Image
     }
     for (int k = 0; k < OCAM_MODEL_WEIGHTS; k++)
     {
-        pParams[k + ROT_VEC_DIM] = stOptiData.polParamWeights[k];
+        pParams[k + ROT_VEC_DIM] = 0.5;
     }
 
-    iResult = dlevmar_dif(errorMatchPointExtrnAndIntrn, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void *)(&stOptiData));
+    iResult = dlevmar_der(errorMatchPoints, jacobianMatchPoints, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void *)(&stOptiData));
+    printf("optimizeExtrnAndIntrnParams: %d iterations\tx_rms: %lf\tweights: %lf\t%lf\n", iResult, sqrt(info[1] / n), pParams[ROT_VEC_DIM], pParams[ROT_VEC_DIM + 1]);
 
     // apply the optimized parameters
-    rotationMtxVecTrans(rotMtx, pParams, rtVec2Mtx);
+    rotVecToMtx(rotMtx, pParams);
     pCameras[1].setRotMtx(rotMtx, extCam2World);
 
+    for (int k = 0; k < OCAM_MODEL_WEIGHTS; k++)
+    {
+        pCameras[k].getOcamModel(&stOcamModelDesign);
+        weightCameraModel(pOcamCalibLinear, &stOcamModelDesign, &stOcamModelWeighted, pParams[ROT_VEC_DIM + k]);
+        pCameras[k].setOcamModel(&stOcamModelWeighted);
+    }
+
     // optimization clean up --------------------------------------------------
+    cleanOptiDataMatch(&stOptiData);
     if (pParams != NULL)
     {
         delete[] pParams;
@@ -2077,22 +2102,19 @@ int extrinsicParamOptimizer::optimizeSphereRadius(int sphereRadius, ImageWarper
 {
     // local variables
     int itrMax = 10000;
-    double rotMtx[EXT_PARAM_R_MTX_NUM], rotVec[ROT_VEC_DIM], transVec[EXT_PARAM_T_VEC_NUM];
     // optimization initialization --------------------------------------------------
     int m, n, iResult, radiusOpt = 0;
     double *pParams;
     double *pTrueValues;
-    //double *pWorkMem;
-    //double *Covar;
     double opts[LM_OPTS_SZ], info[LM_INFO_SZ];
-    optiDataRadius stOptiData;
+    optiDataMatch stOptiData;
 
     opts[0] = LM_INIT_MU; opts[1] = 1E-15; opts[2] = 1E-15; opts[3] = 1E-20;
-    opts[4] = LM_DIFF_DELTA; // relevant only if the Jacobian is approximated using finite differences; specifies forward differencing 
 
-    stOptiData.pMatchedPoints = pMatchPoints;
-    stOptiData.pImgWarper = pImageWarpers;
-    stOptiData.pCamera = pCameras;
+    if (initOptiDataMatch(&stOptiData, optiSphereRadius, mPointNum, pMatchPoints, sphereRadius, pImageWarpers, pCameras, NULL) != 0)
+    {
+        return sphereRadius;
+    }
 
     // set initial values -----
     m = 1;  // only the radius needs optimization
@@ -2107,11 +2129,13 @@ int extrinsicParamOptimizer::optimizeSphereRadius(int sphereRadius, ImageWarper
 
     pParams[0] = (double)sphereRadius / SPHERE_RADIUS_MAGNIFY;
 
-    iResult = dlevmar_dif(errorMatchPointRadius, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void *)(&stOptiData));
+    iResult = dlevmar_der(errorMatchPoints, jacobianMatchPoints, pParams, pTrueValues, m, n, itrMax, opts, info, NULL, NULL, (void *)(&stOptiData));
 
     radiusOpt = pParams[0] * SPHERE_RADIUS_MAGNIFY;
+    printf("optimizeSphereRadius: %d iterations\tx_rms: %lf\t radius: %d\n", iResult, sqrt(info[1] / n), radiusOpt);
 
     // optimization clean up --------------------------------------------------
+    cleanOptiDataMatch(&stOptiData);
     if (pParams != NULL)
     {
         delete[] pParams;
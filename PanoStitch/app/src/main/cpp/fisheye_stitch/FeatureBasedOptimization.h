@@ -73,8 +73,12 @@ public:
     // -------------------------------------------------
     // get camera metadata from stitcher
     int setCameraMetadata();
-    // find matched points in image pairs
-    int findMatchPoints(imageFrame imgA, imageFrame imgB, matchPoint *pMatchPoints, int &matchPointsMinNum, bool useRansac, int neighborThreshold);
+    // mask of A's warped image (roiW x roiH of its warp table) where camera B sees the pano too, for findMatchPoints
+    int findOverlapMask(ImageWarper *pImageWarperA, ImageWarper *pImageWarperB, unsigned char *pMask);
+    // find matched points in image pairs warped by pImageWarperA / pImageWarperB, restricted to their findOverlapMask masks.
+    // NULL warpers for images that aren't warped, the whole images are searched then
+    int findMatchPoints(imageFrame imgA, imageFrame imgB, matchPoint *pMatchPoints, int &matchPointsMinNum, bool useRansac, int neighborThreshold,
+        ImageWarper *pImageWarperA, ImageWarper *pImageWarperB);
     int drawPoints(char *folderPath, imageFrame imgA, imageFrame imgB, matchPoint *matchedPoints, int pointNum);
     int drawPairs(char *fileName, imageFrame imgA, imageFrame imgB, matchPoint *matchedPoints, int pointNum, bool isVertical);
 
@@ -4,6 +4,8 @@
 #include "ImageTailor.h"
 
 #include "ImageIOConverter.h"
+#include "ThreadPool.h"
+#include "StitchProfiler.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -12,6 +14,12 @@
 #include <EGL/egl.h>
 #include <android/log.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 namespace YiPanorama {
 namespace fisheyePano {
 
@@ -20,10 +28,8 @@ namespace fisheyePano {
 #define PI_2_ANGLE      360.0
 #define M_PI       3.14159265358979323846   // pi
 
-#define GEN_NORMAL_BLEND_MASK 0
-
-	int rgba2rgb(const GLubyte* rgbaSrc, GLubyte *rgbDst, const int width, const int height)
-	{
+	int rgba2rgb(const GLubyte* rgbaSrc, int srcStride, GLubyte *rgbDst, int dstStride, const int width, const int height)
+	{// drop the alpha channel, rows are written straight to their place in the destination
 		if (rgbaSrc == NULL || rgbDst == NULL || width < 0 || height < 0)
 			return -1;
 
@@ -31,22 +37,140 @@ namespace fisheyePano {
 		GLubyte *pDstRow = rgbDst;
 		for (int h = 0; h != height; ++h)
 		{
-			for (int w = 0; w != width; ++w)
+			int w = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+			for (; w + 16 <= width; w += 16)
+			{
+				uint8x16x4_t rgba = vld4q_u8(pSrcRow + 4 * w);
+				uint8x16x3_t rgb;
+				rgb.val[0] = rgba.val[0];
+				rgb.val[1] = rgba.val[1];
+				rgb.val[2] = rgba.val[2];
+				vst3q_u8(pDstRow + 3 * w, rgb);
+			}
+#elif defined(__SSSE3__)
+			// 16 pixels per step; 4 x 12 useful bytes, every store but the last is overlapped by the next one
+			const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+			for (; w + 16 <= width; w += 16)
+			{
+				const __m128i *pSrc = (const __m128i *)(pSrcRow + 4 * w);
+				GLubyte *pDst = pDstRow + 3 * w;
+				_mm_storeu_si128((__m128i *)(pDst + 0), _mm_shuffle_epi8(_mm_loadu_si128(pSrc + 0), shuffle));
+				_mm_storeu_si128((__m128i *)(pDst + 12), _mm_shuffle_epi8(_mm_loadu_si128(pSrc + 1), shuffle));
+				_mm_storeu_si128((__m128i *)(pDst + 24), _mm_shuffle_epi8(_mm_loadu_si128(pSrc + 2), shuffle));
+				__m128i last = _mm_shuffle_epi8(_mm_loadu_si128(pSrc + 3), shuffle);
+				// the last 12 bytes must not spill past the row
+				_mm_storel_epi64((__m128i *)(pDst + 36), last);
+				int lastWord = _mm_cvtsi128_si32(_mm_srli_si128(last, 8));
+				memcpy(pDst + 44, &lastWord, 4);
+			}
+#endif
+			for (; w < width; ++w)
 			{
 				pDstRow[3 * w + 0] = pSrcRow[4 * w + 0];
 				pDstRow[3 * w + 1] = pSrcRow[4 * w + 1];
 				pDstRow[3 * w + 2] = pSrcRow[4 * w + 2];
 			}
-			pSrcRow += 4 * width;
-			pDstRow += 3 * width;
+			pSrcRow += srcStride;
+			pDstRow += dstStride;
 		}
 		return 0;
 	}
 
+	const GLchar *glesWarpVertexShaderSrc = "#version 300 es\n"
+		"layout(location = 0) in vec3 position;\n"
+		"layout(location = 1) in vec2 texCoords;\n"
+		"out vec2 TexCoords;\n"
+		"out float f;\n"
+
+		"void main()\n"
+		"{\n"
+		"f = position.z;\n"
+		"gl_Position = vec4(position.x, -position.y, 0.0f, 1.0f);\n"
+		"TexCoords = vec2(texCoords.x, texCoords.y);\n"
+		"}";
+
+	const GLchar *glesWarpFragmentShaderSrc = "#version 300 es\n"
+		"precision mediump float;\n"
+		"in vec2 TexCoords;\n"
+		"in float f;\n"
+		"out vec4 color;\n"
+		"uniform sampler2D ourtexture;\n"
+
+		"void main()\n"
+		"{\n"
+		"color = f * texture(ourtexture, TexCoords);\n"
+		"color = color.bgra;"
+		"}";
+
+	const GLchar *glesQuadVertexShaderSrc = "#version 300 es\n"
+		"layout(location = 0) in vec2 position;\n"
+		"layout(location = 1) in vec2 texCoords;\n"
+		"out vec2 TexCoords;\n"
+		
+		"void main()\n"
+		"{\n"
+		"gl_Position = vec4(position.x, -position.y, 0.0f, 1.0f);\n"
+		"TexCoords = vec2(texCoords.x, texCoords.y);\n"
+		"}";
+
+	// packs a RGBA texture into I420 / NV12 bytes, 4 bytes per RGBA8 texel of a (w / 4) x (h * 3 / 2) target;
+	// BT.601 limited range with the integer rounding of RGBtoYUV420YV, chroma is the 2x2 average
+	const GLchar *glesYUVPackFragmentShaderSrc = "#version 300 es\n"
+		"precision highp float;\n"
+		"precision highp int;\n"
+		"out vec4 color;\n"
+		"uniform sampler2D ourtexture;\n"
+		"uniform int yuvLayout;\n"     // 0: I420, 1: NV12
+		"uniform ivec2 srcSize;\n"
+
+		"vec3 rgbAt(ivec2 p)\n"
+		"{\n"
+		"return floor(texelFetch(ourtexture, p, 0).rgb * 255.0 + 0.5);\n"
+		"}\n"
+
+		"void main()\n"
+		"{\n"
+		"ivec2 p = ivec2(gl_FragCoord.xy);\n"
+		"int w = srcSize.x;\n"
+		"int h = srcSize.y;\n"
+		"vec4 bytes;\n"
+		"if (p.y < h)\n"
+		"{\n"
+		"for (int k = 0; k != 4; ++k)\n"
+		"{\n"
+		"vec3 c = rgbAt(ivec2(4 * p.x + k, p.y));\n"
+		"bytes[k] = floor((66.0 * c.r + 129.0 * c.g + 25.0 * c.b + 128.0) / 256.0) + 16.0;\n"
+		"}\n"
+		"}\n"
+		"else\n"
+		"{\n"
+		"int cw = w / 2;\n"
+		"int planeSize = cw * (h / 2);\n"
+		"int offset = (p.y - h) * w + 4 * p.x;\n"
+		"for (int k = 0; k != 4; ++k)\n"
+		"{\n"
+		"int o = offset + k;\n"
+		"int ci = (yuvLayout == 1) ? o / 2 : ((o < planeSize) ? o : o - planeSize);\n"
+		"bool isV = (yuvLayout == 1) ? (o % 2 == 1) : (o >= planeSize);\n"
+		"ivec2 q = 2 * ivec2(ci % cw, ci / cw);\n"
+		"vec3 c = floor((rgbAt(q) + rgbAt(q + ivec2(1, 0)) + rgbAt(q + ivec2(0, 1)) + rgbAt(q + ivec2(1, 1)) + 2.0) / 4.0);\n"
+		"bytes[k] = isV ? floor((112.0 * c.r - 94.0 * c.g - 18.0 * c.b + 128.0) / 256.0) + 128.0\n"
+		"               : floor((-38.0 * c.r - 74.0 * c.g + 112.0 * c.b + 128.0) / 256.0) + 128.0;\n"
+		"}\n"
+		"}\n"
+		"color = clamp(bytes, 0.0, 255.0) / 255.0;\n"
+		"}";
+
     fisheyePanoStitcherComp::fisheyePanoStitcherComp():
-		pProjImgData(NULL), pSeamImgData(NULL)
+		mSeamOptFlowEnabled(false), pProjImgData(NULL), pSeamImgData(NULL), mGLESSessionMode(glesPersistent), mGLESRenderMode(glesQuadrants), mPipelineDepth(1), mBlendBands(1), mColorAdjustEnabled(true),
+		mBlendFeather(blendFeatherGaussian), mBlendFeatherWidth(BLEND_FEATHER_WIDTH), mPreviewW(0), mPreviewH(0), mOutputFormat(PIXELCOLORSPACE_RGB)
     {
 		mDescriptorGL.isInitialized = GL_FALSE;
+		mDescriptorGL.frameCount = 0;
+		mWarpTableCacheDir[0] = '\0';
+		mWarpMeshTolerance = WARP_MESH_TOLERANCE;
+		mWarpMeshNum = 0;
     }
 
     fisheyePanoStitcherComp::~fisheyePanoStitcherComp()
@@ -61,15 +185,162 @@ int fisheyePanoStitcherComp::init(fisheyePanoParams *pFisheyePanoParams, complex
     setWorkParams(ComplexLevel);
     setWarpers();
     setWorkMems(dat);
+    if (mSeamOptFlowEnabled && initSeamOptFlow() != 0)
+        return -1;
+
+    // long-lived session: all GLES objects are created here once, only uploads/draws/readbacks run per frame
+    if (mGLESSessionMode == glesPersistent)
+        return initStitchGLES();
+
     return 0;
 }
 
 int fisheyePanoStitcherComp::dinit()
 {
+    deInitStitchGLES();
     clean();
     return 0;
 }
 
+int fisheyePanoStitcherComp::setGLESSessionMode(glesSessionMode sessionMode)
+{
+    mGLESSessionMode = sessionMode;
+    return 0;
+}
+
+int fisheyePanoStitcherComp::setGLESRenderMode(glesRenderMode renderMode)
+{
+    mGLESRenderMode = renderMode;
+    return 0;
+}
+
+int fisheyePanoStitcherComp::setPipelineDepth(int depth)
+{
+    mPipelineDepth = (depth < 1) ? 1 : ((depth > STITCH_PIPELINE_MAX_DEPTH) ? STITCH_PIPELINE_MAX_DEPTH : depth);
+    return 0;
+}
+
+int fisheyePanoStitcherComp::setSeamOptFlow(bool enable)
+{
+    mSeamOptFlowEnabled = enable;
+    return 0;
+}
+
+int fisheyePanoStitcherComp::setColorAdjust(bool enable)
+{
+    mColorAdjustEnabled = enable;
+    return 0;
+}
+
+int fisheyePanoStitcherComp::resetSeamOptFlow()
+{
+    for (int i = 0; i != 4; ++i)
+        mSeamOptFlow[i].resetTemporal();
+    return 0;
+}
+
+int fisheyePanoStitcherComp::initSeamOptFlow()
+{// the strips are cut out of the warped quadrants as they are, so the flow works on the strip images as a whole
+    if (pSeamRois == NULL)
+        return -1;
+
+    for (int i = 0; i != 8; ++i)
+        initImageFrame(&mSeamStrips[i], pSeamRois[i].roiW, pSeamRois[i].roiH, PIXELCOLORSPACE_RGBA);
+
+    unsigned char *pWeights = new unsigned char[pSeamRois[0].roiW * pSeamRois[0].roiH];
+    for (int i = 0; i != 4; ++i)
+    {
+        imageRoi *pRoi = &pSeamRois[i];
+        if (mSeamOptFlow[i].init(pRoi->roiW, pRoi->roiH) != 0)
+        {
+            delete[] pWeights;
+            return -1;
+        }
+
+        // the blend mask is the weight of the back quadrant, so each side is moved as far as the other one shows through
+        for (int y = 0; y != pRoi->roiH; ++y)
+            for (int x = 0; x != pRoi->roiW; ++x)
+                pWeights[y * pRoi->roiW + x] = mImageBlender[i].maskAt(pRoi->roiX + x, pRoi->roiY + y, pRoi->imgW, pRoi->imgH);
+        mSeamOptFlow[i].setShiftWeights(pWeights, pRoi->roiW);
+    }
+    delete[] pWeights;
+
+    return 0;
+}
+
+int fisheyePanoStitcherComp::deInitSeamOptFlow()
+{
+    for (int i = 0; i != 4; ++i)
+        mSeamOptFlow[i].dinit();
+    for (int i = 0; i != 8; ++i)
+        dinitImageFrame(&mSeamStrips[i]);
+    return 0;
+}
+
+int fisheyePanoStitcherComp::setBlendBands(int bands)
+{
+    mBlendBands = (bands < 1) ? 1 : ((bands > MAX_PYRAMID_LEVELS) ? MAX_PYRAMID_LEVELS : bands);
+    return 0;
+}
+
+int fisheyePanoStitcherComp::getPipelineLatency()
+{// a single shot session reads every frame back before it is torn down
+    return (mGLESSessionMode == glesPersistent) ? mPipelineDepth - 1 : 0;
+}
+
+int fisheyePanoStitcherComp::setOutputFormat(ePixelColorSpace outputFormat)
+{
+    if (outputFormat != PIXELCOLORSPACE_RGB && outputFormat != PIXELCOLORSPACE_RGBA &&
+        outputFormat != PIXELCOLORSPACE_YUV420PYV && outputFormat != PIXELCOLORSPACE_NV12)
+    {
+        std::cout << "setOutputFormat: unsupported output format " << outputFormat << std::endl;
+        return -1;
+    }
+    mOutputFormat = outputFormat;
+    return 0;
+}
+
+ePixelColorSpace fisheyePanoStitcherComp::getOutputFormat()
+{
+    return mOutputFormat;
+}
+
+int fisheyePanoStitcherComp::setWarpTableCacheDir(const char *cacheDir)
+{
+    if (cacheDir == NULL)
+        cacheDir = "";
+    snprintf(mWarpTableCacheDir, WARP_TABLE_PATH_LEN, "%s", cacheDir);
+    return 0;
+}
+
+int fisheyePanoStitcherComp::setWarpMeshTolerance(float tolerance)
+{
+    mWarpMeshTolerance = tolerance;
+    return 0;
+}
+
+int fisheyePanoStitcherComp::getWarpMeshStats(warpMeshStats stats[8], int *pMeshNum)
+{
+    for (int i = 0; i != mWarpMeshNum; ++i)
+        stats[i] = mWarpMeshStats[i];
+    *pMeshNum = mWarpMeshNum;
+    return 0;
+}
+
+int fisheyePanoStitcherComp::setBlendFeather(blendFeather feather, float width)
+{
+    mBlendFeather = feather;
+    mBlendFeatherWidth = (width > 0.0f) ? width : BLEND_FEATHER_WIDTH;
+    return 0;
+}
+
+int fisheyePanoStitcherComp::setPreviewSize(int viewW, int viewH)
+{
+    mPreviewW = (viewW > 0 && viewH > 0) ? viewW : 0;
+    mPreviewH = (viewW > 0 && viewH > 0) ? viewH : 0;
+    return 0;
+}
+
 
 int fisheyePanoStitcherComp::setFisheyePanoParams(fisheyePanoParams *pFisheyePanoParams, int panoW, int panoH) // metadata from picture/video
 {
@@ -143,13 +414,8 @@ int fisheyePanoStitcherComp::setWarpers()       // check warp device and generat
         break;
     }
 
-    // generate warp tables
-	for (int i = 0; i != 4; ++i)
-	{
-		mImageWarperB[i].genWarperCam(&mCameraMetadata[0], mFisheyePanoParamsCore.sphereRadius);
-		mImageWarperB[4 + i].genWarperCam(&mCameraMetadata[1], mFisheyePanoParamsCore.sphereRadius);
-
-	}
+    // generate warp tables, or map them from the cache
+	genWarpTables(true);
 
 	// set roi in source image
 	mImageWarperB[0].setSrcRoi(0.0, 0.0, 1.0, 0.6); //now 0 & 1 use the same TOP half source image and 2 & 3 use BOTTOM half source image;
@@ -162,14 +428,99 @@ int fisheyePanoStitcherComp::setWarpers()       // check warp device and generat
 	mImageWarperB[6].setSrcRoi(0.0, 0.4, 1.0, 0.6);
 	mImageWarperB[7].setSrcRoi(0.0, 0.4, 1.0, 0.6);
 
-
-#if GEN_NORMAL_BLEND_MASK
-    if (mComplexLevel != simple)
-        mImageWarperB[2].genWarperSph(mSphereRotMtx);
-#endif
     return 0;
 }
 
+int fisheyePanoStitcherComp::genWarpTables(bool useCache)
+{// rows of all 8 tables go through one parallel loop, warpers 0 ~ 3 use the front camera and 4 ~ 7 the back one
+	useCache = useCache && mWarpTableCacheDir[0] != '\0';
+
+	char cacheFile[8][WARP_TABLE_PATH_LEN];
+	unsigned long long cacheKey[8];
+	bool isCached[8];
+	int rowStart[9];
+	rowStart[0] = 0;
+	for (int i = 0; i != 8; ++i)
+	{
+		isCached[i] = false;
+		if (useCache)
+		{
+			cacheKey[i] = mImageWarperB[i].tableCacheKey(&mCameraMetadata[i / 4], mFisheyePanoParamsCore.sphereRadius);
+			snprintf(cacheFile[i], WARP_TABLE_PATH_LEN, "%s/warp_%d_%016llx.tbl", mWarpTableCacheDir, i, cacheKey[i]);
+			isCached[i] = (mImageWarperB[i].read(cacheFile[i], cacheKey[i]) == 0);
+		}
+
+		mImageWarperB[i].mSrcImageW = mCameraMetadata[i / 4].getOcamImgW();
+		mImageWarperB[i].mSrcImageH = mCameraMetadata[i / 4].getOcamImgH();
+		rowStart[i + 1] = rowStart[i] + (isCached[i] ? 0 : mImageWarperB[i].mTableH);
+	}
+
+	ThreadPool::getDefault()->parallelFor(0, rowStart[8], [&](int rowBegin, int rowEnd) {
+		for (int i = 0; i != 8; ++i)
+		{
+			int begin = (rowBegin > rowStart[i]) ? rowBegin : rowStart[i];
+			int end = (rowEnd < rowStart[i + 1]) ? rowEnd : rowStart[i + 1];
+			if (begin < end)
+				mImageWarperB[i].genWarperCamRows(&mCameraMetadata[i / 4], mFisheyePanoParamsCore.sphereRadius, begin - rowStart[i], end - rowStart[i]);
+		}
+	}, 4);
+
+	for (int i = 0; useCache && i != 8; ++i)
+	{
+		if (!isCached[i])
+			mImageWarperB[i].save(cacheFile[i], cacheKey[i]);
+	}
+
+	return 0;
+}
+
+int fisheyePanoStitcherComp::updateWarpers()
+{// regenerate the tables after the calibration changed, a live GLES session gets its meshes rebuilt too.
+ // live calibration tweaks are not written to the table cache
+	genWarpTables(false);
+
+	if (mDescriptorGL.isInitialized == GL_TRUE && makeCurrentGLES(&mDescriptorGL) == 0)
+	{
+		deInitWarpMeshesGLES();
+		initWarpMeshesGLES();
+		setPreviewVignetteGLES(&mDescriptorGL);
+	}
+
+	return 0;
+}
+
+int fisheyePanoStitcherComp::updateFisheyePanoParams(fisheyePanoParams *pFisheyePanoParams)
+{// save the working camera parameters back into the fisheyePanoParam
+	mCameraMetadata[0].setToFisheyePanoParams(&mFisheyePanoParams, 0);
+	mCameraMetadata[1].setToFisheyePanoParams(&mFisheyePanoParams, 1);
+
+	memcpy(pFisheyePanoParams, &mFisheyePanoParams, sizeof(fisheyePanoParams));
+	return 0;
+}
+
+int fisheyePanoStitcherComp::updateFisheyeCenters(fisheyePanoParams *pFisheyePanoParams)
+{// take the image centers of both lenses from the given params and regenerate the tables
+	double centersF[2] = { pFisheyePanoParams->staOcamModels[0].uc, pFisheyePanoParams->staOcamModels[0].vc };
+	double centersB[2] = { pFisheyePanoParams->staOcamModels[1].uc, pFisheyePanoParams->staOcamModels[1].vc };
+
+	setImageCenters(centersF, centersB);
+	return updateWarpers();
+}
+
+int fisheyePanoStitcherComp::getImageCenters(double centersF[2], double centersB[2])
+{
+	mCameraMetadata[0].getImageCenters(centersF);
+	mCameraMetadata[1].getImageCenters(centersB);
+	return 0;
+}
+
+int fisheyePanoStitcherComp::setImageCenters(double centersF[2], double centersB[2])
+{// only the camera metadata is changed, call updateWarpers() to apply it
+	mCameraMetadata[0].setImageCenters(centersF);
+	mCameraMetadata[1].setImageCenters(centersB);
+	return 0;
+}
+
 int fisheyePanoStitcherComp::initBlender(ImageBlender *pImageBlender, int sizeW, int sizeH)
 {
 	pImageBlender->mSizeW = sizeW;
@@ -184,7 +535,8 @@ int fisheyePanoStitcherComp::initBlender(ImageBlender *pImageBlender, int sizeW,
 int fisheyePanoStitcherComp::setBlendMask(ImageBlender *pImageBlender, const char *maskFilePath, int panoW, int panoH)
 {
 	FILE *fp = NULL;
-	fp = fopen(maskFilePath, "rb");
+	if (maskFilePath != NULL)
+		fp = fopen(maskFilePath, "rb");
 	if (fp == NULL)
 	{
 		return -1;
@@ -215,6 +567,26 @@ int fisheyePanoStitcherComp::setBlendMask(ImageBlender *pImageBlender, const cha
 	return 0;
 }
 
+int fisheyePanoStitcherComp::genBlendMasks(ImageBlender *pImageBlender)
+{// every mask has the size of its quadrant, so the ramp is as sharp as the output
+	for (int i = 0; i != 4; ++i)
+	{
+		blendMaskGeometry geometry;
+		geometry.panoW = mFisheyePanoParamsCore.panoImgW;
+		geometry.panoH = mFisheyePanoParamsCore.panoImgH;
+		geometry.quadrant = i;
+		geometry.seamRoi = pSeamRois[i];
+		geometry.feather = mBlendFeather;
+		geometry.featherWidth = mBlendFeatherWidth;
+
+		pImageBlender[i].init(geometry.seamRoi.imgW, geometry.seamRoi.imgH);
+		if (blendMaskCache::getDefault()->getMask(&geometry, pImageBlender[i].pMaskY) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
 
 int fisheyePanoStitcherComp::setWorkMems(const char* dat)      // image and roi memories
 {
@@ -306,31 +678,21 @@ int fisheyePanoStitcherComp::setWorkMems(const char* dat)      // image and roi
     }*/
 
     // image blender
-    unsigned char *tmpMask = NULL;
     switch (mComplexLevel)
     {
     case normal:    // front and back
-
-#if GEN_NORMAL_BLEND_MASK   // generate blend mask
-
-        //mImageBlender.init(mImageWarperB[2].mWarpImageW, mImageWarperB[2].mWarpImageH);
-        //mImageBlender.genMask(20, horiz);
-        //tmpMask = new unsigned char[mImageBlender.mSizeW * mImageBlender.mSizeH];
-        //mImageWarperB[2].warpImageSoftFullWithoutVCSingleChn(mImageBlender.pMaskY, tmpMask);
-        //memcpy(mImageBlender.pMaskY, tmpMask, mImageBlender.mSizeW * mImageBlender.mSizeH);
-        //delete[] tmpMask;
-        //tmpMask = NULL;
-
-#else   // load the pre-generated mask
-		for (int i = 0; i != 4; ++i)
-		{ // Blender mask is not need have same size of image in opengl;
-			mImageBlender[i].init(1440 / 2, 720 / 2);
-		}
-
-        setBlendMask(mImageBlender, dat, 1440, 360);
-
-#endif
-
+        if (mBlendFeather == blendFeatherFile)
+        {// the pre-generated mask of 1440 x 720 panos, scaled to the quadrants by the lookups
+            for (int i = 0; i != 4; ++i)
+                mImageBlender[i].init(1440 / 2, 720 / 2);
+            if (setBlendMask(mImageBlender, dat, 1440, 360) == 0)
+                break;
+
+            std::cout << "setWorkMems: no blend mask file, generating the masks" << std::endl;
+            for (int i = 0; i != 4; ++i)
+                mImageBlender[i].dinit();
+        }
+        genBlendMasks(mImageBlender);
         break;
 
     default:
@@ -375,12 +737,8 @@ int fisheyePanoStitcherComp::setWorkMems(const char* dat)      // image and roi
 int fisheyePanoStitcherComp::clean()
 {
     // clean warpers
-    mImageWarperB[0].dinit();
-    mImageWarperB[1].dinit();
-    if (simple != mComplexLevel)
-    {
-        mImageWarperB[2].dinit();
-    }
+    for (int i = 0; i != 8; ++i)
+        mImageWarperB[i].dinit();
 
     // clean work mems
     if (pSeamRois != NULL)
@@ -397,11 +755,84 @@ int fisheyePanoStitcherComp::clean()
     mColorAdjusterPair.dinit();
 	for (int i = 0; i != 4; ++i)
 		mImageBlender[i].dinit();
-   // mOptFlow.dinit();
+    deInitSeamOptFlow();
     return 0;
 }
 
-int fisheyePanoStitcherComp::initWarpGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescriptorGLES)
+int fisheyePanoStitcherComp::initStitchGLES()
+{// build everything the GLES stitch needs, the source textures are only (re)filled per frame
+	if (initContextGLES(&mDescriptorGL) != 0)
+		return -1;
+
+	initWarpGLES(mImageWarperB, &mDescriptorGL);
+	initWarpMeshesGLES();
+	initColAdjBlendGLES(mImageBlender, &mDescriptorGL);
+	initColorSummaryGLES(&mDescriptorGL);
+	initPreviewGLES(&mDescriptorGL);
+	STITCH_GPU_TIMER_INIT(&mGpuTimer);
+
+	return 0;
+}
+
+int fisheyePanoStitcherComp::initWarpMeshesGLES()
+{
+	if (mDescriptorGL.renderMode == glesFullPano)
+		return initFullPanoVerticesGLES(mImageWarperB, &mDescriptorGL);
+
+	// the meshes are generated on the thread pool, only the uploads need the context
+	warpMesh meshes[8];
+	int results[8];
+	ThreadPool::getDefault()->parallelFor(0, 8, [&](int iBegin, int iEnd) {
+		for (int i = iBegin; i != iEnd; ++i)
+		{
+			ImageWarper *pWarper = &mImageWarperB[i];
+			cameraMetadata *pCamera = &mCameraMetadata[i / 4];
+			results[i] = genWarpMeshGLES(&pWarper, &pCamera, 1, mFisheyePanoParamsCore.sphereRadius, mWarpMeshTolerance, &meshes[i]);
+		}
+	}, 1);
+
+	for (int i = 0; i != 8; ++i)
+	{
+		if (results[i] != 0)
+		{
+			std::cout << "initWarpMeshesGLES: no mesh for warper " << i << std::endl;
+			return -1;
+		}
+		mWarpMeshStats[i] = meshes[i].mStats;
+		initWarpVerticesGLES(&mImageWarperB[i], &meshes[i], &mDescriptorGL, i);
+	}
+	mWarpMeshNum = 8;
+	return 0;
+}
+
+int fisheyePanoStitcherComp::deInitWarpMeshesGLES()
+{
+	if (mDescriptorGL.renderMode == glesFullPano)
+		return deInitFullPanoVerticesGLES(&mDescriptorGL);
+
+	for (int i = 0; i != 8; ++i)
+		deInitWarpVerticesGLES(&mDescriptorGL, i);
+	return 0;
+}
+
+int fisheyePanoStitcherComp::deInitStitchGLES()
+{
+	if (mDescriptorGL.isInitialized == GL_FALSE)
+		return 0;
+
+	makeCurrentGLES(&mDescriptorGL);
+	STITCH_GPU_TIMER_DINIT(&mGpuTimer);
+	deInitPreviewGLES(&mDescriptorGL);
+	deInitColorSummaryGLES(&mDescriptorGL);
+	deInitColAdjBlendGLES(&mDescriptorGL);
+	deInitWarpMeshesGLES();
+	deinitWarpGLES(&mDescriptorGL);
+	deInitContextGLES(&mDescriptorGL);
+
+	return 0;
+}
+
+int initContextGLES(DescriptorGLES *pDescriptorGLES)
 {
 	// check if opengles context has initialized
 	if (pDescriptorGLES->isInitialized == GL_FALSE)
@@ -498,111 +929,343 @@ int fisheyePanoStitcherComp::initWarpGLES(ImageWarper *pImageWarper, DescriptorG
 		pDescriptorGLES->isInitialized = GL_TRUE;
 	}
 
-	pDescriptorGLES->heightSrc = pImageWarper->mSrcImageH;
-	pDescriptorGLES->widthSrc = pImageWarper->mSrcImageW;
+	return 0;
+}
 
-	pDescriptorGLES->heightDst = pImageWarper[0].mWarpImageH;
-	pDescriptorGLES->widthDst = pImageWarper[0].mWarpImageW;
-	pDescriptorGLES->attachmentpoints[0] = GL_COLOR_ATTACHMENT0;
-	pDescriptorGLES->attachmentpoints[1] = GL_COLOR_ATTACHMENT1;
-	pDescriptorGLES->attachmentpoints[2] = GL_COLOR_ATTACHMENT2;
-	pDescriptorGLES->attachmentpoints[3] = GL_COLOR_ATTACHMENT3;
-	pDescriptorGLES->nBytesSrc = pImageWarper[0].mSrcImageH * pImageWarper[0].mSrcImageW * sizeof(GLubyte);
-	pDescriptorGLES->nBytesDst = pImageWarper[0].mWarpImageH * pImageWarper[0].mWarpImageW * sizeof(GLubyte);
+int deInitContextGLES(DescriptorGLES *pDescriptorGLES)
+{
+	if (pDescriptorGLES->isInitialized == GL_FALSE)
+		return 0;
 
+	eglMakeCurrent(pDescriptorGLES->eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(pDescriptorGLES->eglDisplay, pDescriptorGLES->eglContext);
+	eglDestroySurface(pDescriptorGLES->eglDisplay, pDescriptorGLES->eglSurface);
+	eglTerminate(pDescriptorGLES->eglDisplay);
 
-	// Shader
-	// ******************************************build and compile shaders********************************
-	pDescriptorGLES->vertexShaderWarpSrc = "#version 300 es\n"
-		"layout(location = 0) in vec3 position;\n"
-		"layout(location = 1) in vec2 texCoords;\n"
-		"out vec2 TexCoords;\n"
-		"out float f;\n"
+	pDescriptorGLES->eglDisplay = EGL_NO_DISPLAY;
+	pDescriptorGLES->eglSurface = EGL_NO_SURFACE;
+	pDescriptorGLES->eglContext = EGL_NO_CONTEXT;
+	pDescriptorGLES->isInitialized = GL_FALSE;
 
-		"void main()\n"
-		"{\n"
-		"f = position.z;\n"
-		"gl_Position = vec4(position.x, -position.y, 0.0f, 1.0f);\n"
-		"TexCoords = vec2(texCoords.x, texCoords.y);\n"
-		"}";
+	return 0;
+}
 
+int makeCurrentGLES(DescriptorGLES *pDescriptorGLES)
+{// the context may have been created on another thread, bind it to the calling one
+	if (eglGetCurrentContext() == pDescriptorGLES->eglContext)
+		return 0;
 
-	pDescriptorGLES->fragmentShaderWarpSrc = "#version 300 es\n"
-		"precision mediump float;\n"
+	if (!eglMakeCurrent(pDescriptorGLES->eglDisplay, pDescriptorGLES->eglSurface, pDescriptorGLES->eglSurface, pDescriptorGLES->eglContext))
+	{
+		std::cerr << "bind context failed, error code: " << eglGetError() << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+// the seam gains of colorSummaryGLES, shared by the quadrant blend and the full pano pass. it goes after the default
+// float precision, "#define COLOR_ADJUST" compiles it in; without it adjusted() leaves the colors alone
+static const GLchar *glesSeamGainsFragmentSrc =
+	"#ifdef COLOR_ADJUST\n"
+	"uniform highp usampler2D adjCoef;\n"  // see colorSummaryGLES
+	"uniform vec4 expoCurb[64];\n"         // colorAdjuster::mExpoCurbWeights of the 256 levels
+	"highp vec3 gains;\n"
+	"bool isBackAdjusted;\n"
+
+	"void loadGains(int column, int row)\n"
+	"{\n"
+	"highp uvec4 coef = texelFetch(adjCoef, ivec2(column, row), 0);\n"
+	"gains = uintBitsToFloat(coef.rgb);\n"
+	"isBackAdjusted = coef.a != 0u;\n"
+	"}\n"
+	"#endif\n"
+
+	// the gain of the row, curbed towards 1 above 150 by the table of colorAdjuster::colorExposureWeights. weight is
+	// the share of c in the mix, where the adjusted lens doesn't show the curb lookups are skipped
+	"vec4 adjusted(vec4 c, bool isBack, float weight)\n"
+	"{\n"
+	"#ifdef COLOR_ADJUST\n"
+	"if (isBack == isBackAdjusted && weight > 0.0)\n"
+	"{\n"
+	"ivec3 v = ivec3(c.rgb * 255.0 + 0.5);\n"
+	"vec3 curb = vec3(expoCurb[v.r / 4][v.r % 4], expoCurb[v.g / 4][v.g % 4], expoCurb[v.b / 4][v.b % 4]);\n"
+	"return vec4(clamp(c.rgb * (1.0 + (gains - 1.0) * curb), 0.0, 1.0), c.a);\n"
+	"}\n"
+	"#endif\n"
+	"return c;\n"
+	"}\n";
+
+static std::string seamGainsShaderSrc(const GLchar *body, GLboolean colorAdjust)
+{
+	return std::string("#version 300 es\n") + (colorAdjust ? "#define COLOR_ADJUST\n" : "") + "precision mediump float;\n" + glesSeamGainsFragmentSrc + body;
+}
+
+int fisheyePanoStitcherComp::initWarpGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescriptorGLES)
+{
+	pDescriptorGLES->heightSrc = pImageWarper->mSrcImageH;
+	pDescriptorGLES->widthSrc = pImageWarper->mSrcImageW;
+
+	pDescriptorGLES->heightDst = pImageWarper[0].mWarpImageH;
+	pDescriptorGLES->widthDst = pImageWarper[0].mWarpImageW;
+	pDescriptorGLES->attachmentpoints[0] = GL_COLOR_ATTACHMENT0;
+	pDescriptorGLES->attachmentpoints[1] = GL_COLOR_ATTACHMENT1;
+	pDescriptorGLES->attachmentpoints[2] = GL_COLOR_ATTACHMENT2;
+	pDescriptorGLES->attachmentpoints[3] = GL_COLOR_ATTACHMENT3;
+	pDescriptorGLES->nBytesSrc = pImageWarper[0].mSrcImageH * pImageWarper[0].mSrcImageW * sizeof(GLubyte);
+	pDescriptorGLES->nBytesDst = pImageWarper[0].mWarpImageH * pImageWarper[0].mWarpImageW * sizeof(GLubyte);
+	pDescriptorGLES->renderMode = mGLESRenderMode;
+	pDescriptorGLES->previewW = mPreviewW;
+	pDescriptorGLES->previewH = mPreviewH;
+	if (pDescriptorGLES->renderMode == glesFullPano)
+	{// the whole frames are uploaded and the whole pano is read back at once
+		pDescriptorGLES->nBytesSrcRoi = pImageWarper[0].mSrcImageW * pImageWarper[0].mSrcImageH * 3 * sizeof(GLubyte);
+		pDescriptorGLES->readTiles = 1;
+		pDescriptorGLES->readTileW = pImageWarper[0].mWarpImgDstRoi.imgW;
+		pDescriptorGLES->readTileH = pImageWarper[0].mWarpImgDstRoi.imgH;
+	}
+	else
+	{
+		pDescriptorGLES->nBytesSrcRoi = pImageWarper[0].mSrcImageRoi.roiW * pImageWarper[0].mSrcImageRoi.roiH * 3 * sizeof(GLubyte);
+		if (pDescriptorGLES->previewW > 0)   // the preview uploads whole frames
+			pDescriptorGLES->nBytesSrcRoi = pImageWarper[0].mSrcImageW * pImageWarper[0].mSrcImageH * 3 * sizeof(GLubyte);
+		pDescriptorGLES->readTiles = 4;
+		pDescriptorGLES->readTileW = pDescriptorGLES->widthDst;
+		pDescriptorGLES->readTileH = pDescriptorGLES->heightDst;
+	}
+	pDescriptorGLES->pipelineDepth = (mGLESSessionMode == glesPersistent) ? mPipelineDepth : 1;
+	pDescriptorGLES->framesInFlight = 0;
+	pDescriptorGLES->curPBORead = 0;
+	pDescriptorGLES->curPBOWrite = 0;
+	pDescriptorGLES->outputFormat = mOutputFormat;
+
+	// the bands are mip levels of the warped quadrants, so they can't go below a 1 pixel level
+	pDescriptorGLES->blendBands = mBlendBands;
+	if (pDescriptorGLES->renderMode == glesFullPano && mBlendBands > 1)
+	{
+		std::cout << "initWarpGLES: multi band blending needs glesQuadrants, the masks are mixed directly" << std::endl;
+		pDescriptorGLES->blendBands = 1;
+	}
+	pDescriptorGLES->seamOptFlow = (mSeamOptFlowEnabled && pDescriptorGLES->renderMode == glesQuadrants) ? GL_TRUE : GL_FALSE;
+	if (mSeamOptFlowEnabled && pDescriptorGLES->renderMode == glesFullPano)
+		std::cout << "initWarpGLES: seam optical flow needs glesQuadrants, it is skipped" << std::endl;
+	pDescriptorGLES->colorAdjust = (mColorAdjustEnabled && pSeamRois != NULL && pSeamRois[0].roiW > 0) ? GL_TRUE : GL_FALSE;
+	while (pDescriptorGLES->blendBands > 1 && ((pDescriptorGLES->widthDst >> (pDescriptorGLES->blendBands - 1)) < 1 || (pDescriptorGLES->heightDst >> (pDescriptorGLES->blendBands - 1)) < 1))
+		pDescriptorGLES->blendBands--;
+
+
+	// Shader
+	// ******************************************build and compile shaders********************************
+	pDescriptorGLES->vertexShaderWarpSrc = (GLchar *)glesWarpVertexShaderSrc;
+	pDescriptorGLES->fragmentShaderWarpSrc = (GLchar *)glesWarpFragmentShaderSrc;
+	pDescriptorGLES->shaderWarp.init(pDescriptorGLES->vertexShaderWarpSrc, pDescriptorGLES->fragmentShaderWarpSrc);
+
+	pDescriptorGLES->vertexShaderColorAdjSrc = (GLchar *)glesQuadVertexShaderSrc;
+
+	// without the #version line and the precision: see seamGainsShaderSrc, the plain mix stays as lean as it was
+	pDescriptorGLES->fragmentShaderColorAdjSrc = (GLchar *)
 		"in vec2 TexCoords;\n"
-		"in float f;\n"
 		"out vec4 color;\n"
-		"uniform sampler2D ourtexture;\n"
+		"uniform sampler2D ourtexture0;\n"   // back lens
+		"uniform sampler2D ourtexture1;\n"   // front lens
+		"uniform sampler2D ourMask;\n"
+		"uniform int blendBands;\n"
+		"uniform vec2 seamRange;\n"     // u range of the seam, only there the bands are blended
+		"uniform float maskLodBias;\n"  // mask mip level matching mip 0 of the quadrants
+		"#ifdef COLOR_ADJUST\n"
+		"uniform int coefColumn;\n"
+		"#endif\n"
+
+		// laplacian pyramid blend from the mip chains: band l is mip l minus the (bilinear upsampled) mip l + 1,
+		// each band is mixed by the mask at its own scale and the sum collapses the pyramid
+		"vec4 blendBandsAt(vec2 uv)\n"
+		"{\n"
+		"vec4 result = vec4(0.0);\n"
+		"vec4 g0 = adjusted(textureLod(ourtexture0, uv, 0.0), true, 1.0);\n"
+		"vec4 g1 = adjusted(textureLod(ourtexture1, uv, 0.0), false, 1.0);\n"
+		"for (int l = 0; l < blendBands; ++l)\n"
+		"{\n"
+		"vec4 n0 = vec4(0.0);\n"
+		"vec4 n1 = vec4(0.0);\n"
+		"if (l + 1 < blendBands)\n"
+		"{\n"
+		"n0 = adjusted(textureLod(ourtexture0, uv, float(l + 1)), true, 1.0);\n"
+		"n1 = adjusted(textureLod(ourtexture1, uv, float(l + 1)), false, 1.0);\n"
+		"}\n"
+		"float m = textureLod(ourMask, uv, max(float(l) + maskLodBias, 0.0)).r;\n"
+		"result += mix(g0 - n0, g1 - n1, 1.0 - m);\n"
+		"g0 = n0;\n"
+		"g1 = n1;\n"
+		"}\n"
+		"return result;\n"
+		"}\n"
 
 		"void main()\n"
 		"{\n"
-		"color = f * texture(ourtexture, TexCoords);\n"
-		"color = color.bgra;"
+		"#ifdef COLOR_ADJUST\n"
+		"loadGains(coefColumn, int(gl_FragCoord.y));\n"
+		"#endif\n"
+		"if (blendBands > 1 && TexCoords.x >= seamRange.x && TexCoords.x <= seamRange.y)\n"
+		"{\n"
+		"color = clamp(blendBandsAt(TexCoords), 0.0, 1.0);\n"
+		"return;\n"
+		"}\n"
+		"float m = 1.0 - texture(ourMask, TexCoords).r;\n"
+		"color = mix(adjusted(texture(ourtexture0, TexCoords), true, 1.0 - m), adjusted(texture(ourtexture1, TexCoords), false, m), m);\n"
 		"}";
 
-	pDescriptorGLES->shaderWarp.init(pDescriptorGLES->vertexShaderWarpSrc, pDescriptorGLES->fragmentShaderWarpSrc);
+	std::string colorAdjSrc = seamGainsShaderSrc(pDescriptorGLES->fragmentShaderColorAdjSrc, pDescriptorGLES->colorAdjust);
+	pDescriptorGLES->shaderColorAdj.init(pDescriptorGLES->vertexShaderColorAdjSrc, colorAdjSrc.c_str());
+	//std::cout << glGetError() << std::endl;
+
+	// sampler units are program state, so they are bound once here instead of every draw
+	pDescriptorGLES->shaderColorAdj.Use();
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "ourtexture0"), 0);
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "ourtexture1"), 1);
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "ourMask"), 2);
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "adjCoef"), 3);   // COLOR_ADJUST only, an integer sampler can't share unit 0
+	if (pDescriptorGLES->colorAdjust)
+	{// the curb table of the software adjust, a cos per channel and pixel costs more than the rest of the blend on some GPUs
+		mColorAdjusterPair.colorExposureWeights();
+		glUniform4fv(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "expoCurb"), GRAY_SCALE / 4, mColorAdjusterPair.mExpoCurbWeights);
+	}
+	glUseProgram(0);
+
+	pDescriptorGLES->fragmentShaderYUVSrc = (GLchar *)glesYUVPackFragmentShaderSrc;
 
-	pDescriptorGLES->vertexShaderColorAdjSrc = "#version 300 es\n"
+	pDescriptorGLES->shaderYUV.init(pDescriptorGLES->vertexShaderColorAdjSrc, pDescriptorGLES->fragmentShaderYUVSrc);
+	pDescriptorGLES->shaderYUV.Use();
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderYUV.Program, "ourtexture"), 0);
+	glUniform2i(glGetUniformLocation(pDescriptorGLES->shaderYUV.Program, "srcSize"), pDescriptorGLES->readTileW, pDescriptorGLES->readTileH);
+	glUseProgram(0);
+
+	// warp of both lenses, vignette correction and mask blend in one pass; the whole fisheye frames are sampled,
+	// so the texture coordinates need highp to stay below a pixel at 5.7K
+	pDescriptorGLES->vertexShaderFullPanoSrc = "#version 300 es\n"
 		"layout(location = 0) in vec2 position;\n"
-		"layout(location = 1) in vec2 texCoords;\n"
-		"out vec2 TexCoords;\n"
-		
+		"layout(location = 1) in vec3 front;\n"    // texture x, y and vignette factor
+		"layout(location = 2) in vec3 back;\n"
+		"out highp vec3 Front;\n"
+		"out highp vec3 Back;\n"
+		"out vec2 MaskCoords;\n"
+
 		"void main()\n"
 		"{\n"
 		"gl_Position = vec4(position.x, -position.y, 0.0f, 1.0f);\n"
-		"TexCoords = vec2(texCoords.x, texCoords.y);\n"
+		"Front = front;\n"
+		"Back = back;\n"
+		"MaskCoords = vec2(0.5 + 0.5 * position.x, 0.5 - 0.5 * position.y);\n"
 		"}";
 
-	pDescriptorGLES->fragmentShaderColorAdjSrc = "#version 300 es\n"
-		"precision mediump float;\n"
-		"in vec2 TexCoords;\n"
+	// the seam gains are taken from the rows of the pano quadrants, so the warped colors are swapped before they
+	// are adjusted, as in the quadrant textures. without the #version line, see seamGainsShaderSrc
+	pDescriptorGLES->fragmentShaderFullPanoSrc = (GLchar *)
+		"in highp vec3 Front;\n"
+		"in highp vec3 Back;\n"
+		"in vec2 MaskCoords;\n"
 		"out vec4 color;\n"
-		"uniform float exploreWeight[256];\n"
-		"uniform sampler2D ourtexture0;\n"
-		"uniform sampler2D ourtexture1;\n"
+		"uniform sampler2D textureFront;\n"
+		"uniform sampler2D textureBack;\n"
 		"uniform sampler2D ourMask;\n"
-		"uniform sampler2D adjCof;\n"
+		"#ifdef COLOR_ADJUST\n"
+		"uniform int quadH;\n"     // rows of the top quadrants, the first coefficient section
+		"#endif\n"
 
 		"void main()\n"
 		"{\n"
-		//"vec4 adjTarColor = texture(ourtexture1, TexCoords);\n"
-		//"float Y = adjTarColor.r * 0.229 + adjTarColor.g * 0.587 + adjTarColor.b * 0.114;\n"
-		//"vec3 cof = 1.0 + ((texture(adjCof, vec2(1.0, TexCoords.y)) - 1.0) * exploreWeight[int(255.0 * Y)]).rgb;\n"
-		//"adjTarColor = vec4(adjTarColor.rgb * cof, 1.0);\n"
-		//"color = mix(texture(ourtexture0, TexCoords), adjTarColor, 1.0 - texture(ourMask, TexCoords).r);\n"
-		"color = mix(texture(ourtexture0, TexCoords), texture(ourtexture1, TexCoords), 1.0 - texture(ourMask, TexCoords).r);\n"
+		"#ifdef COLOR_ADJUST\n"
+		"int row = int(gl_FragCoord.y);\n"
+		"int section = min(row / quadH, 1);\n"
+		"loadGains(section, row - section * quadH);\n"
+		"#endif\n"
+		"float m = 1.0 - texture(ourMask, MaskCoords).r;\n"
+		"vec4 colorFront = adjusted((Front.z * texture(textureFront, Front.xy)).bgra, false, m);\n"
+		"vec4 colorBack = adjusted((Back.z * texture(textureBack, Back.xy)).bgra, true, 1.0 - m);\n"
+		"color = mix(colorBack, colorFront, m);\n"
 		"}";
 
-	pDescriptorGLES->shaderColorAdj.init(pDescriptorGLES->vertexShaderColorAdjSrc, pDescriptorGLES->fragmentShaderColorAdjSrc);
-	//std::cout << glGetError() << std::endl;
-	// Source Texture
-	glGenTextures(1, &pDescriptorGLES->texture);
-	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pImageWarper->mSrcImageRoi.roiW, pImageWarper->mSrcImageRoi.roiH, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	
-	// Texture for warped images;
-	glGenTextures(8, pDescriptorGLES->textureColorBuffers);
-	for (int i = 0; i != 8; ++i)
+	if (pDescriptorGLES->renderMode == glesFullPano)
 	{
-		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureColorBuffers[i]);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, pDescriptorGLES->widthDst, pDescriptorGLES->heightDst, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		std::string fullPanoSrc = seamGainsShaderSrc(pDescriptorGLES->fragmentShaderFullPanoSrc, pDescriptorGLES->colorAdjust);
+		pDescriptorGLES->shaderFullPano.init(pDescriptorGLES->vertexShaderFullPanoSrc, fullPanoSrc.c_str());
+		pDescriptorGLES->shaderFullPano.Use();
+		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderFullPano.Program, "textureFront"), 0);
+		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderFullPano.Program, "textureBack"), 1);
+		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderFullPano.Program, "ourMask"), 2);
+		if (pDescriptorGLES->colorAdjust)
+		{
+			glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderFullPano.Program, "adjCoef"), 3);
+			glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderFullPano.Program, "quadH"), pDescriptorGLES->heightDst);
+			glUniform4fv(glGetUniformLocation(pDescriptorGLES->shaderFullPano.Program, "expoCurb"), GRAY_SCALE / 4, mColorAdjusterPair.mExpoCurbWeights);
+		}
+		glUseProgram(0);
+	}
+	// Source Texture, the roi texture for the quadrant warps or the 2 whole frames for the full pano pass;
+	// names that are not generated stay 0, which glDeleteTextures ignores
+	memset(pDescriptorGLES->textureSrcFull, 0, sizeof(pDescriptorGLES->textureSrcFull));
+	memset(pDescriptorGLES->textureColorBuffers, 0, sizeof(pDescriptorGLES->textureColorBuffers));
+	memset(pDescriptorGLES->textureBlended, 0, sizeof(pDescriptorGLES->textureBlended));
+	pDescriptorGLES->texture = 0;
+	if (pDescriptorGLES->renderMode == glesFullPano || pDescriptorGLES->previewW > 0)
+	{// the preview samples past the image circle where the other lens takes over, so the edges are clamped
+		glGenTextures(2, pDescriptorGLES->textureSrcFull);
+		for (int i = 0; i != 2; ++i)
+		{
+			glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSrcFull[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pImageWarper[4 * i].mSrcImageW, pImageWarper[4 * i].mSrcImageH, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	if (pDescriptorGLES->renderMode != glesFullPano)
+	{
+		glGenTextures(1, &pDescriptorGLES->texture);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pImageWarper->mSrcImageRoi.roiW, pImageWarper->mSrcImageRoi.roiH, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glBindTexture(GL_TEXTURE_2D, 0);
+
+		// Texture for warped images;
+		glGenTextures(8, pDescriptorGLES->textureColorBuffers);
+		for (int i = 0; i != 8; ++i)
+		{
+			glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureColorBuffers[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, pDescriptorGLES->widthDst, pDescriptorGLES->heightDst, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			if (pDescriptorGLES->blendBands > 1)
+			{// the blend bands are this mip chain, regenerated every frame up to the top band only
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, pDescriptorGLES->blendBands - 1);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+				glGenerateMipmap(GL_TEXTURE_2D);   // complete already for the seam sums, which come before the first blend
+			}
+			else
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
 	}
 
-	// Renderbuffer for result coloradj & blend images;
-	glGenRenderbuffers(4, pDescriptorGLES->renderBuffers);
-	for (int i = 0; i != 4; ++i)
+	// Texture for result coloradj & blend images, one per read tile, sampled again by the yuv pass;
+	glGenTextures(pDescriptorGLES->readTiles, pDescriptorGLES->textureBlended);
+	for (GLuint i = 0; i != pDescriptorGLES->readTiles; ++i)
 	{
-		glBindRenderbuffer(GL_RENDERBUFFER, pDescriptorGLES->renderBuffers[i]);
-		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, pDescriptorGLES->widthDst, pDescriptorGLES->heightDst);
-		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureBlended[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, pDescriptorGLES->readTileW, pDescriptorGLES->readTileH, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
 	}
 
+	// Texture for the yuv packed read tile, w * h * 3 / 2 bytes;
+	glGenTextures(1, &pDescriptorGLES->textureYUV);
+	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureYUV);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, pDescriptorGLES->readTileW / 4, pDescriptorGLES->readTileH * 3 / 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
 	// Frame buffer (dst texture)
 	glGenFramebuffers(1, &pDescriptorGLES->framebuffer);
 	glBindFramebuffer(GL_FRAMEBUFFER, pDescriptorGLES->framebuffer);
@@ -616,132 +1279,302 @@ int fisheyePanoStitcherComp::initWarpGLES(ImageWarper *pImageWarper, DescriptorG
 	//if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
 	//	std::cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << std::endl;
 
-	glGenBuffers(4, pDescriptorGLES->pixelBuffer);
-	for (int i = 0; i != 4; ++i)
+	// readback ring, one set of quadrant buffers per frame in flight
+	for (GLuint k = 0; k != pDescriptorGLES->pipelineDepth; ++k)
 	{
-		// rgba 4 channels;
-		glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescriptorGLES->pixelBuffer[i]);
-		glBufferData(GL_PIXEL_PACK_BUFFER, (GLuint)pDescriptorGLES->heightDst * (GLuint)pDescriptorGLES->widthDst * 4 * sizeof(GL_UNSIGNED_BYTE), NULL, GL_STREAM_READ);
-		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		glGenBuffers(4, pDescriptorGLES->pbosRead[k]);
+		for (GLuint i = 0; i != pDescriptorGLES->readTiles; ++i)
+		{
+			// rgba 4 channels, the largest output format;
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescriptorGLES->pbosRead[k][i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, (GLuint)pDescriptorGLES->readTileH * (GLuint)pDescriptorGLES->readTileW * 4 * sizeof(GL_UNSIGNED_BYTE), NULL, GL_STREAM_READ);
+		}
+		pDescriptorGLES->fencesRead[k] = 0;
 	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	// upload buffers for the source rois
+	glGenBuffers(2, pDescriptorGLES->pbosWrite);
+	for (int i = 0; i != 2; ++i)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pDescriptorGLES->pbosWrite[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, pDescriptorGLES->nBytesSrcRoi, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
 	return 0;
 }
 
 int fisheyePanoStitcherComp::deinitWarpGLES(DescriptorGLES *pDescriptorGLES)
 {
-	//to do deinit;
-	//delete texture
+	//delete source texture and warped textures
 	glDeleteTextures(1, &pDescriptorGLES->texture);
-	//delete vbo, array buffer;
-	glDeleteBuffers(1, &pDescriptorGLES->VBO);
-	//delete ebo, element array buffer;
-	glDeleteBuffers(1, &pDescriptorGLES->EBO);
-	
+	glDeleteTextures(2, pDescriptorGLES->textureSrcFull);
+	glDeleteTextures(8, pDescriptorGLES->textureColorBuffers);
+
+	//delete render targets, framebuffer and pixel buffers
+	glDeleteTextures(4, pDescriptorGLES->textureBlended);
+	glDeleteTextures(1, &pDescriptorGLES->textureYUV);
+	glDeleteFramebuffers(1, &pDescriptorGLES->framebuffer);
+	for (GLuint k = 0; k != pDescriptorGLES->pipelineDepth; ++k)
+	{// frames still in flight are dropped
+		glDeleteBuffers(4, pDescriptorGLES->pbosRead[k]);
+		if (pDescriptorGLES->fencesRead[k] != 0)
+			glDeleteSync(pDescriptorGLES->fencesRead[k]);
+		pDescriptorGLES->fencesRead[k] = 0;
+	}
+	pDescriptorGLES->framesInFlight = 0;
+	glDeleteBuffers(2, pDescriptorGLES->pbosWrite);
+
+	//delete programs
+	glDeleteProgram(pDescriptorGLES->shaderWarp.Program);
+	glDeleteProgram(pDescriptorGLES->shaderColorAdj.Program);
+	glDeleteProgram(pDescriptorGLES->shaderYUV.Program);
+	if (pDescriptorGLES->renderMode == glesFullPano)
+		glDeleteProgram(pDescriptorGLES->shaderFullPano.Program);
+
 	return 0;
 }
 
-int fisheyePanoStitcherComp::initWarpVerticesGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescriptorGLES)
+int genWarpMeshGLES(ImageWarper *pImageWarpers[], cameraMetadata *pCameras[], int tableNum, int sphereRadius, float tolerance, warpMesh *pMesh)
+{
+	imageWarpTable *pTables[WARP_MESH_MAX_TABLES];
+	for (int t = 0; t != tableNum && t != WARP_MESH_MAX_TABLES; ++t)
+		pTables[t] = pImageWarpers[t];
+
+	if (tolerance == 0.0f)
+		return pMesh->genUniform(pTables, tableNum);
+	if (tolerance > 0.0f)
+		return pMesh->genAdaptive(pTables, pCameras, tableNum, sphereRadius, tolerance, WARP_MESH_ROOT_STEP, WARP_MESH_MAX_DEPTH);
+
+	// as accurate as the uniform grid at its worst, which is the coarser the smaller the pano, and never more vertices
+	if (pMesh->genUniform(pTables, tableNum) != 0 || pMesh->measureError(pTables, pCameras, sphereRadius) != 0)
+		return -1;
+	int uniformVertexNum = pMesh->mVertexNum;
+	tolerance = pMesh->mStats.maxError;
+	if (tolerance <= 0.0f)
+		return 0;   // the grid is exact already
+	if (pMesh->genAdaptive(pTables, pCameras, tableNum, sphereRadius, tolerance, WARP_MESH_ROOT_STEP, WARP_MESH_MAX_DEPTH) != 0)
+		return -1;
+	if (pMesh->mVertexNum < uniformVertexNum)
+		return 0;
+	if (pMesh->genUniform(pTables, tableNum) != 0)
+		return -1;
+	return pMesh->measureError(pTables, pCameras, sphereRadius);
+}
+
+int initWarpVerticesGLES(ImageWarper *pImageWarper, warpMesh *pMesh, DescriptorGLES *pDescriptorGLES, int idx)
 {
-	int TableH = pImageWarper->mTableH;
-	int TableW = pImageWarper->mTableW;
-	float *PposX = pImageWarper->mPposX;
-	float *PposY = pImageWarper->mPposY;
-	float *Pvcfr = pImageWarper->mPvcfr;
-	float *PmapX = pImageWarper->mPmapX;
-	float *PmapY = pImageWarper->mPmapY;
-
-	pDescriptorGLES->vertcesAmount = TableH * TableW * 5;
-	pDescriptorGLES->indicesAmount = (TableH - 1) * (TableW - 1) * 6;
-	pDescriptorGLES->vertices = new GLfloat[pDescriptorGLES->vertcesAmount];
-	pDescriptorGLES->indices = new GLuint[pDescriptorGLES->indicesAmount];
-	GLfloat *pVertices = pDescriptorGLES->vertices;
+	GLuint verticesAmount = pMesh->mVertexNum;
+	pDescriptorGLES->indicesAmount[idx] = pMesh->mIndices.size();
+	pDescriptorGLES->indicesType[idx] = pMesh->isIndex16() ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	GLfloat *vertices = new GLfloat[verticesAmount * 5];   // position(x, y, vcf), texture(x, y)
+	GLfloat *pVertices = vertices;
 
 	float roiY = pImageWarper->mSrcImageRoi.roiY;
 	float roiX = pImageWarper->mSrcImageRoi.roiX;
 	float invRoiH = 1.0 / pImageWarper->mSrcImageRoi.roiH;
 	float invRoiW = 1.0 / pImageWarper->mSrcImageRoi.roiW;
 
-	if (pImageWarper->mHasVC)
-		for (int i = 0; i != TableH * TableW; ++i)
+	const float *pPos = &pMesh->mPos[0];
+	const float *pMap = &pMesh->mMaps[0][0];
+	for (GLuint i = 0; i != verticesAmount; ++i, pPos += 2, pMap += 3)
+	{
+		*(pVertices++) = pPos[0];
+		*(pVertices++) = pPos[1];
+		*(pVertices++) = pMap[2];
+		*(pVertices++) = (pMap[0] - roiX) * invRoiW;
+		*(pVertices++) = (pMap[1] - roiY) * invRoiH;
+	}
+
+	// VAO, VBO, EBO;
+	glGenVertexArrays(1, &pDescriptorGLES->warpVAO[idx]);
+	glGenBuffers(1, &pDescriptorGLES->warpVBO[idx]);
+	glGenBuffers(1, &pDescriptorGLES->warpEBO[idx]);
+	glBindVertexArray(pDescriptorGLES->warpVAO[idx]);
+	glBindBuffer(GL_ARRAY_BUFFER, pDescriptorGLES->warpVBO[idx]);
+	glBufferData(GL_ARRAY_BUFFER, verticesAmount * 5 * sizeof(GLfloat), vertices, GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (GLvoid*)0);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pDescriptorGLES->warpEBO[idx]);
+	if (pDescriptorGLES->indicesType[idx] == GL_UNSIGNED_SHORT)
+	{// half the index memory and fetch bandwidth
+		GLushort *indices = new GLushort[pDescriptorGLES->indicesAmount[idx]];
+		pMesh->getIndices16(indices, 0);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, pDescriptorGLES->indicesAmount[idx] * sizeof(GLushort), indices, GL_STATIC_DRAW);
+		delete[] indices;
+	}
+	else
+	{
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, pDescriptorGLES->indicesAmount[idx] * sizeof(GLuint), &pMesh->mIndices[0], GL_STATIC_DRAW);
+	}
+	glBindVertexArray(0);
+
+	delete[] vertices;
+
+	return 0;
+}
+
+int deInitWarpVerticesGLES(DescriptorGLES *pDescriptorGLES, int idx)
+{
+	//delete VAO, VBO, EBO;
+	glDeleteBuffers(1, &pDescriptorGLES->warpVBO[idx]);
+	glDeleteBuffers(1, &pDescriptorGLES->warpEBO[idx]);
+	glDeleteVertexArrays(1, &pDescriptorGLES->warpVAO[idx]);
+	
+	return 0;
+}
+
+int fisheyePanoStitcherComp::initFullPanoVerticesGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescriptorGLES)
+{// warpers i and i + 4 share the same pano grid, so one mesh per quadrant carries the source coordinates of both lenses
+ // and is split wherever either of them needs it. the 4 quadrant meshes go into one buffer with their positions moved
+ // from quadrant to pano clip space
+	warpMesh meshes[4];
+	int results[4];
+	ThreadPool::getDefault()->parallelFor(0, 4, [&](int qBegin, int qEnd) {
+		for (int q = qBegin; q != qEnd; ++q)
 		{
-			*(pVertices++) = PposX[i];
-			*(pVertices++) = PposY[i];
-			*(pVertices++) = Pvcfr[i];
-			*(pVertices++) = (PmapX[i] - roiX) * invRoiW;
-			*(pVertices++) = (PmapY[i] - roiY) * invRoiH;
+			ImageWarper *pWarpers[2] = { &pImageWarper[q], &pImageWarper[q + 4] };
+			cameraMetadata *pCameras[2] = { &mCameraMetadata[0], &mCameraMetadata[1] };
+			results[q] = genWarpMeshGLES(pWarpers, pCameras, 2, mFisheyePanoParamsCore.sphereRadius, mWarpMeshTolerance, &meshes[q]);
 		}
-	else
-		for (int i = 0; i != pImageWarper->mTableH * pImageWarper->mTableW; ++i)
+	}, 1);
+
+	GLuint verticesAmount = 0;
+	pDescriptorGLES->fullIndicesAmount = 0;
+	for (int q = 0; q != 4; ++q)
+	{
+		if (results[q] != 0)
 		{
-			*(pVertices++) = PposX[i];
-			*(pVertices++) = PposY[i];
-			*(pVertices++) = 1.0f;
-			*(pVertices++) = (PmapX[i] - roiX) * invRoiW;
-			*(pVertices++) = (PmapY[i] - roiY) * invRoiH;
+			std::cout << "initFullPanoVerticesGLES: no mesh for quadrant " << q << std::endl;
+			return -1;
 		}
+		mWarpMeshStats[q] = meshes[q].mStats;
+		verticesAmount += meshes[q].mVertexNum;
+		pDescriptorGLES->fullIndicesAmount += meshes[q].mIndices.size();
+	}
+	mWarpMeshNum = 4;
+	pDescriptorGLES->fullIndicesType = (verticesAmount <= WARP_MESH_INDEX16_MAX) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
 
-	// vertexIndeices
-	GLuint *pVerIdx = pDescriptorGLES->indices;
-	GLuint indices[4] = { 0, 1, TableW, TableW + 1 };
-	for (GLint h = 0; h != TableH - 1; ++h)
+	GLfloat *vertices = new GLfloat[verticesAmount * 8];  // position(x, y), front(x, y, vcf), back(x, y, vcf)
+	GLuint *indices = new GLuint[pDescriptorGLES->fullIndicesAmount];
+	GLushort *indices16 = (pDescriptorGLES->fullIndicesType == GL_UNSIGNED_SHORT) ? new GLushort[pDescriptorGLES->fullIndicesAmount] : NULL;
+	GLfloat *pVertices = vertices;
+	GLuint indicesOffset = 0;
+	GLuint base = 0;
+
+	for (int q = 0; q != 4; ++q)
 	{
-		for (GLint w = 0; w != TableW - 1; ++w)
+		ImageWarper *pFront = &pImageWarper[q];
+		ImageWarper *pBack = &pImageWarper[q + 4];
+		warpMesh *pMesh = &meshes[q];
+		imageRoi *pDstRoi = &pFront->mWarpImgDstRoi;
+
+		// quadrant clip space -1 ~ 1 to pano clip space
+		float scaleX = (float)pDstRoi->roiW / pDstRoi->imgW;
+		float offsetX = -1.0f + (float)(2 * pDstRoi->roiX + pDstRoi->roiW) / pDstRoi->imgW;
+		float scaleY = (float)pDstRoi->roiH / pDstRoi->imgH;
+		float offsetY = 1.0f - (float)(2 * pDstRoi->roiY + pDstRoi->roiH) / pDstRoi->imgH;
+		float invSrcW[2] = { 1.0f / pFront->mSrcImageW, 1.0f / pBack->mSrcImageW };
+		float invSrcH[2] = { 1.0f / pFront->mSrcImageH, 1.0f / pBack->mSrcImageH };
+
+		for (int i = 0; i != pMesh->mVertexNum; ++i)
 		{
-			*(pVerIdx++) = indices[0];
-			*(pVerIdx++) = indices[2];
-			*(pVerIdx++) = indices[1];
-			*(pVerIdx++) = indices[1];
-			*(pVerIdx++) = indices[2];
-			*(pVerIdx++) = indices[3];
-			++indices[0];
-			++indices[1];
-			++indices[2];
-			++indices[3];
+			*(pVertices++) = pMesh->mPos[2 * i] * scaleX + offsetX;
+			*(pVertices++) = pMesh->mPos[2 * i + 1] * scaleY + offsetY;
+			for (int t = 0; t != 2; ++t)
+			{
+				*(pVertices++) = pMesh->mMaps[t][3 * i] * invSrcW[t];
+				*(pVertices++) = pMesh->mMaps[t][3 * i + 1] * invSrcH[t];
+				*(pVertices++) = pMesh->mMaps[t][3 * i + 2];
+			}
 		}
-		++indices[0];
-		++indices[1];
-		++indices[2];
-		++indices[3];
+
+		if (indices16 != NULL)
+			pMesh->getIndices16(indices16 + indicesOffset, base);
+		for (size_t i = 0; i != pMesh->mIndices.size(); ++i)
+			indices[indicesOffset + i] = pMesh->mIndices[i] + base;
+		indicesOffset += pMesh->mIndices.size();
+		base += pMesh->mVertexNum;
 	}
 
 	// VAO, VBO, EBO;
-	glGenVertexArrays(1, &pDescriptorGLES->VAO);
-	glGenBuffers(1, &pDescriptorGLES->VBO);
-	glGenBuffers(1, &pDescriptorGLES->EBO);
-	glBindVertexArray(pDescriptorGLES->VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, pDescriptorGLES->VBO);
-	glBufferData(GL_ARRAY_BUFFER, pDescriptorGLES->vertcesAmount * sizeof(GLfloat), pDescriptorGLES->vertices, GL_STATIC_DRAW);
+	glGenVertexArrays(1, &pDescriptorGLES->fullVAO);
+	glGenBuffers(1, &pDescriptorGLES->fullVBO);
+	glGenBuffers(1, &pDescriptorGLES->fullEBO);
+	glBindVertexArray(pDescriptorGLES->fullVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, pDescriptorGLES->fullVBO);
+	glBufferData(GL_ARRAY_BUFFER, verticesAmount * 8 * sizeof(GLfloat), vertices, GL_STATIC_DRAW);
 	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (GLvoid*)0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)0);
 	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pDescriptorGLES->EBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, pDescriptorGLES->indicesAmount * sizeof(GLuint), pDescriptorGLES->indices, GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(2 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(5 * sizeof(GLfloat)));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pDescriptorGLES->fullEBO);
+	if (indices16 != NULL)
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, pDescriptorGLES->fullIndicesAmount * sizeof(GLushort), indices16, GL_STATIC_DRAW);
+	else
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, pDescriptorGLES->fullIndicesAmount * sizeof(GLuint), indices, GL_STATIC_DRAW);
 	glBindVertexArray(0);
 
-	delete[] pDescriptorGLES->vertices;
-	delete[] pDescriptorGLES->indices;
+	delete[] vertices;
+	delete[] indices;
+	if (indices16 != NULL)
+		delete[] indices16;
 
 	return 0;
 }
 
-int fisheyePanoStitcherComp::deInitWarpVerticesGLES(DescriptorGLES *pDescriptorGLES)
+int fisheyePanoStitcherComp::deInitFullPanoVerticesGLES(DescriptorGLES *pDescriptorGLES)
 {
-	//delete VAO, VBO, EBO;
-	glDeleteBuffers(1, &pDescriptorGLES->VBO);
-	glDeleteBuffers(1, &pDescriptorGLES->EBO);
-	glDeleteVertexArrays(1, &pDescriptorGLES->VAO);
-	
+	glDeleteBuffers(1, &pDescriptorGLES->fullVBO);
+	glDeleteBuffers(1, &pDescriptorGLES->fullEBO);
+	glDeleteVertexArrays(1, &pDescriptorGLES->fullVAO);
+
 	return 0;
 }
 
-int fisheyePanoStitcherComp::warpImageGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescriptorGLES, imageFrame *srcImage, int idx)
-{	//warp image in opengl with sparse map table;
+int uploadSrcImageGLES(imageRoi *pRoi, GLuint texture, DescriptorGLES *pDescriptorGLES, imageFrame *srcImage)
+{// load the source roi of a fisheye image into the texture through an upload buffer.
+ // the buffer is invalidated on map, so the copy doesn't wait for the GPU to finish with its previous contents
+	STITCH_PROFILE_SCOPE(profileUpload);
+	int rowBytes = pRoi->roiW * 3;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pDescriptorGLES->pbosWrite[pDescriptorGLES->curPBOWrite]);
+	GLubyte *pDst = (GLubyte *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, pDescriptorGLES->nBytesSrcRoi, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (pDst == NULL)
+	{
+		std::cout << "uploadSrcImageGLES: glMapBufferRange failed" << std::endl;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return -1;
+	}
+
+	const unsigned char *pSrc = srcImage->plane[0] + pRoi->roiY * srcImage->strides[0] + pRoi->roiX * 3;
+	for (int h = 0; h != pRoi->roiH; ++h)
+	{
+		memcpy(pDst, pSrc, rowBytes);
+		pDst += rowBytes;
+		pSrc += srcImage->strides[0];
+	}
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, pRoi->roiW, pRoi->roiH, GL_RGB, GL_UNSIGNED_BYTE, 0);   // offset 0 in the bound buffer
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	pDescriptorGLES->curPBOWrite = (pDescriptorGLES->curPBOWrite + 1) % 2;
+
+	return 0;
+}
+
+int fisheyePanoStitcherComp::warpImageGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescriptorGLES, int idx)
+{	//warp image in opengl with sparse map table, the mesh of this warper is already in warpVAO[idx];
 
-	// vertices process, include VAO
-	initWarpVerticesGLES(pImageWarper, pDescriptorGLES);
-	
 	// bind framebuffer
 	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureColorBuffers[idx]);
 	glBindFramebuffer(GL_FRAMEBUFFER, pDescriptorGLES->framebuffer);
@@ -756,19 +1589,18 @@ int fisheyePanoStitcherComp::warpImageGLES(ImageWarper *pImageWarper, Descriptor
 
 	glViewport(0, 0, pDescriptorGLES->widthDst, pDescriptorGLES->heightDst);
 	
-	// load image data from render to GPU;
+	// source image is uploaded by uploadSrcImageGLES;
+	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->texture);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, pImageWarper->mSrcImageRoi.roiW, pImageWarper->mSrcImageRoi.roiH, GL_RGB, 
-		GL_UNSIGNED_BYTE, srcImage->plane[0] + pImageWarper->mSrcImageRoi.roiY * srcImage->strides[0] + pImageWarper->mSrcImageRoi.roiX * 3);
 	// shader;
 	pDescriptorGLES->shaderWarp.Use();
 
 	// bind VAO;
-	glBindVertexArray(pDescriptorGLES->VAO);
+	glBindVertexArray(pDescriptorGLES->warpVAO[idx]);
 
 	// render
 	glDrawBuffers(1, &(pDescriptorGLES->attachmentpoints[0]));
-	glDrawElements(GL_TRIANGLES, pDescriptorGLES->indicesAmount, GL_UNSIGNED_INT, 0);
+	glDrawElements(GL_TRIANGLES, pDescriptorGLES->indicesAmount[idx], pDescriptorGLES->indicesType[idx], 0);
 	
 	// deattach VAO;
 	glBindVertexArray(0);
@@ -782,29 +1614,97 @@ int fisheyePanoStitcherComp::warpImageGLES(ImageWarper *pImageWarper, Descriptor
 	// deattach framebuffer;
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-	deInitWarpVerticesGLES(pDescriptorGLES);
+	return 0;
+}
+
+int fisheyePanoStitcherComp::stitchFullPanoGLES(DescriptorGLES *pDescriptorGLES)
+{// both lenses are warped, vignette corrected, color adjusted and blended straight into the pano texture
+	glBindFramebuffer(GL_FRAMEBUFFER, pDescriptorGLES->framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureBlended[0], 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Framebuffer is not complete! " << "stitchFullPanoGLES" << std::endl;
+
+	glClearColor(0.0f, 0.5f, 1.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glViewport(0, 0, pDescriptorGLES->readTileW, pDescriptorGLES->readTileH);
+
+	//shader use, sampler units are bound in initWarpGLES
+	pDescriptorGLES->shaderFullPano.Use();
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSrcFull[0]);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSrcFull[1]);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureMaskPano);
+	if (pDescriptorGLES->colorAdjust)
+	{
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureAdjCoef);
+	}
+
+	glBindVertexArray(pDescriptorGLES->fullVAO);
+	glDrawBuffers(1, &pDescriptorGLES->attachmentpoints[0]);
+	glDrawElements(GL_TRIANGLES, pDescriptorGLES->fullIndicesAmount, pDescriptorGLES->fullIndicesType, 0);
+	glBindVertexArray(0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	return 0;
 }
 
 int fisheyePanoStitcherComp::initColAdjBlendGLES(ImageBlender *pImageBlender, DescriptorGLES *pDescriptorGLES)
 {
-	// texture Mask
-	glGenTextures(1, &pDescriptorGLES->textureMask);
-	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureMask);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, pImageBlender->mSizeW/*pDescriptorGLES->widthDst*/, pImageBlender->mSizeH/*pDescriptorGLES->heightDst*/, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	// texture Masks, the masks don't change between frames so they are uploaded only once
+	glGenTextures(4, pDescriptorGLES->textureMasks);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int i = 0; i != 4; ++i)
+	{
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureMasks[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, pImageBlender[i].mSizeW/*pDescriptorGLES->widthDst*/, pImageBlender[i].mSizeH/*pDescriptorGLES->heightDst*/, 0, GL_RED, GL_UNSIGNED_BYTE, pImageBlender[i].pMaskY);
+		glGenerateMipmap(GL_TEXTURE_2D);	// the gaussian pyramid of the mask for the blend bands, and for smaller outputs
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
 	glBindTexture(GL_TEXTURE_2D, 0);
-	// texture coefficient
-	/*glGenTextures(1, &pDescriptorGLES->textureAdjCoef);
-	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureAdjCoef);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, 1, pDescriptorGLES->heightDst, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, 0);*/
+
+	// the seams sit in the middle of every quadrant, all 4 alike
+	pDescriptorGLES->shaderColorAdj.Use();
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "blendBands"), pDescriptorGLES->blendBands);
+	if (pSeamRois != NULL && pSeamRois[0].imgW > 0)
+		glUniform2f(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "seamRange"),
+			(GLfloat)pSeamRois[0].roiX / pSeamRois[0].imgW, (GLfloat)(pSeamRois[0].roiX + pSeamRois[0].roiW) / pSeamRois[0].imgW);
+	else
+		glUniform2f(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "seamRange"), 0.0f, 1.0f);
+	glUniform1f(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "maskLodBias"), log2f((GLfloat)pImageBlender[0].mSizeW / pDescriptorGLES->widthDst));
+	glUseProgram(0);
+
+	// the full pano pass and the preview sample the 4 masks as one texture, laid out like the quadrants
+	pDescriptorGLES->textureMaskPano = 0;
+	if (pDescriptorGLES->renderMode == glesFullPano || pDescriptorGLES->previewW > 0)
+	{
+		int maskW = pImageBlender[0].mSizeW;
+		int maskH = pImageBlender[0].mSizeH;
+		unsigned char *pMaskPano = new unsigned char[4 * maskW * maskH];
+		for (int i = 0; i != 4; ++i)
+		{
+			unsigned char *pDst = pMaskPano + (i / 2) * maskH * 2 * maskW + (i % 2) * maskW;
+			for (int h = 0; h != maskH; ++h)
+				memcpy(pDst + h * 2 * maskW, pImageBlender[i].pMaskY + h * maskW, maskW);
+		}
+
+		glGenTextures(1, &pDescriptorGLES->textureMaskPano);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureMaskPano);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, 2 * maskW, 2 * maskH, 0, GL_RED, GL_UNSIGNED_BYTE, pMaskPano);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		delete[] pMaskPano;
+	}
 
 	// vertex and Texture coordinate;
 	GLfloat vertices[] = {
@@ -834,73 +1734,324 @@ int fisheyePanoStitcherComp::initColAdjBlendGLES(ImageBlender *pImageBlender, De
 
 int fisheyePanoStitcherComp::deInitColAdjBlendGLES(DescriptorGLES *pDescriptorGLES)
 {//  delete textures
-	//glDeleteTextures(1, &pDescriptorGLES->texture);
-	//glDeleteTextures(1, &pDescriptorGLES->texture1);
-
-	glDeleteTextures(8, pDescriptorGLES->textureColorBuffers);
-	glDeleteTextures(1, &pDescriptorGLES->textureAdjCoef);
-	glDeleteTextures(1, &pDescriptorGLES->textureMask);
-
-	glDeleteBuffers(4, pDescriptorGLES->renderBuffers);
-	glDeleteBuffers(4, pDescriptorGLES->pixelBuffer);
+	glDeleteTextures(4, pDescriptorGLES->textureMasks);
+	glDeleteTextures(1, &pDescriptorGLES->textureMaskPano);
 
 	// delete buffer and vertex array
 	glDeleteBuffers(1, &pDescriptorGLES->VBO);
 	glDeleteVertexArrays(1, &pDescriptorGLES->VAO);
 
-	// delete GLES
-	eglMakeCurrent(pDescriptorGLES->eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-	eglDestroyContext(pDescriptorGLES->eglDisplay, pDescriptorGLES->eglContext);
-	eglDestroySurface(pDescriptorGLES->eglDisplay, pDescriptorGLES->eglSurface);
-	eglTerminate(pDescriptorGLES->eglDisplay);
+	return 0;
+}
 
-	pDescriptorGLES->eglDisplay = EGL_NO_DISPLAY;
-	pDescriptorGLES->eglSurface = EGL_NO_SURFACE;
-	pDescriptorGLES->eglContext = EGL_NO_CONTEXT;
+// the seam sums are exact integers: RGBA32UI targets are color renderable in GLES 3.0 core, float ones are not,
+// so the gains travel as float bits too. the integers must be highp, mediump ones may well be 16 bit.
+// each pass sums 4 x 4 blocks, so every fragment does 16 fetches and a strip takes log4 of its size in passes
+// glesFullPano has no warped quadrants, the strips are drawn out of the merged mesh with its vertex shader
+static const GLchar *glesSeamStripFragmentShaderSrc = "#version 300 es\n"
+	"precision mediump float;\n"
+	"in highp vec3 Front;\n"
+	"in highp vec3 Back;\n"
+	"in vec2 MaskCoords;\n"
+	"out vec4 color;\n"
+	"uniform sampler2D textureFront;\n"
+	"uniform sampler2D textureBack;\n"
+	"uniform bool isBack;\n"
+
+	"void main()\n"
+	"{\n"
+	"color = isBack ? Back.z * texture(textureBack, Back.xy) : Front.z * texture(textureFront, Front.xy);\n"
+	"color = color.bgra;\n"
+	"}";
+
+static const GLchar *glesSeamBlockSumFragmentShaderSrc = "#version 300 es\n"
+	"precision highp float;\n"
+	"precision highp int;\n"
+	"uniform sampler2D ourtexture;\n"
+	"uniform ivec2 stripOrigin;\n"    // the seam strip in ourtexture
+	"uniform ivec2 stripSize;\n"
+	"uniform int bandX;\n"            // first column of the band of this strip
+	"out uvec4 color;\n"
+
+	"void main()\n"
+	"{\n"
+	"ivec2 block = 4 * ivec2(int(gl_FragCoord.x) - bandX, int(gl_FragCoord.y));\n"
+	"uvec3 sum = uvec3(0u);\n"
+	"for (int j = 0; j < 4; ++j)\n"
+	"for (int i = 0; i < 4; ++i)\n"
+	"{\n"
+	"ivec2 p = block + ivec2(i, j);\n"
+	"if (p.x < stripSize.x && p.y < stripSize.y)\n"
+	"sum += uvec3(texelFetch(ourtexture, stripOrigin + p, 0).rgb * 255.0 + 0.5);\n"
+	"}\n"
+	"color = uvec4(sum, 0u);\n"
+	"}";
+
+static const GLchar *glesSeamLevelSumFragmentShaderSrc = "#version 300 es\n"
+	"precision highp float;\n"
+	"precision highp int;\n"
+	"uniform highp usampler2D blockSums;\n"
+	"uniform ivec2 srcSize;\n"        // blocks of a band in the level before
+	"uniform int dstW;\n"             // blocks of a band in this level
+	"out uvec4 color;\n"
+
+	"void main()\n"
+	"{\n"
+	"int band = int(gl_FragCoord.x) / dstW;\n"
+	"ivec2 block = 4 * ivec2(int(gl_FragCoord.x) - band * dstW, int(gl_FragCoord.y));\n"
+	"uvec4 sum = uvec4(0u);\n"
+	"for (int j = 0; j < 4; ++j)\n"
+	"for (int i = 0; i < 4; ++i)\n"
+	"{\n"
+	"ivec2 p = block + ivec2(i, j);\n"
+	"if (p.x < srcSize.x && p.y < srcSize.y)\n"
+	"sum += texelFetch(blockSums, ivec2(band * srcSize.x + p.x, p.y), 0);\n"
+	"}\n"
+	"color = sum;\n"
+	"}";
+
+// colorAdjusterPair::colorCoeffSectionsPair and colorCoeffScanline: the darker lens is adjusted, section s gets the
+// gains of the quadrant pair (2s, 2s + 1) and the last quarter of section 0 fades into the first quarter of section 1
+static const GLchar *glesAdjCoefFragmentShaderSrc = "#version 300 es\n"
+	"precision highp float;\n"
+	"precision highp int;\n"
+	"uniform highp usampler2D seamSums;\n"
+	"uniform int height;\n"     // rows of the quadrants
+	"out uvec4 color;\n"
+
+	"vec3 sums(int quadrant)\n"
+	"{\n"
+	"return vec3(texelFetch(seamSums, ivec2(quadrant, 0), 0).rgb);\n"
+	"}\n"
+
+	"void main()\n"
+	"{\n"
+	"float lens[2] = float[2](0.0, 0.0);\n"
+	"for (int q = 0; q < 8; ++q)\n"
+	"lens[q / 4] += dot(sums(q), vec3(1.0));\n"
+	"bool isBackAdjusted = lens[0] > lens[1];\n"
+	"int ref = isBackAdjusted ? 0 : 4;\n"
+	"int adj = 4 - ref;\n"
+
+	"vec3 sections[2];\n"
+	"for (int s = 0; s < 2; ++s)\n"
+	"{\n"
+	"vec3 refSum = sums(ref + 2 * s) + sums(ref + 2 * s + 1);\n"
+	"vec3 adjSum = sums(adj + 2 * s) + sums(adj + 2 * s + 1);\n"
+	"sections[s] = mix(refSum / max(adjSum, vec3(1.0)), vec3(1.0), vec3(equal(adjSum, vec3(0.0))));\n"
+	"}\n"
+
+	"int s = int(gl_FragCoord.x);\n"
+	"int row = int(gl_FragCoord.y);\n"
+	"int transition = height / 4;\n"
+	"vec3 gain = sections[s];\n"
+	"if (transition > 0 && row < transition)\n"
+	"{\n"
+	"vec3 target = (sections[max(s - 1, 0)] + gain) / 2.0;\n"
+	"gain = float(row) / float(transition) * (gain - target) + target;\n"
+	"}\n"
+	"else if (transition > 0 && row >= height - transition)\n"
+	"{\n"
+	"vec3 target = (gain + sections[min(s + 1, 1)]) / 2.0;\n"
+	"gain = float(height - row) / float(transition) * (gain - target) + target;\n"
+	"}\n"
+	"color = uvec4(floatBitsToUint(gain), isBackAdjusted ? 1u : 0u);\n"
+	"}";
+
+static GLuint genIntegerTextureGLES(GLsizei width, GLsizei height)
+{// RGBA32UI, only read by texelFetch
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32UI, width, height, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return texture;
+}
+
+int fisheyePanoStitcherComp::initColorSummaryGLES(DescriptorGLES *pDescriptorGLES)
+{// the seam rois of all 8 warped quadrants are alike
+	pDescriptorGLES->seamLevelNum = 0;
+	pDescriptorGLES->textureAdjCoef = 0;
+	pDescriptorGLES->textureSeamStrips = 0;
+	if (pDescriptorGLES->colorAdjust == GL_FALSE)
+		return 0;
+
+	int seamX = (pSeamRois[0].roiX < 0) ? 0 : pSeamRois[0].roiX;
+	int seamW = (seamX + pSeamRois[0].roiW > pDescriptorGLES->widthDst) ? pDescriptorGLES->widthDst - seamX : pSeamRois[0].roiW;
+	pDescriptorGLES->seamX = seamX;
+	pDescriptorGLES->seamW = seamW;
+
+	if (pDescriptorGLES->renderMode == glesFullPano)
+	{
+		glGenTextures(1, &pDescriptorGLES->textureSeamStrips);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSeamStrips);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 8 * seamW, pDescriptorGLES->heightDst, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		pDescriptorGLES->shaderSeamStrip.init(pDescriptorGLES->vertexShaderFullPanoSrc, glesSeamStripFragmentShaderSrc);
+		pDescriptorGLES->shaderSeamStrip.Use();
+		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderSeamStrip.Program, "textureFront"), 0);
+		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderSeamStrip.Program, "textureBack"), 1);
+	}
 
+	// block sum levels down to a single block per band
+	int levelW = seamW, levelH = pDescriptorGLES->heightDst;
+	do
+	{
+		levelW = (levelW + 3) / 4;
+		levelH = (levelH + 3) / 4;
+		int k = pDescriptorGLES->seamLevelNum++;
+		pDescriptorGLES->seamLevelW[k] = levelW;
+		pDescriptorGLES->seamLevelH[k] = levelH;
+		pDescriptorGLES->textureSeamLevels[k] = genIntegerTextureGLES(8 * levelW, levelH);
+	} while (levelW > 1 || levelH > 1);
+
+	pDescriptorGLES->shaderSeamBlockSum.init(pDescriptorGLES->vertexShaderColorAdjSrc, glesSeamBlockSumFragmentShaderSrc);
+	pDescriptorGLES->shaderSeamBlockSum.Use();
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderSeamBlockSum.Program, "ourtexture"), 0);
+	glUniform2i(glGetUniformLocation(pDescriptorGLES->shaderSeamBlockSum.Program, "stripSize"), seamW, pDescriptorGLES->heightDst);
+
+	pDescriptorGLES->shaderSeamLevelSum.init(pDescriptorGLES->vertexShaderColorAdjSrc, glesSeamLevelSumFragmentShaderSrc);
+	pDescriptorGLES->shaderSeamLevelSum.Use();
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderSeamLevelSum.Program, "blockSums"), 0);
+
+	pDescriptorGLES->shaderAdjCoef.init(pDescriptorGLES->vertexShaderColorAdjSrc, glesAdjCoefFragmentShaderSrc);
+	pDescriptorGLES->shaderAdjCoef.Use();
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderAdjCoef.Program, "seamSums"), 0);
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderAdjCoef.Program, "height"), pDescriptorGLES->heightDst);
+
+	glUseProgram(0);
+
+	pDescriptorGLES->textureAdjCoef = genIntegerTextureGLES(2, pDescriptorGLES->heightDst);    // top and bottom quadrants
 	return 0;
 }
 
-int fisheyePanoStitcherComp::initColorAdjCoefGLES(colorAdjustTarget *pColorAdjTarget, ImageBlender *pImageBlender, DescriptorGLES *pDescriptorGLES)
-{// initial data for color adjust and blend, include explore weight, color coefficient, blend mask;
+int fisheyePanoStitcherComp::deInitColorSummaryGLES(DescriptorGLES *pDescriptorGLES)
+{
+	if (pDescriptorGLES->colorAdjust == GL_FALSE)
+		return 0;
+
+	glDeleteTextures(pDescriptorGLES->seamLevelNum, pDescriptorGLES->textureSeamLevels);
+	pDescriptorGLES->seamLevelNum = 0;
+	glDeleteTextures(1, &pDescriptorGLES->textureAdjCoef);
+	pDescriptorGLES->textureAdjCoef = 0;
+	if (pDescriptorGLES->renderMode == glesFullPano)
+	{
+		glDeleteTextures(1, &pDescriptorGLES->textureSeamStrips);
+		glDeleteProgram(pDescriptorGLES->shaderSeamStrip.Program);
+	}
+	glDeleteProgram(pDescriptorGLES->shaderSeamBlockSum.Program);
+	glDeleteProgram(pDescriptorGLES->shaderSeamLevelSum.Program);
+	glDeleteProgram(pDescriptorGLES->shaderAdjCoef.Program);
+	return 0;
+}
+
+int fisheyePanoStitcherComp::colorSummaryGLES(DescriptorGLES *pDescriptorGLES)
+{// the seam strips are summed up by 4 x 4 blocks, level by level down to 8 x 1, then the gain of each row is solved.
+ // the blend passes read the gains straight from textureAdjCoef, nothing comes back to the cpu
+	glBindFramebuffer(GL_FRAMEBUFFER, pDescriptorGLES->framebuffer);
+	glDrawBuffers(1, &pDescriptorGLES->attachmentpoints[0]);
+	bool isFullPano = (pDescriptorGLES->renderMode == glesFullPano);
+	int seamW = pDescriptorGLES->seamW;
+
+	if (isFullPano)
+	{// strip i is the seam roi of warper i: the pano is drawn with its quadrant seam moved onto the strip, the rest is scissored away
+		glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureSeamStrips, 0);
+		pDescriptorGLES->shaderSeamStrip.Use();
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSrcFull[0]);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSrcFull[1]);
+		glBindVertexArray(pDescriptorGLES->fullVAO);
+		glEnable(GL_SCISSOR_TEST);
+		for (int i = 0; i != 8; ++i)
+		{
+			int quadrant = i % 4;
+			glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderSeamStrip.Program, "isBack"), i / 4);
+			glViewport(i * seamW - (quadrant % 2) * pDescriptorGLES->widthDst - pDescriptorGLES->seamX, -(quadrant / 2) * pDescriptorGLES->heightDst,
+				pDescriptorGLES->readTileW, pDescriptorGLES->readTileH);
+			glScissor(i * seamW, 0, seamW, pDescriptorGLES->heightDst);
+			glDrawElements(GL_TRIANGLES, pDescriptorGLES->fullIndicesAmount, pDescriptorGLES->fullIndicesType, 0);
+		}
+		glDisable(GL_SCISSOR_TEST);
+	}
+
+	glBindVertexArray(pDescriptorGLES->VAO);
+	glActiveTexture(GL_TEXTURE0);
 
-	//process the color coefficient;
-	int coefLen = pColorAdjTarget->coeffsLen[0];
-	pDescriptorGLES->coefRGB = new float[coefLen * 3]; // for R,G,B three channel;
-	float *coefR = pColorAdjTarget->coeffs[0];
-	float *coefG = pColorAdjTarget->coeffs[1];
-	float *coefB = pColorAdjTarget->coeffs[2];
+	// level 0, a band of blocks per warped quadrant
+	glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureSeamLevels[0], 0);
+	pDescriptorGLES->shaderSeamBlockSum.Use();
+	GLint bandXLoc = glGetUniformLocation(pDescriptorGLES->shaderSeamBlockSum.Program, "bandX");
+	GLint stripOriginLoc = glGetUniformLocation(pDescriptorGLES->shaderSeamBlockSum.Program, "stripOrigin");
+	for (int i = 0; i != 8; ++i)
+	{
+		glUniform1i(bandXLoc, i * pDescriptorGLES->seamLevelW[0]);
+		glUniform2i(stripOriginLoc, isFullPano ? i * seamW : pDescriptorGLES->seamX, 0);
+		glViewport(i * pDescriptorGLES->seamLevelW[0], 0, pDescriptorGLES->seamLevelW[0], pDescriptorGLES->seamLevelH[0]);
+		glBindTexture(GL_TEXTURE_2D, isFullPano ? pDescriptorGLES->textureSeamStrips : pDescriptorGLES->textureColorBuffers[i]);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+	}
 
-	for (int i = 0; i != coefLen; ++i)
+	// all 8 bands of a level in one draw
+	pDescriptorGLES->shaderSeamLevelSum.Use();
+	for (int k = 1; k < pDescriptorGLES->seamLevelNum; ++k)
 	{
-		pDescriptorGLES->coefRGB[3 * i + 0] = coefR[i];
-		pDescriptorGLES->coefRGB[3 * i + 1] = coefG[i];
-		pDescriptorGLES->coefRGB[3 * i + 2] = coefB[i];
+		glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureSeamLevels[k], 0);
+		glUniform2i(glGetUniformLocation(pDescriptorGLES->shaderSeamLevelSum.Program, "srcSize"), pDescriptorGLES->seamLevelW[k - 1], pDescriptorGLES->seamLevelH[k - 1]);
+		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderSeamLevelSum.Program, "dstW"), pDescriptorGLES->seamLevelW[k]);
+		glViewport(0, 0, 8 * pDescriptorGLES->seamLevelW[k], pDescriptorGLES->seamLevelH[k]);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSeamLevels[k - 1]);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
 	}
 
+	glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureAdjCoef, 0);
+	pDescriptorGLES->shaderAdjCoef.Use();
+	glViewport(0, 0, 2, pDescriptorGLES->heightDst);
+	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSeamLevels[pDescriptorGLES->seamLevelNum - 1]);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindVertexArray(0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	return 0;
 }
 
-int fisheyePanoStitcherComp::deInitColorAdjCoefGLES(DescriptorGLES *pDescriptorGLES)
+int fisheyePanoStitcherComp::getColorAdjustGains(float *pGains, bool *pIsBackAdjusted)
 {
-	delete[] pDescriptorGLES->coefRGB;
+	if (mDescriptorGL.isInitialized == GL_FALSE || mDescriptorGL.colorAdjust == GL_FALSE || makeCurrentGLES(&mDescriptorGL) != 0)
+		return -1;
+
+	int height = mDescriptorGL.heightDst;
+	std::vector<GLuint> coefs(2 * 4 * height);
+	glBindFramebuffer(GL_FRAMEBUFFER, mDescriptorGL.framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, mDescriptorGL.attachmentpoints[0], GL_TEXTURE_2D, mDescriptorGL.textureAdjCoef, 0);
+	glReadBuffer(mDescriptorGL.attachmentpoints[0]);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, 2, height, GL_RGBA_INTEGER, GL_UNSIGNED_INT, &coefs[0]);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	for (int s = 0; s != 2; ++s)
+		for (int row = 0; row != height; ++row)
+			memcpy(pGains + (s * height + row) * 3, &coefs[(row * 2 + s) * 4], 3 * sizeof(float));
+	*pIsBackAdjusted = (coefs[3] != 0);
 	return 0;
 }
 
+
 int fisheyePanoStitcherComp::colorAdjustRGBChnScanlineGLES(/*imageFrame *pImageFrame, colorAdjustTarget *pColorAdjTarget, colorAdjusterPair *pColorAdjPair,*/ ImageBlender *pImageBlender, DescriptorGLES *pDescriptorGLES, int idx)
 {// adjust the image between borders using the coefficients which has same length of the image
  // and the weights is the exposure curbs
 
-	// texture Mask
-	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureMask);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, pImageBlender->mSizeW/*pDescriptorGLES->widthDst*/, pImageBlender->mSizeH/*pDescriptorGLES->heightDst*/,
-		GL_RED, GL_UNSIGNED_BYTE, pImageBlender->pMaskY);
-	glBindTexture(GL_TEXTURE_2D, 0);
-
 	//bind framebuffer
 	glBindFramebuffer(GL_FRAMEBUFFER, pDescriptorGLES->framebuffer);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], 
-		GL_RENDERBUFFER, pDescriptorGLES->renderBuffers[idx % 4]);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0],
+		GL_TEXTURE_2D, pDescriptorGLES->textureBlended[idx % 4], 0);
 	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
 		std::cout << "Framebuffer is not complete! " << "colorAdjustRGBChnScanlineGLES: " << idx << std::endl;
 
@@ -911,154 +2062,700 @@ int fisheyePanoStitcherComp::colorAdjustRGBChnScanlineGLES(/*imageFrame *pImageF
 	//shader use
 	pDescriptorGLES->shaderColorAdj.Use();
 
-	//pass texture
+	//pass texture, sampler units are bound in initWarpGLES
 	if (idx < 4)
 	{// [0, 1, 2, 3]
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureColorBuffers[idx + 4]);
-		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "ourtexture0"), 0);
 		glActiveTexture(GL_TEXTURE1);
 		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureColorBuffers[idx]);
-		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "ourtexture1"), 1);
 	}
 	else
 	{// [4, 5, 6, 7]
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureColorBuffers[idx]);
-		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "ourtexture0"), 0);
 		glActiveTexture(GL_TEXTURE1);
 		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureColorBuffers[idx - 4]);
-		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "ourtexture1"), 1);
+	}
+
+	if (pDescriptorGLES->blendBands > 1)
+	{// both warped quadrants are complete here, their mips are the bands
+		glActiveTexture(GL_TEXTURE0);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glActiveTexture(GL_TEXTURE1);
+		glGenerateMipmap(GL_TEXTURE_2D);
 	}
 
 	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureMask);
-	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "ourMask"), 2);
+	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureMasks[idx % 4]);
+	if (pDescriptorGLES->colorAdjust)
+	{// quadrants 0, 1 are the top coefficient section, 2, 3 the bottom one
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureAdjCoef);
+		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderColorAdj.Program, "coefColumn"), (idx % 4) / 2);
+		glActiveTexture(GL_TEXTURE0);
+	}
 
 	// bind VAO
 	glBindVertexArray(pDescriptorGLES->VAO);
 	glDrawBuffers(1, &pDescriptorGLES->attachmentpoints[0/*idx % 4*/]);
 	glDrawArrays(GL_TRIANGLES, 0, 6);
 	glBindVertexArray(0);
-	
-	
-	// read pixel data
-	glReadBuffer(pDescriptorGLES->attachmentpoints[0/*idx % 4*/]);
-
-	// Bind PBO;
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescriptorGLES->pixelBuffer[idx % 4]);
-	// can not read pixels in rgb format , so read rgba and transform to rgb;
-	glReadPixels(0, 0, pDescriptorGLES->widthDst, pDescriptorGLES->heightDst, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	glFinish();
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	return 0;
 }
 
-int fisheyePanoStitcherComp::storePanoImagePBO(imageFrame *panoImage, DescriptorGLES *pDescirptorGL)
-{// NOT SAVE RGB BUT RGBA IN THE PANOIMAGE, BECAUSE RGBA2RGB IS TOO SLOW;
-//#define RGBA
-#ifdef RGBA
-	GLint strideQuaRGBA = pDescirptorGL->widthDst * 4; // stride of quarter image;
-	GLint stridePanoRGBA = panoImage->imageW * 4;
-	unsigned char *panoQuaImageRGBA[4]; // pointer to address of 4 quarter image;
-	panoQuaImageRGBA[0] = panoImage->plane[0];
-	panoQuaImageRGBA[1] = panoQuaImageRGBA[0] + stridePanoRGBA / 2;
-	panoQuaImageRGBA[2] = panoQuaImageRGBA[0] + stridePanoRGBA * panoImage->imageH / 2;
-	panoQuaImageRGBA[3] = panoQuaImageRGBA[2] + stridePanoRGBA / 2;
-	
-#else
-	unsigned char *tempBuffer = new unsigned char[pDescirptorGL->widthDst * pDescirptorGL->heightDst * 3];
-	unsigned char *renderedImage[4] = { tempBuffer, tempBuffer, tempBuffer, tempBuffer };
-	unsigned char *panoQuaImage[4]; // pointer to address of 4 quarter image;
-	panoQuaImage[0] = panoImage->plane[0];
-	panoQuaImage[1] = panoQuaImage[0] + panoImage->strides[0] / 2;
-	panoQuaImage[2] = panoQuaImage[0] + panoImage->strides[0] * panoImage->imageH / 2;
-	panoQuaImage[3] = panoQuaImage[2] + panoImage->strides[0] / 2;
-	GLint strideQuaRGB = pDescirptorGL->widthDst * 3; // stride of quarter image;
-#endif // RGBA
-	
-	GLubyte *pRGBQua[4] = { NULL };
+int fisheyePanoStitcherComp::alignSeamsOptFlowGLES(DescriptorGLES *pDescriptorGLES)
+{// the only synchronous readback of the frame, but of the narrow seam strips only.
+ // the 4 quadrant pairs are independent, so their flows run in parallel
+	glBindFramebuffer(GL_FRAMEBUFFER, pDescriptorGLES->framebuffer);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	for (int i = 0; i != 8; ++i)
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureColorBuffers[i], 0);
+		glReadBuffer(pDescriptorGLES->attachmentpoints[0]);
+		// the strip rows are padded, pooled frames
+		glPixelStorei(GL_PACK_ROW_LENGTH, mSeamStrips[i].strides[0] / 4);
+		glReadPixels(pSeamRois[i].roiX, pSeamRois[i].roiY, pSeamRois[i].roiW, pSeamRois[i].roiH, GL_RGBA, GL_UNSIGNED_BYTE, mSeamStrips[i].plane[0]);
+	}
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-	for (int i = 0; i != 4; ++i)
+	ThreadPool::getDefault()->parallelFor(0, 4, [&](int begin, int end) {
+		for (int i = begin; i != end; ++i)
+		{
+			if (mSeamOptFlow[i].computeImageFlow(mSeamStrips[i], mSeamStrips[i + 4]) != 0)
+				continue;
+			mSeamOptFlow[i].genWarpMap();
+			mSeamOptFlow[i].genNovalImage(mSeamStrips[i], mSeamStrips[i + 4]);
+		}
+	});
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int i = 0; i != 8; ++i)
 	{
-		glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescirptorGL->pixelBuffer[i]);
-		pRGBQua[i] = (GLubyte*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, NULL, pDescirptorGL->widthDst * pDescirptorGL->heightDst * sizeof(GLubyte) * 4, GL_MAP_READ_BIT);
-		if (pRGBQua[i] != NULL)
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureColorBuffers[i]);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, mSeamStrips[i].strides[0] / 4);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, pSeamRois[i].roiX, pSeamRois[i].roiY, pSeamRois[i].roiW, pSeamRois[i].roiH, GL_RGBA, GL_UNSIGNED_BYTE, mSeamStrips[i].plane[0]);
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return 0;
+}
+
+int readQuadrantGLES(DescriptorGLES *pDescriptorGLES, int quadrant)
+{// yuv is packed on the GPU, so only w * h * 3 / 2 bytes cross the bus; rgb has to be read as rgba
+	bool isYUV = (pDescriptorGLES->outputFormat == PIXELCOLORSPACE_YUV420PYV || pDescriptorGLES->outputFormat == PIXELCOLORSPACE_NV12);
+	GLint readW = isYUV ? pDescriptorGLES->readTileW / 4 : pDescriptorGLES->readTileW;
+	GLint readH = isYUV ? pDescriptorGLES->readTileH * 3 / 2 : pDescriptorGLES->readTileH;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, pDescriptorGLES->framebuffer);
+	if (isYUV)
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureYUV, 0);
+		glViewport(0, 0, readW, readH);
+
+		pDescriptorGLES->shaderYUV.Use();
+		glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderYUV.Program, "yuvLayout"), pDescriptorGLES->outputFormat == PIXELCOLORSPACE_NV12 ? 1 : 0);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureBlended[quadrant]);
+
+		glBindVertexArray(pDescriptorGLES->VAO);
+		glDrawBuffers(1, &pDescriptorGLES->attachmentpoints[0]);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+		glBindVertexArray(0);
+	}
+	else
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureBlended[quadrant], 0);
+	}
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Framebuffer is not complete! " << "readQuadrantGLES: " << quadrant << std::endl;
+
+	glReadBuffer(pDescriptorGLES->attachmentpoints[0]);
+
+	// Bind PBO of the current ring slot, the read is asynchronous and fenced in imageStitch;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescriptorGLES->pbosRead[pDescriptorGLES->curPBORead][quadrant]);
+	glReadPixels(0, 0, readW, readH, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return 0;
+}
+
+int storePanoImagePBO(imageFrame *panoImage, DescriptorGLES *pDescirptorGL, int slot)
+{// the mapped quadrants are written straight into the pano planes, no intermediate buffer
+	GLint quaW = pDescirptorGL->readTileW;
+	GLint quaH = pDescirptorGL->readTileH;
+	ePixelColorSpace format = pDescirptorGL->outputFormat;
+	GLint nBytesRead = (format == PIXELCOLORSPACE_YUV420PYV || format == PIXELCOLORSPACE_NV12) ? quaW * quaH * 3 / 2 : quaW * quaH * 4;
+
+	for (GLuint i = 0; i != pDescirptorGL->readTiles; ++i)
+	{
+		int quaX = (i % 2) * quaW;  // quadrant origin in the pano
+		int quaY = (i / 2) * quaH;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescirptorGL->pbosRead[slot][i]);
+		const GLubyte *pQua = (const GLubyte*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, nBytesRead, GL_MAP_READ_BIT);
+		if (pQua == NULL)
 		{
-#ifdef RGBA
-			for (int h = 0; h != pDescirptorGL->heightDst; ++h)
-			{
-				memcpy(panoQuaImageRGBA[i], pRGBQua[i], sizeof(unsigned char) * strideQuaRGBA);
-				pRGBQua[i] += strideQuaRGBA;
-				panoQuaImageRGBA[i] += stridePanoRGBA;
+			std::cout << "glMapBuffer failed, error code: " << glGetError() << std::endl;
+			continue;
+		}
+
+		switch (format)
+		{
+		case PIXELCOLORSPACE_RGB:
+			rgba2rgb(pQua, quaW * 4, panoImage->plane[0] + quaY * panoImage->strides[0] + quaX * 3, panoImage->strides[0], quaW, quaH);
+			break;
+
+		case PIXELCOLORSPACE_RGBA:
+		{
+			unsigned char *pDst = panoImage->plane[0] + quaY * panoImage->strides[0] + quaX * 4;
+			for (int h = 0; h != quaH; ++h, pQua += quaW * 4, pDst += panoImage->strides[0])
+				memcpy(pDst, pQua, quaW * 4);
+			break;
+		}
+
+		case PIXELCOLORSPACE_YUV420PYV:
+		case PIXELCOLORSPACE_NV12:
+		{
+			unsigned char *pDst = panoImage->plane[0] + quaY * panoImage->strides[0] + quaX;
+			for (int h = 0; h != quaH; ++h, pQua += quaW, pDst += panoImage->strides[0])
+				memcpy(pDst, pQua, quaW);
+
+			if (format == PIXELCOLORSPACE_NV12)
+			{// interleaved u/v rows are as wide as the luma rows
+				pDst = panoImage->plane[1] + quaY / 2 * panoImage->strides[1] + quaX;
+				for (int h = 0; h != quaH / 2; ++h, pQua += quaW, pDst += panoImage->strides[1])
+					memcpy(pDst, pQua, quaW);
 			}
-#else
-			rgba2rgb(pRGBQua[i], renderedImage[i], pDescirptorGL->widthDst, pDescirptorGL->heightDst);
-			for (int h = 0; h != pDescirptorGL->heightDst; ++h)
+			else
 			{
-				memcpy(panoQuaImage[i], renderedImage[i], sizeof(unsigned char) * strideQuaRGB);
-				renderedImage[i] += strideQuaRGB;
-				panoQuaImage[i] += panoImage->strides[0];
+				for (int c = 1; c != 3; ++c)
+				{
+					pDst = panoImage->plane[c] + quaY / 2 * panoImage->strides[c] + quaX / 2;
+					for (int h = 0; h != quaH / 2; ++h, pQua += quaW / 2, pDst += panoImage->strides[c])
+						memcpy(pDst, pQua, quaW / 2);
+				}
 			}
-#endif // RGBA
-			
-		}	
-		else
-		{
-			std::cout << "glMapBuffer failed" << std::endl;
-			GLuint error = glGetError();
+			break;
+		}
+
+		default:
+			break;
 		}
 		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
 	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-	delete[] tempBuffer;
 	return 0;
 }
 
+int readOldestFrameGLES(imageFrame *panoImage, DescriptorGLES *pDescriptorGLES)
+{// the oldest frame in flight sits framesInFlight slots behind the slot the next frame renders into
+	if (pDescriptorGLES->framesInFlight == 0)
+		return 1;
+
+	STITCH_PROFILE_SCOPE(profileReadback);
+	GLuint depth = pDescriptorGLES->pipelineDepth;
+	GLuint slot = (pDescriptorGLES->curPBORead + depth - pDescriptorGLES->framesInFlight) % depth;
+
+	// normally signaled already when the pipeline is deep enough, otherwise this is where the cpu waits for the GPU
+	GLsync fence = pDescriptorGLES->fencesRead[slot];
+	if (fence != 0)
+	{
+		GLenum waitResult = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		if (waitResult == GL_WAIT_FAILED)
+			std::cout << "readOldestFrameGLES: glClientWaitSync failed" << std::endl;
+		glDeleteSync(fence);
+		pDescriptorGLES->fencesRead[slot] = 0;
+	}
+
+	storePanoImagePBO(panoImage, pDescriptorGLES, slot);
+	pDescriptorGLES->framesInFlight--;
+
+	return 0;
+}
+
+int fisheyePanoStitcherComp::flushStitch(imageFrame panoImage)
+{
+	if (mDescriptorGL.isInitialized == GL_FALSE || makeCurrentGLES(&mDescriptorGL) != 0)
+		return -1;
+
+	if (mDescriptorGL.framesInFlight != 0 && panoImage.pxlColorFormat != mDescriptorGL.outputFormat)
+	{
+		std::cout << "flushStitch: frames in flight are read back as format " << mDescriptorGL.outputFormat << std::endl;
+		return -1;
+	}
+
+	return readOldestFrameGLES(&panoImage, &mDescriptorGL);
+}
+
 int fisheyePanoStitcherComp::imageStitch(imageFrame fisheyeImage[2], imageFrame panoImage)  // warping, color adjusting, blending, extra warping
 {
-    unsigned char *ptrSeamL = NULL;
-    unsigned char *ptrSeamR = NULL;
-    int gap;
+	STITCH_PROFILE_NEXT_FRAME();
+	STITCH_PROFILE_SCOPE(profileFrame);
 
-	// image warping
-	initWarpGLES(mImageWarperB, &mDescriptorGL);
+	if (mGLESSessionMode == glesSingleShot)
+	{// the whole GLES context is built for this frame only
+		STITCH_PROFILE_SCOPE(profileSetup);
+		if (initStitchGLES() != 0)
+			return -1;
+	}
+	else if (mDescriptorGL.isInitialized == GL_FALSE || makeCurrentGLES(&mDescriptorGL) != 0)
+	{
+		return -1;
+	}
+	STITCH_GPU_TIMER_COLLECT(&mGpuTimer);
 
-	warpImageGLES(&mImageWarperB[0], &mDescriptorGL, &fisheyeImage[0], 0);
-	warpImageGLES(&mImageWarperB[1], &mDescriptorGL, &fisheyeImage[0], 1);
-	warpImageGLES(&mImageWarperB[2], &mDescriptorGL, &fisheyeImage[0], 2);
-	warpImageGLES(&mImageWarperB[3], &mDescriptorGL, &fisheyeImage[0], 3);
-												  					
-	warpImageGLES(&mImageWarperB[4], &mDescriptorGL, &fisheyeImage[1], 4);
-	warpImageGLES(&mImageWarperB[5], &mDescriptorGL, &fisheyeImage[1], 5);
-	warpImageGLES(&mImageWarperB[6], &mDescriptorGL, &fisheyeImage[1], 6);
-	warpImageGLES(&mImageWarperB[7], &mDescriptorGL, &fisheyeImage[1], 7);
+	// the pano frame decides the output format; it may only change while no frame is in flight
+	if (panoImage.pxlColorFormat != mDescriptorGL.outputFormat)
+	{
+		bool isYUV = (panoImage.pxlColorFormat == PIXELCOLORSPACE_YUV420PYV || panoImage.pxlColorFormat == PIXELCOLORSPACE_NV12);
+		if (mDescriptorGL.framesInFlight != 0 || setOutputFormat(panoImage.pxlColorFormat) != 0 ||
+			(isYUV && (mDescriptorGL.readTileW % 4 != 0 || mDescriptorGL.readTileH % 2 != 0)))
+		{
+			std::cout << "imageStitch: can not output format " << panoImage.pxlColorFormat << std::endl;
+			if (mGLESSessionMode == glesSingleShot)
+				deInitStitchGLES();
+			return -1;
+		}
+		mDescriptorGL.outputFormat = panoImage.pxlColorFormat;
+	}
 
-    __android_log_print(ANDROID_LOG_ERROR,"libstitch","dinit warp gles");
+	if (mDescriptorGL.renderMode == glesFullPano)
+	{// whole frames in, one draw, one readback
+		for (int i = 0; i != 2; ++i)
+		{
+			imageRoi wholeFrame;
+			wholeFrame.imgW = wholeFrame.roiW = mImageWarperB[4 * i].mSrcImageW;
+			wholeFrame.imgH = wholeFrame.roiH = mImageWarperB[4 * i].mSrcImageH;
+			wholeFrame.roiX = wholeFrame.roiY = 0;
+			STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileUpload);
+			uploadSrcImageGLES(&wholeFrame, mDescriptorGL.textureSrcFull[i], &mDescriptorGL, &fisheyeImage[i]);
+			STITCH_GPU_TIMER_END(&mGpuTimer);
+		}
 
-    deinitWarpGLES(&mDescriptorGL);
+		if (mDescriptorGL.colorAdjust)
+		{
+			STITCH_PROFILE_SCOPE(profileColorAdjust);
+			STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileColorAdjust);
+			colorSummaryGLES(&mDescriptorGL);
+			STITCH_GPU_TIMER_END(&mGpuTimer);
+		}
 
-    __android_log_print(ANDROID_LOG_ERROR,"libstitch","init color adj blend gles");
+		{// warp, color adjust and blend are one draw, timed as the warp
+			STITCH_PROFILE_SCOPE(profileWarp);
+			STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileWarp);
+			stitchFullPanoGLES(&mDescriptorGL);
+			STITCH_GPU_TIMER_END(&mGpuTimer);
+		}
 
-	// color adjust and blending;
-	initColAdjBlendGLES(mImageBlender, &mDescriptorGL);
+		STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileReadback);
+		readQuadrantGLES(&mDescriptorGL, 0);
+		STITCH_GPU_TIMER_END(&mGpuTimer);
+	}
+	else
+	{
+		// image warping, warpers 0 & 1 (2 & 3, ...) read the same source roi, so it is uploaded once for both
+		for (int i = 0; i != 8; ++i)
+		{
+			imageRoi *pRoi = &mImageWarperB[i].mSrcImageRoi;
+			imageRoi *pPrevRoi = (i % 4 != 0) ? &mImageWarperB[i - 1].mSrcImageRoi : NULL;
+			if (pPrevRoi == NULL || pRoi->roiX != pPrevRoi->roiX || pRoi->roiY != pPrevRoi->roiY || pRoi->roiW != pPrevRoi->roiW || pRoi->roiH != pPrevRoi->roiH)
+			{
+				STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileUpload);
+				uploadSrcImageGLES(pRoi, mDescriptorGL.texture, &mDescriptorGL, &fisheyeImage[i / 4]);
+				STITCH_GPU_TIMER_END(&mGpuTimer);
+			}
 
-    __android_log_print(ANDROID_LOG_ERROR,"libstitch","color adjust rgb chn scanline gles");
-	colorAdjustRGBChnScanlineGLES(&mImageBlender[0], &mDescriptorGL, 4);
-	colorAdjustRGBChnScanlineGLES(&mImageBlender[1], &mDescriptorGL, 5);
-	colorAdjustRGBChnScanlineGLES(&mImageBlender[2], &mDescriptorGL, 6);
-	colorAdjustRGBChnScanlineGLES(&mImageBlender[3], &mDescriptorGL, 7);
+			STITCH_PROFILE_SCOPE(profileWarp);
+			STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileWarp);
+			warpImageGLES(&mImageWarperB[i], &mDescriptorGL, i);
+			STITCH_GPU_TIMER_END(&mGpuTimer);
+		}
 
-    __android_log_print(ANDROID_LOG_ERROR,"libstitch","store pano image");
-	storePanoImagePBO(&panoImage, &mDescriptorGL);
+		if (mDescriptorGL.seamOptFlow)
+		{
+			STITCH_PROFILE_SCOPE(profileSeamFlow);
+			alignSeamsOptFlowGLES(&mDescriptorGL);
+		}
 
-    __android_log_print(ANDROID_LOG_ERROR,"libstitch","d init col adj blend gles");
-    deInitColAdjBlendGLES(&mDescriptorGL);
+		if (mDescriptorGL.colorAdjust)
+		{
+			STITCH_PROFILE_SCOPE(profileColorAdjust);
+			STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileColorAdjust);
+			colorSummaryGLES(&mDescriptorGL);
+			STITCH_GPU_TIMER_END(&mGpuTimer);
+		}
 
-    return 0;
+		// color adjust and blending, one pass per quadrant
+		{
+			STITCH_PROFILE_SCOPE(profileBlend);
+			STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileBlend);
+			colorAdjustRGBChnScanlineGLES(&mImageBlender[0], &mDescriptorGL, 4);
+			colorAdjustRGBChnScanlineGLES(&mImageBlender[1], &mDescriptorGL, 5);
+			colorAdjustRGBChnScanlineGLES(&mImageBlender[2], &mDescriptorGL, 6);
+			colorAdjustRGBChnScanlineGLES(&mImageBlender[3], &mDescriptorGL, 7);
+			STITCH_GPU_TIMER_END(&mGpuTimer);
+		}
+
+		STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileReadback);
+		for (int i = 0; i != 4; ++i)
+			readQuadrantGLES(&mDescriptorGL, i);
+		STITCH_GPU_TIMER_END(&mGpuTimer);
+	}
+
+	// fence the readbacks of this frame and move on to the next ring slot
+	mDescriptorGL.fencesRead[mDescriptorGL.curPBORead] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+	mDescriptorGL.curPBORead = (mDescriptorGL.curPBORead + 1) % mDescriptorGL.pipelineDepth;
+	mDescriptorGL.framesInFlight++;
+
+	// only when the ring is full the oldest frame is stored, so its readback overlaps the frames submitted after it
+	int result = 1;
+	if (mDescriptorGL.framesInFlight == mDescriptorGL.pipelineDepth)
+		result = readOldestFrameGLES(&panoImage, &mDescriptorGL);
+
+	if (mGLESSessionMode == glesSingleShot)
+		deInitStitchGLES();
+
+	++mDescriptorGL.frameCount;
+
+	return result;
 }
 
 
+// rectilinear preview: the screen grid is projected per vertex, cameraMetadata::sph2cam and cam2img of both lenses
+// in the vertex shader, so the view is only a few uniforms. the ray to the pano sphere is linear over the screen and
+// interpolates exactly, the masks are looked up per fragment by its pano position since that wraps around at the back
+static const GLchar *glesPreviewVertexShaderSrc = "#version 300 es\n"
+	"layout(location = 0) in vec2 position;\n"     // viewport clip space, y up
+	"out highp vec2 FrontCoords;\n"
+	"out highp vec2 BackCoords;\n"
+	"out highp vec3 Ray;\n"
+	"out float FrontVignette;\n"
+	"out float BackVignette;\n"
+	"uniform highp mat3 view;\n"           // right, up and forward of the view on the pano sphere
+	"uniform highp vec2 tanHalfFov;\n"
+	"uniform highp mat3 world2Cam[2];\n"   // front, back lens
+	"uniform highp vec3 transCam[2];\n"    // world to camera translation over the sphere radius
+	"uniform highp vec3 affine[2];\n"      // c, d, e of the ocam model
+	"uniform highp vec4 center[2];\n"      // uc, vc (row, column of the image center), 1 / frame width, 1 / frame height
+	"uniform highp float invpol[20];\n"    // POL_LENGTH_INV coefficients per lens
+	"uniform int invpolLength[2];\n"
+	"uniform sampler2D vignetteFront;\n"  // see setPreviewVignetteGLES
+	"uniform sampler2D vignetteBack;\n"
+
+	"highp vec2 cam2tex(highp vec3 cam, int lens)\n"
+	"{\n"
+	"highp float norm = max(length(cam.xy), 1e-6);\n"
+	"highp float theta = atan(cam.z / norm);\n"
+	"highp float rho = 0.0;\n"
+	"for (int i = invpolLength[lens] - 1; i >= 0; --i)\n"
+	"rho = rho * theta + invpol[10 * lens + i];\n"
+	"highp vec2 xy = cam.xy * (rho / norm);\n"
+	"highp float row = xy.x * affine[lens].x + xy.y * affine[lens].y + center[lens].x;\n"
+	"highp float column = xy.x * affine[lens].z + xy.y + center[lens].y;\n"
+	"return vec2(column * center[lens].z, row * center[lens].w);\n"
+	"}\n"
+
+	"void main()\n"
+	"{\n"
+	"gl_Position = vec4(position.x, -position.y, 0.0f, 1.0f);\n"
+	"Ray = view * vec3(position * tanHalfFov, 1.0);\n"
+	"highp vec3 dir = normalize(Ray);\n"
+	"FrontCoords = cam2tex(world2Cam[0] * dir + transCam[0], 0);\n"
+	"BackCoords = cam2tex(world2Cam[1] * dir + transCam[1], 1);\n"
+	"FrontVignette = textureLod(vignetteFront, FrontCoords, 0.0).r;\n"
+	"BackVignette = textureLod(vignetteBack, BackCoords, 0.0).r;\n"
+	"}";
+
+static const GLchar *glesPreviewFragmentShaderSrc = "#version 300 es\n"
+	"precision mediump float;\n"
+	"in highp vec2 FrontCoords;\n"
+	"in highp vec2 BackCoords;\n"
+	"in highp vec3 Ray;\n"
+	"in float FrontVignette;\n"
+	"in float BackVignette;\n"
+	"out vec4 color;\n"
+	"uniform sampler2D textureFront;\n"
+	"uniform sampler2D textureBack;\n"
+	"uniform sampler2D ourMask;\n"
+
+	"void main()\n"
+	"{\n"
+	// the sphere point of genWarperCamRows is (-cos(lat) * sin(lon), sin(lat), cos(lat) * cos(lon))
+	"highp vec3 dir = normalize(Ray);\n"
+	"highp vec2 panoCoords = vec2(fract(atan(-dir.x, dir.z) / 6.2831853 + 1.0), 0.5 - asin(clamp(dir.y, -1.0, 1.0)) / 3.1415927);\n"
+	"vec4 colorFront = FrontVignette * texture(textureFront, FrontCoords);\n"
+	"vec4 colorBack = BackVignette * texture(textureBack, BackCoords);\n"
+	"color = mix(colorBack, colorFront, 1.0 - textureLod(ourMask, panoCoords, 0.0).r).bgra;\n"
+	"}";
+
+int fisheyePanoStitcherComp::initPreviewGLES(DescriptorGLES *pDescriptorGLES)
+{// render target, shader and the screen grid of the preview
+	pDescriptorGLES->texturePreview = 0;
+	pDescriptorGLES->texturePreviewVignette[0] = pDescriptorGLES->texturePreviewVignette[1] = 0;
+	pDescriptorGLES->previewVAO = pDescriptorGLES->previewVBO = pDescriptorGLES->previewEBO = 0;
+	pDescriptorGLES->previewIndicesAmount = 0;
+	if (pDescriptorGLES->previewW <= 0)
+		return 0;
+
+	GLint viewW = pDescriptorGLES->previewW;
+	GLint viewH = pDescriptorGLES->previewH;
+	glGenTextures(1, &pDescriptorGLES->texturePreview);
+	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->texturePreview);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, viewW, viewH, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glGenTextures(2, pDescriptorGLES->texturePreviewVignette);
+	for (int i = 0; i != 2; ++i)
+	{// half floats, the only filterable float format of GLES 3.0
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->texturePreviewVignette[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, PREVIEW_VIGNETTE_GRID, PREVIEW_VIGNETTE_GRID, 0, GL_RED, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	setPreviewVignetteGLES(pDescriptorGLES);
+
+	pDescriptorGLES->shaderPreview.init(glesPreviewVertexShaderSrc, glesPreviewFragmentShaderSrc);
+	pDescriptorGLES->shaderPreview.Use();
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderPreview.Program, "textureFront"), 0);
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderPreview.Program, "textureBack"), 1);
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderPreview.Program, "ourMask"), 2);
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderPreview.Program, "vignetteFront"), 3);
+	glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderPreview.Program, "vignetteBack"), 4);
+	glUseProgram(0);
+
+	// grid of PREVIEW_MESH_STEP pixel cells, the last column and row may be narrower
+	int cols = (viewW + PREVIEW_MESH_STEP - 1) / PREVIEW_MESH_STEP;
+	int rows = (viewH + PREVIEW_MESH_STEP - 1) / PREVIEW_MESH_STEP;
+	GLuint verticesAmount = (cols + 1) * (rows + 1);
+	pDescriptorGLES->previewIndicesAmount = cols * rows * 6;
+	pDescriptorGLES->previewIndicesType = (verticesAmount <= WARP_MESH_INDEX16_MAX) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+	std::vector<GLfloat> vertices(verticesAmount * 2);
+	for (int r = 0; r <= rows; ++r)
+	{
+		int y = (r * PREVIEW_MESH_STEP < viewH) ? r * PREVIEW_MESH_STEP : viewH;
+		for (int c = 0; c <= cols; ++c)
+		{
+			int x = (c * PREVIEW_MESH_STEP < viewW) ? c * PREVIEW_MESH_STEP : viewW;
+			vertices[2 * (r * (cols + 1) + c)] = -1.0f + 2.0f * x / viewW;
+			vertices[2 * (r * (cols + 1) + c) + 1] = 1.0f - 2.0f * y / viewH;
+		}
+	}
+
+	std::vector<GLuint> indices(pDescriptorGLES->previewIndicesAmount);
+	GLuint *pIndices = &indices[0];
+	for (int r = 0; r != rows; ++r)
+	{
+		for (int c = 0; c != cols; ++c)
+		{
+			GLuint topLeft = r * (cols + 1) + c;
+			GLuint bottomLeft = topLeft + cols + 1;
+			*(pIndices++) = topLeft;
+			*(pIndices++) = bottomLeft;
+			*(pIndices++) = topLeft + 1;
+			*(pIndices++) = topLeft + 1;
+			*(pIndices++) = bottomLeft;
+			*(pIndices++) = bottomLeft + 1;
+		}
+	}
+
+	glGenVertexArrays(1, &pDescriptorGLES->previewVAO);
+	glGenBuffers(1, &pDescriptorGLES->previewVBO);
+	glGenBuffers(1, &pDescriptorGLES->previewEBO);
+	glBindVertexArray(pDescriptorGLES->previewVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, pDescriptorGLES->previewVBO);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), &vertices[0], GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), (GLvoid*)0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pDescriptorGLES->previewEBO);
+	if (pDescriptorGLES->previewIndicesType == GL_UNSIGNED_SHORT)
+	{
+		std::vector<GLushort> indices16(indices.begin(), indices.end());
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices16.size() * sizeof(GLushort), &indices16[0], GL_STATIC_DRAW);
+	}
+	else
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
+	glBindVertexArray(0);
+
+	return 0;
+}
+
+int fisheyePanoStitcherComp::deInitPreviewGLES(DescriptorGLES *pDescriptorGLES)
+{
+	if (pDescriptorGLES->previewW <= 0)
+		return 0;
+
+	glDeleteTextures(1, &pDescriptorGLES->texturePreview);
+	glDeleteTextures(2, pDescriptorGLES->texturePreviewVignette);
+	glDeleteBuffers(1, &pDescriptorGLES->previewVBO);
+	glDeleteBuffers(1, &pDescriptorGLES->previewEBO);
+	glDeleteVertexArrays(1, &pDescriptorGLES->previewVAO);
+	glDeleteProgram(pDescriptorGLES->shaderPreview.Program);
+
+	return 0;
+}
+
+int fisheyePanoStitcherComp::setPreviewVignetteGLES(DescriptorGLES *pDescriptorGLES)
+{// the factors of cameraMetadata::vignettCorrectionFactor at the centers of a PREVIEW_VIGNETTE_GRID grid over the frame,
+ // 1 where the tables have none, so the preview scales the lenses as the vertices of the warp meshes do
+	if (pDescriptorGLES->previewW <= 0)
+		return 0;
+
+	std::vector<GLfloat> factors(PREVIEW_VIGNETTE_GRID * PREVIEW_VIGNETTE_GRID);
+	for (int i = 0; i != 2; ++i)
+	{
+		ImageWarper *pWarper = &mImageWarperB[4 * i];
+		for (int r = 0; r != PREVIEW_VIGNETTE_GRID; ++r)
+		{
+			for (int c = 0; c != PREVIEW_VIGNETTE_GRID; ++c)
+			{
+				double img[2] = { (r + 0.5) * pWarper->mSrcImageH / PREVIEW_VIGNETTE_GRID, (c + 0.5) * pWarper->mSrcImageW / PREVIEW_VIGNETTE_GRID };
+				factors[r * PREVIEW_VIGNETTE_GRID + c] = pWarper->mHasVC ? (GLfloat)mCameraMetadata[i].vignettCorrectionFactor(img) : 1.0f;
+			}
+		}
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->texturePreviewVignette[i]);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, PREVIEW_VIGNETTE_GRID, PREVIEW_VIGNETTE_GRID, GL_RED, GL_FLOAT, &factors[0]);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return 0;
+}
+
+int fisheyePanoStitcherComp::setPreviewLensesGLES(DescriptorGLES *pDescriptorGLES)
+{// set every frame, so that updateWarpers() reaches the preview without rebuilding anything
+	GLfloat R[2][9], T[2][3], affine[2][3], center[2][4], invpol[2][POL_LENGTH_INV];
+	GLint invpolLength[2];
+	for (int i = 0; i != 2; ++i)
+	{
+		double R64[EXT_PARAM_R_MTX_NUM], T64[EXT_PARAM_T_VEC_NUM];
+		ocamModel stOcamModel;
+		mCameraMetadata[i].getWorld2CamRotMtx(R64);
+		mCameraMetadata[i].getWorld2CamTransVec(T64);
+		mCameraMetadata[i].getOcamModel(&stOcamModel);
+
+		for (int k = 0; k != 9; ++k)
+			R[i][k] = (GLfloat)R64[k];
+		for (int k = 0; k != 3; ++k)
+			T[i][k] = (GLfloat)(T64[k] / mFisheyePanoParamsCore.sphereRadius);
+		affine[i][0] = (GLfloat)stOcamModel.c;
+		affine[i][1] = (GLfloat)stOcamModel.d;
+		affine[i][2] = (GLfloat)stOcamModel.e;
+		center[i][0] = (GLfloat)stOcamModel.uc;
+		center[i][1] = (GLfloat)stOcamModel.vc;
+		center[i][2] = 1.0f / mImageWarperB[4 * i].mSrcImageW;
+		center[i][3] = 1.0f / mImageWarperB[4 * i].mSrcImageH;
+		invpolLength[i] = (stOcamModel.length_invpol < POL_LENGTH_INV) ? stOcamModel.length_invpol : POL_LENGTH_INV;
+		for (int k = 0; k != POL_LENGTH_INV; ++k)
+			invpol[i][k] = (k < invpolLength[i]) ? (GLfloat)stOcamModel.invpol[k] : 0.0f;
+	}
+
+	GLuint program = pDescriptorGLES->shaderPreview.Program;
+	glUniformMatrix3fv(glGetUniformLocation(program, "world2Cam"), 2, GL_TRUE, &R[0][0]);   // row major, as matrixDotMul
+	glUniform3fv(glGetUniformLocation(program, "transCam"), 2, &T[0][0]);
+	glUniform3fv(glGetUniformLocation(program, "affine"), 2, &affine[0][0]);
+	glUniform4fv(glGetUniformLocation(program, "center"), 2, &center[0][0]);
+	glUniform1fv(glGetUniformLocation(program, "invpol"), 2 * POL_LENGTH_INV, &invpol[0][0]);
+	glUniform1iv(glGetUniformLocation(program, "invpolLength"), 2, invpolLength);
+
+	return 0;
+}
+
+int fisheyePanoStitcherComp::previewStitch(imageFrame fisheyeImage[2], imageFrame viewImage, float yaw, float pitch, float fovX)
+{// one draw of the viewport straight from the fisheye frames, none of the pano passes
+	if (mDescriptorGL.isInitialized == GL_FALSE || mDescriptorGL.previewW <= 0 || makeCurrentGLES(&mDescriptorGL) != 0)
+		return -1;
+
+	GLint viewW = mDescriptorGL.previewW;
+	GLint viewH = mDescriptorGL.previewH;
+	if (viewImage.imageW != viewW || viewImage.imageH != viewH || fovX <= 0.0f || fovX >= 180.0f ||
+		(viewImage.pxlColorFormat != PIXELCOLORSPACE_RGB && viewImage.pxlColorFormat != PIXELCOLORSPACE_RGBA))
+	{
+		std::cout << "previewStitch: needs a " << viewW << "x" << viewH << " RGB or RGBA view below 180 degrees" << std::endl;
+		return -1;
+	}
+	STITCH_PROFILE_SCOPE(profilePreview);
+
+	for (int i = 0; i != 2; ++i)
+	{
+		imageRoi wholeFrame;
+		wholeFrame.imgW = wholeFrame.roiW = mImageWarperB[4 * i].mSrcImageW;
+		wholeFrame.imgH = wholeFrame.roiH = mImageWarperB[4 * i].mSrcImageH;
+		wholeFrame.roiX = wholeFrame.roiY = 0;
+		uploadSrcImageGLES(&wholeFrame, mDescriptorGL.textureSrcFull[i], &mDescriptorGL, &fisheyeImage[i]);
+	}
+
+	// the view frame on the pano sphere, yaw 0 is at longitude pi (the pano center) and turns with the pano x
+	double lon = M_PI + yaw * M_PI / PI_ANGLE;
+	double lat = pitch * M_PI / PI_ANGLE;
+	GLfloat view[9] = {
+		(GLfloat)-cos(lon), 0.0f, (GLfloat)-sin(lon),                                  // right
+		(GLfloat)(sin(lat) * sin(lon)), (GLfloat)cos(lat), (GLfloat)(-sin(lat) * cos(lon)),    // up
+		(GLfloat)(-cos(lat) * sin(lon)), (GLfloat)sin(lat), (GLfloat)(cos(lat) * cos(lon))     // forward
+	};
+	GLfloat tanHalfFovX = (GLfloat)tan(fovX * M_PI / PI_2_ANGLE);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, mDescriptorGL.framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, mDescriptorGL.attachmentpoints[0], GL_TEXTURE_2D, mDescriptorGL.texturePreview, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Framebuffer is not complete! " << "previewStitch" << std::endl;
+	glViewport(0, 0, viewW, viewH);
+
+	mDescriptorGL.shaderPreview.Use();
+	setPreviewLensesGLES(&mDescriptorGL);
+	glUniformMatrix3fv(glGetUniformLocation(mDescriptorGL.shaderPreview.Program, "view"), 1, GL_FALSE, view);
+	glUniform2f(glGetUniformLocation(mDescriptorGL.shaderPreview.Program, "tanHalfFov"), tanHalfFovX, tanHalfFovX * viewH / viewW);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, mDescriptorGL.textureSrcFull[0]);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, mDescriptorGL.textureSrcFull[1]);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, mDescriptorGL.textureMaskPano);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, mDescriptorGL.texturePreviewVignette[0]);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, mDescriptorGL.texturePreviewVignette[1]);
+	glActiveTexture(GL_TEXTURE0);
+
+	glBindVertexArray(mDescriptorGL.previewVAO);
+	glDrawBuffers(1, &mDescriptorGL.attachmentpoints[0]);
+	glDrawElements(GL_TRIANGLES, mDescriptorGL.previewIndicesAmount, mDescriptorGL.previewIndicesType, 0);
+	glBindVertexArray(0);
+
+	// a synchronous read, the view is small next to the pano
+	STITCH_PROFILE_SCOPE(profileReadback);
+	glReadBuffer(mDescriptorGL.attachmentpoints[0]);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	if (viewImage.pxlColorFormat == PIXELCOLORSPACE_RGBA && viewImage.strides[0] % 4 == 0)
+	{
+		glPixelStorei(GL_PACK_ROW_LENGTH, viewImage.strides[0] / 4);
+		glReadPixels(0, 0, viewW, viewH, GL_RGBA, GL_UNSIGNED_BYTE, viewImage.plane[0]);
+		glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	}
+	else
+	{
+		mPreviewPixels.resize(viewW * viewH * 4);
+		glReadPixels(0, 0, viewW, viewH, GL_RGBA, GL_UNSIGNED_BYTE, &mPreviewPixels[0]);
+		if (viewImage.pxlColorFormat == PIXELCOLORSPACE_RGB)
+			rgba2rgb(&mPreviewPixels[0], viewW * 4, viewImage.plane[0], viewImage.strides[0], viewW, viewH);
+		else
+			for (int h = 0; h != viewH; ++h)
+				memcpy(viewImage.plane[0] + h * viewImage.strides[0], &mPreviewPixels[h * viewW * 4], viewW * 4);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return 0;
+}
+
 }   // namespace YiPanorama 
 }   // namespace fisheyePano
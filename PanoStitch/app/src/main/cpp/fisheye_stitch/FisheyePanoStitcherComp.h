@@ -10,16 +10,31 @@
 
 
 #include "ImageWarper.h"
+#include "WarpMesh.h"
 #include "ImageColorAdjuster.h"
 #include "ImageBlender.h"
+#include "BlendMask.h"
+#include "ImageOptFlow.h"
+#include "StitchProfiler.h"
 
 //OpenGLES
-#include <egl/egl.h>
-#include <egl/eglext.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLES3/gl3.h>
 
 //#define STITCH_EDGE
 
+#define WARP_TABLE_PATH_LEN 512
+#define STITCH_PIPELINE_MAX_DEPTH 4     // frames that can be in flight on the GPU at once
+#define WARP_MESH_TOLERANCE 0.0f        // default source pixel error of the GLES warp meshes: the uniform table grid, the
+                                        // adaptive meshes (< 0) match its worst error but not yet its mean one
+#define WARP_MESH_ROOT_STEP 160         // pano pixels of the adaptive mesh cells before any split
+#define WARP_MESH_MAX_DEPTH 5           // splits of a root cell, the finest cells are 5 pixels
+#define BLEND_FEATHER_WIDTH 1.0f        // default blend ramp, in seam widths
+#define PREVIEW_MESH_STEP 16            // viewport pixels per cell of the preview mesh
+#define PREVIEW_VIGNETTE_GRID 64        // samples per side of the vignette factors of a fisheye frame in the preview
+#define SEAM_SUM_LEVELS 8               // 4 x 4 block sum levels of the GLES seam strips, 4^8 is past any texture size
+
 namespace YiPanorama {
 namespace fisheyePano {
 
@@ -42,6 +57,18 @@ enum extParamType
 	extWorld2Cam
 };
 
+enum glesSessionMode
+{
+	glesSingleShot,     // context and GL resources are built and released inside every imageStitch call
+	glesPersistent      // context and GL resources are built in init() and reused until dinit()
+};
+
+enum glesRenderMode
+{
+	glesQuadrants,      // 8 quadrant warps, 4 color adjust & blend passes and 4 readbacks per frame
+	glesFullPano        // one merged mesh warps and blends both lenses into the whole pano, 1 readback per frame
+};
+
 
 // OpenGL rendering (reserved)
 struct DescriptorGLES
@@ -62,37 +89,98 @@ struct DescriptorGLES
 	GLchar *fragmentShaderColorAdjSrc;
 	GLchar *vertexShaderBlenderSrc;
 	GLchar *fragmentShaderBlenderSrc;
+	GLchar *fragmentShaderYUVSrc;
+	GLchar *vertexShaderFullPanoSrc;
+	GLchar *fragmentShaderFullPanoSrc;
+	glesRenderMode renderMode;
 	GLuint framebuffer;
 	GLuint curTexBuf;
 	GLenum attachmentpoints[4];
 	GLuint textureColorBuffers[8];
-	GLuint renderBuffers[4];
-	GLuint pixelBuffer[4];
+	GLuint textureBlended[4];   // color adjusted & blended quadrants (only [0], the whole pano, in glesFullPano), the readback source
+	GLuint textureYUV;          // a read tile packed as I420 / NV12 bytes, 4 per texel
+	GLuint textureSrcFull[2];   // whole front / back fisheye frames, glesFullPano or the preview
+	GLuint textureMaskPano;     // the 4 blend masks in one pano sized texture, glesFullPano or the preview
+	GLuint texturePreview;      // the rectilinear preview view
+	GLuint texturePreviewVignette[2];   // vignette factors over the front / back fisheye frames, as the warp meshes carry them
 	GLuint texture;
 	GLuint texture1;
 	GLuint texture2;
-	GLuint textureMask;
-	GLuint textureAdjCoef;
-	GLuint VAO, VBO, EBO;
+	GLuint textureMasks[4];
+	GLuint textureSeamLevels[SEAM_SUM_LEVELS];  // R, G, B byte sums of the 4 x 4 blocks of the level before (of the seam
+	                            // strip at level 0), a band per warped quadrant; the last level is 8 x 1 (RGBA32UI)
+	GLint seamLevelW[SEAM_SUM_LEVELS], seamLevelH[SEAM_SUM_LEVELS];    // block size of a band at each level
+	GLint seamLevelNum;
+	GLint seamX, seamW;         // the seam strip of every quadrant, clamped to the quadrant
+	GLuint textureSeamStrips;   // glesFullPano: the 8 seam strips side by side in warper order, as the quadrant textures
+	                            // would hold them (RGBA8)
+	GLuint textureAdjCoef;      // gain of each row of the adjusted lens as float bits, a column per coefficient section;
+	                            // alpha is 1 when the back lens is the adjusted one (RGBA32UI)
+	GLuint VAO, VBO;    // full screen quad for color adjust and blend
+	GLuint warpVAO[8], warpVBO[8], warpEBO[8];  // one warp mesh per warper, built once
+	GLuint fullVAO, fullVBO, fullEBO;           // merged mesh of all warpers, glesFullPano only
+	GLuint fullIndicesAmount;
+	GLenum fullIndicesType;     // GL_UNSIGNED_SHORT when the merged mesh allows it
+	GLuint previewVAO, previewVBO, previewEBO;  // screen grid of the preview, projected in the vertex shader
+	GLuint previewIndicesAmount;
+	GLenum previewIndicesType;
+	GLint previewW, previewH;   // 0 x 0 when the session has no preview
 	GLuint64 frameCount;
 	Shader shaderWarp;
 	Shader shaderColorAdj;
 	Shader shaderBlender;
-	GLuint pbosWrite[2];
-	GLuint pbosRead[2];
+	Shader shaderYUV;
+	Shader shaderFullPano;
+	Shader shaderSeamBlockSum;  // level 0, blocks of a seam strip
+	Shader shaderSeamLevelSum;  // blocks of the level before
+	Shader shaderSeamStrip;     // glesFullPano: one lens of the merged mesh into textureSeamStrips
+	Shader shaderAdjCoef;
+	Shader shaderPreview;
+	GLuint pbosWrite[2];        // source upload buffers, used in turn so the cpu copy never waits on a pending upload
+	GLuint pbosRead[STITCH_PIPELINE_MAX_DEPTH][4];  // readback ring, 4 quadrant buffers for each frame in flight
+	GLsync fencesRead[STITCH_PIPELINE_MAX_DEPTH];   // signaled when the readback of that ring slot is done
 	GLuint curPBOWrite;
-	GLuint curPBORead;
+	GLuint curPBORead;          // ring slot the next frame renders into
+	GLuint pipelineDepth;       // ring slots in use, 1 reads every frame back before imageStitch returns
+	GLuint framesInFlight;      // frames rendered but not yet read back
+	GLuint nBytesSrcRoi;        // size of a RGB source upload, a roi or a whole frame in glesFullPano
+	GLuint readTiles;           // read back per frame: the 4 quadrants, or 1 whole pano in glesFullPano
+	GLint readTileW, readTileH;
+	ePixelColorSpace outputFormat;              // format the frames in flight are read back in
+	GLboolean seamOptFlow;      // the seam strips of the warped quadrants are aligned by optical flow before blending
+	GLint blendBands;           // laplacian bands of the seam blend, mip levels of the warped quadrants; 1 is a plain mask mix
+	GLboolean colorAdjust;      // the exposure of the darker lens is matched at the seams before blending
 	GLuint nBytesSrc;
 	GLuint nBytesDst;
 
 	GLfloat *vertices; //pointer to vertices' data (position(x, y), texture(x, y), veg;
 	GLuint *indices; //pointer to vertices' index data for opengl draw;
 	GLuint vertcesAmount;
-	GLuint indicesAmount;
-	GLfloat *coefRGB;
+	GLuint indicesAmount[8];
+	GLenum indicesType[8];      // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, per warp mesh
 	GLubyte *pMask[4];
 };
 
+// GLES building blocks which only work on a descriptor, shared with the stereo stitcher
+extern const GLchar *glesWarpVertexShaderSrc;       // mesh warp: position(x, y, vcf), texture(x, y)
+extern const GLchar *glesWarpFragmentShaderSrc;
+extern const GLchar *glesQuadVertexShaderSrc;       // full screen quad: position(x, y), texture(x, y)
+extern const GLchar *glesYUVPackFragmentShaderSrc;  // RGBA texture to I420 / NV12 bytes, see readQuadrantGLES
+
+int initContextGLES(DescriptorGLES *pDescriptorGLES);
+int deInitContextGLES(DescriptorGLES *pDescriptorGLES);
+int makeCurrentGLES(DescriptorGLES *pDescriptorGLES);
+// the mesh of warpers sharing a roi: adaptive to tolerance source pixels, the uniform table grid when tolerance is 0, and
+// when it is < 0 adaptive to the worst error of that grid, falling back to the grid if the adaptive mesh is no smaller
+int genWarpMeshGLES(ImageWarper *pImageWarpers[], cameraMetadata *pCameras[], int tableNum, int sphereRadius, float tolerance, warpMesh *pMesh);
+int initWarpVerticesGLES(ImageWarper *pImageWarper, warpMesh *pMesh, DescriptorGLES *pDescriptorGLES, int idx); // warpVAO / VBO / EBO[idx] of a single warper mesh
+int deInitWarpVerticesGLES(DescriptorGLES *pDescriptorGLES, int idx);
+int uploadSrcImageGLES(imageRoi *pRoi, GLuint texture, DescriptorGLES *pDescirptorGL, imageFrame *srcImage);
+int readQuadrantGLES(DescriptorGLES *pDescriptorGLES, int quadrant);    // queue the readback of textureBlended[quadrant] in the output format
+int storePanoImagePBO(imageFrame *panoImage, DescriptorGLES *pDescirptorGL, int slot);
+int readOldestFrameGLES(imageFrame *panoImage, DescriptorGLES *pDescriptorGLES);   // wait for the oldest frame in flight and store it
+int rgba2rgb(const GLubyte* rgbaSrc, int srcStride, GLubyte *rgbDst, int dstStride, const int width, const int height);
+
 class fisheyePanoStitcherComp
 {
 public:
@@ -105,9 +193,20 @@ public:
 
     int updateFisheyePanoParams(fisheyePanoParams *pFisheyePanoParams);
     int updateFisheyeCenters(fisheyePanoParams *pFisheyePanoParams);
-    int updateWarpers();
+    int updateWarpers();    // regenerate the warp tables, and the GLES meshes when a session is alive
+
+    // warping, color adjusting, blending, extra warping.
+    // with a pipeline depth of N, panoImage receives the frame submitted N - 1 calls earlier and 1 is returned
+    // while the pipeline is still filling up
+    int imageStitch(imageFrame fisheyeImage[2], imageFrame panoImage);
+
+    // read back the oldest frame still in flight into panoImage, returns 1 when there is none. call at the end of a stream
+    int flushStitch(imageFrame panoImage);
 
-    int imageStitch(imageFrame fisheyeImage[2], imageFrame panoImage);  // warping, color adjusting, blending, extra warping
+    // output of imageStitch: PIXELCOLORSPACE_RGB (default), RGBA, YUV420PYV (I420) or NV12, -1 for others.
+    // imageStitch also switches to the format of its panoImage when no frame is in flight
+    int setOutputFormat(ePixelColorSpace outputFormat);
+    ePixelColorSpace getOutputFormat();
 
 
     int intrinsicCalibration(int camIdx, imageFrame fisheyeImage, int checkerNumH, int checkerNumV, int checkerSize, bool drawResults, char *filePath);
@@ -118,6 +217,69 @@ public:
     int extrinsicCalibration(imageFrame fisheyeImage[2], bool drawResults, char *filePath, ocamModel *pOcamCalibLinear);
 
     int dinit();
+
+    // must be called before init(), default is glesPersistent
+    int setGLESSessionMode(glesSessionMode sessionMode);
+
+    // must be called before init(), default is glesQuadrants
+    int setGLESRenderMode(glesRenderMode renderMode);
+
+    // must be called before init(), 1 ~ STITCH_PIPELINE_MAX_DEPTH frames in flight, default 1.
+    // a deeper pipeline lets the readback of a frame overlap the warping of the next ones, glesPersistent mode only
+    int setPipelineDepth(int depth);
+
+    // must be called before init(), 1 ~ MAX_PYRAMID_LEVELS bands for blending the seams, default 1 (the mask alone).
+    // more bands hide exposure and ghosting differences over a wider area, glesQuadrants mode only
+    int setBlendBands(int bands);
+
+    // must be called before init(), default off. video mode for glesQuadrants: the seam strips of every warped quadrant
+    // pair are read back, aligned to each other by optical flow and uploaded again before blending. the flow of a frame
+    // starts from the one of the previous frame, so call resetSeamOptFlow() after a cut
+    int setSeamOptFlow(bool enable);
+    int resetSeamOptFlow();
+
+    // must be called before init(), default on. the seam strips of the warped quadrants are summed up on the GPU and
+    // the darker lens gets per row gains towards the other one, as colorAdjusterPair does in software. glesFullPano
+    // warps the strips of both lenses out of its merged mesh for that, an extra pass over 8 seam widths of the pano
+    int setColorAdjust(bool enable);
+
+    // the seam gains of the last frame of a glesPersistent session with setColorAdjust, waiting for the GPU: pGains gets
+    // 2 x quadrant height x 3 floats, the gain of every row of the top and bottom quadrants of the adjusted lens in the
+    // channel order of the pano, and pIsBackAdjusted whether that lens is the back one. for checks against colorAdjusterPair
+    int getColorAdjustGains(float *pGains, bool *pIsBackAdjusted);
+
+    // frames of latency the pipeline adds: panoImage of imageStitch lags this many calls behind its fisheye input
+    int getPipelineLatency();
+
+    // must be called before init(), warp tables are then mapped from / saved to this writable directory.
+    // NULL or "" (default) always generates the tables
+    int setWarpTableCacheDir(const char *cacheDir);
+
+    // must be called before init(), the largest source pixel error of the GLES warp meshes, default WARP_MESH_TOLERANCE.
+    // cells of the meshes are split where the lens bends most, 0 keeps the uniform grid of the sparse tables and < 0
+    // takes the worst error of that grid as the tolerance, so each mesh is no worse than the grid at its worst pixel and
+    // never larger, though its mean error is higher
+    int setWarpMeshTolerance(float tolerance);
+
+    // sizes and errors of the GLES warp meshes of the last init() / updateWarpers(): 8, one per warper, in glesQuadrants
+    // and 4, one per pano quadrant, in glesFullPano. meshNum is 0 before the first GLES session
+    int getWarpMeshStats(warpMeshStats stats[8], int *pMeshNum);
+
+    // must be called before init(), default blendFeatherGaussian over BLEND_FEATHER_WIDTH. the masks are generated at
+    // the quadrant size from the seam rois (width in seam widths, see blendMaskGeometry) and cached by their geometry.
+    // blendFeatherFile loads the mask file given to init() instead
+    int setBlendFeather(blendFeather feather, float width);
+
+    // must be called before init(), 0 x 0 (default) builds no preview. see previewStitch
+    int setPreviewSize(int viewW, int viewH);
+
+    // live preview of a glesPersistent session without the pano: the rectilinear view at yaw, pitch (degrees, 0, 0 looks
+    // at the pano center, yaw turns right and pitch up) with the horizontal field of view fovX (degrees, below 180).
+    // both fisheye frames are projected per vertex of a PREVIEW_MESH_STEP screen grid, vignette corrected as in the warp
+    // and mixed by the pano blend masks, the seam gains of setColorAdjust are not applied. viewImage is RGB or RGBA of the preview size and is read back
+    // before returning; frames of imageStitch in flight are not touched
+    int previewStitch(imageFrame fisheyeImage[2], imageFrame viewImage, float yaw, float pitch, float fovX);
+
     complexLevel mComplexLevel;
 
 private:
@@ -126,8 +288,10 @@ private:
 
     int setWorkParams(complexLevel ComplexLevel);    // fisheyePanoParamsCore and cameraMetadatas
     int setWarpers();       // check warp device and generate warp tables
+    int genWarpTables(bool useCache);   // (re)generate the 8 warp tables from the current camera metadata, or map cached ones
 	int initBlender(ImageBlender *pImageBlender, int sizeW, int sizeH); // initial imageBlender;
 	int setBlendMask(ImageBlender *pImageBlender, const char *maskFilePath, int panoW, int panoH); // load mask for imageBlender;
+	int genBlendMasks(ImageBlender *pImageBlender);   // masks of the 4 quadrants from the seam rois, through the mask cache
     int setWorkMems(const char* dat);      // image and roi memories
 
     int clean();
@@ -135,17 +299,29 @@ private:
     int visualizeTable(char *filePath, int srcImgW, int srcImgH);
     int drawStitchingEdge(imageFrame panoImage);    // for test only
 
-	int initWarpVerticesGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescriptorGLES); // produce vertices data and VAO / VBO / EBO
-	int deInitWarpVerticesGLES(DescriptorGLES *pDescriptorGLES);
+	int initStitchGLES();    // context, textures, FBO, PBOs, meshes and shaders for the whole stitch
+	int deInitStitchGLES();
+	int initFullPanoVerticesGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescriptorGLES);  // pImageWarper points to all 8 warpers
+	int deInitFullPanoVerticesGLES(DescriptorGLES *pDescriptorGLES);
+	int initWarpMeshesGLES();
+	int deInitWarpMeshesGLES();
 	int initWarpGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescirptorGL);
-	int warpImageGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescirptorGL, imageFrame *srcImage, int idx);
-	int initColAdjBlendGLES(ImageBlender *pImageBlender, DescriptorGLES *pDescriptorGLES);
+	int warpImageGLES(ImageWarper *pImageWarper, DescriptorGLES *pDescirptorGL, int idx);
+	int stitchFullPanoGLES(DescriptorGLES *pDescriptorGLES);   // warp, color adjust and blend of the whole pano in one draw
+	int initColAdjBlendGLES(ImageBlender *pImageBlender, DescriptorGLES *pDescriptorGLES);  // pImageBlender points to all 4 blenders
 	int deInitColAdjBlendGLES(DescriptorGLES *pDescriptorGLES);
-	int initColorAdjCoefGLES(colorAdjustTarget *pColorAdjTarget, ImageBlender *pImageBlender, DescriptorGLES *pDescriptorGLES);
-	int deInitColorAdjCoefGLES(DescriptorGLES *pDescriptorGLES);
+	int initColorSummaryGLES(DescriptorGLES *pDescriptorGLES);     // seam sum textures and shaders, after initColAdjBlendGLES
+	int deInitColorSummaryGLES(DescriptorGLES *pDescriptorGLES);
+	int initPreviewGLES(DescriptorGLES *pDescriptorGLES);
+	int deInitPreviewGLES(DescriptorGLES *pDescriptorGLES);
+	int setPreviewLensesGLES(DescriptorGLES *pDescriptorGLES);     // calibration of both lenses into the preview shader
+	int setPreviewVignetteGLES(DescriptorGLES *pDescriptorGLES);   // vignette factors of both lenses, after the tables changed
+	int colorSummaryGLES(DescriptorGLES *pDescriptorGLES);     // seam sums of the 8 warped quadrants (strips in glesFullPano) and the gains into textureAdjCoef
 	int colorAdjustRGBChnScanlineGLES(/*imageFrame *pImageFrame, colorAdjustTarget *pColorAdjTarget, colorAdjusterPair *pColorAdjPair,*/ ImageBlender *pImageBlender, DescriptorGLES *pDescriptorGLES, int idx);
 	int deinitWarpGLES(DescriptorGLES *pDescirptorGL);
-	int storePanoImagePBO(imageFrame *panoImage, DescriptorGLES *pDescirptorGL);
+	int initSeamOptFlow();  // flow objects and seam strip buffers, kept across GLES sessions for the warm start
+	int deInitSeamOptFlow();
+	int alignSeamsOptFlowGLES(DescriptorGLES *pDescriptorGLES);    // read back, align and re-upload the seam strips of the 8 warped quadrants
     // params from metadata
     fisheyePanoParams mFisheyePanoParams;   // this struct only for initialize from metadata/default file
                                             // should not be used at any other places
@@ -173,12 +349,33 @@ private:
 
     ImageBlender mImageBlender[4];     // for mobile
 
+    bool mSeamOptFlowEnabled;
+    ImageOptFlow mSeamOptFlow[4];       // front / back pair of each quadrant
+    imageFrame mSeamStrips[8];          // RGBA seam roi of each warped quadrant, in warper order
+
     unsigned char *pProjImgData;
     unsigned char *pSeamImgData;
 
 	// device for opengl, for stitch / color adjust / blend
 	bool openGLStitch;
+	glesSessionMode mGLESSessionMode;
+	glesRenderMode mGLESRenderMode;
+	int mPipelineDepth;
+	int mBlendBands;
+	bool mColorAdjustEnabled;
+	blendFeather mBlendFeather;
+	float mBlendFeatherWidth;
+	int mPreviewW;
+	int mPreviewH;
+	std::vector<GLubyte> mPreviewPixels;    // rgba readback of an RGB preview
+	ePixelColorSpace mOutputFormat;
+
+	char mWarpTableCacheDir[WARP_TABLE_PATH_LEN];
+	float mWarpMeshTolerance;
+	warpMeshStats mWarpMeshStats[8];
+	int mWarpMeshNum;
 	DescriptorGLES mDescriptorGL;
+	GpuStageTimer mGpuTimer;    // only used when built with STITCH_PROFILING
 };
 
 
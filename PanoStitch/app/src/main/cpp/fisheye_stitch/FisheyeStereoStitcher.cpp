@@ -4,6 +4,8 @@
 #include "ImageTailor.h"
 
 #include "ImageIOConverter.h"
+#include "ColorConverter.h"
+#include "StitchProfiler.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -19,8 +21,11 @@ namespace fisheyeStereo {
 #define PI_2_ANGLE      360.0
 #define M_PI       3.14159265358979323846   // pi
 
-    fisheyeStereoStitcher::fisheyeStereoStitcher()
+    fisheyeStereoStitcher::fisheyeStereoStitcher():
+        mPipelineDepth(1)
     {
+        mDescriptorGL.isInitialized = GL_FALSE;
+        mDescriptorGL.frameCount = 0;
     }
 
     fisheyeStereoStitcher::~fisheyeStereoStitcher()
@@ -33,14 +38,29 @@ int fisheyeStereoStitcher::init(fisheyePanoParams *pFisheyePanoParams, int panoW
     setWorkParams();
     setWarpers();
     setWorkMems();
-    return 0;
+
+    // all GLES objects are created here once, only uploads / draws / readbacks run per frame
+    return initStitchGLES();
 }
 
 int fisheyeStereoStitcher::dinit()
 {
+    deInitStitchGLES();
+    clean();
     return 0;
 }
 
+int fisheyeStereoStitcher::setPipelineDepth(int depth)
+{
+    mPipelineDepth = (depth < 1) ? 1 : ((depth > STITCH_PIPELINE_MAX_DEPTH) ? STITCH_PIPELINE_MAX_DEPTH : depth);
+    return 0;
+}
+
+int fisheyeStereoStitcher::getPipelineLatency()
+{
+    return mPipelineDepth - 1;
+}
+
 int fisheyeStereoStitcher::updateFisheyePanoParams(fisheyePanoParams *pFisheyePanoParams)
 {// after the extrinsic parameters between 2 lenses are calculated, update them into the standard coordinate system of OpenGL
     
@@ -57,6 +77,16 @@ int fisheyeStereoStitcher::updateWarpers()
 {
     // only back cameras warper is modified
     mImageWarper[1].genWarperCam(&mCameraMetadata[1], mFisheyePanoParamsCore.sphereRadius);
+
+    if (mDescriptorGL.isInitialized == GL_TRUE && makeCurrentGLES(&mDescriptorGL) == 0)
+    {
+        warpMesh mesh;
+        ImageWarper *pWarper = &mImageWarper[1];
+        cameraMetadata *pCamera = &mCameraMetadata[1];
+        genWarpMeshGLES(&pWarper, &pCamera, 1, mFisheyePanoParamsCore.sphereRadius, WARP_MESH_TOLERANCE, &mesh);
+        deInitWarpVerticesGLES(&mDescriptorGL, 1);
+        initWarpVerticesGLES(&mImageWarper[1], &mesh, &mDescriptorGL, 1);
+    }
     return 0;
 }
 
@@ -117,62 +147,17 @@ int fisheyeStereoStitcher::setWarpers()
     mImageWarper[0].genWarperCam(&mCameraMetadata[0], mFisheyePanoParamsCore.sphereRadius);
     mImageWarper[1].genWarperCam(&mCameraMetadata[1], mFisheyePanoParamsCore.sphereRadius);
 
+    // each eye samples its whole fisheye frame
+    mImageWarper[0].setSrcRoi(0.0, 0.0, 1.0, 1.0);
+    mImageWarper[1].setSrcRoi(0.0, 0.0, 1.0, 1.0);
+
     return 0;
 }
 
 int fisheyeStereoStitcher::setWorkMems()
-{
-    // warp image memories ------------------------------------------------------
-    int singleChnProjImgSizeA = mImageWarper[0].mWarpImageW * mImageWarper[0].mWarpImageH;
-    int singleChnProjImgSizeQuarA = singleChnProjImgSizeA / 4;
-    int singleChnProjImgSizeB = mImageWarper[1].mWarpImageW * mImageWarper[1].mWarpImageH;
-    int singleChnProjImgSizeQuarB = singleChnProjImgSizeB / 4;
-    pProjImgData = new unsigned char[singleChnProjImgSizeQuarA * 6 + singleChnProjImgSizeQuarB * 6];// for 2 projected images in YUV420
-    memset(pProjImgData, 128, singleChnProjImgSizeQuarA * 6 + singleChnProjImgSizeQuarB * 6);
-    warpedImage[0].imageW = mImageWarper[0].mWarpImageW;
-    warpedImage[0].imageH = mImageWarper[0].mWarpImageH;
-    warpedImage[0].pxlColorFormat = PIXELCOLORSPACE_YUV420PYV;
-    warpedImage[0].strides[0] = warpedImage[0].imageW;
-    warpedImage[0].strides[1] = warpedImage[0].imageW / 2;
-    warpedImage[0].strides[2] = warpedImage[0].imageW / 2;
-
-    warpedImage[1].imageW = mImageWarper[1].mWarpImageW;
-    warpedImage[1].imageH = mImageWarper[1].mWarpImageH;
-    warpedImage[1].pxlColorFormat = PIXELCOLORSPACE_YUV420PYV;
-    warpedImage[1].strides[0] = warpedImage[1].imageW;
-    warpedImage[1].strides[1] = warpedImage[1].imageW / 2;
-    warpedImage[1].strides[2] = warpedImage[1].imageW / 2;
-
-    pStereoImage.imageW = mFisheyePanoParamsCore.panoImgW;
-    pStereoImage.imageH = mFisheyePanoParamsCore.panoImgH * 2;
-    pStereoImage.pxlColorFormat = PIXELCOLORSPACE_YUV420PYV;
-    pStereoImage.strides[0] = pStereoImage.imageW;
-    pStereoImage.strides[1] = pStereoImage.imageW / 2;
-    pStereoImage.strides[2] = pStereoImage.imageW / 2;
-
-    warpedImage[0].plane[0] = pProjImgData;
-    warpedImage[0].plane[1] = warpedImage[0].plane[0] + singleChnProjImgSizeA;
-    warpedImage[0].plane[2] = warpedImage[0].plane[1] + singleChnProjImgSizeQuarA;
-    warpedImage[1].plane[0] = warpedImage[0].plane[2] + singleChnProjImgSizeQuarA;
-    warpedImage[1].plane[1] = warpedImage[1].plane[0] + singleChnProjImgSizeB;
-    warpedImage[1].plane[2] = warpedImage[1].plane[1] + singleChnProjImgSizeQuarB;
-
-    pStereoImage.plane[0] = pProjImgData;
-    pStereoImage.plane[1] = pStereoImage.plane[0] + mFisheyePanoParamsCore.panoImgW * mFisheyePanoParamsCore.panoImgH * 2;
-    pStereoImage.plane[2] = pStereoImage.plane[1] + mFisheyePanoParamsCore.panoImgW * mFisheyePanoParamsCore.panoImgH / 2;
-
-    warpedImageRoi[0].imgW = pStereoImage.imageW;
-    warpedImageRoi[0].imgH = pStereoImage.imageH;
-    warpedImageRoi[0].roiW = mFisheyePanoParamsCore.panoImgW;
-    warpedImageRoi[0].roiH = mFisheyePanoParamsCore.panoImgH;
-    warpedImageRoi[0].roiX = 0;
-    warpedImageRoi[0].roiY = 0;
-    warpedImageRoi[1].imgW = pStereoImage.imageW;
-    warpedImageRoi[1].imgH = pStereoImage.imageH;
-    warpedImageRoi[1].roiW = mFisheyePanoParamsCore.panoImgW;
-    warpedImageRoi[1].roiH = mFisheyePanoParamsCore.panoImgH;
-    warpedImageRoi[1].roiX = 0;
-    warpedImageRoi[1].roiY = mFisheyePanoParamsCore.panoImgH;
+{// the eyes are warped straight into the stereo texture on the GPU, only YUV sources need a RGB copy
+    for (int i = 0; i != 2; ++i)
+        dinitImageFrame(&mSrcImageRGB[i]);
 
     return 0;
 }
@@ -184,24 +169,292 @@ int fisheyeStereoStitcher::clean()
     mImageWarper[1].dinit();
 
     // clean work mems
-    if (pProjImgData != NULL)
-        delete[] pProjImgData;
+    for (int i = 0; i != 2; ++i)
+        dinitImageFrame(&mSrcImageRGB[i]);
 
     return 0;
 }
 
-int fisheyeStereoStitcher::imageStitch(imageFrame fisheyeImage[2], imageFrame panoImage)  // warping
+int fisheyeStereoStitcher::initStitchGLES()
+{// one RGBA texture holds both eyes, left on top; it is the single read tile of the pano stitcher's readback path
+    DescriptorGLES *pDescriptorGLES = &mDescriptorGL;
+
+    if (initContextGLES(pDescriptorGLES) != 0)
+        return -1;
+
+    pDescriptorGLES->widthDst = mImageWarper[0].mWarpImageW;
+    pDescriptorGLES->heightDst = mImageWarper[0].mWarpImageH;
+    pDescriptorGLES->attachmentpoints[0] = GL_COLOR_ATTACHMENT0;
+    pDescriptorGLES->renderMode = glesFullPano;
+    pDescriptorGLES->readTiles = 1;
+    pDescriptorGLES->readTileW = pDescriptorGLES->widthDst;
+    pDescriptorGLES->readTileH = pDescriptorGLES->heightDst * 2;
+    pDescriptorGLES->pipelineDepth = mPipelineDepth;
+    pDescriptorGLES->framesInFlight = 0;
+    pDescriptorGLES->curPBORead = 0;
+    pDescriptorGLES->curPBOWrite = 0;
+    pDescriptorGLES->outputFormat = PIXELCOLORSPACE_RGB;
+    pDescriptorGLES->nBytesSrcRoi = 0;
+    for (int i = 0; i != 2; ++i)
+    {
+        GLuint nBytes = mImageWarper[i].mSrcImageRoi.roiW * mImageWarper[i].mSrcImageRoi.roiH * 3 * sizeof(GLubyte);
+        if (nBytes > pDescriptorGLES->nBytesSrcRoi)
+            pDescriptorGLES->nBytesSrcRoi = nBytes;
+    }
+
+    // shaders, the mesh warp and the yuv packing of the pano stitcher
+    pDescriptorGLES->vertexShaderWarpSrc = (GLchar *)glesWarpVertexShaderSrc;
+    pDescriptorGLES->fragmentShaderWarpSrc = (GLchar *)glesWarpFragmentShaderSrc;
+    pDescriptorGLES->shaderWarp.init(pDescriptorGLES->vertexShaderWarpSrc, pDescriptorGLES->fragmentShaderWarpSrc);
+
+    pDescriptorGLES->vertexShaderColorAdjSrc = (GLchar *)glesQuadVertexShaderSrc;
+    pDescriptorGLES->fragmentShaderYUVSrc = (GLchar *)glesYUVPackFragmentShaderSrc;
+    pDescriptorGLES->shaderYUV.init(pDescriptorGLES->vertexShaderColorAdjSrc, pDescriptorGLES->fragmentShaderYUVSrc);
+    pDescriptorGLES->shaderYUV.Use();
+    glUniform1i(glGetUniformLocation(pDescriptorGLES->shaderYUV.Program, "ourtexture"), 0);
+    glUniform2i(glGetUniformLocation(pDescriptorGLES->shaderYUV.Program, "srcSize"), pDescriptorGLES->readTileW, pDescriptorGLES->readTileH);
+    glUseProgram(0);
+
+    // source textures, the whole left / right fisheye frames
+    glGenTextures(2, pDescriptorGLES->textureSrcFull);
+    for (int i = 0; i != 2; ++i)
+    {
+        glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSrcFull[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, mImageWarper[i].mSrcImageRoi.roiW, mImageWarper[i].mSrcImageRoi.roiH, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+
+    // the stereo texture the eyes are drawn into, and its yuv packed copy of w * 2h * 3 / 2 bytes
+    glGenTextures(1, pDescriptorGLES->textureBlended);
+    glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureBlended[0]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, pDescriptorGLES->readTileW, pDescriptorGLES->readTileH, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &pDescriptorGLES->textureYUV);
+    glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureYUV);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, pDescriptorGLES->readTileW / 4, pDescriptorGLES->readTileH * 3 / 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &pDescriptorGLES->framebuffer);
+
+    // full screen quad of the yuv pass
+    GLfloat vertices[] = {
+        -1.0f, 1.0f, 0.0f, 0.0f,
+        -1.0f, -1.0f, 0.0f, 1.0f,
+        1.0f, 1.0f, 1.0f, 0.0f,
+
+        1.0f, 1.0f, 1.0f, 0.0f,
+        -1.0f, -1.0f, 0.0f, 1.0f,
+        1.0f, -1.0f, 1.0f, 1.0f
+    };
+    glGenVertexArrays(1, &pDescriptorGLES->VAO);
+    glGenBuffers(1, &pDescriptorGLES->VBO);
+    glBindVertexArray(pDescriptorGLES->VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, pDescriptorGLES->VBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid*)(2 * sizeof(GLfloat)));
+    glBindVertexArray(0);
+
+    // readback ring, one buffer per frame in flight, sized for rgba
+    for (GLuint k = 0; k != pDescriptorGLES->pipelineDepth; ++k)
+    {
+        glGenBuffers(1, pDescriptorGLES->pbosRead[k]);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescriptorGLES->pbosRead[k][0]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLuint)pDescriptorGLES->readTileH * (GLuint)pDescriptorGLES->readTileW * 4 * sizeof(GLubyte), NULL, GL_STREAM_READ);
+        pDescriptorGLES->fencesRead[k] = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // upload buffers, used in turn by the 2 eyes
+    glGenBuffers(2, pDescriptorGLES->pbosWrite);
+    for (int i = 0; i != 2; ++i)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pDescriptorGLES->pbosWrite[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, pDescriptorGLES->nBytesSrcRoi, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // one warp mesh per eye, built once
+    for (int i = 0; i != 2; ++i)
+    {
+        warpMesh mesh;
+        ImageWarper *pWarper = &mImageWarper[i];
+        cameraMetadata *pCamera = &mCameraMetadata[i];
+        if (genWarpMeshGLES(&pWarper, &pCamera, 1, mFisheyePanoParamsCore.sphereRadius, WARP_MESH_TOLERANCE, &mesh) != 0)
+            return -1;
+        initWarpVerticesGLES(&mImageWarper[i], &mesh, pDescriptorGLES, i);
+    }
+    STITCH_GPU_TIMER_INIT(&mGpuTimer);
+
+    return 0;
+}
+
+int fisheyeStereoStitcher::deInitStitchGLES()
 {
-    // image warping
-    mImageWarper[0].warpImage(fisheyeImage[0], warpedImage[0]);
-    mImageWarper[1].warpImage(fisheyeImage[1], warpedImage[1]);
+    DescriptorGLES *pDescriptorGLES = &mDescriptorGL;
+
+    if (pDescriptorGLES->isInitialized == GL_FALSE)
+        return 0;
+
+    makeCurrentGLES(pDescriptorGLES);
+    STITCH_GPU_TIMER_DINIT(&mGpuTimer);
+    for (int i = 0; i != 2; ++i)
+        deInitWarpVerticesGLES(pDescriptorGLES, i);
+
+    glDeleteTextures(2, pDescriptorGLES->textureSrcFull);
+    glDeleteTextures(1, pDescriptorGLES->textureBlended);
+    glDeleteTextures(1, &pDescriptorGLES->textureYUV);
+    glDeleteFramebuffers(1, &pDescriptorGLES->framebuffer);
+    glDeleteBuffers(1, &pDescriptorGLES->VBO);
+    glDeleteVertexArrays(1, &pDescriptorGLES->VAO);
+    for (GLuint k = 0; k != pDescriptorGLES->pipelineDepth; ++k)
+    {// frames still in flight are dropped
+        glDeleteBuffers(1, pDescriptorGLES->pbosRead[k]);
+        if (pDescriptorGLES->fencesRead[k] != 0)
+            glDeleteSync(pDescriptorGLES->fencesRead[k]);
+        pDescriptorGLES->fencesRead[k] = 0;
+    }
+    pDescriptorGLES->framesInFlight = 0;
+    glDeleteBuffers(2, pDescriptorGLES->pbosWrite);
+
+    glDeleteProgram(pDescriptorGLES->shaderWarp.Program);
+    glDeleteProgram(pDescriptorGLES->shaderYUV.Program);
 
-    roiMerge(panoImage, warpedImage[0], warpedImageRoi[0]);
-    roiMerge(panoImage, warpedImage[1], warpedImageRoi[1]);
+    deInitContextGLES(pDescriptorGLES);
+    return 0;
+}
+
+int fisheyeStereoStitcher::renderStereoGLES(DescriptorGLES *pDescriptorGLES)
+{// the mesh of an eye spans its viewport, so the viewport alone places it in the top or bottom half.
+ // warped rows run up the framebuffer like the readback, so the half at y = 0 is the top of the frame
+    glBindFramebuffer(GL_FRAMEBUFFER, pDescriptorGLES->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureBlended[0], 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "Framebuffer is not complete! " << "renderStereoGLES" << std::endl;
+
+    pDescriptorGLES->shaderWarp.Use();
+    glActiveTexture(GL_TEXTURE0);
+    glDrawBuffers(1, &pDescriptorGLES->attachmentpoints[0]);
+    for (int i = 0; i != 2; ++i)
+    {
+        glViewport(0, i * pDescriptorGLES->heightDst, pDescriptorGLES->widthDst, pDescriptorGLES->heightDst);
+        glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSrcFull[i]);
+        glBindVertexArray(pDescriptorGLES->warpVAO[i]);
+        glDrawElements(GL_TRIANGLES, pDescriptorGLES->indicesAmount[i], pDescriptorGLES->indicesType[i], 0);
+    }
+    glBindVertexArray(0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
     return 0;
 }
 
+int fisheyeStereoStitcher::flushStitch(imageFrame panoImage)
+{
+    if (mDescriptorGL.isInitialized == GL_FALSE || makeCurrentGLES(&mDescriptorGL) != 0)
+        return -1;
+
+    if (mDescriptorGL.framesInFlight != 0 && panoImage.pxlColorFormat != mDescriptorGL.outputFormat)
+    {
+        std::cout << "flushStitch: frames in flight are read back as format " << mDescriptorGL.outputFormat << std::endl;
+        return -1;
+    }
+
+    return readOldestFrameGLES(&panoImage, &mDescriptorGL);
+}
+
+int fisheyeStereoStitcher::imageStitch(imageFrame fisheyeImage[2], imageFrame panoImage)  // warping
+{
+    STITCH_PROFILE_NEXT_FRAME();
+    STITCH_PROFILE_SCOPE(profileFrame);
+    if (mDescriptorGL.isInitialized == GL_FALSE || makeCurrentGLES(&mDescriptorGL) != 0)
+        return -1;
+    STITCH_GPU_TIMER_COLLECT(&mGpuTimer);
+
+    if (panoImage.imageW != mDescriptorGL.readTileW || panoImage.imageH != mDescriptorGL.readTileH)
+    {
+        std::cout << "imageStitch: the stereo frame must be " << mDescriptorGL.readTileW << " x " << mDescriptorGL.readTileH << std::endl;
+        return -1;
+    }
+
+    // the pano frame decides the output format; it may only change while no frame is in flight.
+    // an odd eye height would average chroma across the 2 eyes
+    if (panoImage.pxlColorFormat != mDescriptorGL.outputFormat)
+    {
+        ePixelColorSpace format = panoImage.pxlColorFormat;
+        bool isYUV = (format == PIXELCOLORSPACE_YUV420PYV || format == PIXELCOLORSPACE_NV12);
+        if (mDescriptorGL.framesInFlight != 0 || !(isYUV || format == PIXELCOLORSPACE_RGB || format == PIXELCOLORSPACE_RGBA) ||
+            (isYUV && (mDescriptorGL.readTileW % 4 != 0 || mDescriptorGL.heightDst % 2 != 0)))
+        {
+            std::cout << "imageStitch: can not output format " << format << std::endl;
+            return -1;
+        }
+        mDescriptorGL.outputFormat = format;
+    }
+
+    for (int i = 0; i != 2; ++i)
+    {
+        imageFrame *pSrcImage = &fisheyeImage[i];
+        if (pSrcImage->pxlColorFormat != PIXELCOLORSPACE_RGB)
+        {// the source textures are RGB
+            if (mSrcImageRGB[i].plane[0] == NULL || mSrcImageRGB[i].imageW != pSrcImage->imageW || mSrcImageRGB[i].imageH != pSrcImage->imageH)
+            {
+                dinitImageFrame(&mSrcImageRGB[i]);
+                if (initImageFrame(&mSrcImageRGB[i], pSrcImage->imageW, pSrcImage->imageH, PIXELCOLORSPACE_RGB) != 0)
+                    return -1;
+            }
+            if (convertImageFrameColor(*pSrcImage, mSrcImageRGB[i], yuvBT601, yuvLimitedRange) != 0)
+            {
+                std::cout << "imageStitch: can not read fisheye format " << pSrcImage->pxlColorFormat << std::endl;
+                return -1;
+            }
+            pSrcImage = &mSrcImageRGB[i];
+        }
+
+        if (pSrcImage->imageW != mImageWarper[i].mSrcImageW || pSrcImage->imageH != mImageWarper[i].mSrcImageH)
+        {
+            std::cout << "imageStitch: fisheye frame " << i << " does not match its warp table" << std::endl;
+            return -1;
+        }
+        STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileUpload);
+        uploadSrcImageGLES(&mImageWarper[i].mSrcImageRoi, mDescriptorGL.textureSrcFull[i], &mDescriptorGL, pSrcImage);
+        STITCH_GPU_TIMER_END(&mGpuTimer);
+    }
+
+    // both eyes in one texture, one readback
+    {
+        STITCH_PROFILE_SCOPE(profileWarp);
+        STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileWarp);
+        renderStereoGLES(&mDescriptorGL);
+        STITCH_GPU_TIMER_END(&mGpuTimer);
+    }
+    STITCH_GPU_TIMER_BEGIN(&mGpuTimer, profileReadback);
+    readQuadrantGLES(&mDescriptorGL, 0);
+    STITCH_GPU_TIMER_END(&mGpuTimer);
+
+    // fence the readback of this frame and move on to the next ring slot
+    mDescriptorGL.fencesRead[mDescriptorGL.curPBORead] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    mDescriptorGL.curPBORead = (mDescriptorGL.curPBORead + 1) % mDescriptorGL.pipelineDepth;
+    mDescriptorGL.framesInFlight++;
+    ++mDescriptorGL.frameCount;
+
+    // only when the ring is full the oldest frame is stored, so its readback overlaps the frames submitted after it
+    if (mDescriptorGL.framesInFlight == mDescriptorGL.pipelineDepth)
+        return readOldestFrameGLES(&panoImage, &mDescriptorGL);
+
+    return 1;
+}
+
+#if FISHEYE_STEREO_CALIBRATION
 int fisheyeStereoStitcher::intAndExtCalibration(imageFrame fisheyeImage[2], int checkerNumH, int checkerNumV, int checkerSize, bool drawResults, char *filePathLeft, char *filePathRight)
 {
     int iResult = 0;
@@ -238,6 +491,14 @@ int fisheyeStereoStitcher::intAndExtCalibration(imageFrame fisheyeImage[2], int
 
     return iResult;
 }
+#else
+int fisheyeStereoStitcher::intAndExtCalibration(imageFrame /*fisheyeImage*/[2], int /*checkerNumH*/, int /*checkerNumV*/, int /*checkerSize*/,
+    bool /*drawResults*/, char * /*filePathLeft*/, char * /*filePathRight*/)
+{
+    std::cout << "intAndExtCalibration: built without FISHEYE_STEREO_CALIBRATION" << std::endl;
+    return -1;
+}
+#endif
 
 }   // namespace fisheyeStereo
 }   // namespace YiPanorama
@@ -9,7 +9,17 @@
 #define _FISHEYE_STEREO_STITCHER_H
 
 #include "ImageWarper.h"
+#include "FisheyePanoStitcherComp.h"    // the GLES warp mesh and PBO readback machinery
+
+// build switch, FISHEYE_STEREO_CALIBRATION=1 (the STEREO_CALIBRATION cmake option) builds the chessboard calibration.
+// it needs FeatureBasedOptimization, with levmar and the xfeatures2d module of opencv
+#ifndef FISHEYE_STEREO_CALIBRATION
+#define FISHEYE_STEREO_CALIBRATION 0
+#endif
+
+#if FISHEYE_STEREO_CALIBRATION
 #include "FeatureBasedOptimization.h"
+#endif
 
 namespace YiPanorama {
 namespace fisheyeStereo {
@@ -17,6 +27,7 @@ namespace fisheyeStereo {
 using namespace calibration;
 using namespace warper;
 using namespace util;
+using namespace fisheyePano;
 
 class fisheyeStereoStitcher
 {
@@ -25,13 +36,28 @@ public:
     ~fisheyeStereoStitcher();
 
 
+    // panoW x panoH per eye, the output is a top / bottom frame of panoW x 2 panoH. a persistent GLES session is
+    // built here, so init, imageStitch and dinit have to run on threads which may bind the same context
     int init(fisheyePanoParams *pFisheyePanoParams, int panoW, int panoH);
 
     int updateFisheyePanoParams(fisheyePanoParams *pFisheyePanoParams);
-    int updateWarpers();
-    int imageStitch(imageFrame fisheyeImage[2], imageFrame panoImage);  // warping
+    int updateWarpers();    // regenerate the warp table of the right eye, and its GLES mesh
+
+    // left eye into the top half and right eye into the bottom half of panoImage, both drawn straight into one
+    // texture. fisheye frames in RGB, or YUV420PYV / NV12 which are converted first; panoImage in RGB, RGBA,
+    // YUV420PYV or NV12. with a pipeline depth of N, panoImage receives the frame submitted N - 1 calls earlier
+    // and 1 is returned while the pipeline is still filling up
+    int imageStitch(imageFrame fisheyeImage[2], imageFrame panoImage);
+
+    // read back the oldest frame still in flight into panoImage, returns 1 when there is none
+    int flushStitch(imageFrame panoImage);
 
+    // must be called before init(), 1 ~ STITCH_PIPELINE_MAX_DEPTH frames in flight, default 1
+    int setPipelineDepth(int depth);
+    int getPipelineLatency();
 
+
+    // -1 when built without FISHEYE_STEREO_CALIBRATION
     int intAndExtCalibration(imageFrame fisheyeImage[2], int checkerNumH, int checkerNumV, int checkerSize, bool drawResults, char *filePathLeft, char *filePathRight);
     int getImageCenters(double centersL[2], double centersR[2]);
     int setImageCenters(double centersL[2], double centersR[2]);
@@ -47,6 +73,10 @@ private:
 
     int clean();
 
+    int initStitchGLES();   // context, eye meshes, source and stereo textures, shaders and PBOs
+    int deInitStitchGLES();
+    int renderStereoGLES(DescriptorGLES *pDescriptorGLES);  // both eye meshes into their halves of textureBlended[0]
+
     // params from metadata
     fisheyePanoParams mFisheyePanoParams;   // this struct only for initialize from metadata/default file
                                             // should not be used at any other places
@@ -57,18 +87,20 @@ private:
 
     // for stitch
     ImageWarper mImageWarper[2];
-    imageFrame warpedImage[2];
-    imageFrame pStereoImage;   // just a pointer, no memories allocated for this
-    imageRoi warpedImageRoi[2];
+    imageFrame mSrcImageRGB[2];     // pooled RGB copies of YUV fisheye frames, acquired on first use
 
+#if FISHEYE_STEREO_CALIBRATION
     // for intrinsic calibration
     intrinsicParamOptimizer mIntrinsicParamOptimizer;
 
     // for extrinsic calibration
     extrinsicParamRelativeCalculator mExtrinsicParamRelativeCalculator;
+#endif
 
-    unsigned char *pProjImgData;
-
+    // device for opengl, the same descriptor as the pano stitcher with one read tile: the whole stereo frame
+    int mPipelineDepth;
+    DescriptorGLES mDescriptorGL;
+    GpuStageTimer mGpuTimer;    // only used when built with STITCH_PROFILING
 };
 
 
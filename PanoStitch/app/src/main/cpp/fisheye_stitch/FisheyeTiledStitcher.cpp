@@ -0,0 +1,706 @@
+#include "FisheyeTiledStitcher.h"
+#include "ImageIOConverter.h"
+#include "ThreadPool.h"
+#include "StitchProfiler.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <iostream>
+
+namespace YiPanorama {
+namespace fisheyePano {
+
+#define SPARSE_STEP 40
+#define PI_ANGLE        180.0
+#define PI_2_ANGLE      360.0
+
+// the full pano pass of fisheyePanoStitcherComp, with the mask looked up at the place of the tile in the pano.
+// on the cube faces tileRect is the place of the tile in its face, and the mask is looked up by longitude / latitude
+static const GLchar *glesTileVertexShaderSrc = "#version 300 es\n"
+	"layout(location = 0) in vec2 position;\n"    // tile clip space
+	"layout(location = 1) in vec3 front;\n"       // texture x, y and vignette factor
+	"layout(location = 2) in vec3 back;\n"
+	"out highp vec3 Front;\n"
+	"out highp vec3 Back;\n"
+	"out highp vec2 MaskCoords;\n"
+	"uniform highp vec4 tileRect;\n"              // x, y, w, h of the tile over the pano size, or the face size
+
+	"void main()\n"
+	"{\n"
+	"gl_Position = vec4(position.x, -position.y, 0.0f, 1.0f);\n"
+	"Front = front;\n"
+	"Back = back;\n"
+	"MaskCoords = tileRect.xy + tileRect.zw * vec2(0.5 + 0.5 * position.x, 0.5 - 0.5 * position.y);\n"
+	"}";
+
+static const GLchar *glesTileFragmentShaderSrc = "#version 300 es\n"
+	"precision mediump float;\n"
+	"in highp vec3 Front;\n"
+	"in highp vec3 Back;\n"
+	"in highp vec2 MaskCoords;\n"
+	"out vec4 color;\n"
+	"uniform sampler2D textureFront;\n"
+	"uniform sampler2D textureBack;\n"
+	"uniform sampler2D ourMask;\n"
+	"uniform int projection;\n"                  // warpProjection
+	"uniform highp mat3 faceAxes;\n"             // right, down and forward of the face as columns
+
+	"void main()\n"
+	"{\n"
+	"vec4 colorFront = Front.z * texture(textureFront, Front.xy);\n"
+	"vec4 colorBack = Back.z * texture(textureBack, Back.xy);\n"
+	"float mask;\n"
+	"if (projection == 0)\n"
+	"    mask = texture(ourMask, MaskCoords).r;\n"
+	"else\n"
+	"{\n"
+	"    highp vec2 face = 2.0 * MaskCoords - 1.0;\n"
+	"    if (projection == 2)\n"
+	"        face = tan(0.78539816 * face);\n"
+	"    highp vec3 sphere = normalize(faceAxes * vec3(face, 1.0));\n"
+	"    highp vec2 lonLat = vec2(fract(atan(-sphere.x, sphere.z) / 6.28318531), 0.5 - asin(sphere.y) / 3.14159265);\n"
+	"    mask = textureLod(ourMask, lonLat, 0.0).r;\n"     // no derivatives across the longitude wrap
+	"}\n"
+	"color = mix(colorBack, colorFront, 1.0 - mask).bgra;\n"
+	"}";
+
+// ====================================================================
+panoStripFileWriter::panoStripFileWriter():
+	mFile(NULL), mPanoW(0), mPanoH(0), mNextRow(0)
+{
+}
+
+panoStripFileWriter::~panoStripFileWriter()
+{
+	close();
+}
+
+int panoStripFileWriter::open(const char *filePath, int panoW, int panoH)
+{
+	close();
+	if (panoW <= 0 || panoH <= 0)
+		return -1;
+
+	mFile = fopen(filePath, "wb");
+	if (mFile == NULL)
+	{
+		std::cout << "panoStripFileWriter: can not open " << filePath << std::endl;
+		return -1;
+	}
+	fprintf(mFile, "P6\n%d %d\n255\n", panoW, panoH);
+	mPanoW = panoW;
+	mPanoH = panoH;
+	mNextRow = 0;
+	return 0;
+}
+
+int panoStripFileWriter::writeStrip(imageFrame strip, int stripY)
+{
+	if (mFile == NULL || strip.pxlColorFormat != PIXELCOLORSPACE_RGB || strip.imageW != mPanoW || stripY != mNextRow ||
+		stripY + strip.imageH > mPanoH)
+		return -1;
+
+	for (int h = 0; h != strip.imageH; ++h)
+	{
+		if (fwrite(strip.plane[0] + h * strip.strides[0], 3, mPanoW, mFile) != (size_t)mPanoW)
+			return -1;
+	}
+	mNextRow += strip.imageH;
+	return 0;
+}
+
+int panoStripFileWriter::close()
+{
+	if (mFile == NULL)
+		return 0;
+
+	int result = (mNextRow == mPanoH && fclose(mFile) == 0) ? 0 : -1;
+	if (result != 0 && mNextRow != mPanoH)
+		fclose(mFile);
+	mFile = NULL;
+	return result;
+}
+
+panoStripSink panoStripFileWriter::sink()
+{
+	return [this](imageFrame strip, int stripY) { return writeStrip(strip, stripY); };
+}
+
+// ====================================================================
+	fisheyeTiledStitcher::fisheyeTiledStitcher():
+		mTileW(TILED_STITCH_TILE_W), mTileH(TILED_STITCH_TILE_H), mTileCols(0), mTileRows(0),
+		mBlendFeather(blendFeatherGaussian), mBlendFeatherWidth(BLEND_FEATHER_WIDTH), mWarpMeshTolerance(WARP_MESH_TOLERANCE),
+		mProjection(warpEquirect)
+	{
+		mDescriptorGL.isInitialized = GL_FALSE;
+		mDescriptorGL.frameCount = 0;
+	}
+
+	fisheyeTiledStitcher::~fisheyeTiledStitcher()
+	{
+	}
+
+int fisheyeTiledStitcher::setTileSize(int tileW, int tileH)
+{
+	if (tileW <= 0 || tileH <= 0)
+		return -1;
+	mTileW = tileW;
+	mTileH = tileH;
+	return 0;
+}
+
+int fisheyeTiledStitcher::setBlendFeather(blendFeather feather, float width)
+{
+	if (feather == blendFeatherFile || width <= 0.0f)
+		return -1;
+	mBlendFeather = feather;
+	mBlendFeatherWidth = width;
+	return 0;
+}
+
+int fisheyeTiledStitcher::setWarpMeshTolerance(float tolerance)
+{
+	mWarpMeshTolerance = tolerance;
+	return 0;
+}
+
+int fisheyeTiledStitcher::setOutputProjection(warpProjection projection)
+{
+	if (projection != warpEquirect && projection != warpCubemap && projection != warpEAC)
+		return -1;
+	mProjection = projection;
+	return 0;
+}
+
+int fisheyeTiledStitcher::init(fisheyePanoParams *pFisheyePanoParams, int panoW, int panoH)
+{
+	if (mProjection != warpEquirect && (panoW % 3 != 0 || panoW / 3 * 2 != panoH))
+	{
+		std::cout << "fisheyeTiledStitcher: cube faces need a 3 x 2 layout of square faces, not " << panoW << "x" << panoH << std::endl;
+		return -1;
+	}
+	setFisheyePanoParams(pFisheyePanoParams, panoW, panoH);
+	setWorkParams();
+
+	// the tile is clamped to the texture limit, so the context comes first
+	if (initContextGLES(&mDescriptorGL) != 0)
+		return -1;
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	mTileW = (mTileW < maxTextureSize) ? mTileW : maxTextureSize;
+	mTileH = (mTileH < maxTextureSize) ? mTileH : maxTextureSize;
+	for (int i = 0; i != 2; ++i)
+	{
+		if (mSrcImageW[i] > maxTextureSize || mSrcImageH[i] > maxTextureSize)
+		{
+			std::cout << "fisheyeTiledStitcher: fisheye frames of " << mSrcImageW[i] << "x" << mSrcImageH[i]
+				<< " exceed GL_MAX_TEXTURE_SIZE " << maxTextureSize << std::endl;
+			deInitContextGLES(&mDescriptorGL);
+			return -1;
+		}
+	}
+
+	setTiles();
+	if (genTileMeshes() != 0)
+	{
+		mTiles.clear();
+		deInitContextGLES(&mDescriptorGL);
+		return -1;
+	}
+	if (initStitchGLES() != 0)
+	{
+		dinit();
+		return -1;
+	}
+
+	initImageFrame(&mStrip, mFisheyePanoParamsCore.panoImgW, mTileH, PIXELCOLORSPACE_RGB);
+	return 0;
+}
+
+int fisheyeTiledStitcher::dinit()
+{
+	deInitStitchGLES();
+	mTiles.clear();
+	dinitImageFrame(&mStrip);
+	return 0;
+}
+
+int fisheyeTiledStitcher::updateFisheyePanoParams(fisheyePanoParams *pFisheyePanoParams)
+{
+	mCameraMetadata[0].setToFisheyePanoParams(&mFisheyePanoParams, 0);
+	mCameraMetadata[1].setToFisheyePanoParams(&mFisheyePanoParams, 1);
+	memcpy(pFisheyePanoParams, &mFisheyePanoParams, sizeof(fisheyePanoParams));
+	return 0;
+}
+
+int fisheyeTiledStitcher::updateWarpers()
+{// the tile meshes are rebuilt as a whole, the session keeps everything else
+	if (mDescriptorGL.isInitialized == GL_FALSE || makeCurrentGLES(&mDescriptorGL) != 0)
+		return -1;
+
+	if (genTileMeshes() != 0)
+		return -1;
+	deInitTileVerticesGLES();
+	return initTileVerticesGLES();
+}
+
+int fisheyeTiledStitcher::setFisheyePanoParams(fisheyePanoParams *pFisheyePanoParams, int panoW, int panoH)
+{
+	memcpy(&mFisheyePanoParams, pFisheyePanoParams, sizeof(fisheyePanoParams));
+	mFisheyePanoParams.stFisheyePanoParamsCore.panoImgW = panoW;
+	mFisheyePanoParams.stFisheyePanoParamsCore.panoImgH = panoH;
+	return 0;
+}
+
+int fisheyeTiledStitcher::setWorkParams()
+{
+	memcpy(&mFisheyePanoParamsCore, &mFisheyePanoParams.stFisheyePanoParamsCore, sizeof(fisheyePanoParamsCore));
+	for (int i = 0; i != 2; ++i)
+	{
+		mCameraMetadata[i].setFromFisheyePanoParams(&mFisheyePanoParams, i);
+		mSrcImageW[i] = mCameraMetadata[i].getOcamImgW();
+		mSrcImageH[i] = mCameraMetadata[i].getOcamImgH();
+	}
+	return 0;
+}
+
+int fisheyeTiledStitcher::setTiles()
+{// row major, the last column and row of tiles may be narrower. the cube faces are tiled one by one the same way,
+ // so the tiles of a row still share their rows of the pano and fill one strip
+	int panoW = mFisheyePanoParamsCore.panoImgW;
+	int panoH = mFisheyePanoParamsCore.panoImgH;
+	int faceCols = (mProjection == warpEquirect) ? 1 : 3;
+	int faceRows = (mProjection == warpEquirect) ? 1 : 2;
+	int faceW = panoW / faceCols;
+	int faceH = panoH / faceRows;
+	int tileColsFace = (faceW + mTileW - 1) / mTileW;
+	int tileRowsFace = (faceH + mTileH - 1) / mTileH;
+	mTileCols = faceCols * tileColsFace;
+	mTileRows = faceRows * tileRowsFace;
+
+	mTiles.clear();
+	mTiles.resize(mTileCols * mTileRows);
+	for (int r = 0; r != mTileRows; ++r)
+	{
+		for (int c = 0; c != mTileCols; ++c)
+		{
+			tileMesh *pTile = &mTiles[r * mTileCols + c];
+			int faceX = (c / tileColsFace) * faceW;
+			int faceY = (r / tileRowsFace) * faceH;
+			int tileX = (c % tileColsFace) * mTileW;
+			int tileY = (r % tileRowsFace) * mTileH;
+
+			imageRoi *pRoi = &pTile->roi;
+			pRoi->imgW = panoW;
+			pRoi->imgH = panoH;
+			pRoi->roiX = faceX + tileX;
+			pRoi->roiY = faceY + tileY;
+			pRoi->roiW = (tileX + mTileW < faceW) ? mTileW : faceW - tileX;
+			pRoi->roiH = (tileY + mTileH < faceH) ? mTileH : faceH - tileY;
+			pTile->face = (mProjection == warpEquirect) ? -1 : (r / tileRowsFace) * 3 + c / tileColsFace;
+		}
+	}
+	return 0;
+}
+
+int fisheyeTiledStitcher::genTileMeshes()
+{// the sub-tables live only while the mesh of their tile is built, so the whole pano table never exists
+	int results = 0;
+	std::mutex resultMutex;
+	ThreadPool::getDefault()->parallelFor(0, (int)mTiles.size(), [&](int tileBegin, int tileEnd) {
+		for (int t = tileBegin; t != tileEnd; ++t)
+		{
+			tileMesh *pTile = &mTiles[t];
+			imageRoi *pRoi = &pTile->roi;
+			ImageWarper warpers[2];
+			ImageWarper *pWarpers[2] = { &warpers[0], &warpers[1] };
+			cameraMetadata *pCameras[2] = { &mCameraMetadata[0], &mCameraMetadata[1] };
+			for (int i = 0; i != 2; ++i)
+			{
+				warpers[i].init(pRoi->imgW, pRoi->imgH, pRoi->roiY, pRoi->roiY + pRoi->roiH, pRoi->roiX, pRoi->roiX + pRoi->roiW,
+					true, SPARSE_STEP, SPARSE_STEP, false);
+				warpers[i].setProjection(mProjection);
+				warpers[i].mSrcImageW = mSrcImageW[i];
+				warpers[i].mSrcImageH = mSrcImageH[i];
+				warpers[i].genWarperCamRows(&mCameraMetadata[i], mFisheyePanoParamsCore.sphereRadius, 0, warpers[i].mTableH);
+			}
+
+			warpMesh mesh;
+			int result = genWarpMeshGLES(pWarpers, pCameras, 2, mFisheyePanoParamsCore.sphereRadius, mWarpMeshTolerance, &mesh);
+			for (int i = 0; i != 2; ++i)
+				warpers[i].dinit();
+			if (result != 0)
+			{
+				std::lock_guard<std::mutex> lock(resultMutex);
+				results++;
+				continue;
+			}
+
+			float invSrcW[2] = { 1.0f / mSrcImageW[0], 1.0f / mSrcImageW[1] };
+			float invSrcH[2] = { 1.0f / mSrcImageH[0], 1.0f / mSrcImageH[1] };
+			pTile->vertices.resize(mesh.mVertexNum * 8);
+			GLfloat *pVertices = &pTile->vertices[0];
+			for (int i = 0; i != mesh.mVertexNum; ++i)
+			{
+				*(pVertices++) = mesh.mPos[2 * i];
+				*(pVertices++) = mesh.mPos[2 * i + 1];
+				for (int k = 0; k != 2; ++k)
+				{
+					*(pVertices++) = mesh.mMaps[k][3 * i] * invSrcW[k];
+					*(pVertices++) = mesh.mMaps[k][3 * i + 1] * invSrcH[k];
+					*(pVertices++) = mesh.mMaps[k][3 * i + 2];
+				}
+			}
+			pTile->indices.assign(mesh.mIndices.begin(), mesh.mIndices.end());
+			pTile->indicesType = mesh.isIndex16() ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+		}
+	}, 1);
+
+	if (results != 0)
+	{
+		std::cout << "fisheyeTiledStitcher: no mesh for " << results << " tile(s)" << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+int fisheyeTiledStitcher::genMaskPano(std::vector<unsigned char> *pMaskPano, int *pMaskW, int *pMaskH)
+{// the 4 quadrant masks of a pano of TILED_MASK_PANO_W at most, with the seam of the real pano size.
+ // the ramps span tens of pano pixels even there, so the tiles magnify them without steps.
+ // the cube faces look up an equirect mask too, of the pano with their resolution on the equator
+	int panoW = mFisheyePanoParamsCore.panoImgW;
+	int panoH = mFisheyePanoParamsCore.panoImgH;
+	if (mProjection != warpEquirect)
+	{
+		panoW = panoW / 3 * 4;
+		panoH = panoW / 2;
+	}
+	int maskW = (panoW < TILED_MASK_PANO_W) ? panoW : TILED_MASK_PANO_W;
+	maskW &= ~1;
+	int maskH = (int)((double)maskW * panoH / panoW) & ~1;
+
+	// the seam rois of fisheyePanoStitcherComp::setWarpers at the real size, scaled to the mask pano
+	float anglesPerStep = PI_2_ANGLE / (panoW / SPARSE_STEP);
+	float horiAngle = floor(2 * mFisheyePanoParamsCore.maxFovAngle / anglesPerStep) * anglesPerStep;
+	int seamWidth = (int)(maskW * (horiAngle - PI_ANGLE) / PI_2_ANGLE + 0.5);
+
+	pMaskPano->resize(maskW * maskH);
+	std::vector<unsigned char> mask((maskW / 2) * (maskH / 2));
+	for (int i = 0; i != 4; ++i)
+	{
+		blendMaskGeometry geometry;
+		geometry.panoW = maskW;
+		geometry.panoH = maskH;
+		geometry.quadrant = i;
+		geometry.seamRoi.imgW = maskW / 2;
+		geometry.seamRoi.imgH = maskH / 2;
+		geometry.seamRoi.roiX = (maskW / 2 - seamWidth) / 2;
+		geometry.seamRoi.roiY = 0;
+		geometry.seamRoi.roiW = seamWidth;
+		geometry.seamRoi.roiH = maskH / 2;
+		geometry.feather = mBlendFeather;
+		geometry.featherWidth = mBlendFeatherWidth;
+		if (blendMaskCache::getDefault()->getMask(&geometry, &mask[0]) != 0)
+			return -1;
+
+		unsigned char *pDst = &(*pMaskPano)[0] + (i / 2) * (maskH / 2) * maskW + (i % 2) * (maskW / 2);
+		for (int h = 0; h != maskH / 2; ++h)
+			memcpy(pDst + h * maskW, &mask[h * (maskW / 2)], maskW / 2);
+	}
+
+	*pMaskW = maskW;
+	*pMaskH = maskH;
+	return 0;
+}
+
+int fisheyeTiledStitcher::initStitchGLES()
+{// nothing pano sized: the fisheye frames, the mask pano, one tile texture and a pair of tile readback buffers
+	DescriptorGLES *pDescriptorGLES = &mDescriptorGL;
+
+	// names of objects not created yet are 0, so a failed init can be released as a whole
+	mShaderTile.Program = 0;
+	pDescriptorGLES->textureSrcFull[0] = pDescriptorGLES->textureSrcFull[1] = 0;
+	pDescriptorGLES->textureMaskPano = pDescriptorGLES->textureBlended[0] = 0;
+	pDescriptorGLES->framebuffer = 0;
+	pDescriptorGLES->pbosRead[0][0] = pDescriptorGLES->pbosRead[1][0] = 0;
+	pDescriptorGLES->pbosWrite[0] = pDescriptorGLES->pbosWrite[1] = 0;
+	for (size_t t = 0; t != mTiles.size(); ++t)
+		mTiles[t].VAO = mTiles[t].VBO = mTiles[t].EBO = 0;
+
+	pDescriptorGLES->widthDst = mTileW;
+	pDescriptorGLES->heightDst = mTileH;
+	pDescriptorGLES->attachmentpoints[0] = GL_COLOR_ATTACHMENT0;
+	pDescriptorGLES->renderMode = glesFullPano;
+	pDescriptorGLES->readTiles = 1;
+	pDescriptorGLES->readTileW = mTileW;
+	pDescriptorGLES->readTileH = mTileH;
+	pDescriptorGLES->pipelineDepth = 2;
+	pDescriptorGLES->curPBOWrite = 0;
+	pDescriptorGLES->outputFormat = PIXELCOLORSPACE_RGB;
+	pDescriptorGLES->nBytesSrcRoi = 0;
+	for (int i = 0; i != 2; ++i)
+	{
+		GLuint nBytes = mSrcImageW[i] * mSrcImageH[i] * 3 * sizeof(GLubyte);
+		if (nBytes > pDescriptorGLES->nBytesSrcRoi)
+			pDescriptorGLES->nBytesSrcRoi = nBytes;
+	}
+
+	std::vector<unsigned char> maskPano;
+	int maskW, maskH;
+	if (genMaskPano(&maskPano, &maskW, &maskH) != 0)
+		return -1;
+
+	mShaderTile.init(glesTileVertexShaderSrc, glesTileFragmentShaderSrc);
+	mShaderTile.Use();
+	glUniform1i(glGetUniformLocation(mShaderTile.Program, "textureFront"), 0);
+	glUniform1i(glGetUniformLocation(mShaderTile.Program, "textureBack"), 1);
+	glUniform1i(glGetUniformLocation(mShaderTile.Program, "ourMask"), 2);
+	glUseProgram(0);
+
+	// source textures, the whole front / back fisheye frames
+	glGenTextures(2, pDescriptorGLES->textureSrcFull);
+	for (int i = 0; i != 2; ++i)
+	{
+		glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureSrcFull[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, mSrcImageW[i], mSrcImageH[i], 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	glGenTextures(1, &pDescriptorGLES->textureMaskPano);
+	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureMaskPano);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, maskW, maskH, 0, GL_RED, GL_UNSIGNED_BYTE, &maskPano[0]);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	// the tile render target
+	glGenTextures(1, pDescriptorGLES->textureBlended);
+	glBindTexture(GL_TEXTURE_2D, pDescriptorGLES->textureBlended[0]);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, mTileW, mTileH, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &pDescriptorGLES->framebuffer);
+
+	// readback pair, a tile is read into one while the next is rendered
+	for (GLuint k = 0; k != pDescriptorGLES->pipelineDepth; ++k)
+	{
+		glGenBuffers(1, pDescriptorGLES->pbosRead[k]);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescriptorGLES->pbosRead[k][0]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, (GLuint)mTileW * (GLuint)mTileH * 4 * sizeof(GLubyte), NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	// upload buffers, used in turn by the 2 lenses
+	glGenBuffers(2, pDescriptorGLES->pbosWrite);
+	for (int i = 0; i != 2; ++i)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pDescriptorGLES->pbosWrite[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, pDescriptorGLES->nBytesSrcRoi, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return initTileVerticesGLES();
+}
+
+int fisheyeTiledStitcher::deInitStitchGLES()
+{
+	DescriptorGLES *pDescriptorGLES = &mDescriptorGL;
+
+	if (pDescriptorGLES->isInitialized == GL_FALSE)
+		return 0;
+
+	makeCurrentGLES(pDescriptorGLES);
+	deInitTileVerticesGLES();
+	glDeleteProgram(mShaderTile.Program);
+	glDeleteTextures(2, pDescriptorGLES->textureSrcFull);
+	glDeleteTextures(1, &pDescriptorGLES->textureMaskPano);
+	glDeleteTextures(1, pDescriptorGLES->textureBlended);
+	glDeleteFramebuffers(1, &pDescriptorGLES->framebuffer);
+	for (GLuint k = 0; k != pDescriptorGLES->pipelineDepth; ++k)
+		glDeleteBuffers(1, pDescriptorGLES->pbosRead[k]);
+	glDeleteBuffers(2, pDescriptorGLES->pbosWrite);
+	deInitContextGLES(pDescriptorGLES);
+
+	return 0;
+}
+
+int fisheyeTiledStitcher::initTileVerticesGLES()
+{// one VAO per tile, the cpu copies of the meshes are dropped once uploaded
+	for (size_t t = 0; t != mTiles.size(); ++t)
+	{
+		tileMesh *pTile = &mTiles[t];
+		pTile->indicesAmount = pTile->indices.size();
+
+		glGenVertexArrays(1, &pTile->VAO);
+		glGenBuffers(1, &pTile->VBO);
+		glGenBuffers(1, &pTile->EBO);
+		glBindVertexArray(pTile->VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, pTile->VBO);
+		glBufferData(GL_ARRAY_BUFFER, pTile->vertices.size() * sizeof(GLfloat), &pTile->vertices[0], GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(2 * sizeof(GLfloat)));
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(5 * sizeof(GLfloat)));
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pTile->EBO);
+		if (pTile->indicesType == GL_UNSIGNED_SHORT)
+		{
+			std::vector<GLushort> indices16(pTile->indices.begin(), pTile->indices.end());
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices16.size() * sizeof(GLushort), &indices16[0], GL_STATIC_DRAW);
+		}
+		else
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, pTile->indices.size() * sizeof(GLuint), &pTile->indices[0], GL_STATIC_DRAW);
+		glBindVertexArray(0);
+
+		std::vector<GLfloat>().swap(pTile->vertices);
+		std::vector<GLuint>().swap(pTile->indices);
+	}
+	return 0;
+}
+
+int fisheyeTiledStitcher::deInitTileVerticesGLES()
+{
+	for (size_t t = 0; t != mTiles.size(); ++t)
+	{
+		glDeleteBuffers(1, &mTiles[t].VBO);
+		glDeleteBuffers(1, &mTiles[t].EBO);
+		glDeleteVertexArrays(1, &mTiles[t].VAO);
+	}
+	return 0;
+}
+
+int fisheyeTiledStitcher::renderTileGLES(int tile)
+{// warp and blend the tile, then queue its readback into the pbo of its parity
+	DescriptorGLES *pDescriptorGLES = &mDescriptorGL;
+	tileMesh *pTile = &mTiles[tile];
+	imageRoi *pRoi = &pTile->roi;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, pDescriptorGLES->framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, pDescriptorGLES->attachmentpoints[0], GL_TEXTURE_2D, pDescriptorGLES->textureBlended[0], 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Framebuffer is not complete! " << "renderTileGLES: " << tile << std::endl;
+	glViewport(0, 0, pRoi->roiW, pRoi->roiH);
+
+	glUniform1i(glGetUniformLocation(mShaderTile.Program, "projection"), (GLint)mProjection);
+	if (pTile->face < 0)
+		glUniform4f(glGetUniformLocation(mShaderTile.Program, "tileRect"), (GLfloat)pRoi->roiX / pRoi->imgW, (GLfloat)pRoi->roiY / pRoi->imgH,
+			(GLfloat)pRoi->roiW / pRoi->imgW, (GLfloat)pRoi->roiH / pRoi->imgH);
+	else
+	{
+		int faceW = pRoi->imgW / 3;
+		const double *pAxes = imageWarpTable::cubeFaceAxes(pTile->face);
+		GLfloat faceAxes[9];
+		for (int i = 0; i != 9; ++i)
+			faceAxes[i] = (GLfloat)pAxes[i];
+		glUniform4f(glGetUniformLocation(mShaderTile.Program, "tileRect"), (GLfloat)(pRoi->roiX % faceW) / faceW,
+			(GLfloat)(pRoi->roiY % faceW) / faceW, (GLfloat)pRoi->roiW / faceW, (GLfloat)pRoi->roiH / faceW);
+		glUniformMatrix3fv(glGetUniformLocation(mShaderTile.Program, "faceAxes"), 1, GL_FALSE, faceAxes);
+	}
+	glBindVertexArray(pTile->VAO);
+	glDrawBuffers(1, &pDescriptorGLES->attachmentpoints[0]);
+	glDrawElements(GL_TRIANGLES, pTile->indicesAmount, pTile->indicesType, 0);
+	glBindVertexArray(0);
+
+	glReadBuffer(pDescriptorGLES->attachmentpoints[0]);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescriptorGLES->pbosRead[tile % 2][0]);
+	glReadPixels(0, 0, pRoi->roiW, pRoi->roiH, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return 0;
+}
+
+int fisheyeTiledStitcher::storeTileGLES(int tile, panoStripSink *pSink)
+{
+	STITCH_PROFILE_SCOPE(profileReadback);
+	DescriptorGLES *pDescriptorGLES = &mDescriptorGL;
+	imageRoi *pRoi = &mTiles[tile].roi;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pDescriptorGLES->pbosRead[tile % 2][0]);
+	const GLubyte *pSrc = (const GLubyte *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pRoi->roiW * pRoi->roiH * 4, GL_MAP_READ_BIT);
+	if (pSrc == NULL)
+	{
+		std::cout << "storeTileGLES: glMapBufferRange failed" << std::endl;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		return -1;
+	}
+	rgba2rgb(pSrc, pRoi->roiW * 4, mStrip.plane[0] + pRoi->roiX * 3, mStrip.strides[0], pRoi->roiW, pRoi->roiH);
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	// the last tile of its row completes the strip
+	if (tile % mTileCols != mTileCols - 1)
+		return 0;
+
+	imageFrame strip = mStrip;
+	strip.imageH = pRoi->roiH;
+	return ((*pSink)(strip, pRoi->roiY) == 0) ? 0 : -1;
+}
+
+int fisheyeTiledStitcher::imageStitch(imageFrame fisheyeImage[2], panoStripSink sink)
+{
+	if (mDescriptorGL.isInitialized == GL_FALSE || makeCurrentGLES(&mDescriptorGL) != 0 || !sink)
+		return -1;
+	for (int i = 0; i != 2; ++i)
+	{
+		if (fisheyeImage[i].pxlColorFormat != PIXELCOLORSPACE_RGB || fisheyeImage[i].imageW != mSrcImageW[i] ||
+			fisheyeImage[i].imageH != mSrcImageH[i])
+		{
+			std::cout << "fisheyeTiledStitcher: needs RGB fisheye frames of the calibrated size" << std::endl;
+			return -1;
+		}
+	}
+	STITCH_PROFILE_SCOPE(profileFrame);
+
+	for (int i = 0; i != 2; ++i)
+	{
+		imageRoi wholeFrame;
+		wholeFrame.imgW = wholeFrame.roiW = mSrcImageW[i];
+		wholeFrame.imgH = wholeFrame.roiH = mSrcImageH[i];
+		wholeFrame.roiX = wholeFrame.roiY = 0;
+		if (uploadSrcImageGLES(&wholeFrame, mDescriptorGL.textureSrcFull[i], &mDescriptorGL, &fisheyeImage[i]) != 0)
+			return -1;
+	}
+
+	mShaderTile.Use();
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, mDescriptorGL.textureSrcFull[0]);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, mDescriptorGL.textureSrcFull[1]);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, mDescriptorGL.textureMaskPano);
+	glActiveTexture(GL_TEXTURE0);
+
+	// tile t is rendered before tile t - 1 is stored, so the GPU always has the next tile to work on
+	int result = 0;
+	int tileNum = (int)mTiles.size();
+	for (int t = 0; t != tileNum && result == 0; ++t)
+	{
+		{
+			STITCH_PROFILE_SCOPE(profileWarp);
+			renderTileGLES(t);
+		}
+		if (t > 0)
+			result = storeTileGLES(t - 1, &sink);
+	}
+	if (result == 0)
+		result = storeTileGLES(tileNum - 1, &sink);
+
+	glUseProgram(0);
+	mDescriptorGL.frameCount++;
+	return result;
+}
+
+}   // namespace fisheyePano
+}   // namespace YiPanorama
@@ -0,0 +1,137 @@
+/************************************************************************/
+/* Tiled stitching of panoramas larger than the GLES texture limits     */
+/* and the device memory: the pano is rendered tile by tile from warp   */
+/* sub-tables and handed out strip by strip, it never exists as a whole */
+/************************************************************************/
+#pragma once
+#ifndef _FISHEYE_TILED_STITCHER_H
+#define _FISHEYE_TILED_STITCHER_H
+
+#include "FisheyePanoStitcherComp.h"    // the GLES context, upload and mesh machinery
+
+#include <stdio.h>
+#include <vector>
+#include <functional>
+
+#define TILED_STITCH_TILE_W 2048        // default tile, below GL_MAX_TEXTURE_SIZE of any GLES 3 device
+#define TILED_STITCH_TILE_H 512
+#define TILED_MASK_PANO_W   2048        // the blend masks are generated at this pano width at most, the ramps are smooth
+
+namespace YiPanorama {
+namespace fisheyePano {
+
+// receives rows [stripY, stripY + strip.imageH) of the pano in RGB, top to bottom. the strip is reused for the next
+// one as soon as this returns, anything but 0 stops the stitch
+typedef std::function<int(imageFrame strip, int stripY)> panoStripSink;
+
+class panoStripFileWriter
+{// binary PPM written strip by strip, so a pano bigger than the memory can go to storage
+public:
+    panoStripFileWriter();
+    ~panoStripFileWriter();
+
+    int open(const char *filePath, int panoW, int panoH);
+    int writeStrip(imageFrame strip, int stripY);   // strips must come in order, as fisheyeTiledStitcher sends them
+    int close();                                    // -1 when fewer rows than the pano height were written
+
+    panoStripSink sink();   // writeStrip of this writer, for fisheyeTiledStitcher::imageStitch
+
+private:
+    FILE *mFile;
+    int mPanoW;
+    int mPanoH;
+    int mNextRow;
+};
+
+class fisheyeTiledStitcher
+{
+public:
+    fisheyeTiledStitcher();
+    ~fisheyeTiledStitcher();
+
+    // must be called before init(), default TILED_STITCH_TILE_W x TILED_STITCH_TILE_H. init() clamps the tile to
+    // GL_MAX_TEXTURE_SIZE; the pano strips handed to the sink are panoW x tileH
+    int setTileSize(int tileW, int tileH);
+
+    // must be called before init(), as fisheyePanoStitcherComp::setBlendFeather. blendFeatherFile is not supported
+    int setBlendFeather(blendFeather feather, float width);
+
+    // must be called before init(), source pixel error of the tile meshes, default WARP_MESH_TOLERANCE, see fisheyePanoStitcherComp
+    int setWarpMeshTolerance(float tolerance);
+
+    // must be called before init(), default warpEquirect. warpCubemap and warpEAC need panoW x panoH of 3 x 2 faces,
+    // the tiles then never cross a face and the strips carry the 3 x 2 layout of imageWarpTable
+    int setOutputProjection(warpProjection projection);
+
+    // the sparse sub-tables and meshes of every tile are generated here, and a persistent GLES session is built.
+    // panoW x panoH is not limited by GL_MAX_TEXTURE_SIZE, only the fisheye frames have to fit into textures
+    int init(fisheyePanoParams *pFisheyePanoParams, int panoW, int panoH);
+
+    int updateFisheyePanoParams(fisheyePanoParams *pFisheyePanoParams);
+    int updateWarpers();    // regenerate the tile tables and meshes after the calibration changed
+
+    // both RGB fisheye frames are uploaded once, then the tiles are rendered row by row, warped and blended as in
+    // glesFullPano, and read back into a panoW x tileH strip which goes to the sink when its row of tiles is done.
+    // the readback of a tile overlaps the rendering of the next one. no seam gains, unlike glesFullPano a tile
+    // doesn't hold the seam strips of its rows
+    int imageStitch(imageFrame fisheyeImage[2], panoStripSink sink);
+
+    int dinit();
+
+private:
+    struct tileMesh
+    {// one tile of the pano and its mesh carrying the source coordinates of both lenses
+        imageRoi roi;
+        int face;                       // cube face of the tile, -1 for the equirect pano
+        std::vector<GLfloat> vertices;  // position(x, y), front(x, y, vcf), back(x, y, vcf), dropped after the upload
+        std::vector<GLuint> indices;
+        GLuint VAO, VBO, EBO;
+        GLuint indicesAmount;
+        GLenum indicesType;
+    };
+
+    int setFisheyePanoParams(fisheyePanoParams *pFisheyePanoParams, int panoW, int panoH); // metadata from picture/video
+    int setWorkParams();    // fisheyePanoParamsCore and cameraMetadatas
+    int setTiles();         // tile rois over the pano, or over each cube face
+    int genTileMeshes();    // sub-tables of both lenses and the mesh of every tile, tiles in parallel
+    int genMaskPano(std::vector<unsigned char> *pMaskPano, int *pMaskW, int *pMaskH);
+
+    int initStitchGLES();   // context, tile meshes, source, mask and tile textures, shader and PBOs
+    int deInitStitchGLES();
+    int initTileVerticesGLES();
+    int deInitTileVerticesGLES();
+    int renderTileGLES(int tile);
+    int storeTileGLES(int tile, panoStripSink *pSink);  // the readback of the tile into the strip, the strip to the sink
+
+    // params from metadata
+    fisheyePanoParams mFisheyePanoParams;   // this struct only for initialize from metadata/default file
+                                            // should not be used at any other places
+
+    // params for internal works which actually are used when generating warp tables
+    fisheyePanoParamsCore mFisheyePanoParamsCore;
+    cameraMetadata mCameraMetadata[2];
+    int mSrcImageW[2];
+    int mSrcImageH[2];
+
+    int mTileW;
+    int mTileH;
+    int mTileCols;
+    int mTileRows;
+    std::vector<tileMesh> mTiles;   // row major
+    blendFeather mBlendFeather;
+    float mBlendFeatherWidth;
+    float mWarpMeshTolerance;
+    warpProjection mProjection;
+
+    imageFrame mStrip;              // one row of tiles, panoW x tileH RGB
+
+    // device for opengl: textureSrcFull, textureMaskPano, textureBlended[0] as the tile and pbosRead[0 ~ 1][0]
+    // as the readback pair
+    DescriptorGLES mDescriptorGL;
+    Shader mShaderTile;
+};
+
+}   // namespace fisheyePano
+}   // namespace YiPanorama
+
+#endif // !_FISHEYE_TILED_STITCHER_H
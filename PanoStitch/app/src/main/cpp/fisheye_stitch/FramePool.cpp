@@ -0,0 +1,250 @@
+#include "FramePool.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <new>
+#include <iostream>
+
+namespace YiPanorama {
+namespace util {
+
+static int alignToPool(int bytes)
+{
+    return (bytes + FRAME_POOL_ALIGN - 1) / FRAME_POOL_ALIGN * FRAME_POOL_ALIGN;
+}
+
+long long getFrameLayout(int width, int height, ePixelColorSpace imgCs, int strides[MAX_IMAGE_CHANNELS], long long offsets[MAX_IMAGE_CHANNELS])
+{// strides are multiples of FRAME_POOL_ALIGN, so every plane after the first starts aligned too
+    int rows[MAX_IMAGE_CHANNELS] = { 0 };
+    int chromaH = (height + 1) / 2;
+
+    if (width <= 0 || height <= 0)
+    {
+        return 0;
+    }
+
+    for (int k = 0; k < MAX_IMAGE_CHANNELS; k++)
+    {
+        strides[k] = 0;
+        offsets[k] = 0;
+    }
+
+    switch (imgCs)
+    {
+    case PIXELCOLORSPACE_MONO:
+        strides[0] = alignToPool(width);
+        rows[0] = height;
+        break;
+
+    case PIXELCOLORSPACE_YUV420PYV:
+        strides[0] = alignToPool(width);
+        strides[1] = alignToPool((width + 1) / 2);
+        strides[2] = strides[1];
+        rows[0] = height;
+        rows[1] = chromaH;
+        rows[2] = chromaH;
+        break;
+
+    case PIXELCOLORSPACE_RGB:
+        strides[0] = alignToPool(width * 3);
+        rows[0] = height;
+        break;
+
+    case PIXELCOLORSPACE_RGBA:
+        strides[0] = alignToPool(width * 4);
+        rows[0] = height;
+        break;
+
+    case PIXELCOLORSPACE_NV12:
+        strides[0] = alignToPool(width);
+        strides[1] = alignToPool(width + width % 2);
+        rows[0] = height;
+        rows[1] = chromaH;
+        break;
+
+    default:
+        return 0;
+    }
+
+    long long size = 0;
+    for (int k = 0; k < MAX_IMAGE_CHANNELS; k++)
+    {
+        offsets[k] = size;
+        size += (long long)strides[k] * rows[k];
+    }
+    return size;
+}
+
+FramePool::FramePool() :
+    mStats(), mFreeBytesLimit(FRAME_POOL_FREE_LIMIT)
+{
+}
+
+FramePool::~FramePool()
+{
+    trim();
+    if (!mUsedBlocks.empty())
+    {
+        std::cout << "FramePool: " << mUsedBlocks.size() << " frames still in use" << std::endl;
+    }
+}
+
+int FramePool::acquire(imageFrame *pImage, int width, int height, ePixelColorSpace imgCs)
+{
+    int strides[MAX_IMAGE_CHANNELS];
+    long long offsets[MAX_IMAGE_CHANNELS];
+    long long size = getFrameLayout(width, height, imgCs, strides, offsets);
+    frameBlock block;
+
+    if (pImage == NULL || size == 0)
+    {
+        return -1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        // the most recently released frame of this shape is the most likely to be in cache
+        int found = -1;
+        for (int k = (int)mFreeBlocks.size() - 1; k >= 0; k--)
+        {
+            if (mFreeBlocks[k].width == width && mFreeBlocks[k].height == height && mFreeBlocks[k].imgCs == imgCs)
+            {
+                found = k;
+                break;
+            }
+        }
+
+        if (found >= 0)
+        {
+            block = mFreeBlocks[found];
+            mFreeBlocks.erase(mFreeBlocks.begin() + found);
+            mStats.framesFree--;
+            mStats.bytesFree -= block.size;
+            mStats.reuses++;
+        }
+        else
+        {
+            block.pRaw = new (std::nothrow) unsigned char[size + FRAME_POOL_ALIGN - 1];
+            if (block.pRaw == NULL)
+            {
+                std::cout << "FramePool: failed to allocate " << size << " bytes" << std::endl;
+                return -1;
+            }
+            block.pData = (unsigned char *)(((uintptr_t)block.pRaw + FRAME_POOL_ALIGN - 1) & ~(uintptr_t)(FRAME_POOL_ALIGN - 1));
+            block.size = size;
+            block.width = width;
+            block.height = height;
+            block.imgCs = imgCs;
+            mStats.allocations++;
+        }
+
+        mUsedBlocks[block.pData] = block;
+        mStats.framesInUse++;
+        mStats.bytesInUse += block.size;
+        if (mStats.bytesInUse > mStats.peakBytesInUse)
+            mStats.peakBytesInUse = mStats.bytesInUse;
+        if (mStats.bytesInUse + mStats.bytesFree > mStats.peakBytes)
+            mStats.peakBytes = mStats.bytesInUse + mStats.bytesFree;
+    }
+
+    pImage->imageW = width;
+    pImage->imageH = height;
+    pImage->pxlColorFormat = imgCs;
+    for (int k = 0; k < MAX_IMAGE_CHANNELS; k++)
+    {
+        pImage->strides[k] = strides[k];
+        pImage->plane[k] = (strides[k] > 0) ? block.pData + offsets[k] : NULL;
+    }
+    return 0;
+}
+
+int FramePool::release(imageFrame *pImage)
+{
+    if (pImage == NULL || pImage->plane[0] == NULL)
+    {
+        return -1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        std::map<const unsigned char *, frameBlock>::iterator it = mUsedBlocks.find(pImage->plane[0]);
+        if (it == mUsedBlocks.end())
+        {
+            return -1;
+        }
+
+        mFreeBlocks.push_back(it->second);
+        mStats.framesInUse--;
+        mStats.bytesInUse -= it->second.size;
+        mStats.framesFree++;
+        mStats.bytesFree += it->second.size;
+        mUsedBlocks.erase(it);
+        freeOverLimit();
+    }
+
+    for (int k = 0; k < MAX_IMAGE_CHANNELS; k++)
+    {
+        pImage->plane[k] = NULL;
+        pImage->strides[k] = 0;
+    }
+    return 0;
+}
+
+int FramePool::setFreeBytesLimit(long long bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mFreeBytesLimit = (bytes < 0) ? 0 : bytes;
+    freeOverLimit();
+    return 0;
+}
+
+int FramePool::trim()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for (size_t k = 0; k < mFreeBlocks.size(); k++)
+    {
+        delete[] mFreeBlocks[k].pRaw;
+    }
+    mFreeBlocks.clear();
+    mStats.framesFree = 0;
+    mStats.bytesFree = 0;
+    return 0;
+}
+
+int FramePool::getStats(framePoolStats *pStats)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    *pStats = mStats;
+    return 0;
+}
+
+void FramePool::freeOverLimit()
+{// mMutex is held by the caller
+    size_t count = 0;
+    while (count < mFreeBlocks.size() && mStats.bytesFree > mFreeBytesLimit)
+    {
+        delete[] mFreeBlocks[count].pRaw;
+        mStats.framesFree--;
+        mStats.bytesFree -= mFreeBlocks[count].size;
+        count++;
+    }
+    mFreeBlocks.erase(mFreeBlocks.begin(), mFreeBlocks.begin() + count);
+}
+
+FramePool *FramePool::getDefault()
+{// never destroyed, frames may be released from static destructors of other objects
+    static FramePool *pPool = NULL;
+    static std::once_flag flag;
+    std::call_once(flag, []() {
+        pPool = new FramePool();
+    });
+    return pPool;
+}
+
+}   // namespace util
+}   // namespace YiPanorama
@@ -0,0 +1,82 @@
+/************************************************************************/
+/* Pool of aligned, stride padded image frames reused by shape          */
+/************************************************************************/
+#pragma once
+#ifndef _FRAME_POOL_H
+#define _FRAME_POOL_H
+
+#include "YiPanoramaTypes.h"
+
+#include <vector>
+#include <map>
+#include <mutex>
+
+namespace YiPanorama {
+namespace util {
+
+#define FRAME_POOL_ALIGN 64     // plane starts and row strides are multiples of this
+#define FRAME_POOL_FREE_LIMIT (256LL * 1024 * 1024)   // default bytes kept for reuse
+
+struct framePoolStats
+{
+    int framesInUse;
+    int framesFree;
+    long long bytesInUse;
+    long long bytesFree;
+    long long peakBytesInUse;   // high watermark of bytesInUse
+    long long peakBytes;        // high watermark of bytesInUse + bytesFree
+    int allocations;            // acquires which had to allocate
+    int reuses;                 // acquires served from released frames
+};
+
+class FramePool
+{// frames are released back to the pool and handed out again for the same width, height and color space,
+ // so a video session allocates its working set once. all planes of a frame are one allocation
+public:
+    FramePool();
+    ~FramePool();
+
+    // *pImage gets planes starting on FRAME_POOL_ALIGN bytes and row strides padded to it, the content is undefined
+    int acquire(imageFrame *pImage, int width, int height, ePixelColorSpace imgCs);
+
+    // hand a frame of acquire back and clear *pImage, -1 when its planes are not from this pool
+    int release(imageFrame *pImage);
+
+    // released frames beyond this many bytes are freed, oldest first
+    int setFreeBytesLimit(long long bytes);
+
+    // free all released frames, frames in use are untouched
+    int trim();
+
+    int getStats(framePoolStats *pStats);
+
+    // process wide pool behind initImageFrame / dinitImageFrame, created on first use
+    static FramePool *getDefault();
+
+private:
+    struct frameBlock
+    {
+        unsigned char *pRaw;    // as allocated
+        unsigned char *pData;   // aligned start of plane 0
+        long long size;
+        int width;
+        int height;
+        ePixelColorSpace imgCs;
+    };
+
+    void freeOverLimit();
+
+    std::mutex mMutex;
+    std::vector<frameBlock> mFreeBlocks;                        // oldest release first
+    std::map<const unsigned char *, frameBlock> mUsedBlocks;    // by plane 0
+    framePoolStats mStats;
+    long long mFreeBytesLimit;
+};
+
+// strides and plane offsets of a width x height frame as laid out by the pool, returns the total bytes or 0
+long long getFrameLayout(int width, int height, ePixelColorSpace imgCs, int strides[MAX_IMAGE_CHANNELS], long long offsets[MAX_IMAGE_CHANNELS]);
+
+}   // namespace util
+}   // namespace YiPanorama
+
+#endif  // !_FRAME_POOL_H
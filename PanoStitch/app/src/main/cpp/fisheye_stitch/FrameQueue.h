@@ -0,0 +1,111 @@
+/************************************************************************/
+/* Bounded single producer / single consumer queue for pipeline stages  */
+/************************************************************************/
+#pragma once
+#ifndef _FRAME_QUEUE_H
+#define _FRAME_QUEUE_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+namespace YiPanorama {
+namespace util {
+
+template <typename T, int CAPACITY>
+class FrameQueue
+{// push and pop never lock; the mutex is only taken when the other side is asleep waiting.
+ // exactly one thread may push and one thread may pop
+public:
+    FrameQueue() : mHead(0), mTail(0), mWaiters(0) {}
+
+    // false when the queue is full
+    bool tryPush(const T &item)
+    {
+        unsigned int tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) == CAPACITY)
+            return false;
+
+        mItems[tail % CAPACITY] = item;
+        mTail.store(tail + 1, std::memory_order_release);
+        notify();
+        return true;
+    }
+
+    // false when the queue is empty
+    bool tryPop(T *pItem)
+    {
+        unsigned int head = mHead.load(std::memory_order_relaxed);
+        if (mTail.load(std::memory_order_acquire) == head)
+            return false;
+
+        *pItem = mItems[head % CAPACITY];
+        mHead.store(head + 1, std::memory_order_release);
+        notify();
+        return true;
+    }
+
+    // block until an item arrives or timeoutMs passed
+    bool waitPop(T *pItem, int timeoutMs)
+    {
+        if (tryPop(pItem))
+            return true;
+
+        mWaiters.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(mWaitMutex);
+            mWaitCond.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]() { return !empty(); });
+        }
+        mWaiters.fetch_sub(1);
+        return tryPop(pItem);
+    }
+
+    // block until there is room or timeoutMs passed
+    bool waitPush(const T &item, int timeoutMs)
+    {
+        if (tryPush(item))
+            return true;
+
+        mWaiters.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(mWaitMutex);
+            mWaitCond.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]() { return size() < CAPACITY; });
+        }
+        mWaiters.fetch_sub(1);
+        return tryPush(item);
+    }
+
+    bool empty()
+    {
+        return size() == 0;
+    }
+
+    int size()
+    {
+        return (int)(mTail.load(std::memory_order_acquire) - mHead.load(std::memory_order_acquire));
+    }
+
+private:
+    void notify()
+    {// the fence pairs with the waiter's fetch_add: either it sees the new item or we see the waiter.
+     // taking the mutex then orders the notify after its check, so a wakeup can't be lost
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mWaiters.load(std::memory_order_relaxed) == 0)
+            return;
+        std::lock_guard<std::mutex> lock(mWaitMutex);
+        mWaitCond.notify_all();
+    }
+
+    T mItems[CAPACITY];
+    std::atomic<unsigned int> mHead;    // next item to pop, only written by the consumer
+    std::atomic<unsigned int> mTail;    // next free slot, only written by the producer
+    std::atomic<int> mWaiters;
+    std::mutex mWaitMutex;
+    std::condition_variable mWaitCond;
+};
+
+}   // namespace util
+}   // namespace YiPanorama
+
+#endif  //!_FRAME_QUEUE_H
@@ -2,12 +2,21 @@
 #include "ImageBlender.h"
 
 #include "ImageIOConverter.h"
+#include "StitchProfiler.h"
 
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
 #include <string.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BLENDER_USE_NEON
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BLENDER_USE_SSE2
+#endif
+
 namespace YiPanorama {
 namespace util {
 
@@ -15,19 +24,516 @@ namespace util {
 #define M_PI_2     1.57079632679489661923   // pi/2
 #define M_PI_4     0.785398163397448309616  // pi/4
 
-#define USE_GAUSSIAN_BLUR       1   // use gaussian blur or box blur
 // function definitions ========================================================
 
-// buffer for temporary images during pyramid operations
-static float *gTempImageBuf = NULL;       // for pyramid smooth operations, temporary images' buffer
-static void *gTmpVoidBuf = NULL;          // temp void buffer
+
+// ====================================================================
+// 4 lane float helpers, so the kernels below are written once for NEON and SSE2
+#if defined(BLENDER_USE_NEON)
+typedef float32x4_t vec4f;
+static inline vec4f v4Load(const float *p) { return vld1q_f32(p); }
+static inline void v4Store(float *p, vec4f v) { vst1q_f32(p, v); }
+static inline vec4f v4Set(float f) { return vdupq_n_f32(f); }
+static inline vec4f v4Add(vec4f a, vec4f b) { return vaddq_f32(a, b); }
+static inline vec4f v4Sub(vec4f a, vec4f b) { return vsubq_f32(a, b); }
+static inline vec4f v4Mul(vec4f a, vec4f b) { return vmulq_f32(a, b); }
+static inline vec4f v4Mla(vec4f a, vec4f b, vec4f c) { return vmlaq_f32(a, b, c); }    // a + b * c
+#define BLENDER_USE_VEC4
+#elif defined(BLENDER_USE_SSE2)
+typedef __m128 vec4f;
+static inline vec4f v4Load(const float *p) { return _mm_loadu_ps(p); }
+static inline void v4Store(float *p, vec4f v) { _mm_storeu_ps(p, v); }
+static inline vec4f v4Set(float f) { return _mm_set1_ps(f); }
+static inline vec4f v4Add(vec4f a, vec4f b) { return _mm_add_ps(a, b); }
+static inline vec4f v4Sub(vec4f a, vec4f b) { return _mm_sub_ps(a, b); }
+static inline vec4f v4Mul(vec4f a, vec4f b) { return _mm_mul_ps(a, b); }
+static inline vec4f v4Mla(vec4f a, vec4f b, vec4f c) { return _mm_add_ps(a, _mm_mul_ps(b, c)); }
+#define BLENDER_USE_VEC4
+#endif
+
+static inline int clampIdx(int i, int n)
+{
+    return (i < 0) ? 0 : ((i >= n) ? n - 1 : i);
+}
+
+static void weightedSumRow(float *pDst, const float *pA, const float *pB, float wa, float wb, int n)
+{// pDst = wa * pA + wb * pB
+    int i = 0;
+#ifdef BLENDER_USE_VEC4
+    vec4f va = v4Set(wa);
+    vec4f vb = v4Set(wb);
+    for (; i + 4 <= n; i += 4)
+        v4Store(pDst + i, v4Mla(v4Mul(v4Load(pA + i), va), v4Load(pB + i), vb));
+#endif
+    for (; i < n; ++i)
+        pDst[i] = wa * pA[i] + wb * pB[i];
+}
+
+static void addRow(float *pDst, const float *pSrc, float sign, int n)
+{// pDst += sign * pSrc
+    int i = 0;
+#ifdef BLENDER_USE_VEC4
+    vec4f vs = v4Set(sign);
+    for (; i + 4 <= n; i += 4)
+        v4Store(pDst + i, v4Mla(v4Load(pDst + i), v4Load(pSrc + i), vs));
+#endif
+    for (; i < n; ++i)
+        pDst[i] += sign * pSrc[i];
+}
+
+
+// ====================================================================
+pyramidBase::pyramidBase() :
+    mKernelChoice(gaukernel),
+    mChannels(0),
+    mpPyraData(NULL),
+    mpTempData(NULL),
+    mpColTemp(NULL),
+    mpTempRow(NULL)
+{
+    memset(&mPyramidInfo, 0, sizeof(mPyramidInfo));
+    memset(&mPyramidDataPtrs, 0, sizeof(mPyramidDataPtrs));
+}
+
+pyramidBase::~pyramidBase()
+{
+    dinit();
+}
+
+int pyramidBase::genKernels(float sigma)
+{
+    // gaussian, +-3 sigma
+    int half = (int)ceil(3.0f * sigma);
+    if (half < 1)
+        half = 1;
+    if (half > MAX_GAUSS_KERNEL_WIDTH - 1)
+        half = MAX_GAUSS_KERNEL_WIDTH - 1;
+    mGaussianKernel.sigma = sigma;
+    mGaussianKernel.halfWindowWidth = half;
+    float sum = 0.0f;
+    for (int k = 0; k <= half; ++k)
+    {
+        mGaussianKernel.gCoeffs[k] = expf(-0.5f * k * k / (sigma * sigma));
+        sum += (k == 0) ? mGaussianKernel.gCoeffs[k] : 2.0f * mGaussianKernel.gCoeffs[k];
+    }
+    for (int k = 0; k <= half; ++k)
+        mGaussianKernel.gCoeffs[k] /= sum;
+
+    // BOX_KERNEL_NUM boxes of odd sizes whose variances add up to sigma^2
+    float wIdeal = sqrtf(12.0f * sigma * sigma / BOX_KERNEL_NUM + 1.0f);
+    int wl = (int)floorf(wIdeal);
+    if (wl % 2 == 0)
+        --wl;
+    if (wl < 1)
+        wl = 1;
+    int wu = wl + 2;
+    float mIdeal = (12.0f * sigma * sigma - BOX_KERNEL_NUM * wl * wl - 4.0f * BOX_KERNEL_NUM * wl - 3.0f * BOX_KERNEL_NUM) / (-4.0f * wl - 4.0f);
+    int m = (int)floorf(mIdeal + 0.5f);
+    mBoxKernel.sigma = sigma;
+    mBoxKernel.boxNum = BOX_KERNEL_NUM;
+    for (int i = 0; i != BOX_KERNEL_NUM; ++i)
+        mBoxKernel.boxSizes[i] = (i < m) ? wl : wu;
+
+    return 0;
+}
+
+int pyramidBase::init(int levelNum, int baseImgW, int baseImgH, int channels, float sigma, kernelChoice mkernel)
+{
+    dinit();
+    if (levelNum < 1 || baseImgW < 1 || baseImgH < 1 || channels < 1)
+        return -1;
+    if (levelNum > MAX_PYRAMID_LEVELS)
+        levelNum = MAX_PYRAMID_LEVELS;
+
+    mKernelChoice = mkernel;
+    mChannels = channels;
+    genKernels(sigma);
+
+    // levels stop before they get narrower than the kernel
+    int total = 0;
+    int w = baseImgW, h = baseImgH, l = 0;
+    for (; l != levelNum && w >= 2 && h >= 2; ++l)
+    {
+        mPyramidInfo.width[l] = w;
+        mPyramidInfo.height[l] = h;
+        mPyramidInfo.level_size[l] = w * h;
+        total += w * h * channels;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+    if (l == 0)
+        return -1;
+    mPyramidInfo.levelNum = l;
+    mPyramidInfo.total_size = total;
+
+    int radius = mGaussianKernel.halfWindowWidth;
+    for (int i = 0; i != BOX_KERNEL_NUM; ++i)
+        radius = (mBoxKernel.boxSizes[i] / 2 > radius) ? mBoxKernel.boxSizes[i] / 2 : radius;
+
+    // levels, 2 scratch planes and a padded scratch row, in one allocation
+    int rowSize = baseImgW + 2 * radius + 2;
+    mpPyraData = new pyraDataType[total + 2 * baseImgW * baseImgH + rowSize];
+    mpTempData = mpPyraData + total;
+    mpColTemp = mpTempData + baseImgW * baseImgH;
+    mpTempRow = mpColTemp + baseImgW * baseImgH;
+
+    mPyramidDataPtrs.levelNum = l;
+    pyraDataType *pLevel = mpPyraData;
+    for (int i = 0; i != l; ++i)
+    {
+        mPyramidDataPtrs.levelPtr[i] = pLevel;
+        pLevel += mPyramidInfo.level_size[i] * channels;
+    }
+
+    return 0;
+}
+
+int pyramidBase::dinit()
+{
+    if (mpPyraData != NULL)
+        delete[] mpPyraData;
+    mpPyraData = NULL;
+    mpTempData = NULL;
+    mpColTemp = NULL;
+    mpTempRow = NULL;
+    memset(&mPyramidInfo, 0, sizeof(mPyramidInfo));
+    memset(&mPyramidDataPtrs, 0, sizeof(mPyramidDataPtrs));
+    return 0;
+}
+
+int pyramidBase::channelNum()
+{
+    return mChannels;
+}
+
+pyraDataType *pyramidBase::levelPlane(int level, int channel)
+{
+    return mPyramidDataPtrs.levelPtr[level] + channel * mPyramidInfo.level_size[level];
+}
+
+int pyramidBase::loadBase(const unsigned char *image, int stride)
+{
+    int w = mPyramidInfo.width[0];
+    for (int c = 0; c != mChannels; ++c)
+    {
+        pyraDataType *pDst = levelPlane(0, c);
+        for (int y = 0; y != mPyramidInfo.height[0]; ++y)
+        {
+            const unsigned char *pSrc = image + y * stride + c;
+            for (int x = 0; x != w; ++x)
+                pDst[x] = pSrc[x * mChannels];
+            pDst += w;
+        }
+    }
+    return 0;
+}
+
+void pyramidBase::smoothRowsGaussian(pyraDataType *pPlane, int width, int height)
+{// the row is copied with replicated borders, then every output is a symmetric sum over the padded copy
+    int r = mGaussianKernel.halfWindowWidth;
+    const float *g = mGaussianKernel.gCoeffs;
+    float *pPad = mpTempRow;
+    for (int y = 0; y != height; ++y)
+    {
+        float *pRow = pPlane + y * width;
+        for (int i = 0; i != width + 2 * r; ++i)
+            pPad[i] = pRow[clampIdx(i - r, width)];
+
+        const float *pC = pPad + r;
+        int x = 0;
+#ifdef BLENDER_USE_VEC4
+        for (; x + 4 <= width; x += 4)
+        {
+            vec4f acc = v4Mul(v4Load(pC + x), v4Set(g[0]));
+            for (int k = 1; k <= r; ++k)
+                acc = v4Mla(acc, v4Add(v4Load(pC + x - k), v4Load(pC + x + k)), v4Set(g[k]));
+            v4Store(pRow + x, acc);
+        }
+#endif
+        for (; x < width; ++x)
+        {
+            float acc = pC[x] * g[0];
+            for (int k = 1; k <= r; ++k)
+                acc += (pC[x - k] + pC[x + k]) * g[k];
+            pRow[x] = acc;
+        }
+    }
+}
+
+void pyramidBase::smoothColsGaussian(pyraDataType *pPlane, int width, int height)
+{// vertical pass over a copy of the plane, vectorized along the rows
+    int r = mGaussianKernel.halfWindowWidth;
+    const float *g = mGaussianKernel.gCoeffs;
+    memcpy(mpColTemp, pPlane, sizeof(pyraDataType) * width * height);
+    for (int y = 0; y != height; ++y)
+    {
+        float *pDst = pPlane + y * width;
+        const float *pC = mpColTemp + y * width;
+        int x = 0;
+#ifdef BLENDER_USE_VEC4
+        for (; x + 4 <= width; x += 4)
+        {
+            vec4f acc = v4Mul(v4Load(pC + x), v4Set(g[0]));
+            for (int k = 1; k <= r; ++k)
+            {
+                const float *pUp = mpColTemp + clampIdx(y - k, height) * width;
+                const float *pDown = mpColTemp + clampIdx(y + k, height) * width;
+                acc = v4Mla(acc, v4Add(v4Load(pUp + x), v4Load(pDown + x)), v4Set(g[k]));
+            }
+            v4Store(pDst + x, acc);
+        }
+#endif
+        for (; x < width; ++x)
+        {
+            float acc = pC[x] * g[0];
+            for (int k = 1; k <= r; ++k)
+                acc += (mpColTemp[clampIdx(y - k, height) * width + x] + mpColTemp[clampIdx(y + k, height) * width + x]) * g[k];
+            pDst[x] = acc;
+        }
+    }
+}
+
+void pyramidBase::smoothRowsBox(pyraDataType *pPlane, int width, int height, int boxSize)
+{// running sum along each row
+    int r = boxSize / 2;
+    float norm = 1.0f / boxSize;
+    for (int y = 0; y != height; ++y)
+    {
+        float *pRow = pPlane + y * width;
+        for (int i = 0; i != width + 2 * r + 2; ++i)
+            mpTempRow[i] = pRow[clampIdx(i - r - 1, width)];
+
+        float sum = 0.0f;
+        for (int i = 1; i <= 2 * r + 1; ++i)
+            sum += mpTempRow[i];
+        for (int x = 0; x != width; ++x)
+        {
+            pRow[x] = sum * norm;
+            sum += mpTempRow[x + 2 * r + 2] - mpTempRow[x + 1];
+        }
+    }
+}
+
+void pyramidBase::smoothColsBox(pyraDataType *pPlane, int width, int height, int boxSize)
+{// running sums of all columns at once, one row of accumulators
+    int r = boxSize / 2;
+    float norm = 1.0f / boxSize;
+    memcpy(mpColTemp, pPlane, sizeof(pyraDataType) * width * height);
+    float *pAcc = mpTempRow;
+    memset(pAcc, 0, sizeof(float) * width);
+    for (int k = -r; k <= r; ++k)
+        addRow(pAcc, mpColTemp + clampIdx(k, height) * width, 1.0f, width);
+
+    for (int y = 0; y != height; ++y)
+    {
+        float *pDst = pPlane + y * width;
+        int x = 0;
+#ifdef BLENDER_USE_VEC4
+        vec4f vn = v4Set(norm);
+        for (; x + 4 <= width; x += 4)
+            v4Store(pDst + x, v4Mul(v4Load(pAcc + x), vn));
+#endif
+        for (; x < width; ++x)
+            pDst[x] = pAcc[x] * norm;
+
+        addRow(pAcc, mpColTemp + clampIdx(y + r + 1, height) * width, 1.0f, width);
+        addRow(pAcc, mpColTemp + clampIdx(y - r, height) * width, -1.0f, width);
+    }
+}
+
+int pyramidBase::smooth(pyraDataType *pPlane, int width, int height)
+{
+    if (mKernelChoice == boxKernel)
+    {
+        for (int i = 0; i != mBoxKernel.boxNum; ++i)
+        {
+            smoothRowsBox(pPlane, width, height, mBoxKernel.boxSizes[i]);
+            smoothColsBox(pPlane, width, height, mBoxKernel.boxSizes[i]);
+        }
+    }
+    else
+    {
+        smoothRowsGaussian(pPlane, width, height);
+        smoothColsGaussian(pPlane, width, height);
+    }
+    return 0;
+}
+
+int pyramidBase::buildGaussian()
+{// blur and halve. a pixel of the next level is the mean of a 2 x 2 block, so its center sits at 2x + 0.5 as expand
+ // assumes (and as the mip levels of the GLES blend bands); the last column and row of an odd level repeat
+    for (int l = 0; l + 1 < mPyramidInfo.levelNum; ++l)
+    {
+        int w = mPyramidInfo.width[l], h = mPyramidInfo.height[l];
+        int nw = mPyramidInfo.width[l + 1], nh = mPyramidInfo.height[l + 1];
+        for (int c = 0; c != mChannels; ++c)
+        {
+            memcpy(mpTempData, levelPlane(l, c), sizeof(pyraDataType) * w * h);
+            smooth(mpTempData, w, h);
+
+            pyraDataType *pDst = levelPlane(l + 1, c);
+            for (int y = 0; y != nh; ++y)
+            {
+                const pyraDataType *pSrc0 = mpTempData + 2 * y * w;
+                const pyraDataType *pSrc1 = mpTempData + clampIdx(2 * y + 1, h) * w;
+                for (int x = 0; x != nw; ++x)
+                {
+                    int x1 = clampIdx(2 * x + 1, w);
+                    pDst[x] = 0.25f * (pSrc0[2 * x] + pSrc0[x1] + pSrc1[2 * x] + pSrc1[x1]);
+                }
+                pDst += nw;
+            }
+        }
+    }
+    return 0;
+}
+
+int pyramidBase::expand(const pyraDataType *pSrc, int srcW, int srcH, pyraDataType *pDst, int dstW, int dstH)
+{// pixel centers of the upper level sit at 2x + 0.5, so each output mixes its nearest source by 3/4 and the next by 1/4
+    // horizontal, into mpColTemp (dstW x srcH)
+    for (int y = 0; y != srcH; ++y)
+    {
+        const pyraDataType *pRow = pSrc + y * srcW;
+        pyraDataType *pOut = mpColTemp + y * dstW;
+        for (int x = 0; x != dstW; ++x)
+        {
+            int i = x >> 1;
+            int j = clampIdx((x & 1) ? i + 1 : i - 1, srcW);
+            i = clampIdx(i, srcW);
+            pOut[x] = 0.75f * pRow[i] + 0.25f * pRow[j];
+        }
+    }
+
+    // vertical
+    for (int y = 0; y != dstH; ++y)
+    {
+        int i = y >> 1;
+        int j = clampIdx((y & 1) ? i + 1 : i - 1, srcH);
+        i = clampIdx(i, srcH);
+        weightedSumRow(pDst + y * dstW, mpColTemp + i * dstW, mpColTemp + j * dstW, 0.75f, 0.25f, dstW);
+    }
+    return 0;
+}
+
+
+// ====================================================================
+pyramidGaussian::pyramidGaussian()
+{
+}
+
+pyramidGaussian::~pyramidGaussian()
+{
+}
+
+int pyramidGaussian::pyraBuild(const unsigned char *image, int stride)
+{
+    if (mpPyraData == NULL)
+        return -1;
+
+    loadBase(image, stride);
+    return buildGaussian();
+}
+
+int pyramidGaussian::levelWeightedSum(pyramidBase *pPyraL, pyramidBase *pPyraR)
+{// L = R + m * (L - R), m in 0 ~ 1
+    if (mpPyraData == NULL || pPyraR->channelNum() != pPyraL->channelNum() || pPyraL->mPyramidInfo.levelNum != mPyramidInfo.levelNum || pPyraR->mPyramidInfo.levelNum != mPyramidInfo.levelNum)
+        return -1;
+
+    const float inv255 = 1.0f / 255.0f;
+    int channels = pPyraL->channelNum();
+    for (int l = 0; l != mPyramidInfo.levelNum; ++l)
+    {
+        int n = mPyramidInfo.level_size[l];
+        const float *pM = levelPlane(l, 0);
+        for (int c = 0; c != channels; ++c)
+        {
+            float *pL = pPyraL->levelPlane(l, c);
+            const float *pR = pPyraR->levelPlane(l, c);
+            int i = 0;
+#ifdef BLENDER_USE_VEC4
+            vec4f vk = v4Set(inv255);
+            for (; i + 4 <= n; i += 4)
+            {
+                vec4f r = v4Load(pR + i);
+                v4Store(pL + i, v4Mla(r, v4Sub(v4Load(pL + i), r), v4Mul(v4Load(pM + i), vk)));
+            }
+#endif
+            for (; i < n; ++i)
+                pL[i] = pR[i] + (pL[i] - pR[i]) * pM[i] * inv255;
+        }
+    }
+    return 0;
+}
+
+
+// ====================================================================
+pyramidLOG::pyramidLOG()
+{
+}
+
+pyramidLOG::~pyramidLOG()
+{
+}
+
+int pyramidLOG::pyraBuild(const unsigned char *image, int stride)
+{// gaussian first, then every level but the top one keeps what the expanded next level misses
+    if (mpPyraData == NULL)
+        return -1;
+
+    loadBase(image, stride);
+    buildGaussian();
+    for (int l = 0; l + 1 < mPyramidInfo.levelNum; ++l)
+    {
+        int w = mPyramidInfo.width[l], h = mPyramidInfo.height[l];
+        for (int c = 0; c != mChannels; ++c)
+        {
+            expand(levelPlane(l + 1, c), mPyramidInfo.width[l + 1], mPyramidInfo.height[l + 1], mpTempData, w, h);
+            addRow(levelPlane(l, c), mpTempData, -1.0f, w * h);
+        }
+    }
+    return 0;
+}
+
+int pyramidLOG::pyraReconstuct(unsigned char *image, int stride)
+{// collapse from the top, the levels are overwritten
+    if (mpPyraData == NULL)
+        return -1;
+
+    for (int l = mPyramidInfo.levelNum - 2; l >= 0; --l)
+    {
+        int w = mPyramidInfo.width[l], h = mPyramidInfo.height[l];
+        for (int c = 0; c != mChannels; ++c)
+        {
+            expand(levelPlane(l + 1, c), mPyramidInfo.width[l + 1], mPyramidInfo.height[l + 1], mpTempData, w, h);
+            addRow(levelPlane(l, c), mpTempData, 1.0f, w * h);
+        }
+    }
+
+    int w = mPyramidInfo.width[0];
+    for (int c = 0; c != mChannels; ++c)
+    {
+        const pyraDataType *pSrc = levelPlane(0, c);
+        for (int y = 0; y != mPyramidInfo.height[0]; ++y)
+        {
+            unsigned char *pDst = image + y * stride + c;
+            for (int x = 0; x != w; ++x)
+            {
+                float v = pSrc[x] + 0.5f;
+                pDst[x * mChannels] = (v <= 0.0f) ? 0 : ((v >= 255.0f) ? 255 : (unsigned char)v);
+            }
+            pSrc += w;
+        }
+    }
+    return 0;
+}
 
 
 // ====================================================================
 ImageBlender::ImageBlender() :
 	pMaskY(NULL),
 	pMaskUV(NULL),
-	pMaskStitchEdge(NULL)
+	pMaskStitchEdge(NULL),
+	mMultiBandValid(false)
 {
 }
 
@@ -60,8 +566,84 @@ int ImageBlender::loadMask(char *filePath, int width, int height)
     return 0;
 }
 
+unsigned char ImageBlender::maskAt(int x, int y, int imgW, int imgH)
+{// the mask may be smaller than the images, nearest lookup
+    return pMaskY[(y * mSizeH / imgH) * mSizeW + x * mSizeW / imgW];
+}
+
+int ImageBlender::initMultiBand(imageRoi seamRoi, int levelNum, float sigma, kernelChoice kernel)
+{
+    mMultiBandValid = false;
+    if (pMaskY == NULL || seamRoi.roiW < 2 || seamRoi.roiH < 2)
+        return -1;
+
+    if (mPyraL.init(levelNum, seamRoi.roiW, seamRoi.roiH, 3, sigma, kernel) != 0 ||
+        mPyraR.init(levelNum, seamRoi.roiW, seamRoi.roiH, 3, sigma, kernel) != 0 ||
+        mPyraMask.init(levelNum, seamRoi.roiW, seamRoi.roiH, 1, sigma, kernel) != 0)
+        return -1;
+
+    // the mask doesn't change between frames, so its pyramid is built once
+    unsigned char *pRoiMask = new unsigned char[seamRoi.roiW * seamRoi.roiH];
+    for (int y = 0; y != seamRoi.roiH; ++y)
+        for (int x = 0; x != seamRoi.roiW; ++x)
+            pRoiMask[y * seamRoi.roiW + x] = maskAt(seamRoi.roiX + x, seamRoi.roiY + y, seamRoi.imgW, seamRoi.imgH);
+    mPyraMask.pyraBuild(pRoiMask, seamRoi.roiW);
+    delete[] pRoiMask;
+
+    mSeamRoi = seamRoi;
+    mMultiBandValid = true;
+    return 0;
+}
+
+int ImageBlender::blendMultiBand(imageFrame imgL, imageFrame imgR, imageFrame outImg)
+{
+    STITCH_PROFILE_SCOPE(profileBlend);
+    if (!mMultiBandValid)
+        return -1;
+    if (imgL.pxlColorFormat != PIXELCOLORSPACE_RGB || imgR.pxlColorFormat != PIXELCOLORSPACE_RGB || outImg.pxlColorFormat != PIXELCOLORSPACE_RGB ||
+        imgL.imageW != mSeamRoi.imgW || imgL.imageH != mSeamRoi.imgH || imgR.imageW != mSeamRoi.imgW || imgR.imageH != mSeamRoi.imgH ||
+        outImg.imageW != mSeamRoi.imgW || outImg.imageH != mSeamRoi.imgH)
+        return -1;
+
+    // outside the seam the mask alone decides, it is 0 or 255 there for the usual masks
+    for (int y = 0; y != mSeamRoi.imgH; ++y)
+    {
+        const unsigned char *pL = imgL.plane[0] + y * imgL.strides[0];
+        const unsigned char *pR = imgR.plane[0] + y * imgR.strides[0];
+        unsigned char *pOut = outImg.plane[0] + y * outImg.strides[0];
+        bool inSeamRows = (y >= mSeamRoi.roiY && y < mSeamRoi.roiY + mSeamRoi.roiH);
+        for (int x = 0; x != mSeamRoi.imgW; ++x)
+        {
+            if (inSeamRows && x == mSeamRoi.roiX)
+            {
+                x += mSeamRoi.roiW - 1;
+                continue;
+            }
+            int m = maskAt(x, y, mSeamRoi.imgW, mSeamRoi.imgH);
+            for (int c = 0; c != 3; ++c)
+                pOut[3 * x + c] = (unsigned char)((pL[3 * x + c] * m + pR[3 * x + c] * (255 - m) + 127) / 255);
+        }
+    }
+
+    // inside, band by band
+    int offsetL = mSeamRoi.roiY * imgL.strides[0] + mSeamRoi.roiX * 3;
+    int offsetR = mSeamRoi.roiY * imgR.strides[0] + mSeamRoi.roiX * 3;
+    int offsetOut = mSeamRoi.roiY * outImg.strides[0] + mSeamRoi.roiX * 3;
+    mPyraL.pyraBuild(imgL.plane[0] + offsetL, imgL.strides[0]);
+    mPyraR.pyraBuild(imgR.plane[0] + offsetR, imgR.strides[0]);
+    mPyraMask.levelWeightedSum(&mPyraL, &mPyraR);
+    mPyraL.pyraReconstuct(outImg.plane[0] + offsetOut, outImg.strides[0]);
+
+    return 0;
+}
+
 int ImageBlender::dinit()
 {
+    mMultiBandValid = false;
+    mPyraL.dinit();
+    mPyraR.dinit();
+    mPyraMask.dinit();
+
     mSizeW = 0;
     mSizeH = 0;
     if (pMaskY != NULL)
@@ -60,60 +60,48 @@ struct PyramidDataPtrs
     pyraDataType *levelPtr[MAX_PYRAMID_LEVELS];
 };
 
-class ImageBlender
-{
-public:
-    ImageBlender();
-    ~ImageBlender();
-
-    int init(int sizeW, int sizeH);
-//     int genMask(float sigma, blenderSeamDirection direction);
-    int loadMask(char *filePath, int width, int height);    // single channel mask only
-
-   /* int weightedSumByMask1Level(imageDataType *inImgLeft, imageDataType *inImgRight, imageDataType *mask, imageDataType *outImg, int mask_size);
-    int weightedSumByMask1Level(unsigned char *inImgLeft, unsigned char *inImgRight, unsigned char *mask, unsigned char *outImg, int mask_size);
-
-    int weightedSumByMask(imageFrame imgLeft, imageFrame imgRight, imageFrame outImg);
-
-    int weightEdge(unsigned char *image, int size);*/
-
-    int dinit();
-
-    //private:
-    int mSizeW;
-    int mSizeH;
-    bool uvMaskValid;
-    unsigned char *pMaskY;
-    unsigned char *pMaskUV;
-
-    unsigned char *pMaskStitchEdge; // for test only
-};
-
-#if 0
-
 class pyramidBase
-{
+{// levelNum levels of planar float images, level 0 has the size of the base image and every next one half of it.
+ // all levels and the smoothing scratch live in one arena allocated by init
 public:
     pyramidBase();
-    ~pyramidBase();
+    virtual ~pyramidBase();
 
-    int init(int levelNum, int baseImgW, int baseImgH, float sigma, kernelChoice mkernel);
+    int init(int levelNum, int baseImgW, int baseImgH, int channels, float sigma, kernelChoice mkernel);
+    int dinit();
+
+    // build up this pyramid(just fill up the content of each level) from an interleaved 8 bit image
+    virtual int pyraBuild(const unsigned char *image, int stride) = 0;
 
-    // build up this pyramid(just fill up the content of each level)
-    virtual int pyraBuild(unsigned char *image) = 0;
+    // plane of a channel in a level
+    pyraDataType *levelPlane(int level, int channel);
+    int channelNum();
 
     PyramidInfo mPyramidInfo;
     PyramidDataPtrs mPyramidDataPtrs;
 
 protected:
+    int loadBase(const unsigned char *image, int stride);   // deinterleave into level 0
+    int buildGaussian();                                    // level 1 ~ levelNum - 1 from level 0
+    int smooth(pyraDataType *pPlane, int width, int height);  // separable blur in place
+    int expand(const pyraDataType *pSrc, int srcW, int srcH, pyraDataType *pDst, int dstW, int dstH);  // bilinear upsample
+
     kernelChoice mKernelChoice;
     BoxKernel mBoxKernel;
     GaussianKernel mGaussianKernel;
+    int mChannels;
 
-    pyraDataType *mpPyraData;
+    pyraDataType *mpPyraData;   // the arena
+    pyraDataType *mpTempData;   // scratch of one base plane, inside the arena
+    pyraDataType *mpColTemp;    // second base plane, used by smooth and expand themselves
+    pyraDataType *mpTempRow;    // scratch of one base row (plus a box window), inside the arena
 
 private:
-
+    int genKernels(float sigma);
+    void smoothRowsGaussian(pyraDataType *pPlane, int width, int height);
+    void smoothColsGaussian(pyraDataType *pPlane, int width, int height);
+    void smoothRowsBox(pyraDataType *pPlane, int width, int height, int boxSize);
+    void smoothColsBox(pyraDataType *pPlane, int width, int height, int boxSize);
 };
 
 class pyramidGaussian : public pyramidBase
@@ -122,31 +110,76 @@ public:
     pyramidGaussian();
     ~pyramidGaussian();
 
-    int pyraBuild(unsigned char *image);
+    int pyraBuild(const unsigned char *image, int stride);
 
-    // use this gaussian pyramid as mask to weight and summary 2 pyramids
+    // use this gaussian pyramid as mask to weight and summary 2 pyramids, the result is written into pPyraL.
+    // a mask value of 255 takes pPyraL, 0 takes pPyraR
     int levelWeightedSum(pyramidBase *pPyraL, pyramidBase *pPyraR);
 
-    ImageBlender mImageBlender;
 private:
 
 };
 
 class pyramidLOG : public pyramidBase
-{
+{// laplacian pyramid, the top level keeps the gaussian residual
 public:
     pyramidLOG();
     ~pyramidLOG();
 
-    int pyraBuild(unsigned char *image);
+    int pyraBuild(const unsigned char *image, int stride);
 
-    int pyraReconstuct(unsigned char *image);
+    int pyraReconstuct(unsigned char *image, int stride);
 
 private:
 
 };
 
-#endif
+class ImageBlender
+{
+public:
+    ImageBlender();
+    ~ImageBlender();
+
+    int init(int sizeW, int sizeH);
+//     int genMask(float sigma, blenderSeamDirection direction);
+    int loadMask(char *filePath, int width, int height);    // single channel mask only
+
+    // pyramids for multi band blending of the seam roi of RGB images, allocated once here.
+    // the mask (pMaskY, covering the whole image) must be loaded before
+    int initMultiBand(imageRoi seamRoi, int levelNum, float sigma, kernelChoice kernel);
+
+    // outImg = imgL * mask + imgR * (1 - mask), blended band by band inside the seam roi and
+    // by the mask alone outside of it. all 3 are RGB frames of seamRoi.imgW x seamRoi.imgH
+    int blendMultiBand(imageFrame imgL, imageFrame imgR, imageFrame outImg);
+
+    // mask value at an image pixel, the mask may be smaller than the image
+    unsigned char maskAt(int x, int y, int imgW, int imgH);
+
+   /* int weightedSumByMask1Level(imageDataType *inImgLeft, imageDataType *inImgRight, imageDataType *mask, imageDataType *outImg, int mask_size);
+    int weightedSumByMask1Level(unsigned char *inImgLeft, unsigned char *inImgRight, unsigned char *mask, unsigned char *outImg, int mask_size);
+
+    int weightedSumByMask(imageFrame imgLeft, imageFrame imgRight, imageFrame outImg);
+
+    int weightEdge(unsigned char *image, int size);*/
+
+    int dinit();
+
+    //private:
+    int mSizeW;
+    int mSizeH;
+    bool uvMaskValid;
+    unsigned char *pMaskY;
+    unsigned char *pMaskUV;
+
+    unsigned char *pMaskStitchEdge; // for test only
+
+private:
+    bool mMultiBandValid;
+    imageRoi mSeamRoi;
+    pyramidLOG mPyraL;
+    pyramidLOG mPyraR;
+    pyramidGaussian mPyraMask;
+};
 
 }   // namespace util
 }   // namespace YiPanorama
@@ -1,8 +1,18 @@
 
 #include "ImageColorAdjuster.h"
+#include "StitchProfiler.h"
 
 #include <math.h>
 #include <string.h>
+#include <iostream>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ADJUSTER_USE_NEON
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ADJUSTER_USE_SSE2
+#endif
 
 namespace YiPanorama {
 namespace util {
@@ -12,17 +22,18 @@ namespace util {
 #define M_PI_4     0.785398163397448309616  // pi/4
 
 #define EXPOSURE_WEIGHT_THRES 150
+#define IDENTITY_LUT_IDX    -1  // scanlines which are left untouched
 
 // =============================================================================
 //------------------------------------------------------------------------------
-float colorSummary1Chn1Roi(unsigned char *img, imageRoi roiInImage)
-{// calculate the average intensity of the roi area in the image
+float colorSummary1Chn1Roi(unsigned char *img, int stride, imageRoi roiInImage)
+{// calculate the average intensity of the roi area in the image, whose rows are stride bytes apart
 
     unsigned char *pImg = img;
     int count = 0;
     double amout = 0.0;
 
-    pImg += roiInImage.imgW * roiInImage.roiY + roiInImage.roiX;
+    pImg += stride * roiInImage.roiY + roiInImage.roiX;
     for (int k = 0; k < roiInImage.roiH; k++)
     {
         for (int m = 0; m < roiInImage.roiW; m++)
@@ -30,31 +41,93 @@ float colorSummary1Chn1Roi(unsigned char *img, imageRoi roiInImage)
             amout += *(pImg + m);
             count++;
         }
-        pImg += roiInImage.imgW;
+        pImg += stride;
     }
 
     return amout / count;
 }
 
-int colorSummary3Chn1Roi(unsigned char *img, imageRoi roiInImage, double *average)
-{// calculate the R,G,B three channel average intensity of the roi area in the image
+int colorSummary3Chn1Roi(unsigned char *img, int stride, imageRoi roiInImage, double *average)
+{// calculate the R,G,B three channel average intensity of the roi area in the image, whose rows are stride bytes apart
+ // (pooled frames pad them). integer sums all the way, 16 pixels per step
+
+	if (roiInImage.roiW <= 0 || roiInImage.roiH <= 0)
+		return -1;
 
-	unsigned char *pImg = img;
-	int count = 0;
-	double amout[3] = { 0.0, 0.0, 0.0 };
+	unsigned long long amout[3] = { 0, 0, 0 };
+	unsigned char *pRow = img + stride * roiInImage.roiY + roiInImage.roiX * 3;
+
+#if defined(ADJUSTER_USE_SSE2)
+	// byte j of the k-th 16 bytes of a 48 byte block belongs to channel (j + 16 * k) % 3,
+	// so each channel is picked by a mask and summed up by psadbw into 64 bit lanes
+	__m128i chnMasks[3][3];
+	for (int k = 0; k != 3; ++k)
+	{
+		for (int c = 0; c != 3; ++c)
+		{
+			unsigned char bytes[16];
+			for (int j = 0; j != 16; ++j)
+				bytes[j] = ((j + 16 * k) % 3 == c) ? 0xff : 0;
+			chnMasks[k][c] = _mm_loadu_si128((const __m128i *)bytes);
+		}
+	}
+	__m128i sums[3] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+	const __m128i zero = _mm_setzero_si128();
+#endif
 
-	pImg += roiInImage.imgW * 3 * roiInImage.roiY + roiInImage.roiX * 3;
 	for (int k = 0; k < roiInImage.roiH; k++)
 	{
-		for (int m = 0; m < roiInImage.roiW; m++)
+		int m = 0;
+#if defined(ADJUSTER_USE_NEON)
+		uint32x4_t sum32[3] = { vdupq_n_u32(0), vdupq_n_u32(0), vdupq_n_u32(0) };
+		while (m + 16 <= roiInImage.roiW)
+		{// 16 bit partial sums hold 128 steps of 2 x 255
+			uint16x8_t sum16[3] = { vdupq_n_u16(0), vdupq_n_u16(0), vdupq_n_u16(0) };
+			for (int n = 0; n != 128 && m + 16 <= roiInImage.roiW; ++n, m += 16)
+			{
+				uint8x16x3_t rgb = vld3q_u8(pRow + 3 * m);
+				sum16[0] = vpadalq_u8(sum16[0], rgb.val[0]);
+				sum16[1] = vpadalq_u8(sum16[1], rgb.val[1]);
+				sum16[2] = vpadalq_u8(sum16[2], rgb.val[2]);
+			}
+			for (int c = 0; c != 3; ++c)
+				sum32[c] = vpadalq_u16(sum32[c], sum16[c]);
+		}
+		for (int c = 0; c != 3; ++c)
+		{
+			uint64x2_t sum64 = vpaddlq_u32(sum32[c]);
+			amout[c] += vgetq_lane_u64(sum64, 0) + vgetq_lane_u64(sum64, 1);
+		}
+#elif defined(ADJUSTER_USE_SSE2)
+		for (; m + 16 <= roiInImage.roiW; m += 16)
 		{
-			amout[0] += *(pImg + 3 * m + 0);
-			amout[1] += *(pImg + 3 * m + 1);
-			amout[2] += *(pImg + 3 * m + 2);
-			count++;
+			for (int b = 0; b != 3; ++b)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i *)(pRow + 3 * m + 16 * b));
+				for (int c = 0; c != 3; ++c)
+					sums[c] = _mm_add_epi64(sums[c], _mm_sad_epu8(_mm_and_si128(v, chnMasks[b][c]), zero));
+			}
 		}
-		pImg += roiInImage.imgW * 3;
+#endif
+		for (; m < roiInImage.roiW; m++)
+		{
+			amout[0] += *(pRow + 3 * m + 0);
+			amout[1] += *(pRow + 3 * m + 1);
+			amout[2] += *(pRow + 3 * m + 2);
+		}
+		pRow += stride;
+	}
+
+#if defined(ADJUSTER_USE_SSE2)
+	for (int c = 0; c != 3; ++c)
+	{
+		unsigned long long lanes[2];
+		_mm_storeu_si128((__m128i *)lanes, sums[c]);
+		amout[c] += lanes[0] + lanes[1];
 	}
+#endif
+
+	double count = (double)roiInImage.roiW * roiInImage.roiH;
 	average[0] = amout[0] / count;
 	average[1] = amout[1] / count;
 	average[2] = amout[2] / count;
@@ -62,13 +135,14 @@ int colorSummary3Chn1Roi(unsigned char *img, imageRoi roiInImage, double *averag
 }
 
 int colorSummary1Target(colorSummaryTarget *pColorSummaryTarget)
-{
+{// all sections lie in the one frame of the target
     imageRoi localRoi;
+    imageFrame *pFrame = pColorSummaryTarget->pSummaryFrame;
     for (int k = 0; k < pColorSummaryTarget->mSectionNum; k++)
     {
 		localRoi = pColorSummaryTarget->pSectionRois[k];
 		double tmpAverage[3] = { 0.0 };
-		colorSummary3Chn1Roi(pColorSummaryTarget->pSummaryFrame[k].plane[0], localRoi, tmpAverage);
+		colorSummary3Chn1Roi(pFrame->plane[0], pFrame->strides[0], localRoi, tmpAverage);
         for (int m = 0; m < 3; m++)
         {
             pColorSummaryTarget->mAverages[m][k] = tmpAverage[m];
@@ -78,7 +152,8 @@ int colorSummary1Target(colorSummaryTarget *pColorSummaryTarget)
 }
 
     colorAdjuster::colorAdjuster():
-		mAdjustTargets(NULL), mSummaryTargets(NULL)
+		mColorAdjustHeadTailConnection(straight),   // the sections run from pole to pole, the ends don't meet
+		mAdjustTargets(NULL), mSummaryTargets(NULL), mpScanlineLuts(NULL), mpScanlineLutIdx(NULL), mScanlineLutCapacity(0)
     {
     }
 
@@ -160,6 +235,15 @@ int colorAdjuster::dinit()
         delete[] mAdjustTargets;
         mAdjustTargets = NULL;
     }
+
+    if (mpScanlineLuts != NULL)
+    {
+        delete[] mpScanlineLuts;
+        delete[] mpScanlineLutIdx;
+        mpScanlineLuts = NULL;
+        mpScanlineLutIdx = NULL;
+    }
+    mScanlineLutCapacity = 0;
     return 0;
 }
 
@@ -359,78 +443,142 @@ int colorAdjuster::colorCoeffScanline()
 }
 
 //------------------------------------------------------------------------------
-int colorAdjustLuminChnScanline(unsigned char *img, int imageW, int imageH, int scanlineLen, float *coeffs, float *weights, colorAdjustScanlineDirection ColorAdjustScanlineDirection)
-{// adjust the image between borders using the coefficients which has same length of the image
- // and the weights is the exposure curbs
-    unsigned char *pImg = img;
-    float *pCoeffs = coeffs;
-    int tmpPixelValue;
-
-    if (ColorAdjustScanlineDirection == horizontal)
+int colorAdjuster::colorScanlineLuts(colorAdjustTarget *pAdjustTarget)
+{// one R,G,B lut triple per scanline: v -> (1 + (coeff - 1) * curb[v]) * v.
+ // scanlines whose coefficients are too close to 1 to change any value get no lut at all,
+ // and runs of equal coefficients (the middle of every section) share one
+    int len = pAdjustTarget->coeffsLen[0];
+    if (len > mScanlineLutCapacity)
     {
-        for (int k = 0; k < imageH; k++)
+        if (mpScanlineLuts != NULL)
         {
-            pCoeffs = coeffs;
-            for (int m = 0; m < imageW; m++)
-            {
-                tmpPixelValue = (1 + (*pCoeffs - 1)*weights[*pImg])**pImg + 0.5;
-                *pImg++ = tmpPixelValue > 255 ? 255 : (tmpPixelValue < 0 ? 0 : tmpPixelValue);
-                pCoeffs++;
-            }
-
+            delete[] mpScanlineLuts;
+            delete[] mpScanlineLutIdx;
         }
-    } 
-    else
+        mpScanlineLuts = new unsigned char[len * 3 * GRAY_SCALE];
+        mpScanlineLutIdx = new int[len];
+        mScanlineLutCapacity = len;
+    }
+
+    int lutNum = 0;
+    float prevCoeffs[3] = { 1.0f, 1.0f, 1.0f };
+    for (int i = 0; i != len; ++i)
     {
-        for (int k = 0; k < imageH; k++)
+        float c[3] = { pAdjustTarget->coeffs[0][i], pAdjustTarget->coeffs[1][i], pAdjustTarget->coeffs[2][i] };
+        if (fabsf(c[0] - 1.0f) * 255.0f < 0.5f && fabsf(c[1] - 1.0f) * 255.0f < 0.5f && fabsf(c[2] - 1.0f) * 255.0f < 0.5f)
+        {
+            mpScanlineLutIdx[i] = IDENTITY_LUT_IDX;
+            continue;
+        }
+        if (lutNum > 0 && c[0] == prevCoeffs[0] && c[1] == prevCoeffs[1] && c[2] == prevCoeffs[2])
+        {
+            mpScanlineLutIdx[i] = lutNum - 1;
+            continue;
+        }
+
+        unsigned char *pLut = mpScanlineLuts + lutNum * 3 * GRAY_SCALE;
+        for (int chn = 0; chn != 3; ++chn)
         {
-            //pCoeffs = coeffs;
-            for (int m = 0; m < imageW; m++)
+            for (int v = 0; v != GRAY_SCALE; ++v)
             {
-                tmpPixelValue = (1 + (*pCoeffs - 1)*weights[*pImg])**pImg + 0.5;
-                *pImg++ = tmpPixelValue > 255 ? 255 : (tmpPixelValue < 0 ? 0 : tmpPixelValue);
+                int tmpPixelValue = (int)((1 + (c[chn] - 1) * mExpoCurbWeights[v]) * v + 0.5f);
+                pLut[chn * GRAY_SCALE + v] = tmpPixelValue > 255 ? 255 : (tmpPixelValue < 0 ? 0 : tmpPixelValue);
             }
-            pCoeffs++;
+            prevCoeffs[chn] = c[chn];
         }
+        mpScanlineLutIdx[i] = lutNum++;
     }
 
-    return 0;
+    return lutNum;
 }
 
-//------------------------------------------------------------------------------
-int colorAdjustChromChnScanline(unsigned char *img, int imageW, int imageH, int scanlineLen, float *coeffs, colorAdjustScanlineDirection ColorAdjustScanlineDirection)
-{// adjust the image between borders using the coefficients which has same length of the image
- // since this is UV channel, no exposure curbing is performed.
-    unsigned char *pImg = img;
-    float *pCoeffs = coeffs;
-    int tmpPixelValue;
-
-    //pImg += imgW * upBorder;    // pointing to the start of the area needed to be adjusted
+#if defined(ADJUSTER_USE_NEON) && defined(__aarch64__)
+static inline uint8x16_t lut256(const uint8x16x4_t lut[4], uint8x16_t v)
+{// tbl yields 0 for indices out of its 64 entries, tbx keeps the lane, so the 4 quarters chain up
+    const uint8x16_t step = vdupq_n_u8(64);
+    uint8x16_t r = vqtbl4q_u8(lut[0], v);
+    v = vsubq_u8(v, step);
+    r = vqtbx4q_u8(r, lut[1], v);
+    v = vsubq_u8(v, step);
+    r = vqtbx4q_u8(r, lut[2], v);
+    v = vsubq_u8(v, step);
+    return vqtbx4q_u8(r, lut[3], v);
+}
+#endif
 
-    if (ColorAdjustScanlineDirection == horizontal)
+static void colorAdjustRowLut(unsigned char *pRow, int width, const unsigned char *pLut)
+{// all pixels of the row through the same R,G,B luts
+    const unsigned char *pLutR = pLut;
+    const unsigned char *pLutG = pLut + GRAY_SCALE;
+    const unsigned char *pLutB = pLut + 2 * GRAY_SCALE;
+    int m = 0;
+#if defined(ADJUSTER_USE_NEON) && defined(__aarch64__)
+    uint8x16x4_t luts[3][4];
+    for (int c = 0; c != 3; ++c)
+        for (int q = 0; q != 4; ++q)
+            luts[c][q] = vld1q_u8_x4(pLut + c * GRAY_SCALE + q * 64);
+    for (; m + 16 <= width; m += 16)
+    {
+        uint8x16x3_t rgb = vld3q_u8(pRow + 3 * m);
+        rgb.val[0] = lut256(luts[0], rgb.val[0]);
+        rgb.val[1] = lut256(luts[1], rgb.val[1]);
+        rgb.val[2] = lut256(luts[2], rgb.val[2]);
+        vst3q_u8(pRow + 3 * m, rgb);
+    }
+#endif
+    for (; m + 4 <= width; m += 4)
+    {
+        unsigned char *p = pRow + 3 * m;
+        p[0] = pLutR[p[0]]; p[1] = pLutG[p[1]]; p[2] = pLutB[p[2]];
+        p[3] = pLutR[p[3]]; p[4] = pLutG[p[4]]; p[5] = pLutB[p[5]];
+        p[6] = pLutR[p[6]]; p[7] = pLutG[p[7]]; p[8] = pLutB[p[8]];
+        p[9] = pLutR[p[9]]; p[10] = pLutG[p[10]]; p[11] = pLutB[p[11]];
+    }
+    for (; m < width; ++m)
     {
-        for (int k = 0; k < imageH; k++)
+        unsigned char *p = pRow + 3 * m;
+        p[0] = pLutR[p[0]]; p[1] = pLutG[p[1]]; p[2] = pLutB[p[2]];
+    }
+}
+
+//------------------------------------------------------------------------------
+int colorAdjuster::colorAdjustRGBScanline(colorAdjustTarget *pAdjustTarget)
+{// adjust the image along the scanlines, using the coefficients which have the same length as the scanline direction of the image
+ // and the exposure curb weights, both folded into the luts
+    imageFrame *pFrame = pAdjustTarget->pAdjustFrame;
+    if (colorScanlineLuts(pAdjustTarget) == 0)
+        return 0;   // nothing differs from 1
+
+    if (pAdjustTarget->mAdjustDirection == vertical)
+    {// a coefficient per row
+        int rows = (pFrame->imageH < pAdjustTarget->coeffsLen[0]) ? pFrame->imageH : pAdjustTarget->coeffsLen[0];
+        for (int k = 0; k < rows; k++)
         {
-            pCoeffs = coeffs;
-            for (int m = 0; m < imageW; m++)
-            {
-                tmpPixelValue = *pCoeffs**pImg + 0.5;
-                *pImg++ = tmpPixelValue > 255 ? 255 : (tmpPixelValue < 0 ? 0 : tmpPixelValue);
-                pCoeffs++;
-            }
+            if (mpScanlineLutIdx[k] == IDENTITY_LUT_IDX)
+                continue;
+            colorAdjustRowLut(pFrame->plane[0] + k * pFrame->strides[0], pFrame->imageW, mpScanlineLuts + mpScanlineLutIdx[k] * 3 * GRAY_SCALE);
         }
     }
     else
-    {
-        for (int k = 0; k < imageH; k++)
+    {// a coefficient per column, only the column runs that change are walked
+        int cols = (pFrame->imageW < pAdjustTarget->coeffsLen[0]) ? pFrame->imageW : pAdjustTarget->coeffsLen[0];
+        for (int k = 0; k < pFrame->imageH; k++)
         {
-            //pCoeffs = coeffs;
-            for (int m = 0; m < imageW; m++)
+            unsigned char *pRow = pFrame->plane[0] + k * pFrame->strides[0];
+            int m = 0;
+            while (m < cols)
             {
-                tmpPixelValue = *pCoeffs**pImg + 0.5;
-                *pImg++ = tmpPixelValue > 255 ? 255 : (tmpPixelValue < 0 ? 0 : tmpPixelValue);
+                if (mpScanlineLutIdx[m] == IDENTITY_LUT_IDX)
+                {
+                    ++m;
+                    continue;
+                }
+                int runEnd = m + 1;
+                while (runEnd < cols && mpScanlineLutIdx[runEnd] == mpScanlineLutIdx[m])
+                    ++runEnd;
+                colorAdjustRowLut(pRow + 3 * m, runEnd - m, mpScanlineLuts + mpScanlineLutIdx[m] * 3 * GRAY_SCALE);
+                m = runEnd;
             }
-            pCoeffs++;
         }
     }
 
@@ -439,9 +587,16 @@ int colorAdjustChromChnScanline(unsigned char *img, int imageW, int imageH, int
 
 int colorAdjuster::colorAdjust()
 {
-    colorAdjustLuminChnScanline(mAdjustTargets->pAdjustFrame->plane[0], mAdjustTargets->pAdjustFrame->imageW, mAdjustTargets->pAdjustFrame->imageH, mAdjustTargets->coeffsLen[0], mAdjustTargets->coeffs[0], mExpoCurbWeights, mAdjustTargets->mAdjustDirection);
-    colorAdjustChromChnScanline(mAdjustTargets->pAdjustFrame->plane[1], mAdjustTargets->pAdjustFrame->imageW / 2, mAdjustTargets->pAdjustFrame->imageH / 2, mAdjustTargets->coeffsLen[1], mAdjustTargets->coeffs[1], mAdjustTargets->mAdjustDirection);
-    colorAdjustChromChnScanline(mAdjustTargets->pAdjustFrame->plane[2], mAdjustTargets->pAdjustFrame->imageW / 2, mAdjustTargets->pAdjustFrame->imageH / 2, mAdjustTargets->coeffsLen[2], mAdjustTargets->coeffs[2], mAdjustTargets->mAdjustDirection);
+    STITCH_PROFILE_SCOPE(profileColorAdjust);
+    for (int k = 0; k < mTargetImageNum; k++)
+    {
+        if (mAdjustTargets[k].pAdjustFrame->pxlColorFormat != PIXELCOLORSPACE_RGB)
+        {
+            std::cout << "colorAdjuster::colorAdjust: only RGB targets are supported" << std::endl;
+            return -1;
+        }
+        colorAdjustRGBScanline(&mAdjustTargets[k]);
+    }
 
     return 0;
 }
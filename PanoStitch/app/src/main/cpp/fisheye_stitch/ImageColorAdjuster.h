@@ -88,6 +88,9 @@ public:
 
     int colorCoeffScanline();
 
+    int colorScanlineLuts(colorAdjustTarget *pAdjustTarget);    // luts of the scanlines to adjust, returns how many were built
+    int colorAdjustRGBScanline(colorAdjustTarget *pAdjustTarget);
+
     int mSummaryImageNum;   
     int mTargetImageNum;
     //int mSummarySectionNumOfEachRoi; // sections of each summary target
@@ -101,6 +104,10 @@ public:
     float *pCoeffSections[3];
 
     float mExpoCurbWeights[GRAY_SCALE];
+
+    unsigned char *mpScanlineLuts;  // 3 x GRAY_SCALE bytes for each distinct scanline coefficient triple
+    int *mpScanlineLutIdx;          // lut of each scanline, IDENTITY_LUT_IDX for the untouched ones
+    int mScanlineLutCapacity;       // scanlines the two buffers above can hold
 };
 
 
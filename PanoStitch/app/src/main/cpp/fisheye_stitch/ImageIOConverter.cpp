@@ -1,7 +1,11 @@
 
 #include <cstdio>
 #include <string.h>
+#include <vector>
 #include "ImageIOConverter.h"
+#include "ColorConverter.h"
+#include "FramePool.h"
+#include "StitchProfiler.h"
 
 namespace YiPanorama {
 namespace util {
@@ -9,193 +13,38 @@ namespace util {
 // function definitions ========================================================
 //------------------------------------------------------------------------------
 int RGBtoYUV420NV(unsigned char *rgbBuf, int iWidth, int iHeight, unsigned char *yuvBuf)
-{
-    // rgb buf is interleaved
-    // Y and UV buffer are separated
-    int i, j;
-    int m_size = iHeight * iWidth;
-
-    unsigned char *pRGBBuf = rgbBuf;
-    unsigned char r, g, b;
-    int y, u, v;
-
-    unsigned char *pYBuf = yuvBuf;
-    unsigned char *pVUBuf = yuvBuf + m_size;
-
-    for (i = 0; i < iHeight; i += 2)
-    {
-        for (j = 0; j < iWidth; j += 2)
-        {
-            r = *pRGBBuf++;
-            g = *pRGBBuf++;
-            b = *pRGBBuf++;
-
-            y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
-            u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
-            v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
-
-            *(pYBuf + j) = y>255 ? 255 : (y < 0 ? 0 : y);
-            *(pVUBuf + j) = v > 255 ? 255 : (v < 0 ? 0 : v);        // channel v
-            *(pVUBuf + j + 1) = u > 255 ? 255 : (u < 0 ? 0 : u);    // channel u
-
-            r = *pRGBBuf++;
-            g = *pRGBBuf++;
-            b = *pRGBBuf++;
-
-            y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
-            *(pYBuf + j + 1) = y > 255 ? 255 : (y < 0 ? 0 : y);
-        }
-
-        pYBuf += iWidth;
-        pVUBuf += iWidth;
-
-        for (j = 0; j < iWidth; j++)
-        {
-            r = *pRGBBuf++;
-            g = *pRGBBuf++;
-            b = *pRGBBuf++;
-
-            y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
-
-            *(pYBuf + j) = y>255 ? 255 : (y < 0 ? 0 : y);
-
-        }
-        pYBuf += iWidth;
-
-    }
-
-    return 0;
-
+{// interleaved v/u chroma after the Y plane (NV21), BT.601 limited range
+    yuv420Planes planes;
+    if (setYUV420Planes(&planes, yuvBuf, iWidth, iHeight, yuvNV21) != 0)
+        return -1;
+    return convertRGBToYUV420(rgbBuf, iWidth * 3, 3, planes, iWidth, iHeight, yuvBT601, yuvLimitedRange);
 }
 
 //------------------------------------------------------------------------------
 int RGBtoYUV420YV(unsigned char *rgbBuf, int iWidth, int iHeight, unsigned char *yuvBuf)
-{
-    // rgb buf is interleaved
-    // YUV buffer is planar
-    int i, j;
-    int m_size = iHeight*iWidth;
-
-    unsigned char *pRGBBuf = rgbBuf;
-    unsigned char r, g, b;
-    int y, u, v;
-
-    unsigned char *pYBuf = yuvBuf;
-    unsigned char *pUBuf = pYBuf + m_size;
-    unsigned char *pVBuf = pUBuf + m_size / 4;
-
-    for (i = 0; i < iHeight; i += 2)
-    {
-        for (j = 0; j < iWidth; j += 2)
-        {
-            r = *pRGBBuf++;
-            g = *pRGBBuf++;
-            b = *pRGBBuf++;
-
-            y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
-            u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
-            v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
-
-            *(pYBuf + j) = y>255 ? 255 : (y < 0 ? 0 : y);
-            *(pUBuf + j / 2) = u > 255 ? 255 : (u < 0 ? 0 : u);  // channel u
-            *(pVBuf + j / 2) = v > 255 ? 255 : (v < 0 ? 0 : v);  // channel v
-
-            r = *pRGBBuf++;
-            g = *pRGBBuf++;
-            b = *pRGBBuf++;
-
-            y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
-            *(pYBuf + j + 1) = y > 255 ? 255 : (y < 0 ? 0 : y);
-        }
-
-        pYBuf += iWidth;
-        pUBuf += iWidth / 2;
-        pVBuf += iWidth / 2;
-
-        for (j = 0; j < iWidth; j++)
-        {
-            r = *pRGBBuf++;
-            g = *pRGBBuf++;
-            b = *pRGBBuf++;
-
-            y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
-
-            *(pYBuf + j) = y>255 ? 255 : (y < 0 ? 0 : y);
-
-        }
-        pYBuf += iWidth;
-
-    }
-
-    return 0;
-
+{// U plane then V plane after the Y plane, BT.601 limited range
+    yuv420Planes planes;
+    if (setYUV420Planes(&planes, yuvBuf, iWidth, iHeight, yuvI420) != 0)
+        return -1;
+    return convertRGBToYUV420(rgbBuf, iWidth * 3, 3, planes, iWidth, iHeight, yuvBT601, yuvLimitedRange);
 }
 
 //------------------------------------------------------------------------------
 int YUV420NVtoRGB(unsigned char *yuvBuf, int iWidth, int iHeight, unsigned char *rgbBuf)
 {
-    int i, j;
-    int im_size = iHeight*iWidth;
-
-    unsigned char *pY = yuvBuf;
-    unsigned char *pVU = pY + im_size;
-    unsigned char *pRGB = rgbBuf;
-
-    unsigned char y, u, v;
-    int r, g, b;
-
-    for (i = 0; i < iHeight; i++)
-        for (j = 0; j < iWidth; j++)
-        {
-            y = *(pY + i*iWidth + j);
-            v = *(pVU + (i / 2)*iWidth + j - (j % 2));
-            u = *(pVU + (i / 2)*iWidth + j - (j % 2) + 1);
-
-            r = (64 * y + 90 * v - 11488) >> 6;
-            g = (64 * y - 22 * u - 46 * v + 8736) >> 6;
-            b = (64 * y + 113 * u - 14432) >> 6;
-
-            *pRGB++ = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-            *pRGB++ = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-            *pRGB++ = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-        }
-
-    return 0;
-
+    yuv420Planes planes;
+    if (setYUV420Planes(&planes, yuvBuf, iWidth, iHeight, yuvNV21) != 0)
+        return -1;
+    return convertYUV420ToRGB(planes, rgbBuf, iWidth * 3, 3, iWidth, iHeight, yuvBT601, yuvLimitedRange);
 }
 
 //------------------------------------------------------------------------------
 int YUV420YVtoRGB(unsigned char *yuvBuf, int iWidth, int iHeight, unsigned char *rgbBuf)
 {
-    int i, j;
-    int im_size = iHeight*iWidth;
-
-    unsigned char *pY = yuvBuf;
-    unsigned char *pU = pY + im_size;
-    unsigned char *pV = pU + im_size / 4;
-    unsigned char *pRGB = rgbBuf;
-
-    unsigned char y, u, v;
-    int r, g, b;
-
-    for (i = 0; i < iHeight; i++)
-        for (j = 0; j < iWidth; j++)
-        {
-            y = *(pY + i*iWidth + j);
-            u = *(pU + (i / 2)*(iWidth / 2) + (j / 2));
-            v = *(pV + (i / 2)*(iWidth / 2) + (j / 2));
-
-            r = (64 * y + 90 * v - 11488) >> 6;
-            g = (64 * y - 22 * u - 46 * v + 8736) >> 6;
-            b = (64 * y + 113 * u - 14432) >> 6;
-
-            *pRGB++ = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-            *pRGB++ = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-            *pRGB++ = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-        }
-
-    return 0;
-
+    yuv420Planes planes;
+    if (setYUV420Planes(&planes, yuvBuf, iWidth, iHeight, yuvI420) != 0)
+        return -1;
+    return convertYUV420ToRGB(planes, rgbBuf, iWidth * 3, 3, iWidth, iHeight, yuvBT601, yuvLimitedRange);
 }
 
 //------------------------------------------------------------------------------
@@ -204,18 +53,20 @@ int loadImageData(const char *imgPath, unsigned char *imageData, int iWidth, int
     int rgbChannels = 3;
     unsigned char *pTmp = NULL;
 
-    IplImage *cvImgData = cvLoadImage(imgPath, -1);
-    if (cvImgData == NULL)
+    // the C++ api, the legacy C image io is gone from OpenCV 4
+    Mat decoded = imread(imgPath, IMREAD_UNCHANGED);
+    if (decoded.empty())
         return -1;
 
     switch (imgCs)
     {
     case PIXELCOLORSPACE_RGB:
         for (int j = 0; j < iHeight; ++j) {
+            const unsigned char *pRow = decoded.ptr<unsigned char>(j);
             for (int i = 0; i < iWidth; ++i) {
-                imageData[(j*iWidth + i)*rgbChannels + 0] = (unsigned char)cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 0];
-                imageData[(j*iWidth + i)*rgbChannels + 1] = (unsigned char)cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 1];
-                imageData[(j*iWidth + i)*rgbChannels + 2] = (unsigned char)cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 2];
+                imageData[(j*iWidth + i)*rgbChannels + 0] = pRow[i * 3 + 0];
+                imageData[(j*iWidth + i)*rgbChannels + 1] = pRow[i * 3 + 1];
+                imageData[(j*iWidth + i)*rgbChannels + 2] = pRow[i * 3 + 2];
             }
         }
         break;
@@ -223,16 +74,17 @@ int loadImageData(const char *imgPath, unsigned char *imageData, int iWidth, int
     case PIXELCOLORSPACE_MONO:
         for (int j = 0; j < iHeight; ++j)
             for (int i = 0; i < iWidth; ++i)
-                imageData[j*iWidth + i] = (unsigned char)cvImgData->imageData[j*cvImgData->widthStep + i];
+                imageData[j*iWidth + i] = decoded.ptr<unsigned char>(j)[i];
         break;
 
     case PIXELCOLORSPACE_YUV420PYV:
         pTmp = new unsigned char[iWidth * iHeight * 3];
         for (int j = 0; j < iHeight; ++j) {
+            const unsigned char *pRow = decoded.ptr<unsigned char>(j);
             for (int i = 0; i < iWidth; ++i) {
-                pTmp[(j*iWidth + i)*rgbChannels + 0] = (unsigned char)cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 0];
-                pTmp[(j*iWidth + i)*rgbChannels + 1] = (unsigned char)cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 1];
-                pTmp[(j*iWidth + i)*rgbChannels + 2] = (unsigned char)cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 2];
+                pTmp[(j*iWidth + i)*rgbChannels + 0] = pRow[i * 3 + 0];
+                pTmp[(j*iWidth + i)*rgbChannels + 1] = pRow[i * 3 + 1];
+                pTmp[(j*iWidth + i)*rgbChannels + 2] = pRow[i * 3 + 2];
             }
         }
         RGBtoYUV420YV(pTmp, iWidth, iHeight, imageData);
@@ -244,7 +96,6 @@ int loadImageData(const char *imgPath, unsigned char *imageData, int iWidth, int
         break;
     }
 
-    cvReleaseImage(&cvImgData);
     return 0;
 }
 
@@ -256,18 +107,16 @@ int saveImage(const char *imgPath, unsigned char *imageData, int iWidth, int iHe
         imgChannels = 1;
     unsigned char *pTmp = NULL;
 
-    IplImage *cvImgData = cvCreateImage(cvSize(iWidth, iHeight), 8, imgChannels);
-    if (cvImgData == NULL)
-        return -1;
+    Mat cvImgData(iHeight, iWidth, CV_8UC(imgChannels));
 
     switch (imgCS)
     {
     case PIXELCOLORSPACE_RGB:
         for (int j = 0; j < iHeight; ++j) {
             for (int i = 0; i < iWidth; ++i) {
-                cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 0] = imageData[(j*iWidth + i)*imgChannels + 0];
-                cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 1] = imageData[(j*iWidth + i)*imgChannels + 1];
-                cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 2] = imageData[(j*iWidth + i)*imgChannels + 2];
+                cvImgData.ptr<unsigned char>(j)[i * 3 + 0] = imageData[(j*iWidth + i)*imgChannels + 0];
+                cvImgData.ptr<unsigned char>(j)[i * 3 + 1] = imageData[(j*iWidth + i)*imgChannels + 1];
+                cvImgData.ptr<unsigned char>(j)[i * 3 + 2] = imageData[(j*iWidth + i)*imgChannels + 2];
             }
         }
         break;
@@ -275,7 +124,7 @@ int saveImage(const char *imgPath, unsigned char *imageData, int iWidth, int iHe
     case PIXELCOLORSPACE_MONO:
         for (int j = 0; j < iHeight; ++j)
             for (int i = 0; i < iWidth; ++i)
-                cvImgData->imageData[j*cvImgData->widthStep + i] = imageData[j*iWidth + i];
+                cvImgData.ptr<unsigned char>(j)[i] = imageData[j*iWidth + i];
         break;
 
     case PIXELCOLORSPACE_YUV420PYV:
@@ -283,9 +132,9 @@ int saveImage(const char *imgPath, unsigned char *imageData, int iWidth, int iHe
         YUV420YVtoRGB(imageData, iWidth, iHeight, pTmp);
         for (int j = 0; j < iHeight; ++j) {
             for (int i = 0; i < iWidth; ++i) {
-                cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 0] = pTmp[(j*iWidth + i)*imgChannels + 0];
-                cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 1] = pTmp[(j*iWidth + i)*imgChannels + 1];
-                cvImgData->imageData[j*cvImgData->widthStep + i * 3 + 2] = pTmp[(j*iWidth + i)*imgChannels + 2];
+                cvImgData.ptr<unsigned char>(j)[i * 3 + 0] = pTmp[(j*iWidth + i)*imgChannels + 0];
+                cvImgData.ptr<unsigned char>(j)[i * 3 + 1] = pTmp[(j*iWidth + i)*imgChannels + 1];
+                cvImgData.ptr<unsigned char>(j)[i * 3 + 2] = pTmp[(j*iWidth + i)*imgChannels + 2];
             }
         }
         delete[] pTmp;
@@ -296,8 +145,7 @@ int saveImage(const char *imgPath, unsigned char *imageData, int iWidth, int iHe
         break;
     }
 
-    cvSaveImage(imgPath, cvImgData);
-    cvReleaseImage(&cvImgData);
+    imwrite(imgPath, cvImgData);
 
     return 0;
 }
@@ -387,22 +235,21 @@ void convertUCYUV420toCvMat(unsigned char *imgYuv, Mat imgDst)
 // exposed functions ===========================================================
 int readImageParameters(const char *imgPath, int *iWidth, int *iHeight, int *iChn)
 {
-    IplImage *cvImgData = cvLoadImage(imgPath, -1);
+    Mat decoded = imread(imgPath, IMREAD_UNCHANGED);
 
-    if (cvImgData == NULL)
+    if (decoded.empty())
     {
         return -1;
     }
-    *iWidth = cvImgData->width;
-    *iHeight = cvImgData->height;
-    *iChn = cvImgData->nChannels;
+    *iWidth = decoded.cols;
+    *iHeight = decoded.rows;
+    *iChn = decoded.channels();
 
-    cvReleaseImage(&cvImgData);
     return 0;
 }
 
 int initImageFrame(imageFrame *pImage, int width, int height, ePixelColorSpace imgCs)
-{
+{// planes come from the default frame pool, 64 byte aligned with padded strides; RGB(A) frames start black
     pImage->imageW = width;
     pImage->imageH = height;
     pImage->pxlColorFormat = imgCs;
@@ -413,306 +260,311 @@ int initImageFrame(imageFrame *pImage, int width, int height, ePixelColorSpace i
         pImage->strides[k] = 0;
     }
 
-    switch (imgCs)
+    if (FramePool::getDefault()->acquire(pImage, width, height, imgCs) != 0)
     {
-    case PIXELCOLORSPACE_INVALID:
         return -1;
-        break;
-
-    case PIXELCOLORSPACE_MONO:
-        pImage->strides[0] = width;
-        pImage->plane[0] = new unsigned char[width * height];
-        break;
-
-    case PIXELCOLORSPACE_YUV420PYV:
-        pImage->strides[0] = width;
-        pImage->strides[1] = width / 2;
-        pImage->strides[2] = width / 2;
-        pImage->plane[0] = new unsigned char[width * height];
-        pImage->plane[1] = new unsigned char[width * height / 4];
-        pImage->plane[2] = new unsigned char[width * height / 4];
-        break;
+    }
 
-    case PIXELCOLORSPACE_RGB:
-        pImage->strides[0] = width * 3;
-		pImage->strides[1] = 0;
-		pImage->strides[2] = 0;
-		pImage->plane[0] = new unsigned char[width * height * 3];
-		pImage->plane[1] = NULL;
-		pImage->plane[2] = NULL;
-		memset(pImage->plane[0], 0, width * height * 3);
- 
-        break;
-    default:
-        break;
+    if (imgCs == PIXELCOLORSPACE_RGB || imgCs == PIXELCOLORSPACE_RGBA)
+    {
+        memset(pImage->plane[0], 0, pImage->strides[0] * height);
     }
 
     return 0;
 }
 
 int dinitImageFrame(imageFrame *pImage)
-{
+{// the planes go back to the pool for the next frame of this shape
+    FramePool::getDefault()->release(pImage);
+
     for (int k = 0; k < MAX_IMAGE_CHANNELS; k++)
     {
         pImage->strides[k] = 0;
-        if (pImage->plane[k] != NULL)
-        {
-            delete[] pImage->plane[k];
-            pImage->plane[k] = NULL;
-        }
+        pImage->plane[k] = NULL;
     }
     return 0;
 }
 
 int loadImageData(const char *imgPath, imageFrame image)
-{
-    int imageDataSize;
+{// decoded and then copied or converted straight into the frame's rows
+    STITCH_PROFILE_SCOPE(profileLoad);
+    yuv420Planes planes;
+    Mat decoded = imread(imgPath, (image.pxlColorFormat == PIXELCOLORSPACE_MONO) ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+
+    if (decoded.empty() || decoded.cols < image.imageW || decoded.rows < image.imageH)
+    {
+        return -1;
+    }
+    decoded = decoded(Rect(0, 0, image.imageW, image.imageH));
+
     switch (image.pxlColorFormat)
     {
     case PIXELCOLORSPACE_MONO:
-        imageDataSize = image.imageW * image.imageH;
-        break;
-    case PIXELCOLORSPACE_YUV420PYV:
-        imageDataSize = image.imageW * image.imageH * 3 / 2;
+        decoded.copyTo(Mat(image.imageH, image.imageW, CV_8UC1, image.plane[0], image.strides[0]));
         break;
+
     case PIXELCOLORSPACE_RGB:
-        imageDataSize = image.imageW * image.imageH * 3;
+        decoded.copyTo(Mat(image.imageH, image.imageW, CV_8UC3, image.plane[0], image.strides[0]));
         break;
+
+    case PIXELCOLORSPACE_YUV420PYV:
+    case PIXELCOLORSPACE_NV12:
+        setYUV420Planes(&planes, image);
+        return convertRGBToYUV420(decoded.data, (int)decoded.step, 3, planes, image.imageW, image.imageH, yuvBT601, yuvLimitedRange);
+
     default:
         return -1;
-        break;
     }
+    return 0;
+}
 
-    unsigned char *TmpImgData = new unsigned char[imageDataSize];
-    loadImageData(imgPath, TmpImgData, image.imageW, image.imageH, image.pxlColorFormat);
+int setFisheyePairViews(imageFrame pairImage, imageFrame fisheyeImage[2], imageLayout layout)
+{// the views share the planes and stride of the pair image, only the origin of the back lens moves
+    int lensW, lensH;
+    int pixelBytes = (pairImage.pxlColorFormat == PIXELCOLORSPACE_RGBA) ? 4 : 3;
 
-    switch (image.pxlColorFormat)
+    if (pairImage.pxlColorFormat != PIXELCOLORSPACE_RGB && pairImage.pxlColorFormat != PIXELCOLORSPACE_RGBA)
     {
-    case PIXELCOLORSPACE_MONO:
-        memcpy(image.plane[0], TmpImgData, sizeof(unsigned char) * image.imageW * image.imageH);
-        break;
-    case PIXELCOLORSPACE_YUV420PYV:
-        memcpy(image.plane[0], TmpImgData, sizeof(unsigned char) * image.imageW * image.imageH);
-        memcpy(image.plane[1], TmpImgData + image.imageW * image.imageH, sizeof(unsigned char) * image.imageW * image.imageH / 4);
-        memcpy(image.plane[2], TmpImgData + image.imageW * image.imageH * 5 / 4, sizeof(unsigned char) * image.imageW * image.imageH / 4);
+        return -1;
+    }
+
+    switch (layout)
+    {
+    case sideBySide:
+        lensW = pairImage.imageW / 2;
+        lensH = pairImage.imageH;
         break;
-    case PIXELCOLORSPACE_RGB:
-        memcpy(image.plane[0], TmpImgData, sizeof(unsigned char) * image.imageW * image.imageH);
-        memcpy(image.plane[1], TmpImgData + image.imageW * image.imageH, sizeof(unsigned char) * image.imageW * image.imageH);
-        memcpy(image.plane[2], TmpImgData + image.imageW * image.imageH * 2, sizeof(unsigned char) * image.imageW * image.imageH);
+    case overAndUnder:
+        lensW = pairImage.imageW;
+        lensH = pairImage.imageH / 2;
         break;
     default:
-        return -1;
-        break;
+        return -2;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        fisheyeImage[i] = pairImage;
+        fisheyeImage[i].imageW = lensW;
+        fisheyeImage[i].imageH = lensH;
+    }
+
+    if (layout == sideBySide)
+    {
+        fisheyeImage[1].plane[0] = pairImage.plane[0] + lensW * pixelBytes;
+    }
+    else
+    {
+        fisheyeImage[1].plane[0] = pairImage.plane[0] + lensH * pairImage.strides[0];
     }
-    delete[] TmpImgData;
+
     return 0;
 }
 
-int loadImageDataFisheyePair(const char *imgPath, imageFrame fisheyeImage[2], imageLayout layout)
-{// the image's size is known after they are loaded
-    int iResult = 0;
-    IplImage *pImgLoad = cvLoadImage(imgPath);
-    IplImage *pImg = NULL;
-    IplImage *pImgF = NULL;
-    IplImage *pImgB = NULL;
-
-    unsigned char *pTmpRgb = NULL;
-    unsigned char *pTmpYuv = NULL;
+int loadImageDataFisheyePair(const char *imgPath, imageFrame *pPairImage, imageFrame fisheyeImage[2], imageLayout layout, int fisheyeW, int fisheyeH)
+{// the file is decoded straight into the pair image when that already has the file's size, so from the second frame of
+ // a sequence on there is no copy at all. otherwise the pair image is (re)allocated, and filled by one copy, or by
+ // resampling each half when the lenses in the file don't have the calibrated size
+    STITCH_PROFILE_SCOPE(profileLoad);
+    FILE *fp = fopen(imgPath, "rb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
 
-    if (pImgLoad == NULL)
+    std::vector<unsigned char> fileData;
+    fseek(fp, 0, SEEK_END);
+    long fileSize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (fileSize > 0)
     {
-        iResult = -1;
+        fileData.resize(fileSize);
+        fileSize = (long)fread(&fileData[0], 1, fileSize, fp);
+    }
+    fclose(fp);
+    if (fileSize <= 0)
+    {
+        return -1;
     }
 
-    // check if the load image doesn't have size of 2880*5760
-    pImg = cvCreateImage(cvSize(2880, 5760), pImgLoad->depth, pImgLoad->nChannels);
-    cvResize(pImgLoad, pImg);
+    if (layout != sideBySide && layout != overAndUnder)
+    {
+        return -2;
+    }
 
-    int sizeW,sizeH;
-    CvRect roiF, roiB;
+    // the pair image can take the decode when its lenses have the calibrated size, imdecode keeps the buffer if the file
+    // turns out to have that size too
+    bool isCalibratedSize = (fisheyeW <= 0 || fisheyeH <= 0)
+        || (pPairImage->imageW == ((layout == sideBySide) ? fisheyeW * 2 : fisheyeW) && pPairImage->imageH == ((layout == overAndUnder) ? fisheyeH * 2 : fisheyeH));
+    Mat decoded;
+    if (pPairImage->plane[0] != NULL && pPairImage->pxlColorFormat == PIXELCOLORSPACE_RGB && isCalibratedSize)
+    {
+        decoded = Mat(pPairImage->imageH, pPairImage->imageW, CV_8UC3, pPairImage->plane[0], pPairImage->strides[0]);
+    }
+    imdecode(fileData, IMREAD_COLOR, &decoded);
+    if (decoded.empty())
+    {
+        return -1;
+    }
 
-    if (0 == iResult)
+    if (decoded.data != pPairImage->plane[0])
     {
-        switch (layout)
+        int srcW = (layout == sideBySide) ? decoded.cols / 2 : decoded.cols;
+        int srcH = (layout == overAndUnder) ? decoded.rows / 2 : decoded.rows;
+        int lensW = (fisheyeW > 0) ? fisheyeW : srcW;
+        int lensH = (fisheyeH > 0) ? fisheyeH : srcH;
+        int pairW = (layout == sideBySide) ? lensW * 2 : lensW;
+        int pairH = (layout == overAndUnder) ? lensH * 2 : lensH;
+
+        if (pPairImage->plane[0] == NULL || pPairImage->pxlColorFormat != PIXELCOLORSPACE_RGB || pPairImage->imageW != pairW || pPairImage->imageH != pairH)
         {
-        case sideBySide:
-            sizeW = pImg->width / 2;
-            sizeH = pImg->height;
-            roiF.x = 0;
-            roiF.y = 0;
-            roiB.x = sizeW;
-            roiB.y = 0;
-            break;
-        case overAndUnder:
-            sizeW = pImg->width;
-            sizeH = pImg->height / 2;
-            roiF.x = 0;
-            roiF.y = 0;
-            roiB.x = 0;
-            roiB.y = sizeH;
-            break;
-        default:
-            iResult = -2;  // 
-            break;
-        }
-        
-        roiF.width = sizeW;
-        roiF.height = sizeH;
-        roiB.width = sizeW;
-        roiB.height = sizeH;
-        pImgF = cvCreateImage(cvSize(sizeW, sizeH), 8, 3);
-        pImgB = cvCreateImage(cvSize(sizeW, sizeH), 8, 3);
-        cvSetImageROI(pImg, roiF);
-        cvResize(pImg, pImgF);
-        cvResetImageROI(pImg);
-        cvSetImageROI(pImg, roiB);
-        cvResize(pImg, pImgB);
-        cvResetImageROI(pImg);
-
-        initImageFrame(&fisheyeImage[0], sizeW, sizeH, PIXELCOLORSPACE_RGB);
-        initImageFrame(&fisheyeImage[1], sizeW, sizeH, PIXELCOLORSPACE_RGB);
-
-        //pTmpRgb = new unsigned char[sizeW * sizeH * 3];
-
-        for (int j = 0; j < sizeH; ++j) {
-			memcpy(fisheyeImage[0].plane[0] + j * fisheyeImage[0].strides[0], pImgF->imageData + j * pImgF->widthStep, sizeof(unsigned char) * fisheyeImage[0].strides[0]);
+            dinitImageFrame(pPairImage);
+            initImageFrame(pPairImage, pairW, pairH, PIXELCOLORSPACE_RGB);
         }
+        Mat pair(pairH, pairW, CV_8UC3, pPairImage->plane[0], pPairImage->strides[0]);
 
-
-        for (int j = 0; j < sizeH; ++j) {
-			memcpy(fisheyeImage[1].plane[0] + j * fisheyeImage[1].strides[0], pImgB->imageData + j * pImgB->widthStep, sizeof(unsigned char) * fisheyeImage[1].strides[0]);
-		}
-       
-        cvReleaseImage(&pImgF);
-        cvReleaseImage(&pImgB);
-
+        if (srcW == lensW && srcH == lensH)
+        {
+            decoded(Rect(0, 0, pairW, pairH)).copyTo(pair);
+        }
+        else
+        {// the calibration was done at another resolution
+            for (int i = 0; i < 2; i++)
+            {
+                Rect srcRoi = (layout == sideBySide) ? Rect(i * srcW, 0, srcW, srcH) : Rect(0, i * srcH, srcW, srcH);
+                Rect dstRoi = (layout == sideBySide) ? Rect(i * lensW, 0, lensW, lensH) : Rect(0, i * lensH, lensW, lensH);
+                Mat dst = pair(dstRoi);
+                resize(decoded(srcRoi), dst, dst.size(), 0, 0, INTER_LINEAR);
+            }
+        }
     }
-    cvReleaseImage(&pImgLoad);
-    cvReleaseImage(&pImg);
-    return iResult;
+
+    return setFisheyePairViews(*pPairImage, fisheyeImage, layout);
 }
 
 int saveImage(const char *imgPath, imageFrame image)
-{
-    int imageDataSize;
-    unsigned char *TmpImgData = NULL;
+{// RGB(A) and gray frames are written from their rows, YUV through a pooled RGB frame
+    STITCH_PROFILE_SCOPE(profileSave);
+    imageFrame rgbImage;
+    int result = 0;
 
     switch (image.pxlColorFormat)
     {
     case PIXELCOLORSPACE_MONO:
-        imageDataSize = image.imageW * image.imageH;
-        TmpImgData = new unsigned char[imageDataSize];
-        memcpy(TmpImgData, image.plane[0], sizeof(unsigned char) * image.imageW * image.imageH);
+        imwrite(imgPath, Mat(image.imageH, image.imageW, CV_8UC1, image.plane[0], image.strides[0]));
         break;
 
-    case PIXELCOLORSPACE_YUV420PYV:
-        imageDataSize = image.imageW * image.imageH * 3 / 2;
-        TmpImgData = new unsigned char[imageDataSize];
-        memcpy(TmpImgData, image.plane[0], sizeof(unsigned char) * image.imageW * image.imageH);
-        memcpy(TmpImgData + image.imageW * image.imageH, image.plane[1], sizeof(unsigned char) * image.imageW * image.imageH / 4);
-        memcpy(TmpImgData + image.imageW * image.imageH * 5 / 4, image.plane[2], sizeof(unsigned char) * image.imageW * image.imageH / 4);
-        break;
     case PIXELCOLORSPACE_RGB:
-        imageDataSize = image.imageW * image.imageH * 3;
-        TmpImgData = new unsigned char[imageDataSize];
-        memcpy(TmpImgData, image.plane[0], sizeof(unsigned char) * image.imageW * image.imageH);
-        memcpy(TmpImgData + image.imageW * image.imageH, image.plane[1], sizeof(unsigned char) * image.imageW * image.imageH);
-        memcpy(TmpImgData + image.imageW * image.imageH * 2, image.plane[2], sizeof(unsigned char) * image.imageW * image.imageH);
+        imwrite(imgPath, Mat(image.imageH, image.imageW, CV_8UC3, image.plane[0], image.strides[0]));
+        break;
+
+    case PIXELCOLORSPACE_RGBA:
+        imwrite(imgPath, Mat(image.imageH, image.imageW, CV_8UC4, image.plane[0], image.strides[0]));
+        break;
+
+    case PIXELCOLORSPACE_YUV420PYV:
+    case PIXELCOLORSPACE_NV12:
+        if (FramePool::getDefault()->acquire(&rgbImage, image.imageW, image.imageH, PIXELCOLORSPACE_RGB) != 0)
+            return -1;
+        result = convertImageFrameColor(image, rgbImage, yuvBT601, yuvLimitedRange);
+        if (result == 0)
+            imwrite(imgPath, Mat(rgbImage.imageH, rgbImage.imageW, CV_8UC3, rgbImage.plane[0], rgbImage.strides[0]));
+        FramePool::getDefault()->release(&rgbImage);
         break;
+
     default:
         return -1;
-        break;
     }
 
-    saveImage(imgPath, TmpImgData, image.imageW, image.imageH, image.pxlColorFormat);
-
-    delete[] TmpImgData;
-    return 0;
+    return result;
 }
 
 int copyImage(imageFrame *pSrcImage, imageFrame *pDstImage)
-{// dst image is already malloced 
-    int imageSize = pSrcImage->imageW * pSrcImage->imageH;
+{// dst image is already malloced, both may have any strides
+    int rowBytes[MAX_IMAGE_CHANNELS] = { 0 };
+    int rows[MAX_IMAGE_CHANNELS] = { 0 };
+    int w = pSrcImage->imageW;
+    int h = pSrcImage->imageH;
 
     switch (pSrcImage->pxlColorFormat)
     {
     case PIXELCOLORSPACE_MONO:
-        memcpy(pDstImage->plane[0], pSrcImage->plane[0], sizeof(unsigned char) * imageSize);
+        rowBytes[0] = w;
+        rows[0] = h;
         break;
 
     case PIXELCOLORSPACE_YUV420PYV:
-        memcpy(pDstImage->plane[0], pSrcImage->plane[0], sizeof(unsigned char) * imageSize);
-        imageSize /= 4;
-        memcpy(pDstImage->plane[1], pSrcImage->plane[1], sizeof(unsigned char) * imageSize);
-        memcpy(pDstImage->plane[2], pSrcImage->plane[2], sizeof(unsigned char) * imageSize);
+        rowBytes[0] = w;
+        rowBytes[1] = rowBytes[2] = w / 2;
+        rows[0] = h;
+        rows[1] = rows[2] = h / 2;
         break;
 
     case PIXELCOLORSPACE_RGB:
-        memcpy(pDstImage->plane[0], pSrcImage->plane[0], sizeof(unsigned char) * imageSize);
-        memcpy(pDstImage->plane[1], pSrcImage->plane[1], sizeof(unsigned char) * imageSize);
-        memcpy(pDstImage->plane[2], pSrcImage->plane[2], sizeof(unsigned char) * imageSize);
+        rowBytes[0] = w * 3;
+        rows[0] = h;
         break;
 
-    default:
+    case PIXELCOLORSPACE_RGBA:
+        rowBytes[0] = w * 4;
+        rows[0] = h;
         break;
+
+    case PIXELCOLORSPACE_NV12:
+        rowBytes[0] = rowBytes[1] = w;
+        rows[0] = h;
+        rows[1] = h / 2;
+        break;
+
+    default:
+        return -1;
+    }
+
+    for (int k = 0; k < MAX_IMAGE_CHANNELS; k++)
+    {
+        for (int j = 0; j < rows[k]; j++)
+        {
+            memcpy(pDstImage->plane[k] + j * pDstImage->strides[k], pSrcImage->plane[k] + j * pSrcImage->strides[k], rowBytes[k]);
+        }
     }
 
     return 0;
 }
 
 int convertImageFrametoCvMat(imageFrame image, Mat imgDst)
-{
-    int imageDataSize = 0;
-    unsigned char *TmpImgData = NULL;
+{// imgDst is a preallocated image of the frame's size, CV_8UC3 or CV_8UC1 for gray frames
+    imageFrame rgbImage = image;
 
     switch (image.pxlColorFormat)
     {
     case PIXELCOLORSPACE_MONO:
-        imageDataSize = image.imageW * image.imageH;
-        TmpImgData = new unsigned char[imageDataSize];
-        memcpy(TmpImgData, image.plane[0], sizeof(unsigned char) * image.imageW * image.imageH);
-        convertUCGrayToCvMat(TmpImgData, imgDst);
+        if (imgDst.channels() == 1)
+            Mat(image.imageH, image.imageW, CV_8UC1, image.plane[0], image.strides[0]).copyTo(imgDst);
+        else
+            cvtColor(Mat(image.imageH, image.imageW, CV_8UC1, image.plane[0], image.strides[0]), imgDst, COLOR_GRAY2RGB);
         break;
 
     case PIXELCOLORSPACE_YUV420PYV:
-        imageDataSize = image.imageW * image.imageH * 3 / 2;
-        TmpImgData = new unsigned char[imageDataSize];
-        memcpy(TmpImgData, image.plane[0], sizeof(unsigned char) * image.imageW * image.imageH);
-        memcpy(TmpImgData + image.imageW * image.imageH, image.plane[1], sizeof(unsigned char) * image.imageW * image.imageH / 4);
-        memcpy(TmpImgData + image.imageW * image.imageH * 5 / 4, image.plane[2], sizeof(unsigned char) * image.imageW * image.imageH / 4);
-        convertUCYUV420toCvMat(TmpImgData, imgDst);
-        break;
+    case PIXELCOLORSPACE_NV12:
+        rgbImage.pxlColorFormat = PIXELCOLORSPACE_RGB;
+        rgbImage.plane[0] = imgDst.data;
+        rgbImage.strides[0] = (int)imgDst.step;
+        return convertImageFrameColor(image, rgbImage, yuvBT601, yuvLimitedRange);
 
     case PIXELCOLORSPACE_RGB:
-        imageDataSize = image.imageW * image.imageH * 3;
-        TmpImgData = new unsigned char[imageDataSize];
-        memcpy(TmpImgData, image.plane[0], sizeof(unsigned char) * image.imageW * image.imageH);
-        memcpy(TmpImgData + image.imageW * image.imageH, image.plane[1], sizeof(unsigned char) * image.imageW * image.imageH);
-        memcpy(TmpImgData + image.imageW * image.imageH * 2, image.plane[2], sizeof(unsigned char) * image.imageW * image.imageH);
-        convertUCRGBtoCvMat(TmpImgData, imgDst);
+        Mat(image.imageH, image.imageW, CV_8UC3, image.plane[0], image.strides[0]).copyTo(imgDst);
         break;
 
     default:
         return -1;
-        break;
     }
 
-    delete[] TmpImgData;
     return 0;
 }
 
 int convertImageFrametoCvMatGray(imageFrame image, Mat imgDst)
 {
-    int imageDataSize = 0;
-    unsigned char *TmpImgData = NULL;
-
-    imageDataSize = image.imageW * image.imageH;
-    TmpImgData = new unsigned char[imageDataSize];
-    memcpy(TmpImgData, image.plane[0], sizeof(unsigned char) * image.imageW * image.imageH);
-    convertUCGrayToCvMat(TmpImgData, imgDst);
-
-    delete[] TmpImgData;
+    Mat(image.imageH, image.imageW, CV_8UC1, image.plane[0], image.strides[0]).copyTo(imgDst);
     return 0;
 }
 
@@ -35,7 +35,14 @@ int dinitImageFrame(imageFrame *pImage);
 // load image data into preallocated memory
 int loadImageData(const char *imgPath, imageFrame image);
 
-int loadImageDataFisheyePair(const char *imgPath, imageFrame fisheyeImage[2], imageLayout layout);
+// decode a dual fisheye image once into *pPairImage and point fisheyeImage[0] / [1] at its front and back lens, by plane
+// and stride only. fisheyeW x fisheyeH is the lens size the camera model is calibrated for (ocamModel.width / height),
+// the image is resampled only when its lenses have another size; 0 keeps the file's size.
+// pPairImage is allocated when needed and reused as is when it fits, so keep it across frames and release only it
+int loadImageDataFisheyePair(const char *imgPath, imageFrame *pPairImage, imageFrame fisheyeImage[2], imageLayout layout, int fisheyeW, int fisheyeH);
+
+// point the two lens views at the halves of an RGB(A) dual fisheye frame, nothing is copied
+int setFisheyePairViews(imageFrame pairImage, imageFrame fisheyeImage[2], imageLayout layout);
 
 // save image to file
 int saveImage(const char *imgPath, imageFrame image);
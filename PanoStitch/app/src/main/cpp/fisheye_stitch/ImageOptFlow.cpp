@@ -1,20 +1,13 @@
 
 #include "ImageOptFlow.h"
 #include "ImageIOConverter.h"
+#include "ColorConverter.h"
+#include "ColorConverter.h"
 
 
 namespace YiPanorama {
 namespace util {
 	using namespace cv;
-	using namespace cv::ximgproc;
-
-enum shiftMethod
-{
-    shift_linear_up_down,
-    shift_linear_down_up,
-    shift_fixed,
-    shift_none
-};
 
 // local functions ===================================================
 void drawOptFlowMap(const Mat& flow, Mat& cflowmap, int step, const Scalar& color)
@@ -47,217 +40,163 @@ int setFarneback(optFlowFarneback *pFarneback)
     return 0;
 }
 
-int calcSingleOptFlow(Mat imgSrc, Mat imgDst, Mat flow, optFlowFarneback *pFarn)
-{
-    calcOpticalFlowFarneback(imgSrc, imgDst, flow, pFarn->pyrScale, pFarn->numLevels, pFarn->winSize, pFarn->numIters, pFarn->polyN, pFarn->polySigma, pFarn->flags);
+int calcSingleOptFlow(Mat imgSrc, Mat imgDst, Mat flow, optFlowFarneback *pFarn, bool warmStart)
+{// a warm start already has the coarse motion in flow, so the coarsest level is skipped and fewer iterations refine it
+    if (warmStart)
+    {
+        int levels = (pFarn->numLevels > 1) ? pFarn->numLevels - 1 : 1;
+        int iters = (pFarn->numIters > 1) ? pFarn->numIters - 1 : 1;
+        calcOpticalFlowFarneback(imgSrc, imgDst, flow, pFarn->pyrScale, levels, pFarn->winSize, iters, pFarn->polyN, pFarn->polySigma, pFarn->flags | OPTFLOW_USE_INITIAL_FLOW);
+    }
+    else
+    {
+        calcOpticalFlowFarneback(imgSrc, imgDst, flow, pFarn->pyrScale, pFarn->numLevels, pFarn->winSize, pFarn->numIters, pFarn->polyN, pFarn->polySigma, pFarn->flags);
+    }
     return 0;
 }
 
-void genFlowWarpMat(Mat flow, Mat warpMap, int w, int h, shiftMethod shift, double shiftMax)
-{
-    double shiftScale;
-    switch (shift)
+void genFlowWarpMat(Mat flow, Mat weights, bool invertWeights, imageRoi roi, Mat mapX, Mat mapY)
+{// map of each roi pixel into the whole image: its position moved by the weighted flow
+    for (int y = 0; y < roi.roiH; ++y)
     {
-    case shift_linear_up_down:
-        for (int y = 0; y < h; ++y)
+        const float *pFlow = flow.ptr<float>(y);
+        const float *pW = weights.ptr<float>(y);
+        float *pX = mapX.ptr<float>(y);
+        float *pY = mapY.ptr<float>(y);
+        float baseX = (float)roi.roiX;
+        float baseY = (float)(roi.roiY + y);
+        for (int x = 0; x < roi.roiW; ++x)
         {
-            shiftScale = (double)y / h;
-            for (int x = 0; x < w; ++x)
-            {
-                Point2f flowDir = flow.at<Point2f>(y, x);
-                warpMap.at<Point2f>(y, x) =
-                    Point2f(x + flowDir.x * shiftScale * shiftMax, y + flowDir.y * shiftScale * shiftMax);
-            }
+            float w = invertWeights ? 1.0f - pW[x] : pW[x];
+            pX[x] = baseX + x + w * pFlow[2 * x];
+            pY[x] = baseY + w * pFlow[2 * x + 1];
         }
-        break;
-
-    case shift_linear_down_up:
-        for (int y = 0; y < h; ++y)
-        {
-            shiftScale = 1.0 - (double)y / h;
-            for (int x = 0; x < w; ++x)
-            {
-                Point2f flowDir = flow.at<Point2f>(y, x);
-                warpMap.at<Point2f>(y, x) =
-                    Point2f(x + flowDir.x * shiftScale * shiftMax, y + flowDir.y * shiftScale * shiftMax);
-            }
-        }
-        break;
-
-    case shift_fixed:
-        for (int y = 0; y < h; ++y)
-        {
-            for (int x = 0; x < w; ++x)
-            {
-                Point2f flowDir = flow.at<Point2f>(y, x);
-                warpMap.at<Point2f>(y, x) =
-                    Point2f(x + flowDir.x * shiftMax, y + flowDir.y * shiftMax);
-            }
-        }
-
-        break;
+    }
+}
 
-    case shift_none:
-        for (int y = 0; y < h; ++y)
+void genHalfWarpMat(Mat mapX, Mat mapY, Mat mapHalfX, Mat mapHalfY)
+{// chroma planes of YUV420 use every second position, at half the coordinates
+    for (int y = 0; y < mapHalfX.rows; ++y)
+    {
+        const float *pX = mapX.ptr<float>(2 * y);
+        const float *pY = mapY.ptr<float>(2 * y);
+        float *pHX = mapHalfX.ptr<float>(y);
+        float *pHY = mapHalfY.ptr<float>(y);
+        for (int x = 0; x < mapHalfX.cols; ++x)
         {
-            for (int x = 0; x < w; ++x)
-            {
-                Point2f flowDir = flow.at<Point2f>(y, x);
-                warpMap.at<Point2f>(y, x) =
-                    Point2f(x + flowDir.x, y + flowDir.y);
-            }
+            pHX[x] = 0.5f * pX[2 * x];
+            pHY[x] = 0.5f * pY[2 * x];
         }
-        break;
-
-    default:
-        break;
     }
-    return;
 }
 
-int warpImageFrame(imageFrame srcImage, Mat warpMap, imageFrame dstImage)
-{// source & destiny images have same size with the warp map
- // since the images are in YUV color space, so UV channel's warp map need to be downsampled
-    unsigned char *srcImg_y = srcImage.plane[0];
-    unsigned char *srcImg_u = srcImage.plane[1];
-    unsigned char *srcImg_v = srcImage.plane[2];
-
-    unsigned char *proImg_y = dstImage.plane[0];
-    unsigned char *proImg_u = dstImage.plane[1];
-    unsigned char *proImg_v = dstImage.plane[2];
-
-    /////projection from image planar to spherical surface
-    int imgoff_ori_0, imgoff_ori_1, imgoff_ori_2, imgoff_ori_3;
-    int imgoff_ori_quart_0, imgoff_ori_quart_1, imgoff_ori_quart_2, imgoff_ori_quart_3;
-    int imgoff_pro_base;
-    int imgoff_pro, imageoff_pro_quart;
-    int col, row, col_half, row_half, proImgW_half;
-    Point2f coord;
-    float col_f, row_f;
-    unsigned char pv_0, pv_1, pv_2, pv_3;
-    double pixelTmp;
-
-    proImgW_half = dstImage.imageW >> 1;
-
-    for (int i = 0; i < warpMap.rows; i++)
-    {
-        imgoff_pro_base = i * warpMap.cols;
+// interface functions ====================================================================
+ImageOptFlow::ImageOptFlow() :
+    mImageW(0),
+    mImageH(0),
+    mFlowValid(false)
+{
+}
 
-        for (int j = 0; j < warpMap.cols; j++)
-        {
-            coord = warpMap.at<Point2f>(i, j);      // get the float coordinates in original image
-            col_f = coord.x;
-            row_f = coord.y;      // get the float coordinates in original image
+ImageOptFlow::~ImageOptFlow()
+{
+}
 
-            row = row_f;
-            col = col_f;    // get the float coordinates in original image(with sub pixel precision)
+int ImageOptFlow::init(int imageW, int imageH)
+{
+    imageRoi wholeImage;
+    wholeImage.imgW = wholeImage.roiW = imageW;
+    wholeImage.imgH = wholeImage.roiH = imageH;
+    wholeImage.roiX = wholeImage.roiY = 0;
+    return init(wholeImage);
+}
 
-            col_half = col >> 1;
-            row_half = row >> 1;
+int ImageOptFlow::init(imageRoi seamRoi)
+{// initialize all memories and objects needed in the calculation of optical flow
 
-            while (row_f >= srcImage.imageH - 2)    // when the coordinates exceed the last row, cut it
-            {
-                row_f -= 1;
-                row -= 1;
-                row_half -= 1;
-            }
+    if (seamRoi.roiW <= 0 || seamRoi.roiH <= 0 || seamRoi.roiX < 0 || seamRoi.roiY < 0 ||
+        seamRoi.roiX + seamRoi.roiW > seamRoi.imgW || seamRoi.roiY + seamRoi.roiH > seamRoi.imgH)
+        return -1;
 
-            imgoff_ori_0 = row*srcImage.strides[0] + col;
-            imgoff_ori_1 = imgoff_ori_0 + 1;
-            imgoff_ori_2 = imgoff_ori_0 + srcImage.strides[0];
-            imgoff_ori_3 = imgoff_ori_1 + srcImage.strides[0];
+    // reused memories(image data\ flow\ others), all of the roi size
+    mImageW = seamRoi.imgW;
+    mImageH = seamRoi.imgH;
+    mRoi = seamRoi;
+    Size roiSize(mRoi.roiW, mRoi.roiH);
+    imageL.create(roiSize, CV_8UC1);
+    imageR.create(roiSize, CV_8UC1);
 
-            imgoff_ori_quart_0 = row_half*srcImage.strides[1] + col_half;
-            imgoff_ori_quart_1 = imgoff_ori_quart_0 + 1;
-            imgoff_ori_quart_2 = imgoff_ori_quart_0 + srcImage.strides[1];
-            imgoff_ori_quart_3 = imgoff_ori_quart_1 + srcImage.strides[1];
+    flowLtoR.create(roiSize, CV_32FC2);
+    flowRtoL.create(roiSize, CV_32FC2);
+    mFlowValid = false;
 
-            imgoff_pro = imgoff_pro_base + j;
+    mapX.create(roiSize, CV_32FC1);
+    mapY.create(roiSize, CV_32FC1);
 
-            if (col >= 0 && row >= 0 && imgoff_ori_0 >= 0)
-            {
-                pv_0 = *(srcImg_y + imgoff_ori_0);
-                pv_1 = *(srcImg_y + imgoff_ori_1);
-                pv_2 = *(srcImg_y + imgoff_ori_2);
-                pv_3 = *(srcImg_y + imgoff_ori_3);
-
-                pixelTmp = ((pv_0)*(col + 1 - col_f) + (pv_1)*(col_f - col))*(row + 1 - row_f) + ((pv_2)*(col + 1 - col_f) + (pv_3)*(col_f - col))*(row_f - row);
-                *(proImg_y + imgoff_pro) = pixelTmp;
-
-                if (i % 2 == 0 && j % 2 == 0)
-                {
-                    imageoff_pro_quart = (i / 2)*proImgW_half + (j / 2);
-
-                    pv_0 = *(srcImg_u + imgoff_ori_quart_0);
-                    pv_1 = *(srcImg_u + imgoff_ori_quart_1);
-                    pv_2 = *(srcImg_u + imgoff_ori_quart_2);
-                    pv_3 = *(srcImg_u + imgoff_ori_quart_3);
-                    pixelTmp = ((pv_0)*(col + 1 - col_f) + (pv_1)*(col_f - col))*(row + 1 - row_f) + ((pv_2)*(col + 1 - col_f) + (pv_3)*(col_f - col))*(row_f - row);
-                    *(proImg_u + imageoff_pro_quart) = pixelTmp;
-
-                    pv_0 = *(srcImg_v + imgoff_ori_quart_0);
-                    pv_1 = *(srcImg_v + imgoff_ori_quart_1);
-                    pv_2 = *(srcImg_v + imgoff_ori_quart_2);
-                    pv_3 = *(srcImg_v + imgoff_ori_quart_3);
-                    pixelTmp = ((pv_0)*(col + 1 - col_f) + (pv_1)*(col_f - col))*(row + 1 - row_f) + ((pv_2)*(col + 1 - col_f) + (pv_3)*(col_f - col))*(row_f - row);
-                    *(proImg_v + imageoff_pro_quart) = pixelTmp;
-                }
-            }
-        }
+    // default weights, a ramp across the roi
+    shiftWeights.create(roiSize, CV_32FC1);
+    for (int y = 0; y < mRoi.roiH; ++y)
+    {
+        float *pW = shiftWeights.ptr<float>(y);
+        for (int x = 0; x < mRoi.roiW; ++x)
+            pW[x] = (mRoi.roiW > 1) ? (float)x / (mRoi.roiW - 1) : 0.5f;
     }
+
+    // farneback kernel
+    setFarneback(&farn);
+
     return 0;
 }
 
-// interface functions ====================================================================
-ImageOptFlow::ImageOptFlow()
+int ImageOptFlow::setShiftWeights(const unsigned char *pWeights, int stride)
 {
-	for (int k = 0; k != MAX_IMAGE_CHANNELS; ++k)
-	{
-		tempImage.plane[k] = NULL;
-	}
+    if (pWeights == NULL || shiftWeights.empty())
+        return -1;
+
+    for (int y = 0; y < mRoi.roiH; ++y)
+    {
+        float *pW = shiftWeights.ptr<float>(y);
+        for (int x = 0; x < mRoi.roiW; ++x)
+            pW[x] = pWeights[y * stride + x] * (1.0f / 255.0f);
+    }
+    return 0;
 }
 
-ImageOptFlow::~ImageOptFlow()
+int ImageOptFlow::grayRoi(imageFrame image, Mat &gray)
 {
-}
+    switch (image.pxlColorFormat)
+    {
+    case PIXELCOLORSPACE_RGB:
+    case PIXELCOLORSPACE_RGBA:
+    {// full range BT.601 luma, the weights of COLOR_RGB2GRAY
+        int pixelBytes = (image.pxlColorFormat == PIXELCOLORSPACE_RGB) ? 3 : 4;
+        gray.create(mRoi.roiH, mRoi.roiW, CV_8UC1);
+        convertRGBToLuma(image.plane[0] + mRoi.roiY * image.strides[0] + mRoi.roiX * pixelBytes, image.strides[0], pixelBytes,
+            gray.data, (int)gray.step, mRoi.roiW, mRoi.roiH, yuvBT601, yuvFullRange);
+        break;
+    }
 
-int ImageOptFlow::init(int imageW, int imageH)
-{// initialize all memories and objects needed in the calculation of optical flow
-    
-    // reused memories(image data\ flow\ others)
-    mImageW = imageW;
-    mImageH = imageH;
-    imageL.create(Size(mImageW, mImageH), CV_8UC1);
-    imageR.create(Size(mImageW, mImageH), CV_8UC1);
-
-    flowLtoR.create(Size(mImageW, mImageH), CV_32FC2);
-    flowRtoL.create(Size(mImageW, mImageH), CV_32FC2);
-
-    warpMapL.create(Size(mImageW, mImageH), CV_32FC2);
-    warpMapR.create(Size(mImageW, mImageH), CV_32FC2);
-
-    tempImage.imageW = imageW;
-    tempImage.imageH = imageH;
-    tempImage.pxlColorFormat = PIXELCOLORSPACE_YUV420PYV;
-    tempImage.plane[0] = new unsigned char[imageW * imageH];
-    tempImage.plane[1] = new unsigned char[imageW * imageH / 4];
-    tempImage.plane[2] = new unsigned char[imageW * imageH / 4];
-    tempImage.strides[0] = imageW;
-    tempImage.strides[1] = imageW / 2;
-    tempImage.strides[2] = imageW / 2;
-    // farneback kernel
-    setFarneback(&farn);
-    
+    case PIXELCOLORSPACE_YUV420PYV:
+        gray = Mat(mRoi.roiH, mRoi.roiW, CV_8UC1, image.plane[0] + mRoi.roiY * image.strides[0] + mRoi.roiX, image.strides[0]);
+        break;
+
+    default:
+        return -1;
+    }
     return 0;
 }
 
 int ImageOptFlow::computeImageFlow(imageFrame pImgL, imageFrame pImgR)
 {// calculate flows between 2 seam images
-    convertImageFrametoCvMatGray(pImgL, imageL);    // convert yuv image frame to single gray mat
-    convertImageFrametoCvMatGray(pImgR, imageR);
+    if (pImgL.imageW != mImageW || pImgL.imageH != mImageH || pImgR.imageW != mImageW || pImgR.imageH != mImageH)
+        return -1;
+    if (grayRoi(pImgL, imageL) != 0 || grayRoi(pImgR, imageR) != 0)
+        return -1;
 
-    calcSingleOptFlow(imageL, imageR, flowLtoR, &farn);
-    calcSingleOptFlow(imageR, imageL, flowRtoL, &farn);
+    // consecutive video frames move little, the last flow is a good guess for this one
+    calcSingleOptFlow(imageL, imageR, flowLtoR, &farn, mFlowValid);
+    calcSingleOptFlow(imageR, imageL, flowRtoL, &farn, mFlowValid);
+    mFlowValid = true;
 
 #if 0
     // draw flow
@@ -269,23 +208,76 @@ int ImageOptFlow::computeImageFlow(imageFrame pImgL, imageFrame pImgR)
 }
 
 int ImageOptFlow::genWarpMap()
-{
-    genFlowWarpMat(flowLtoR, warpMapR, mImageW, mImageH, shift_linear_down_up, 1.0);
-    genFlowWarpMat(flowRtoL, warpMapL, mImageW, mImageH, shift_linear_up_down, 1.0);
+{// the left image is moved towards the right one by the weight, the right image by the rest of it
+    if (!mFlowValid)
+        return -1;
+
+    Size halfSize(mRoi.roiW / 2, mRoi.roiH / 2);
+    Mat mapHalfX(halfSize, CV_32FC1);
+    Mat mapHalfY(halfSize, CV_32FC1);
+
+    genFlowWarpMat(flowRtoL, shiftWeights, false, mRoi, mapX, mapY);
+    convertMaps(mapX, mapY, warpMapL[0], warpMapL[1], CV_16SC2);
+    genHalfWarpMat(mapX, mapY, mapHalfX, mapHalfY);
+    convertMaps(mapHalfX, mapHalfY, warpMapHalfL[0], warpMapHalfL[1], CV_16SC2);
+
+    genFlowWarpMat(flowLtoR, shiftWeights, true, mRoi, mapX, mapY);
+    convertMaps(mapX, mapY, warpMapR[0], warpMapR[1], CV_16SC2);
+    genHalfWarpMat(mapX, mapY, mapHalfX, mapHalfY);
+    convertMaps(mapHalfX, mapHalfY, warpMapHalfR[0], warpMapHalfR[1], CV_16SC2);
 
     return 0;
 }
 
+int ImageOptFlow::remapRoi(imageFrame image, Mat &map1, Mat &map2, Mat &mapHalf1, Mat &mapHalf2)
+{// the maps read the whole image, so the roi is remapped into remapBuf first and then copied over itself
+    switch (image.pxlColorFormat)
+    {
+    case PIXELCOLORSPACE_RGB:
+    case PIXELCOLORSPACE_RGBA:
+    {
+        int type = (image.pxlColorFormat == PIXELCOLORSPACE_RGB) ? CV_8UC3 : CV_8UC4;
+        Mat whole(mImageH, mImageW, type, image.plane[0], image.strides[0]);
+        remap(whole, remapBuf, map1, map2, INTER_LINEAR, BORDER_REPLICATE);
+        remapBuf.copyTo(whole(Rect(mRoi.roiX, mRoi.roiY, mRoi.roiW, mRoi.roiH)));
+        break;
+    }
+
+    case PIXELCOLORSPACE_YUV420PYV:
+    {
+        Mat wholeY(mImageH, mImageW, CV_8UC1, image.plane[0], image.strides[0]);
+        remap(wholeY, remapBuf, map1, map2, INTER_LINEAR, BORDER_REPLICATE);
+        remapBuf.copyTo(wholeY(Rect(mRoi.roiX, mRoi.roiY, mRoi.roiW, mRoi.roiH)));
+
+        Rect halfRoi(mRoi.roiX / 2, mRoi.roiY / 2, mRoi.roiW / 2, mRoi.roiH / 2);
+        for (int k = 1; k != 3; ++k)
+        {
+            Mat wholeUV(mImageH / 2, mImageW / 2, CV_8UC1, image.plane[k], image.strides[k]);
+            remap(wholeUV, remapBuf, mapHalf1, mapHalf2, INTER_LINEAR, BORDER_REPLICATE);
+            remapBuf.copyTo(wholeUV(halfRoi));
+        }
+        break;
+    }
+
+    default:
+        return -1;
+    }
+    return 0;
+}
 
 int ImageOptFlow::genNovalImage(imageFrame pSrcImgL, imageFrame pSrcImgR)
 {// remap image using imageFrame structure rather than mat
+    if (warpMapL[0].empty())
+        return -1;
 
-    copyImage(&pSrcImgL, &tempImage);
-    warpImageFrame(tempImage, warpMapL, pSrcImgL);
-
-    copyImage(&pSrcImgR, &tempImage);
-    warpImageFrame(tempImage, warpMapR, pSrcImgR);
+    if (remapRoi(pSrcImgL, warpMapL[0], warpMapL[1], warpMapHalfL[0], warpMapHalfL[1]) != 0)
+        return -1;
+    return remapRoi(pSrcImgR, warpMapR[0], warpMapR[1], warpMapHalfR[0], warpMapHalfR[1]);
+}
 
+int ImageOptFlow::resetTemporal()
+{
+    mFlowValid = false;
     return 0;
 }
 
@@ -296,13 +288,19 @@ int ImageOptFlow::dinit()
 
     flowLtoR.release();
     flowRtoL.release();
+    mFlowValid = false;
 
-    warpMapL.release();
-    warpMapR.release();
-
-    delete[] tempImage.plane[0];
-    delete[] tempImage.plane[1];
-    delete[] tempImage.plane[2];
+    shiftWeights.release();
+    for (int k = 0; k != 2; ++k)
+    {
+        warpMapL[k].release();
+        warpMapR[k].release();
+        warpMapHalfL[k].release();
+        warpMapHalfR[k].release();
+    }
+    mapX.release();
+    mapY.release();
+    remapBuf.release();
 
     return 0;
 }
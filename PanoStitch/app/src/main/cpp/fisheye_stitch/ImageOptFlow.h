@@ -7,14 +7,12 @@
 
 #include "YiPanoramaTypes.h"
 #include <opencv.hpp>
-#include <opencv2/ximgproc.hpp>
 #include <string>
 
 namespace YiPanorama {
 namespace util {
 
 using namespace cv;
-using namespace cv::ximgproc;
 
 // function declarations ========================================================
 struct optFlowFarneback
@@ -27,51 +25,74 @@ struct optFlowFarneback
     double polySigma;
     int flags;
     bool fastPyramids;
-}; 
+};
 
 class ImageOptFlow
-{
+{// flow between 2 images of the same size, only inside a roi (the seam), and warm started from the flow of
+ // the previous frame so video frames only refine it on the finer pyramid levels.
+ // RGB, RGBA and YUV420PYV frames are supported
 public:
     ImageOptFlow();
     ~ImageOptFlow();
 
-    // initialize the kernel of this optical flow
+    // initialize the kernel of this optical flow, for the whole image
     int init(int imageW, int imageH);
 
-    // compute optical flow from left to right image, only gray channel of the image is needed
+    // flow is only computed and applied inside seamRoi of imageW x imageH images
+    int init(imageRoi seamRoi);
+
+    // weight of the right image for each roi pixel, 0 ~ 255: where it is 255 the left image is moved all the way
+    // onto the right one and the right one stays, and the other way round for 0. the default is a ramp from 0 to 255 across the roi
+    int setShiftWeights(const unsigned char *pWeights, int stride);
+
+    // compute optical flow from left to right image and back, only gray channel of the image is needed
     int computeImageFlow(imageFrame pImgL, imageFrame pImgR);
 
     // generate the warp maps according to the optical flows
     int genWarpMap();
-    
-    // generate novel view image from left image by calculated flow
+
+    // generate novel view image from left image by calculated flow, the roi of both images is rewritten in place
     int genNovalImage(imageFrame pSrcImgL, imageFrame pSrcImgR);
 
+    // forget the previous flow, e.g. after a cut, the next computeImageFlow starts from scratch
+    int resetTemporal();
+
     // free
     int dinit();
 
 
 private:
+    int grayRoi(imageFrame image, Mat &gray);    // gray of the roi, a header on the Y plane for YUV
+    int remapRoi(imageFrame image, Mat &map1, Mat &map2, Mat &mapHalf1, Mat &mapHalf2);
+
     // opticalFlow related data
     optFlowFarneback farn;
     int mImageW;
     int mImageH;
+    imageRoi mRoi;
+    bool mFlowValid;    // flowLtoR / flowRtoL hold the flow of the previous frame
 
     // opencv image structure
-    Mat imageL; // since main data structure are imageFrame(YUV420) in video, this is generated from the Y channel of the image
+    Mat imageL; // gray of the roi
     Mat imageR;
 
     Mat flowLtoR;   // flow from left to right
     Mat flowRtoL;   // flow from right to left
 
-    Mat warpMapL;   // warp map generated from flow right to left, the trans-shift is needed
-    Mat warpMapR;   // warp map generated from flow left to right, the trans-shift is needed
+    Mat shiftWeights;   // CV_32FC1, weight of the right image in the roi, 0 ~ 1
+
+    Mat warpMapL[2];    // fixed point maps of the roi into the whole left image, for cv::remap
+    Mat warpMapR[2];
+    Mat warpMapHalfL[2];    // the same for the half sized chroma planes, YUV only
+    Mat warpMapHalfR[2];
+    Mat mapX;           // float maps before the fixed point conversion
+    Mat mapY;
 
-    imageFrame tempImage;
+    Mat remapBuf;       // remapped roi, copied back over the source roi
 };
 
 
 }   // namespace util
 }   // namespace YiPanorama
 
-#endif  //!_IMAGE_OPT_FLOW_H
\ No newline at end of file
+#endif  //!_IMAGE_OPT_FLOW_H
@@ -1,30 +1,68 @@
 
 #include "ImageWarpTable.h"
 #include "MatrixVectors.h"
+#include "ThreadPool.h"
 
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
 #include <iostream>
 #include <string.h>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WARPTABLE_USE_NEON
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WARPTABLE_USE_SSE2
+#endif
 
 #define M_PI       3.14159265358979323846   // pi
 #define M_PI_2     1.57079632679489661923   // pi/2
 #define M_PI_4     0.785398163397448309616  // pi/4
 #define MAX_PATH_LEN    512
 
+#define ATAN_POLY_LEN   8
+#define NODE_EPS        1e-30f  // keeps the reciprocals finite, a node on the camera axis still lands on the center
+
+#define TABLE_FILE_VERSION      1
+#define TABLE_FILE_DATA_OFFSET  128     // tables start cache line aligned after the header
+
 namespace YiPanorama {
 namespace warper {
 
     imageWarpTable::imageWarpTable() :
+        mProjection(warpEquirect),
         mPmapX(NULL),
         mPmapY(NULL),
         mPvcfr(NULL),
 		mPposX(NULL),
-		mPposY(NULL)
+		mPposY(NULL),
+		mPMapBase(NULL),
+		mMapSize(0)
     {
     }
 
+struct warpTableFileHeader
+{// header of a saved table, the float tables follow at TABLE_FILE_DATA_OFFSET in the order mapX, mapY, posX, posY, (vcf)
+    char magic[4];      // "YWTB"
+    int version;
+    unsigned long long key;
+    imageRoi warpImgDstRoi;
+    int stepX;
+    int stepY;
+    int tableW;
+    int tableH;
+    int hasVC;
+    int srcImageW;
+    int srcImageH;
+};
+
     imageWarpTable::~imageWarpTable()
     {
     }
@@ -144,28 +182,562 @@ int imageWarpTable::init(int wholeImageW, int wholeImageH, int vertPixelUp, int
 	return 0;
 }
 
+// right, down and forward of the cube faces, in the sphere axes: x to the right, y to the north pole, the pano center
+// at -z. the top row runs left, front, right around the horizon, the lower one down, back, up over the poles
+static const double cubeFaceAxesTable[6][9] = {
+    { 0, 0, -1,     0, -1, 0,   -1, 0, 0 },     // left
+    { 1, 0, 0,      0, -1, 0,   0, 0, -1 },     // front
+    { 0, 0, 1,      0, -1, 0,   1, 0, 0 },      // right
+    { 0, 0, 1,      -1, 0, 0,   0, -1, 0 },     // down
+    { 0, 1, 0,      -1, 0, 0,   0, 0, 1 },      // back
+    { 0, 0, -1,     -1, 0, 0,   0, 1, 0 } };    // up
+
+const double *imageWarpTable::cubeFaceAxes(int face)
+{
+    return (face >= 0 && face < 6) ? cubeFaceAxesTable[face] : NULL;
+}
+
+int imageWarpTable::setProjection(warpProjection projection)
+{
+    if (projection != warpEquirect && projection != warpCubemap && projection != warpEAC)
+        return -1;
+
+    mProjection = projection;
+    return 0;
+}
+
+int imageWarpTable::panoToSphere(const double panoCoords[2], double sphere[3])
+{
+    if (mProjection == warpEquirect)
+    {
+        double theta = M_PI_2 - M_PI * panoCoords[0] / mWarpImgDstRoi.imgH;   // latitude
+        double phi = 2 * M_PI * panoCoords[1] / mWarpImgDstRoi.imgW;          // longitude
+
+        sphere[1] = sin(theta);              // sphere axis Y, pointing to the north pole
+        sphere[2] = cos(theta) * cos(phi);   // sphere axis Z, pointing to the viewer
+        sphere[0] = -cos(theta) * sin(phi);  // sphere axis X, pointing to the right hand direction
+        return 0;
+    }
+
+    // the face of the roi center, the nodes on the roi borders then stay on the edges of that face
+    int faceW = mWarpImgDstRoi.imgW / 3;
+    int faceH = mWarpImgDstRoi.imgH / 2;
+    if (faceW <= 0 || faceH <= 0)
+        return -1;
+    int faceCol = (mWarpImgDstRoi.roiX + mWarpImgDstRoi.roiW / 2) / faceW;
+    int faceRow = (mWarpImgDstRoi.roiY + mWarpImgDstRoi.roiH / 2) / faceH;
+    faceCol = (faceCol < 2) ? faceCol : 2;
+    faceRow = (faceRow < 1) ? faceRow : 1;
+    const double *pAxes = cubeFaceAxesTable[faceRow * 3 + faceCol];
+
+    double u = 2.0 * (panoCoords[1] - faceCol * faceW) / faceW - 1.0;   // -1 ~ 1 over the face
+    double v = 2.0 * (panoCoords[0] - faceRow * faceH) / faceH - 1.0;
+    if (mProjection == warpEAC)
+    {
+        u = tan(M_PI_4 * u);
+        v = tan(M_PI_4 * v);
+    }
+
+    double norm = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        sphere[i] = u * pAxes[i] + v * pAxes[3 + i] + pAxes[6 + i];
+        norm += sphere[i] * sphere[i];
+    }
+    norm = sqrt(norm);
+    for (int i = 0; i < 3; i++)
+        sphere[i] /= norm;
+
+    return 0;
+}
+
+int imageWarpTable::sphereToPano(const double sphere[3], double panoCoords[2])
+{
+    if (mProjection == warpEquirect)
+    {
+        double norm = sqrt(sphere[0] * sphere[0] + sphere[1] * sphere[1] + sphere[2] * sphere[2]);
+        double theta = asin(sphere[1] / norm);
+        norm = sqrt(sphere[0] * sphere[0] + sphere[2] * sphere[2]);
+        double phi = acos(sphere[2] / norm);
+        if (sphere[0] > 0)
+            phi = 2 * M_PI - phi;
+
+        panoCoords[1] = mWarpImgDstRoi.imgW * phi / (2 * M_PI);           // x
+        panoCoords[0] = mWarpImgDstRoi.imgH * (M_PI_2 - theta) / M_PI;    // y
+        return 0;
+    }
+
+    // the face the point looks at the most
+    int face = 0;
+    double forward = -1e30;
+    for (int i = 0; i < 6; i++)
+    {
+        const double *pAxes = cubeFaceAxesTable[i];
+        double dot = sphere[0] * pAxes[6] + sphere[1] * pAxes[7] + sphere[2] * pAxes[8];
+        if (dot > forward)
+        {
+            forward = dot;
+            face = i;
+        }
+    }
+    if (forward <= 0)
+        return -1;
+
+    const double *pAxes = cubeFaceAxesTable[face];
+    double u = (sphere[0] * pAxes[0] + sphere[1] * pAxes[1] + sphere[2] * pAxes[2]) / forward;
+    double v = (sphere[0] * pAxes[3] + sphere[1] * pAxes[4] + sphere[2] * pAxes[5]) / forward;
+    if (mProjection == warpEAC)
+    {
+        u = atan(u) / M_PI_4;
+        v = atan(v) / M_PI_4;
+    }
+
+    int faceW = mWarpImgDstRoi.imgW / 3;
+    int faceH = mWarpImgDstRoi.imgH / 2;
+    panoCoords[1] = faceW * (face % 3 + (u + 1.0) / 2);   // x
+    panoCoords[0] = faceH * (face / 3 + (v + 1.0) / 2);   // y
+
+    return 0;
+}
+
 int imageWarpTable::dinit()
 {
-    // delete map coordinates and vc factors
-    if (mPmapX != NULL)
-        delete[] mPmapX;
+    if (mPMapBase != NULL)
+    {// tables live in the cache file mapping
+        munmap(mPMapBase, mMapSize);
+        mPMapBase = NULL;
+        mMapSize = 0;
+    }
+    else
+    {
+        // delete map coordinates and vc factors
+        if (mPmapX != NULL)
+            delete[] mPmapX;
+
+        if (mPmapY != NULL)
+            delete[] mPmapY;
+
+        if (mPvcfr != NULL)
+            delete[] mPvcfr;
+
+        if (mPposX != NULL)
+            delete[] mPposX;
+
+        if (mPposY != NULL)
+            delete[] mPposY;
+    }
+
+    mPmapX = NULL;
+    mPmapY = NULL;
+    mPvcfr = NULL;
+    mPposX = NULL;
+    mPposY = NULL;
+
+    return 0;
+}
+
+static unsigned long long hashBytes(unsigned long long hash, const void *pData, size_t size)
+{// 64 bit FNV-1a
+    const unsigned char *p = (const unsigned char *)pData;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+unsigned long long imageWarpTable::tableCacheKey(cameraMetadata *pCameraMetadata, int sphereRadius)
+{// fields are hashed one by one, the structures may carry uninitialized padding
+    ocamModel stOcamModel;
+    double R[EXT_PARAM_R_MTX_NUM], T[EXT_PARAM_T_VEC_NUM];
+    pCameraMetadata->getOcamModel(&stOcamModel);
+    pCameraMetadata->getWorld2CamRotMtx(R);
+    pCameraMetadata->getWorld2CamTransVec(T);
+
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = hashBytes(hash, &stOcamModel.length_pol, sizeof(int));
+    hash = hashBytes(hash, stOcamModel.pol, sizeof(stOcamModel.pol));
+    hash = hashBytes(hash, &stOcamModel.length_invpol, sizeof(int));
+    hash = hashBytes(hash, stOcamModel.invpol, sizeof(stOcamModel.invpol));
+    hash = hashBytes(hash, &stOcamModel.uc, sizeof(double));
+    hash = hashBytes(hash, &stOcamModel.vc, sizeof(double));
+    hash = hashBytes(hash, &stOcamModel.c, sizeof(double));
+    hash = hashBytes(hash, &stOcamModel.d, sizeof(double));
+    hash = hashBytes(hash, &stOcamModel.e, sizeof(double));
+    hash = hashBytes(hash, &stOcamModel.width, sizeof(int));
+    hash = hashBytes(hash, &stOcamModel.height, sizeof(int));
+    hash = hashBytes(hash, stOcamModel.vcf_factors, sizeof(stOcamModel.vcf_factors));
+    hash = hashBytes(hash, R, sizeof(R));
+    hash = hashBytes(hash, T, sizeof(T));
+    hash = hashBytes(hash, &sphereRadius, sizeof(int));
+
+    int geometry[10] = { mWarpImgDstRoi.imgW, mWarpImgDstRoi.imgH, mWarpImgDstRoi.roiX, mWarpImgDstRoi.roiY, mWarpImgDstRoi.roiW, mWarpImgDstRoi.roiH,
+                         mIsSparseTable ? mProStepX : 1, mIsSparseTable ? mProStepY : 1, mHasVC ? 1 : 0, TABLE_FILE_VERSION };
+    hash = hashBytes(hash, geometry, sizeof(geometry));
+    if (mProjection != warpEquirect)    // equirect keys stay those of the tables cached before the projections
+        hash = hashBytes(hash, &mProjection, sizeof(int));
+
+    return hash;
+}
+
+int imageWarpTable::save(const char *fileName, unsigned long long key)
+{// written to a temporary file first and renamed, so a reader never maps a half written table
+    warpTableFileHeader stHeader = {};
+    memcpy(stHeader.magic, "YWTB", 4);
+    stHeader.version = TABLE_FILE_VERSION;
+    stHeader.key = key;
+    stHeader.warpImgDstRoi = mWarpImgDstRoi;
+    stHeader.stepX = mProStepX;
+    stHeader.stepY = mProStepY;
+    stHeader.tableW = mTableW;
+    stHeader.tableH = mTableH;
+    stHeader.hasVC = mHasVC ? 1 : 0;
+    stHeader.srcImageW = mSrcImageW;
+    stHeader.srcImageH = mSrcImageH;
+
+    char tmpName[MAX_PATH_LEN];
+    snprintf(tmpName, MAX_PATH_LEN, "%s.%d.tmp", fileName, (int)getpid());
+
+    FILE *fp = fopen(tmpName, "wb");
+    if (fp == NULL)
+    {
+        std::cout << "save: can not open warp table file " << tmpName << std::endl;
+        return -1;
+    }
+
+    unsigned char pad[TABLE_FILE_DATA_OFFSET];
+    memset(pad, 0, TABLE_FILE_DATA_OFFSET);
+    memcpy(pad, &stHeader, sizeof(stHeader));
+
+    size_t tableSize = (size_t)mTableW * mTableH;
+    bool isOk = fwrite(pad, 1, TABLE_FILE_DATA_OFFSET, fp) == TABLE_FILE_DATA_OFFSET;
+    isOk = isOk && fwrite(mPmapX, sizeof(float), tableSize, fp) == tableSize;
+    isOk = isOk && fwrite(mPmapY, sizeof(float), tableSize, fp) == tableSize;
+    isOk = isOk && fwrite(mPposX, sizeof(float), tableSize, fp) == tableSize;
+    isOk = isOk && fwrite(mPposY, sizeof(float), tableSize, fp) == tableSize;
+    if (mHasVC)
+        isOk = isOk && fwrite(mPvcfr, sizeof(float), tableSize, fp) == tableSize;
+    isOk = (fclose(fp) == 0) && isOk;
+
+    if (!isOk || rename(tmpName, fileName) != 0)
+    {
+        std::cout << "save: writing warp table file " << fileName << " failed" << std::endl;
+        remove(tmpName);
+        return -1;
+    }
 
-    if (mPmapY != NULL)
-        delete[] mPmapY;
+    return 0;
+}
 
-    if (mPvcfr != NULL)
-        delete[] mPvcfr;
+int imageWarpTable::read(const char *fileName, unsigned long long key)
+{// the file is mapped copy on write, so the tables can still be regenerated in place later
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return -1;
 
-	if (mPposX != NULL)
-		delete[] mPposX;
+    size_t tableSize = (size_t)mTableW * mTableH;
+    size_t fileSize = TABLE_FILE_DATA_OFFSET + sizeof(float) * tableSize * (mHasVC ? 5 : 4);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != fileSize)
+    {
+        close(fd);
+        return -1;
+    }
 
-	if (mPposY != NULL)
-		delete[] mPposY;
+    void *pBase = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pBase == MAP_FAILED)
+        return -1;
+
+    const warpTableFileHeader *pHeader = (const warpTableFileHeader *)pBase;
+    if (memcmp(pHeader->magic, "YWTB", 4) != 0 || pHeader->version != TABLE_FILE_VERSION || pHeader->key != key ||
+        memcmp(&pHeader->warpImgDstRoi, &mWarpImgDstRoi, sizeof(imageRoi)) != 0 ||
+        pHeader->stepX != mProStepX || pHeader->stepY != mProStepY || pHeader->tableW != mTableW || pHeader->tableH != mTableH ||
+        pHeader->hasVC != (mHasVC ? 1 : 0))
+    {
+        munmap(pBase, fileSize);
+        return -1;
+    }
+    mSrcImageW = pHeader->srcImageW;
+    mSrcImageH = pHeader->srcImageH;
+
+    // drop the tables of init() and point into the mapping
+    dinit();
+    float *pTables = (float *)((unsigned char *)pBase + TABLE_FILE_DATA_OFFSET);
+    mPmapX = pTables;
+    mPmapY = pTables + tableSize;
+    mPposX = pTables + 2 * tableSize;
+    mPposY = pTables + 3 * tableSize;
+    mPvcfr = mHasVC ? pTables + 4 * tableSize : NULL;
+    mPMapBase = pBase;
+    mMapSize = fileSize;
 
     return 0;
 }
 
+// odd minimax polynomial of atan(q) on [0, 1]: q * (a0 + a1 * q^2 + ... + a7 * q^14), |error| < 1.4e-7 rad in float.
+// with ~900 pixels per radian of a 2880 fisheye this is below 1e-3 pixel.
+static const float atanPoly[ATAN_POLY_LEN] = {
+    9.999993443e-01f, -3.332985938e-01f, 1.994656622e-01f, -1.390862912e-01f,
+    9.642197192e-02f, -5.591231957e-02f, 2.186295390e-02f, -4.054565914e-03f };
+
+struct camProjection
+{// the ocam terms of cam2img in float, shared by all nodes of a table
+    float invpol[POL_LENGTH_INV];
+    int lengthInvpol;
+    float c, d, e;
+    float uc, vc;
+};
+
+static inline float atanFast(float z, float norm)
+{// atan(z / norm) for norm >= 0, the same steps as the simd kernels
+    float a = fabsf(z);
+    float mn = (a < norm) ? a : norm;
+    float mx = (a < norm) ? norm : a;
+    float q = mn / ((mx > NODE_EPS) ? mx : NODE_EPS);
+    float q2 = q * q;
+    float t = atanPoly[ATAN_POLY_LEN - 1];
+    for (int i = ATAN_POLY_LEN - 2; i >= 0; i--)
+        t = t * q2 + atanPoly[i];
+    t *= q;
+    if (a > norm)
+        t = (float)M_PI_2 - t;
+    return (z < 0) ? -t : t;
+}
+
+static void projectNodes(const camProjection *pProj, float cosTheta, const float B[3], const float *pA0, const float *pA1, const float *pA2,
+    int count, float *pImgX, float *pImgY)
+{// cam = cosTheta * A[m] + B for each node of a row, then cam2img. pImgY holds rows (img[0]), pImgX columns (img[1])
+    int m = 0;
+#if defined(WARPTABLE_USE_SSE2)
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 eps = _mm_set1_ps(NODE_EPS);
+    __m128 vCos = _mm_set1_ps(cosTheta);
+    for (; m + 4 <= count; m += 4)
+    {
+        __m128 x = _mm_add_ps(_mm_mul_ps(vCos, _mm_loadu_ps(pA0 + m)), _mm_set1_ps(B[0]));
+        __m128 y = _mm_add_ps(_mm_mul_ps(vCos, _mm_loadu_ps(pA1 + m)), _mm_set1_ps(B[1]));
+        __m128 z = _mm_add_ps(_mm_mul_ps(vCos, _mm_loadu_ps(pA2 + m)), _mm_set1_ps(B[2]));
+
+        __m128 n2 = _mm_max_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), eps);
+        __m128 invNorm = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(n2));
+        __m128 norm = _mm_mul_ps(n2, invNorm);
+
+        // atan2(z, norm) with the range reduced to [0, 1]
+        __m128 a = _mm_andnot_ps(signMask, z);
+        __m128 q = _mm_div_ps(_mm_min_ps(a, norm), _mm_max_ps(_mm_max_ps(a, norm), eps));
+        __m128 q2 = _mm_mul_ps(q, q);
+        __m128 t = _mm_set1_ps(atanPoly[ATAN_POLY_LEN - 1]);
+        for (int i = ATAN_POLY_LEN - 2; i >= 0; i--)
+            t = _mm_add_ps(_mm_mul_ps(t, q2), _mm_set1_ps(atanPoly[i]));
+        t = _mm_mul_ps(t, q);
+        __m128 swap = _mm_cmpgt_ps(a, norm);
+        t = _mm_or_ps(_mm_and_ps(swap, _mm_sub_ps(_mm_set1_ps((float)M_PI_2), t)), _mm_andnot_ps(swap, t));
+        t = _mm_xor_ps(t, _mm_and_ps(z, signMask));
+
+        __m128 rho = _mm_set1_ps(pProj->invpol[pProj->lengthInvpol - 1]);
+        for (int i = pProj->lengthInvpol - 2; i >= 0; i--)
+            rho = _mm_add_ps(_mm_mul_ps(rho, t), _mm_set1_ps(pProj->invpol[i]));
+
+        __m128 s = _mm_mul_ps(rho, invNorm);
+        __m128 u = _mm_mul_ps(x, s);
+        __m128 v = _mm_mul_ps(y, s);
+        _mm_storeu_ps(pImgY + m, _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_set1_ps(pProj->c)), _mm_mul_ps(v, _mm_set1_ps(pProj->d))), _mm_set1_ps(pProj->uc)));
+        _mm_storeu_ps(pImgX + m, _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_set1_ps(pProj->e)), v), _mm_set1_ps(pProj->vc)));
+    }
+#elif defined(WARPTABLE_USE_NEON)
+    const uint32x4_t signMask = vdupq_n_u32(0x80000000);
+    const float32x4_t eps = vdupq_n_f32(NODE_EPS);
+    for (; m + 4 <= count; m += 4)
+    {
+        float32x4_t x = vmlaq_n_f32(vdupq_n_f32(B[0]), vld1q_f32(pA0 + m), cosTheta);
+        float32x4_t y = vmlaq_n_f32(vdupq_n_f32(B[1]), vld1q_f32(pA1 + m), cosTheta);
+        float32x4_t z = vmlaq_n_f32(vdupq_n_f32(B[2]), vld1q_f32(pA2 + m), cosTheta);
+
+        // armv7 has no vector sqrt / div, the estimates are refined with two newton steps
+        float32x4_t n2 = vmaxq_f32(vmlaq_f32(vmulq_f32(x, x), y, y), eps);
+        float32x4_t invNorm = vrsqrteq_f32(n2);
+        invNorm = vmulq_f32(invNorm, vrsqrtsq_f32(vmulq_f32(n2, invNorm), invNorm));
+        invNorm = vmulq_f32(invNorm, vrsqrtsq_f32(vmulq_f32(n2, invNorm), invNorm));
+        float32x4_t norm = vmulq_f32(n2, invNorm);
+
+        float32x4_t a = vabsq_f32(z);
+        float32x4_t mx = vmaxq_f32(vmaxq_f32(a, norm), eps);
+        float32x4_t invMx = vrecpeq_f32(mx);
+        invMx = vmulq_f32(invMx, vrecpsq_f32(mx, invMx));
+        invMx = vmulq_f32(invMx, vrecpsq_f32(mx, invMx));
+        float32x4_t q = vmulq_f32(vminq_f32(a, norm), invMx);
+        float32x4_t q2 = vmulq_f32(q, q);
+        float32x4_t t = vdupq_n_f32(atanPoly[ATAN_POLY_LEN - 1]);
+        for (int i = ATAN_POLY_LEN - 2; i >= 0; i--)
+            t = vmlaq_f32(vdupq_n_f32(atanPoly[i]), t, q2);
+        t = vmulq_f32(t, q);
+        t = vbslq_f32(vcgtq_f32(a, norm), vsubq_f32(vdupq_n_f32((float)M_PI_2), t), t);
+        t = vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(t), vandq_u32(vreinterpretq_u32_f32(z), signMask)));
+
+        float32x4_t rho = vdupq_n_f32(pProj->invpol[pProj->lengthInvpol - 1]);
+        for (int i = pProj->lengthInvpol - 2; i >= 0; i--)
+            rho = vmlaq_f32(vdupq_n_f32(pProj->invpol[i]), rho, t);
+
+        float32x4_t s = vmulq_f32(rho, invNorm);
+        float32x4_t u = vmulq_f32(x, s);
+        float32x4_t v = vmulq_f32(y, s);
+        vst1q_f32(pImgY + m, vaddq_f32(vmlaq_n_f32(vmulq_n_f32(u, pProj->c), v, pProj->d), vdupq_n_f32(pProj->uc)));
+        vst1q_f32(pImgX + m, vaddq_f32(vmlaq_n_f32(v, u, pProj->e), vdupq_n_f32(pProj->vc)));
+    }
+#endif
+    for (; m < count; m++)
+    {
+        float x = cosTheta * pA0[m] + B[0];
+        float y = cosTheta * pA1[m] + B[1];
+        float z = cosTheta * pA2[m] + B[2];
+
+        float n2 = x * x + y * y;
+        n2 = (n2 > NODE_EPS) ? n2 : NODE_EPS;
+        float invNorm = 1.0f / sqrtf(n2);
+        float t = atanFast(z, n2 * invNorm);
+
+        float rho = pProj->invpol[pProj->lengthInvpol - 1];
+        for (int i = pProj->lengthInvpol - 2; i >= 0; i--)
+            rho = rho * t + pProj->invpol[i];
+
+        float u = x * rho * invNorm;
+        float v = y * rho * invNorm;
+        pImgY[m] = u * pProj->c + v * pProj->d + pProj->uc;
+        pImgX[m] = u * pProj->e + v + pProj->vc;
+    }
+}
+
 int imageWarpTable::genWarperCam(cameraMetadata *pCameraMetadata, int sphereRadius)
+{
+    mSrcImageW = pCameraMetadata->getOcamImgW();
+    mSrcImageH = pCameraMetadata->getOcamImgH();
+
+    util::ThreadPool::getDefault()->parallelFor(0, mTableH, [&](int rowBegin, int rowEnd) {
+        genWarperCamRows(pCameraMetadata, sphereRadius, rowBegin, rowEnd);
+    }, 4);
+
+    return 0;
+}
+
+int imageWarpTable::genWarperCamRows(cameraMetadata *pCameraMetadata, int sphereRadius, int rowBegin, int rowEnd)
+{// the same projection as genWarperCamPrecise, rearranged so that most of the work is shared:
+ // the sphere point is (-cos(theta) * sin(phi), sin(theta), cos(theta) * cos(phi)), so with the world to camera R, T
+ //     cam = cos(theta) * A[m] + B[k],  A[m] = radius * (-sin(phi) * R.col0 + cos(phi) * R.col2),  B[k] = radius * sin(theta) * R.col1 + T
+ // A is computed once per column, B once per row, and the nodes are left with a few multiply-adds, atan and the invpol polynomial
+ // the cube faces have no such split, there A holds the whole rotated sphere point of every node and B is just T
+
+    double R[EXT_PARAM_R_MTX_NUM], T[EXT_PARAM_T_VEC_NUM];
+    ocamModel stOcamModel;
+    pCameraMetadata->getWorld2CamRotMtx(R);
+    pCameraMetadata->getWorld2CamTransVec(T);
+    pCameraMetadata->getOcamModel(&stOcamModel);
+
+    camProjection stProj;
+    stProj.lengthInvpol = (stOcamModel.length_invpol > 0) ? stOcamModel.length_invpol : 1;
+    for (int i = 0; i < POL_LENGTH_INV; i++)
+        stProj.invpol[i] = (i < stOcamModel.length_invpol) ? (float)stOcamModel.invpol[i] : 0.0f;
+    stProj.c = (float)stOcamModel.c;
+    stProj.d = (float)stOcamModel.d;
+    stProj.e = (float)stOcamModel.e;
+    stProj.uc = (float)stOcamModel.uc;
+    stProj.vc = (float)stOcamModel.vc;
+
+    // column terms
+    std::vector<float> columnMem(6 * mTableW);
+    float *pA0 = &columnMem[0];
+    float *pA1 = pA0 + mTableW;
+    float *pA2 = pA1 + mTableW;
+    float *pColPosX = pA2 + mTableW;
+    float *pImgX = pColPosX + mTableW;
+    float *pImgY = pImgX + mTableW;
+    std::vector<int> colSteps(mTableW);
+
+    for (int m = 0; m < mTableW; m++)
+    {
+        int m_steps = mWarpImgDstRoi.roiX + m * mProStepX;
+        if (m_steps > mWarpImgDstRoi.roiX + mWarpImgDstRoi.roiW)
+            m_steps = mWarpImgDstRoi.roiX + mWarpImgDstRoi.roiW;
+        pColPosX[m] = -1.0 + 2.0 * (m_steps - mWarpImgDstRoi.roiX) / mWarpImgDstRoi.roiW;  // normalized to -1.0 ~ 1.0
+        colSteps[m] = m_steps;
+        if (mProjection != warpEquirect)
+            continue;
+
+        double phi = 2 * M_PI * m_steps / mWarpImgDstRoi.imgW;
+        double sinPhi = sin(phi);
+        double cosPhi = cos(phi);
+        pA0[m] = (float)(sphereRadius * (-sinPhi * R[0] + cosPhi * R[2]));
+        pA1[m] = (float)(sphereRadius * (-sinPhi * R[3] + cosPhi * R[5]));
+        pA2[m] = (float)(sphereRadius * (-sinPhi * R[6] + cosPhi * R[8]));
+    }
+
+    for (int k = rowBegin; k < rowEnd; k++)
+    {
+        int k_steps = mWarpImgDstRoi.roiY + k * mProStepY;
+        if (k_steps > mWarpImgDstRoi.roiY + mWarpImgDstRoi.roiH)
+            k_steps = mWarpImgDstRoi.roiY + mWarpImgDstRoi.roiH;
+        float tempPosY = 1.0 - 2.0 * (k_steps - mWarpImgDstRoi.roiY) / mWarpImgDstRoi.roiH; // normalized to 1.0 ~ -1.0
+
+        if (mProjection == warpEquirect)
+        {
+            double theta = M_PI_2 - M_PI * k_steps / mWarpImgDstRoi.imgH;	// latitude
+            float B[3];
+            for (int i = 0; i < 3; i++)
+                B[i] = (float)(sphereRadius * sin(theta) * R[3 * i + 1] + T[i]);
+
+            projectNodes(&stProj, (float)cos(theta), B, pA0, pA1, pA2, mTableW, pImgX, pImgY);
+        }
+        else
+        {
+            for (int m = 0; m < mTableW; m++)
+            {
+                double panoCoords[2] = { (double)k_steps, (double)colSteps[m] };
+                double sphere[3];
+                panoToSphere(panoCoords, sphere);
+                pA0[m] = (float)(sphereRadius * (R[0] * sphere[0] + R[1] * sphere[1] + R[2] * sphere[2]));
+                pA1[m] = (float)(sphereRadius * (R[3] * sphere[0] + R[4] * sphere[1] + R[5] * sphere[2]));
+                pA2[m] = (float)(sphereRadius * (R[6] * sphere[0] + R[7] * sphere[1] + R[8] * sphere[2]));
+            }
+            float B[3] = { (float)T[0], (float)T[1], (float)T[2] };
+
+            projectNodes(&stProj, 1.0f, B, pA0, pA1, pA2, mTableW, pImgX, pImgY);
+        }
+
+        float *pmapX = mPmapX + k * mTableW;
+        float *pmapY = mPmapY + k * mTableW;
+        float *pposX = mPposX + k * mTableW;
+        float *pposY = mPposY + k * mTableW;
+        float *pvcf = mHasVC ? mPvcfr + k * mTableW : NULL;
+        for (int m = 0; m < mTableW; m++)
+        {
+            float imgY = pImgY[m];
+            float imgX = pImgX[m];
+
+            // points falling out of the image borders are pointed to the head, as genWarperCamPrecise does
+            if (imgY < 1 || imgY > mSrcImageH - 1 || imgX < 1 || imgX > mSrcImageW - 1)
+            {
+                imgY = 0;
+                imgX = 0;
+            }
+
+            pmapX[m] = imgX;
+            pmapY[m] = imgY;
+            pposX[m] = pColPosX[m];
+            pposY[m] = tempPosY;
+
+            if (mHasVC)
+            {
+                double img[2] = { imgY, imgX };
+                pvcf[m] = (imgY == 0) ? 1.0f : (float)pCameraMetadata->vignettCorrectionFactor(img);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int imageWarpTable::genWarperCamPrecise(cameraMetadata *pCameraMetadata, int sphereRadius)
 {// when fisheye image is the input, vignette correction is needed. 
  // and normalized coordinates are saved.
 
@@ -211,6 +783,11 @@ int imageWarpTable::genWarperCam(cameraMetadata *pCameraMetadata, int sphereRadi
             sphere[1] = sin(theta);               // sphere axis Y, pointing to the north pole
             sphere[2] = cos(theta) * cos(phi);    // sphere axis Z, pointing to the viewer
             sphere[0] = -cos(theta) * sin(phi);   // sphere axis X, pointing to the right hand direction
+            if (mProjection != warpEquirect)
+            {
+                double panoCoords[2] = { (double)k_steps, (double)m_steps };
+                panoToSphere(panoCoords, sphere);
+            }
             pCameraMetadata->sph2cam(sphereRadius, cam, sphere);
             pCameraMetadata->cam2img(img, cam);
 
@@ -329,14 +906,8 @@ int imageWarpTable::coordTransPanoToFisheye(double oriCoords[2], double panoCoor
  // which is the camera model calibration used image, not the projection source image
 
     double sphere[3], cam[3], img[2];
-    double theta, phi;
-
-    theta = M_PI_2 - M_PI * panoCoords[0] / mWarpImgDstRoi.imgH;  //height;
-    phi = 2 * M_PI * panoCoords[1] / mWarpImgDstRoi.imgW;         //width;
 
-    sphere[1] = sin(theta);              // sphere axis Y, pointing to the north pole
-    sphere[2] = cos(theta) * cos(phi);   // sphere axis Z, pointing to the viewer
-    sphere[0] = -cos(theta) * sin(phi);  // sphere axis X, pointing to the right hand direction
+    panoToSphere(panoCoords, sphere);
 
     pCameraMetadata->sph2cam(sphereRadius, cam, sphere);
     pCameraMetadata->cam2img(img, cam);
@@ -355,7 +926,7 @@ int imageWarpTable::coordTransFisheyeToPano(double panoCoords[2], double oriCoor
  // which is the camera model calibration used image, not the projection source image
 
     double sphere[3], cam[3], img[2];
-    double theta, phi, norm;
+    double norm;
     int k;
 
     img[0] = oriCoords[0];  // y
@@ -371,19 +942,7 @@ int imageWarpTable::coordTransFisheyeToPano(double panoCoords[2], double oriCoor
         sphere[k] /= norm;
     }
 
-    theta = asin(sphere[1]);
-    norm = sqrt(sphere[0] * sphere[0] + sphere[2] * sphere[2]);
-    phi = acos(sphere[2] / norm);
-
-    if (sphere[0] > 0)
-    {
-        phi = 2 * M_PI - phi;
-    }
-
-    panoCoords[1] = mWarpImgDstRoi.imgW * phi / (2 * M_PI);           // x
-    panoCoords[0] = mWarpImgDstRoi.imgH * (M_PI_2 - theta) / M_PI;    // y
-
-    return 0;
+    return sphereToPano(sphere, panoCoords);
 }
 
 int imageWarpTable::checkMapTableRange()
@@ -8,12 +8,22 @@
 #include "YiPanoramaTypes.h"
 #include "CameraMetadata.h"
 
+#include <stddef.h>
+
 namespace YiPanorama {
 namespace warper {
 
 using namespace util;
 using namespace calibration;
 
+enum warpProjection
+{// layout of the whole warped image a table is part of
+    warpEquirect = 0,   // longitude along x with the front lens at the center, latitude along y
+    warpCubemap,        // 3 x 2 cube faces of W / 3 x H / 2: left, front, right on top and down, back, up below,
+                        // both rows run on across their faces so the lower one lies on its side
+    warpEAC             // the same faces, equi-angular: the pixels are spread evenly over the view angle
+};
+
 class imageWarpTable
 {// an image warp table represents a projection mapping table and generating operations related.
 public:
@@ -28,14 +38,37 @@ public:
     // release table memories
     int dinit();
 
-    // save projection table into file
-    //int save(char *fileName);
+    // default warpEquirect, must be set before the table is generated. with the cube faces the roi of the table has to
+    // stay inside one face, so the mapping is smooth all over the table and the edges of the face are exact
+    int setProjection(warpProjection projection);
+
+    // a point of the whole warped image (row, column) to the unit sphere of genWarperCamRows, and back
+    int panoToSphere(const double panoCoords[2], double sphere[3]);
+    int sphereToPano(const double sphere[3], double panoCoords[2]);
+
+    // right, down and forward (3 x 3, in rows) of cube face 0 ~ 5 in the warpCubemap / warpEAC layout
+    static const double *cubeFaceAxes(int face);
+
+    // key of the table cache: a hash of the camera model, extrinsic parameters, sphere radius, pano size, step and ROI
+    unsigned long long tableCacheKey(cameraMetadata *pCameraMetadata, int sphereRadius);
 
-    // read projection table from file
-    //int read(char *fileName);
+    // save projection table into file, tagged with the cache key
+    int save(const char *fileName, unsigned long long key);
 
-    // set fisheye camera projection table, memories are set in this process
+    // map a saved projection table instead of generating it, init() must have been called with the same sizes.
+    // returns -1 when the file is missing or doesn't match this table and key, the table is then left untouched
+    int read(const char *fileName, unsigned long long key);
+
+    // set fisheye camera projection table, memories are set in this process.
+    // nodes are evaluated 4 at a time in float, rows are split over the default thread pool
     int genWarperCam(cameraMetadata *pCameraMetadata, int sphereRadius);
+
+    // fast generating of table rows [rowBegin, rowEnd) only, so that several tables can share one parallel loop.
+    // mSrcImageW / mSrcImageH must already be set from the camera, genWarperCam does that
+    int genWarperCamRows(cameraMetadata *pCameraMetadata, int sphereRadius, int rowBegin, int rowEnd);
+
+    // the original per node sph2cam + cam2img in double, slow, kept as the reference of the fast generator
+    int genWarperCamPrecise(cameraMetadata *pCameraMetadata, int sphereRadius);
     //int genWarperCamReserve(cameraMetadata *pCameraMetadata, int sphereRadius, int thresAngle);
 
     // set whole sphere projection, memories are set in this process
@@ -69,6 +102,8 @@ public:
                              // so the size of the map table could also be set in the process of projection
 	imageRoi mSrcImageRoi; // the source image is part of a destiny image
 
+    warpProjection mProjection;
+
     bool mIsSparseTable;    // if the table is sparse table
     int mProStepX;          // sparse mapping table steps
     int mProStepY;
@@ -83,6 +118,9 @@ public:
 
 	float *mPposX;            // postion x, y in OpenGL, normalized , ranging from -1 ~ 1;
 	float *mPposY;
+
+	void *mPMapBase;          // tables mapped from a cache file by read(), NULL when they are allocated by init()
+	size_t mMapSize;
 };
 
 }   // namespace warper
@@ -1,15 +1,28 @@
-
 #include "ImageWarper.h"
 #include "MappingCL.h"
+#include "ThreadPool.h"
+#include "StitchProfiler.h"
 
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
 #include <iostream>
 #include <string.h>
+#include <vector>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WARPER_USE_NEON
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WARPER_USE_SSE2
+#endif
 
 #pragma warning (disable :4996)
 
+#define BILINEAR_BITS   8       // bilinear weights are fixed point, the four weights sum up to 1 << BILINEAR_BITS
+#define VC_MAX_Q        32767   // vignette factor in the same fixed point, clamped so that results stay in int16
+
 namespace YiPanorama {
 namespace warper {
 
@@ -17,6 +30,7 @@ using namespace std;
 
     ImageWarper::ImageWarper()
     {
+        renderDevice = useSoftware;
     }
 
     ImageWarper::~ImageWarper()
@@ -30,6 +44,366 @@ int ImageWarper::setWarpDevice(renderDeviceType deviceType)
 	return 0;
 }
 
+static inline void fillLinear(float *pDst, float start, float delta, int n)
+{// pDst[i] = start + i * delta
+    int i = 0;
+#if defined(WARPER_USE_NEON)
+    const float ramp[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+    float32x4_t vi = vld1q_f32(ramp);
+    float32x4_t v4 = vdupq_n_f32(4.0f);
+    for (; i + 4 <= n; i += 4)
+    {// same start + i * delta as the scalar tail, not an accumulated sum, to keep both paths bit exact
+        vst1q_f32(pDst + i, vaddq_f32(vdupq_n_f32(start), vmulq_n_f32(vi, delta)));
+        vi = vaddq_f32(vi, v4);
+    }
+#elif defined(WARPER_USE_SSE2)
+    __m128 vi = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    __m128 v4 = _mm_set1_ps(4.0f);
+    for (; i + 4 <= n; i += 4)
+    {// same start + i * delta as the scalar tail, not an accumulated sum, to keep both paths bit exact
+        _mm_storeu_ps(pDst + i, _mm_add_ps(_mm_set1_ps(start), _mm_mul_ps(vi, _mm_set1_ps(delta))));
+        vi = _mm_add_ps(vi, v4);
+    }
+#endif
+    for (; i < n; i++)
+        pDst[i] = start + i * delta;
+}
+
+int ImageWarper::interpRowMap(int row, float *pRowX, float *pRowY, float *pRowF)
+{// the sparse nodes sit on every mProStep pixels, the last node is clamped to the roi border.
+ // the row is first interpolated between the two node rows, then each tile is filled linearly
+    int k = row / mProStepY;
+    int y0 = k * mProStepY;
+    int y1 = (y0 + mProStepY < mWarpImageH) ? y0 + mProStepY : mWarpImageH;
+    float fy = (y1 > y0 && k + 1 < mTableH) ? (float)(row - y0) / (y1 - y0) : 0.0f;
+    int k1 = (k + 1 < mTableH) ? k + 1 : k;
+
+    const float *pX0 = mPmapX + k * mTableW;
+    const float *pX1 = mPmapX + k1 * mTableW;
+    const float *pY0 = mPmapY + k * mTableW;
+    const float *pY1 = mPmapY + k1 * mTableW;
+    const float *pF0 = mHasVC ? mPvcfr + k * mTableW : NULL;
+    const float *pF1 = mHasVC ? mPvcfr + k1 * mTableW : NULL;
+
+    float ax, ay, af, bx, by, bf;
+    ax = pX0[0] + (pX1[0] - pX0[0]) * fy;
+    ay = pY0[0] + (pY1[0] - pY0[0]) * fy;
+    af = mHasVC ? pF0[0] + (pF1[0] - pF0[0]) * fy : 1.0f;
+
+    for (int m = 0; m < mTableW; m++)
+    {
+        int x0 = m * mProStepX;
+        if (x0 >= mWarpImageW)
+            break;
+        int x1 = (x0 + mProStepX < mWarpImageW) ? x0 + mProStepX : mWarpImageW;
+        int n = x1 - x0;
+
+        if (m + 1 < mTableW)
+        {
+            bx = pX0[m + 1] + (pX1[m + 1] - pX0[m + 1]) * fy;
+            by = pY0[m + 1] + (pY1[m + 1] - pY0[m + 1]) * fy;
+            bf = mHasVC ? pF0[m + 1] + (pF1[m + 1] - pF0[m + 1]) * fy : 1.0f;
+        }
+        else
+        {// full table or the right most node
+            bx = ax;
+            by = ay;
+            bf = af;
+        }
+
+        float invN = 1.0f / n;
+        fillLinear(pRowX + x0, ax, (bx - ax) * invN, n);
+        fillLinear(pRowY + x0, ay, (by - ay) * invN, n);
+        fillLinear(pRowF + x0, af, (bf - af) * invN, n);
+
+        ax = bx;
+        ay = by;
+        af = bf;
+    }
+
+    return 0;
+}
+
+static inline void bilinearFixed(float sx, float sy, int srcW, int srcH, int &ix, int &iy, int w[4])
+{// integer position and the four weights (00, 01, 10, 11) of a sample point, clamped to the image
+    sx = (sx < 0.0f) ? 0.0f : ((sx > srcW - 1) ? srcW - 1 : sx);
+    sy = (sy < 0.0f) ? 0.0f : ((sy > srcH - 1) ? srcH - 1 : sy);
+    ix = (int)sx;
+    iy = (int)sy;
+    ix = (ix > srcW - 2) ? srcW - 2 : ix;
+    iy = (iy > srcH - 2) ? srcH - 2 : iy;
+
+    int ax = (int)((sx - ix) * (1 << BILINEAR_BITS) + 0.5f);
+    int ay = (int)((sy - iy) * (1 << BILINEAR_BITS) + 0.5f);
+    w[3] = (ax * ay + (1 << (BILINEAR_BITS - 1))) >> BILINEAR_BITS;
+    w[1] = ax - w[3];
+    w[2] = ay - w[3];
+    w[0] = (1 << BILINEAR_BITS) - ax - ay + w[3];
+}
+
+static inline int vcFixed(float f)
+{
+    int q = (int)(f * (1 << BILINEAR_BITS) + 0.5f);
+    return (q < 0) ? 0 : ((q > VC_MAX_Q) ? VC_MAX_Q : q);
+}
+
+// scalar reference of all kernels: ((sum of p * w) + half) * vc >> 16
+static inline unsigned char blendScalar(int p00, int p01, int p10, int p11, const int w[4], int vcQ)
+{
+    int s = p00 * w[0] + p01 * w[1] + p10 * w[2] + p11 * w[3] + (1 << (BILINEAR_BITS - 1));
+    s = (s * vcQ) >> (2 * BILINEAR_BITS);
+    return (unsigned char)((s > 255) ? 255 : s);
+}
+
+int ImageWarper::warpRowsRGB(imageFrame *pSrcImage, imageFrame *pProImage, int dstX, int dstY, int rowBegin, int rowEnd)
+{
+    int srcW = pSrcImage->imageW;
+    int srcH = pSrcImage->imageH;
+    int srcStride = pSrcImage->strides[0];
+    const unsigned char *pSrc = pSrcImage->plane[0];
+
+    std::vector<float> rowMap(3 * mWarpImageW);
+    float *pRowX = &rowMap[0];
+    float *pRowY = pRowX + mWarpImageW;
+    float *pRowF = pRowY + mWarpImageW;
+
+    for (int row = rowBegin; row < rowEnd; row++)
+    {
+        interpRowMap(row, pRowX, pRowY, pRowF);
+        unsigned char *pDst = pProImage->plane[0] + (dstY + row) * pProImage->strides[0] + dstX * 3;
+
+        for (int col = 0; col < mWarpImageW; col++, pDst += 3)
+        {
+            int ix, iy, w[4];
+            bilinearFixed(pRowX[col], pRowY[col], srcW, srcH, ix, iy, w);
+            int vcQ = mHasVC ? vcFixed(pRowF[col]) : (1 << BILINEAR_BITS);
+            const unsigned char *p0 = pSrc + iy * srcStride + ix * 3;
+            const unsigned char *p1 = p0 + srcStride;
+
+#if defined(WARPER_USE_NEON) || defined(WARPER_USE_SSE2)
+            if (ix < srcW - 2)
+            {// 8 byte loads hold both neighbours of a row: r0 g0 b0 r1 g1 b1 x x
+#if defined(WARPER_USE_NEON)
+                const uint16_t wa[16] = { (uint16_t)w[0], (uint16_t)w[0], (uint16_t)w[0], (uint16_t)w[1], (uint16_t)w[1], (uint16_t)w[1], 0, 0,
+                                          (uint16_t)w[2], (uint16_t)w[2], (uint16_t)w[2], (uint16_t)w[3], (uint16_t)w[3], (uint16_t)w[3], 0, 0 };
+                uint16x8_t s = vmulq_u16(vmovl_u8(vld1_u8(p0)), vld1q_u16(wa));
+                s = vmlaq_u16(s, vmovl_u8(vld1_u8(p1)), vld1q_u16(wa + 8));
+                s = vaddq_u16(s, vextq_u16(s, s, 3));
+                s = vaddq_u16(s, vdupq_n_u16(1 << (BILINEAR_BITS - 1)));
+                uint16x4_t h = vshrn_n_u32(vmull_n_u16(vget_low_u16(s), (uint16_t)vcQ), 16);
+                uint8x8_t o = vqmovn_u16(vcombine_u16(h, h));
+                pDst[0] = vget_lane_u8(o, 0);
+                pDst[1] = vget_lane_u8(o, 1);
+                pDst[2] = vget_lane_u8(o, 2);
+#else
+                __m128i zero = _mm_setzero_si128();
+                __m128i r0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p0), zero);
+                __m128i r1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p1), zero);
+                __m128i s = _mm_add_epi16(_mm_mullo_epi16(r0, _mm_setr_epi16(w[0], w[0], w[0], w[1], w[1], w[1], 0, 0)),
+                                          _mm_mullo_epi16(r1, _mm_setr_epi16(w[2], w[2], w[2], w[3], w[3], w[3], 0, 0)));
+                s = _mm_add_epi16(s, _mm_srli_si128(s, 6));
+                s = _mm_add_epi16(s, _mm_set1_epi16(1 << (BILINEAR_BITS - 1)));
+                s = _mm_mulhi_epu16(s, _mm_set1_epi16((short)vcQ));
+                int o = _mm_cvtsi128_si32(_mm_packus_epi16(s, s));
+                pDst[0] = (unsigned char)o;
+                pDst[1] = (unsigned char)(o >> 8);
+                pDst[2] = (unsigned char)(o >> 16);
+#endif
+                continue;
+            }
+#endif
+            for (int c = 0; c < 3; c++)
+                pDst[c] = blendScalar(p0[c], p0[c + 3], p1[c], p1[c + 3], w, vcQ);
+        }
+    }
+
+    return 0;
+}
+
+static void sampleRowMono(const unsigned char *pSrc, int srcStride, int srcW, int srcH, const float *pRowX, const float *pRowY,
+    const short *pVcQ, float coordScale, int count, int colStep, unsigned char *pDst)
+{// single channel bilinear sampling, the neighbours are gathered 8 at a time and blended with simd
+ // colStep picks every colStep-th entry of the row map, coordScale maps it onto the plane (0.5 for chroma)
+    int col = 0;
+#if defined(WARPER_USE_NEON) || defined(WARPER_USE_SSE2)
+    unsigned short p[4][8], w[4][8], vc[8];
+    for (; col + 8 <= count; col += 8)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            int ix, iy, wi[4];
+            int m = (col + i) * colStep;
+            bilinearFixed(pRowX[m] * coordScale, pRowY[m] * coordScale, srcW, srcH, ix, iy, wi);
+            const unsigned char *p0 = pSrc + iy * srcStride + ix;
+            p[0][i] = p0[0];
+            p[1][i] = p0[1];
+            p[2][i] = p0[srcStride];
+            p[3][i] = p0[srcStride + 1];
+            w[0][i] = wi[0];
+            w[1][i] = wi[1];
+            w[2][i] = wi[2];
+            w[3][i] = wi[3];
+            vc[i] = pVcQ ? pVcQ[m] : (1 << BILINEAR_BITS);
+        }
+#if defined(WARPER_USE_NEON)
+        uint16x8_t s = vmulq_u16(vld1q_u16(p[0]), vld1q_u16(w[0]));
+        s = vmlaq_u16(s, vld1q_u16(p[1]), vld1q_u16(w[1]));
+        s = vmlaq_u16(s, vld1q_u16(p[2]), vld1q_u16(w[2]));
+        s = vmlaq_u16(s, vld1q_u16(p[3]), vld1q_u16(w[3]));
+        s = vaddq_u16(s, vdupq_n_u16(1 << (BILINEAR_BITS - 1)));
+        uint16x8_t f = vld1q_u16(vc);
+        uint16x4_t lo = vshrn_n_u32(vmull_u16(vget_low_u16(s), vget_low_u16(f)), 16);
+        uint16x4_t hi = vshrn_n_u32(vmull_u16(vget_high_u16(s), vget_high_u16(f)), 16);
+        vst1_u8(pDst + col, vqmovn_u16(vcombine_u16(lo, hi)));
+#else
+        __m128i s = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)p[0]), _mm_loadu_si128((const __m128i *)w[0]));
+        s = _mm_add_epi16(s, _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)p[1]), _mm_loadu_si128((const __m128i *)w[1])));
+        s = _mm_add_epi16(s, _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)p[2]), _mm_loadu_si128((const __m128i *)w[2])));
+        s = _mm_add_epi16(s, _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)p[3]), _mm_loadu_si128((const __m128i *)w[3])));
+        s = _mm_add_epi16(s, _mm_set1_epi16(1 << (BILINEAR_BITS - 1)));
+        s = _mm_mulhi_epu16(s, _mm_loadu_si128((const __m128i *)vc));
+        _mm_storel_epi64((__m128i *)(pDst + col), _mm_packus_epi16(s, s));
+#endif
+    }
+#endif
+    for (; col < count; col++)
+    {
+        int ix, iy, wi[4];
+        int m = col * colStep;
+        bilinearFixed(pRowX[m] * coordScale, pRowY[m] * coordScale, srcW, srcH, ix, iy, wi);
+        const unsigned char *p0 = pSrc + iy * srcStride + ix;
+        pDst[col] = blendScalar(p0[0], p0[1], p0[srcStride], p0[srcStride + 1], wi, pVcQ ? pVcQ[m] : (1 << BILINEAR_BITS));
+    }
+}
+
+static void vignetteChroma(unsigned char *pDst, const short *pVcQ, int count, int colStep)
+{// vignette correction scales rgb, in yuv this means scaling the chroma around 128
+    int col = 0;
+#if defined(WARPER_USE_NEON) || defined(WARPER_USE_SSE2)
+    short f[8];
+    for (; col + 8 <= count; col += 8)
+    {
+        for (int i = 0; i < 8; i++)
+            f[i] = pVcQ[(col + i) * colStep];
+#if defined(WARPER_USE_NEON)
+        int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(pDst + col), vdup_n_u8(128)));
+        int16x8_t vf = vld1q_s16(f);
+        int16x4_t lo = vqrshrn_n_s32(vmull_s16(vget_low_s16(d), vget_low_s16(vf)), BILINEAR_BITS);
+        int16x4_t hi = vqrshrn_n_s32(vmull_s16(vget_high_s16(d), vget_high_s16(vf)), BILINEAR_BITS);
+        int16x8_t r = vaddq_s16(vcombine_s16(lo, hi), vdupq_n_s16(128));
+        vst1_u8(pDst + col, vqmovun_s16(r));
+#else
+        __m128i c128 = _mm_set1_epi16(128);
+        __m128i d = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pDst + col)), _mm_setzero_si128()), c128);
+        __m128i vf = _mm_loadu_si128((const __m128i *)f);
+        __m128i ml = _mm_mullo_epi16(d, vf);
+        __m128i mh = _mm_mulhi_epi16(d, vf);
+        __m128i half = _mm_set1_epi32(1 << (BILINEAR_BITS - 1));
+        __m128i lo = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(ml, mh), half), BILINEAR_BITS);
+        __m128i hi = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(ml, mh), half), BILINEAR_BITS);
+        __m128i r = _mm_add_epi16(_mm_packs_epi32(lo, hi), c128);
+        _mm_storel_epi64((__m128i *)(pDst + col), _mm_packus_epi16(r, r));
+#endif
+    }
+#endif
+    for (; col < count; col++)
+    {
+        int r = (((pDst[col] - 128) * pVcQ[col * colStep] + (1 << (BILINEAR_BITS - 1))) >> BILINEAR_BITS) + 128;
+        pDst[col] = (unsigned char)((r < 0) ? 0 : ((r > 255) ? 255 : r));
+    }
+}
+
+int ImageWarper::warpRowsYUV420(imageFrame *pSrcImage, imageFrame *pProImage, int dstX, int dstY, int rowBegin, int rowEnd)
+{// chroma row r is sampled with the mapping of luma row 2r and every second column, as the opencl kernel does
+    int srcW = pSrcImage->imageW;
+    int srcH = pSrcImage->imageH;
+    int chromaW = mWarpImageW / 2;
+
+    std::vector<float> rowMap(3 * mWarpImageW);
+    std::vector<short> rowVc(mWarpImageW);
+    float *pRowX = &rowMap[0];
+    float *pRowY = pRowX + mWarpImageW;
+    float *pRowF = pRowY + mWarpImageW;
+    short *pVcQ = mHasVC ? &rowVc[0] : NULL;
+
+    for (int cRow = rowBegin; cRow < rowEnd; cRow++)
+    {
+        for (int row = 2 * cRow; row < 2 * cRow + 2 && row < mWarpImageH; row++)
+        {
+            interpRowMap(row, pRowX, pRowY, pRowF);
+            if (mHasVC)
+            {
+                for (int col = 0; col < mWarpImageW; col++)
+                    pVcQ[col] = (short)vcFixed(pRowF[col]);
+            }
+
+            unsigned char *pDstY = pProImage->plane[0] + (dstY + row) * pProImage->strides[0] + dstX;
+            sampleRowMono(pSrcImage->plane[0], pSrcImage->strides[0], srcW, srcH, pRowX, pRowY, pVcQ, 1.0f, mWarpImageW, 1, pDstY);
+
+            if (row != 2 * cRow)
+                continue;
+
+            for (int c = 1; c < 3; c++)
+            {
+                unsigned char *pDstC = pProImage->plane[c] + (dstY / 2 + cRow) * pProImage->strides[c] + dstX / 2;
+                sampleRowMono(pSrcImage->plane[c], pSrcImage->strides[c], srcW / 2, srcH / 2, pRowX, pRowY, NULL, 0.5f, chromaW, 2, pDstC);
+                if (mHasVC)
+                    vignetteChroma(pDstC, pVcQ, chromaW, 2);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ImageWarper::warpImage(imageFrame srcImage, imageFrame proImage)
+{// software warping with the sparse table, deterministic on every device so it also serves as the gles reference
+    STITCH_PROFILE_SCOPE(profileWarp);
+    if (mPmapX == NULL || mPmapY == NULL || mWarpImageW <= 0 || mWarpImageH <= 0)
+    {
+        std::cout << "warpImage: warp table is not generated" << std::endl;
+        return -1;
+    }
+    if (srcImage.pxlColorFormat != proImage.pxlColorFormat || srcImage.imageW < 2 || srcImage.imageH < 2)
+    {
+        std::cout << "warpImage: source and warped image formats do not match" << std::endl;
+        return -1;
+    }
+
+    // the warped roi is written at its place when a whole panorama frame is given
+    int dstX = 0, dstY = 0;
+    if (proImage.imageW == mWarpImgDstRoi.imgW && proImage.imageH == mWarpImgDstRoi.imgH)
+    {
+        dstX = mWarpImgDstRoi.roiX;
+        dstY = mWarpImgDstRoi.roiY;
+    }
+    if (proImage.imageW < dstX + mWarpImageW || proImage.imageH < dstY + mWarpImageH)
+    {
+        std::cout << "warpImage: warped image is smaller than the warp roi" << std::endl;
+        return -1;
+    }
+
+    util::ThreadPool *pPool = util::ThreadPool::getDefault();
+    switch (srcImage.pxlColorFormat)
+    {
+    case PIXELCOLORSPACE_RGB:
+        pPool->parallelFor(0, mWarpImageH, [&](int rowBegin, int rowEnd) {
+            warpRowsRGB(&srcImage, &proImage, dstX, dstY, rowBegin, rowEnd);
+        }, 8);
+        break;
+    case PIXELCOLORSPACE_YUV420PYV:
+        pPool->parallelFor(0, (mWarpImageH + 1) / 2, [&](int rowBegin, int rowEnd) {
+            warpRowsYUV420(&srcImage, &proImage, dstX & ~1, dstY & ~1, rowBegin, rowEnd);
+        }, 4);
+        break;
+    default:
+        std::cout << "warpImage: unsupported color format" << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
 
 }   // namespace warper
 }   // namespace YiPanorama
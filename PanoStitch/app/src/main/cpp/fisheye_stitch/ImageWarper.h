@@ -47,12 +47,19 @@ public:
 
     // pure software warping without any hardware acceleration
     int setWarpDevice(renderDeviceType deviceType);
+    // warp a RGB or YUV420 frame with the sparse table on the cpu, rows are split over the default thread pool.
+    // proImage is either the warped roi alone, or a whole panorama frame whose mWarpImgDstRoi is filled
     int warpImage(imageFrame srcImage, imageFrame proImage);
 
     int warpImageSoftFullWithoutVCSingleChn(unsigned char *srcImage, unsigned char *proImage);// for basic mode mask generating only
 
 private:
+    // dense mapping of one warped row, interpolated from the sparse table tile by tile
+    int interpRowMap(int row, float *pRowX, float *pRowY, float *pRowF);
 
+    // bilinear sampling kernels for rows [rowBegin, rowEnd) of the warped image
+    int warpRowsRGB(imageFrame *pSrcImage, imageFrame *pProImage, int dstX, int dstY, int rowBegin, int rowEnd);
+    int warpRowsYUV420(imageFrame *pSrcImage, imageFrame *pProImage, int dstX, int dstY, int rowBegin, int rowEnd);  // rows in chroma units
 
     renderDeviceType renderDevice;  // important 
 
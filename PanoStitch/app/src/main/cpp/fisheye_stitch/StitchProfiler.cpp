@@ -0,0 +1,335 @@
+#include "StitchProfiler.h"
+
+#include <EGL/egl.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iostream>
+
+namespace YiPanorama {
+namespace util {
+
+static const char *gStageNames[PROFILE_STAGE_NUM] =
+{
+    "frame",
+    "load",
+    "upload",
+    "warp",
+    "seamFlow",
+    "colorAdjust",
+    "blend",
+    "readback",
+    "save",
+    "preview",
+    "setup"
+};
+
+static int profileThreadId()
+{// small per thread numbers for the trace, 0 is the GPU track
+    static std::atomic<int> threadCount(0);
+    thread_local int threadId = ++threadCount;
+    return threadId;
+}
+
+StitchProfiler::StitchProfiler() :
+    mNextEvent(0), mFrame(0)
+{
+    for (int k = 0; k != PROFILE_RING_SIZE; ++k)
+        mEvents[k].seq.store(0, std::memory_order_relaxed);
+}
+
+StitchProfiler::~StitchProfiler()
+{
+}
+
+void StitchProfiler::record(profileStage stage, profileDevice device, double startUs, double durationUs, long long frame)
+{// the slot is claimed by the index, and marked as being written until its fields are complete
+    unsigned int index = mNextEvent.fetch_add(1, std::memory_order_relaxed);
+    profileEvent *pEvent = &mEvents[index % PROFILE_RING_SIZE];
+
+    pEvent->seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    pEvent->stage = stage;
+    pEvent->device = device;
+    pEvent->threadId = (device == profileGPU) ? 0 : profileThreadId();
+    pEvent->frame = (frame < 0) ? mFrame.load(std::memory_order_relaxed) : frame;
+    pEvent->startUs = startUs;
+    pEvent->durationUs = durationUs;
+    pEvent->seq.store(index + 1, std::memory_order_release);
+}
+
+int StitchProfiler::copyEvent(unsigned int index, profileEvent *pCopy)
+{
+    profileEvent *pEvent = &mEvents[index % PROFILE_RING_SIZE];
+
+    unsigned int seq = pEvent->seq.load(std::memory_order_acquire);
+    if (seq != index + 1)
+        return -1;
+
+    pCopy->stage = pEvent->stage;
+    pCopy->device = pEvent->device;
+    pCopy->threadId = pEvent->threadId;
+    pCopy->frame = pEvent->frame;
+    pCopy->startUs = pEvent->startUs;
+    pCopy->durationUs = pEvent->durationUs;
+
+    // a writer which took the slot meanwhile has changed seq before touching the fields
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (pEvent->seq.load(std::memory_order_relaxed) == seq) ? 0 : -1;
+}
+
+long long StitchProfiler::nextFrame()
+{
+    return mFrame.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+long long StitchProfiler::currentFrame()
+{
+    return mFrame.load(std::memory_order_relaxed);
+}
+
+int StitchProfiler::getStageStats(profileStage stage, profileDevice device, profileStageStats *pStats)
+{
+    if (pStats == NULL || stage < 0 || stage >= PROFILE_STAGE_NUM)
+        return -1;
+
+    // a stage may run several times in a frame (8 warps, 4 blends), its time of the frame is their sum
+    std::map<long long, double> frameDurations;
+    unsigned int end = mNextEvent.load(std::memory_order_acquire);
+    unsigned int count = (end < PROFILE_RING_SIZE) ? end : PROFILE_RING_SIZE;
+    profileEvent event;
+    for (unsigned int index = end - count; index != end; ++index)
+    {
+        if (copyEvent(index, &event) == 0 && event.stage == stage && event.device == device)
+            frameDurations[event.frame] += event.durationUs / 1000.0;
+    }
+
+    std::vector<double> durations;
+    durations.reserve(frameDurations.size());
+    for (std::map<long long, double>::iterator it = frameDurations.begin(); it != frameDurations.end(); ++it)
+        durations.push_back(it->second);
+
+    memset(pStats, 0, sizeof(profileStageStats));
+    if (durations.empty())
+        return 0;
+
+    std::sort(durations.begin(), durations.end());
+    double sum = 0.0;
+    for (size_t k = 0; k != durations.size(); ++k)
+        sum += durations[k];
+
+    pStats->count = (int)durations.size();
+    pStats->minMs = durations.front();
+    pStats->maxMs = durations.back();
+    pStats->avgMs = sum / durations.size();
+    pStats->p99Ms = durations[(size_t)ceil(0.99 * durations.size()) - 1];
+    return 0;
+}
+
+int StitchProfiler::printStats()
+{
+    static const char *deviceNames[PROFILE_DEVICE_NUM] = { "cpu", "gpu" };
+    profileStageStats stats;
+
+    printf("StitchProfiler: stage         frames     min     avg     p99     max (ms)\n");
+    for (int device = 0; device != PROFILE_DEVICE_NUM; ++device)
+    {
+        for (int stage = 0; stage != PROFILE_STAGE_NUM; ++stage)
+        {
+            getStageStats((profileStage)stage, (profileDevice)device, &stats);
+            if (stats.count == 0)
+                continue;
+            printf("StitchProfiler: %s %-11s %6d %7.2f %7.2f %7.2f %7.2f\n", deviceNames[device], gStageNames[stage],
+                stats.count, stats.minMs, stats.avgMs, stats.p99Ms, stats.maxMs);
+        }
+    }
+    return 0;
+}
+
+int StitchProfiler::dumpChromeTrace(const char *filePath)
+{
+    FILE *fp = fopen(filePath, "w");
+    if (fp == NULL)
+    {
+        std::cout << "dumpChromeTrace: can not open " << filePath << std::endl;
+        return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"GPU\"}}");
+
+    unsigned int end = mNextEvent.load(std::memory_order_acquire);
+    unsigned int count = (end < PROFILE_RING_SIZE) ? end : PROFILE_RING_SIZE;
+    profileEvent event;
+    for (unsigned int index = end - count; index != end; ++index)
+    {
+        if (copyEvent(index, &event) != 0 || event.stage < 0 || event.stage >= PROFILE_STAGE_NUM)
+            continue;
+        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%lld}}",
+            gStageNames[event.stage], event.device == profileGPU ? "gpu" : "cpu", event.threadId,
+            event.startUs, event.durationUs, event.frame);
+    }
+    fprintf(fp, "\n]}\n");
+
+    int result = ferror(fp) ? -1 : 0;
+    fclose(fp);
+    return result;
+}
+
+int StitchProfiler::reset()
+{// events written meanwhile may survive, their slots are past the new start
+    mNextEvent.store(0, std::memory_order_relaxed);
+    for (int k = 0; k != PROFILE_RING_SIZE; ++k)
+        mEvents[k].seq.store(0, std::memory_order_release);
+    return 0;
+}
+
+const char *StitchProfiler::stageName(profileStage stage)
+{
+    return (stage >= 0 && stage < PROFILE_STAGE_NUM) ? gStageNames[stage] : "unknown";
+}
+
+double StitchProfiler::nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+StitchProfiler *StitchProfiler::getDefault()
+{// never destroyed, stages may end in static destructors of other objects
+    static StitchProfiler *pProfiler = NULL;
+    static std::once_flag flag;
+    std::call_once(flag, []() {
+        pProfiler = new StitchProfiler();
+    });
+    return pProfiler;
+}
+
+scopedStageTimer::scopedStageTimer(profileStage stage) :
+    mStage(stage), mStartUs(StitchProfiler::nowUs())
+{
+}
+
+scopedStageTimer::~scopedStageTimer()
+{
+    StitchProfiler::getDefault()->record(mStage, profileCPU, mStartUs, StitchProfiler::nowUs() - mStartUs);
+}
+
+GpuStageTimer::GpuStageTimer() :
+    pGetQueryObjectui64v(NULL), mIsAvailable(false), mIsActive(false), mHead(0), mTail(0)
+{
+    memset(mQueries, 0, sizeof(mQueries));
+}
+
+GpuStageTimer::~GpuStageTimer()
+{// the queries go with their context, dinit() deletes them while it is alive
+}
+
+int GpuStageTimer::init()
+{
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    mIsAvailable = false;
+    mIsActive = false;
+    mHead = mTail = 0;
+
+    if (extensions == NULL || strstr(extensions, "GL_EXT_disjoint_timer_query") == NULL)
+    {
+        std::cout << "GpuStageTimer: GL_EXT_disjoint_timer_query is not supported, gpu stages are not timed" << std::endl;
+        return -1;
+    }
+    pGetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+    if (pGetQueryObjectui64v == NULL)
+        return -1;
+
+    glGenQueries(GPU_TIMER_QUERIES, mQueries);
+    mIsAvailable = true;
+    return 0;
+}
+
+int GpuStageTimer::dinit()
+{
+    if (mIsAvailable)
+    {// a single shot session ends right after its frame, so the pending results are waited for here
+        if (mIsActive)
+            end();
+        if (mHead != mTail)
+        {
+            glFinish();
+            collect();
+        }
+        glDeleteQueries(GPU_TIMER_QUERIES, mQueries);
+    }
+    mIsAvailable = false;
+    mIsActive = false;
+    mHead = mTail = 0;
+    return 0;
+}
+
+int GpuStageTimer::begin(profileStage stage)
+{
+    if (!mIsAvailable || mIsActive)
+        return -1;
+
+    // all queries wait for results: take the ready ones, or leave this stage out
+    if (mTail - mHead == GPU_TIMER_QUERIES && (collect() != 0 || mTail - mHead == GPU_TIMER_QUERIES))
+        return -1;
+
+    unsigned int slot = mTail % GPU_TIMER_QUERIES;
+    glBeginQuery(GL_TIME_ELAPSED_EXT, mQueries[slot]);
+    mStages[slot] = stage;
+    mStartUs[slot] = StitchProfiler::nowUs();
+    mFrames[slot] = StitchProfiler::getDefault()->currentFrame();
+    mIsActive = true;
+    return 0;
+}
+
+int GpuStageTimer::end()
+{
+    if (!mIsActive)
+        return -1;
+
+    glEndQuery(GL_TIME_ELAPSED_EXT);
+    mTail++;
+    mIsActive = false;
+    return 0;
+}
+
+int GpuStageTimer::collect()
+{
+    if (!mIsAvailable)
+        return -1;
+
+    GLint disjoint = 0;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    if (disjoint)
+    {// the pending times are meaningless
+        mHead = mTail;
+        return 0;
+    }
+
+    // queries complete in order, so the first one not ready ends the scan
+    while (mHead != mTail)
+    {
+        unsigned int slot = mHead % GPU_TIMER_QUERIES;
+        GLuint isReady = 0;
+        glGetQueryObjectuiv(mQueries[slot], GL_QUERY_RESULT_AVAILABLE, &isReady);
+        if (!isReady)
+            break;
+
+        GLuint64 elapsedNs = 0;
+        pGetQueryObjectui64v(mQueries[slot], GL_QUERY_RESULT, &elapsedNs);
+        StitchProfiler::getDefault()->record(mStages[slot], profileGPU, mStartUs[slot], elapsedNs / 1000.0, mFrames[slot]);
+        mHead++;
+    }
+    return 0;
+}
+
+}   // namespace util
+}   // namespace YiPanorama
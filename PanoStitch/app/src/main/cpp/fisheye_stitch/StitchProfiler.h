@@ -0,0 +1,174 @@
+/************************************************************************/
+/* Per-stage cpu / gpu timing of the stitch pipeline                    */
+/* events go into a lock free ring, from which the stage statistics     */
+/* and a Chrome trace (chrome://tracing, Perfetto) are taken            */
+/************************************************************************/
+#pragma once
+#ifndef _STITCH_PROFILER_H
+#define _STITCH_PROFILER_H
+
+#include <atomic>
+
+#include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
+
+// build switch, STITCH_PROFILING=1 (the STITCH_PROFILING cmake option) compiles the timers in.
+// otherwise the STITCH_PROFILE_* / STITCH_GPU_TIMER_* macros are empty and nothing is measured
+#ifndef STITCH_PROFILING
+#define STITCH_PROFILING 0
+#endif
+
+#define PROFILE_RING_SIZE 8192      // events kept, the statistics and the trace cover these
+#define GPU_TIMER_QUERIES 64        // gpu stages that can wait for their result at once
+
+namespace YiPanorama {
+namespace util {
+
+enum profileStage
+{
+    profileFrame,           // a whole imageStitch call
+    profileLoad,
+    profileUpload,          // fisheye frames to the GPU
+    profileWarp,
+    profileSeamFlow,        // optical flow alignment of the seams
+    profileColorAdjust,
+    profileBlend,
+    profileReadback,        // GPU to the output frame, including the wait for the GPU
+    profileSave,
+    profilePreview,         // a whole previewStitch call
+    profileSetup,           // GLES objects built for a glesSingleShot frame
+    PROFILE_STAGE_NUM
+};
+
+enum profileDevice
+{
+    profileCPU,
+    profileGPU,
+    PROFILE_DEVICE_NUM
+};
+
+struct profileStageStats
+{// milliseconds a stage took per frame, over the frames with events still in the ring
+    int count;          // frames
+    double minMs;
+    double avgMs;
+    double p99Ms;
+    double maxMs;
+};
+
+class StitchProfiler
+{// record() may be called from any thread and never locks; a writer that laps a reader only costs the reader
+ // that one event, the statistics and the trace skip events which change while they are copied
+public:
+    StitchProfiler();
+    ~StitchProfiler();
+
+    // startUs on the nowUs() clock, frame -1 is the current frame
+    void record(profileStage stage, profileDevice device, double startUs, double durationUs, long long frame = -1);
+
+    // the frame index events are tagged with, advanced once per imageStitch
+    long long nextFrame();
+    long long currentFrame();
+
+    int getStageStats(profileStage stage, profileDevice device, profileStageStats *pStats);
+
+    // count / min / avg / p99 / max of every stage that has events, printed to stdout
+    int printStats();
+
+    // the events in the ring as Chrome trace JSON, cpu stages on their threads and gpu stages on a "GPU" track
+    int dumpChromeTrace(const char *filePath);
+
+    // drop all events
+    int reset();
+
+    static const char *stageName(profileStage stage);
+
+    // monotonic clock in microseconds
+    static double nowUs();
+
+    // process wide profiler the STITCH_PROFILE_* macros record into, created on first use
+    static StitchProfiler *getDefault();
+
+private:
+    struct profileEvent
+    {
+        std::atomic<unsigned int> seq;  // index + 1 once written, 0 while being written
+        int stage;
+        int device;
+        int threadId;
+        long long frame;
+        double startUs;
+        double durationUs;
+    };
+
+    int copyEvent(unsigned int index, profileEvent *pCopy);    // 0 when event index is still in the ring and whole
+
+    profileEvent mEvents[PROFILE_RING_SIZE];
+    std::atomic<unsigned int> mNextEvent;
+    std::atomic<long long> mFrame;
+};
+
+class scopedStageTimer
+{// a cpu stage from construction to destruction
+public:
+    explicit scopedStageTimer(profileStage stage);
+    ~scopedStageTimer();
+
+private:
+    profileStage mStage;
+    double mStartUs;
+};
+
+class GpuStageTimer
+{// GL_TIME_ELAPSED_EXT queries around GLES stages. results arrive frames later, collect() records those that are
+ // ready; a disjoint event (frequency change, context loss) drops the pending ones. the queries belong to the
+ // GLES context current at init(), so all calls need that context. without the extension every call does nothing
+public:
+    GpuStageTimer();
+    ~GpuStageTimer();
+
+    int init();
+    int dinit();
+
+    // one stage at a time, GLES can't nest elapsed time queries
+    int begin(profileStage stage);
+    int end();
+
+    int collect();
+
+private:
+    PFNGLGETQUERYOBJECTUI64VEXTPROC pGetQueryObjectui64v;
+    bool mIsAvailable;
+    bool mIsActive;
+    GLuint mQueries[GPU_TIMER_QUERIES];
+    profileStage mStages[GPU_TIMER_QUERIES];
+    double mStartUs[GPU_TIMER_QUERIES];     // cpu time of begin(), where the stage is placed in the trace
+    long long mFrames[GPU_TIMER_QUERIES];
+    unsigned int mHead;     // oldest query waiting for its result
+    unsigned int mTail;     // next query to begin
+};
+
+}   // namespace util
+}   // namespace YiPanorama
+
+#if STITCH_PROFILING
+#define STITCH_PROFILE_CONCAT_(a, b) a##b
+#define STITCH_PROFILE_CONCAT(a, b) STITCH_PROFILE_CONCAT_(a, b)
+#define STITCH_PROFILE_SCOPE(stage) YiPanorama::util::scopedStageTimer STITCH_PROFILE_CONCAT(stitchStageTimer, __LINE__)(stage)
+#define STITCH_PROFILE_NEXT_FRAME() YiPanorama::util::StitchProfiler::getDefault()->nextFrame()
+#define STITCH_GPU_TIMER_INIT(pTimer) (pTimer)->init()
+#define STITCH_GPU_TIMER_DINIT(pTimer) (pTimer)->dinit()
+#define STITCH_GPU_TIMER_BEGIN(pTimer, stage) (pTimer)->begin(stage)
+#define STITCH_GPU_TIMER_END(pTimer) (pTimer)->end()
+#define STITCH_GPU_TIMER_COLLECT(pTimer) (pTimer)->collect()
+#else
+#define STITCH_PROFILE_SCOPE(stage) ((void)0)
+#define STITCH_PROFILE_NEXT_FRAME() ((void)0)
+#define STITCH_GPU_TIMER_INIT(pTimer) ((void)0)
+#define STITCH_GPU_TIMER_DINIT(pTimer) ((void)0)
+#define STITCH_GPU_TIMER_BEGIN(pTimer, stage) ((void)0)
+#define STITCH_GPU_TIMER_END(pTimer) ((void)0)
+#define STITCH_GPU_TIMER_COLLECT(pTimer) ((void)0)
+#endif
+
+#endif  // !_STITCH_PROFILER_H
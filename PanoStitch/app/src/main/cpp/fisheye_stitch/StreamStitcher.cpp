@@ -0,0 +1,266 @@
+
+#include "StreamStitcher.h"
+#include "ImageIOConverter.h"
+#include "FramePool.h"
+#include "StitchProfiler.h"
+
+#include <string.h>
+#include <iostream>
+
+namespace YiPanorama {
+namespace fisheyePano {
+
+#define STREAM_WAIT_MS 10   // how long the stitch thread sleeps before checking for stop / end of stream again
+
+fisheyeStreamStitcher::fisheyeStreamStitcher() :
+    mInitResult(0), mEndOfStream(false), mStop(false), mDrained(false), mIsOpen(false), mPulledSlot(-1), mFisheyeW(0), mFisheyeH(0)
+{
+}
+
+fisheyeStreamStitcher::~fisheyeStreamStitcher()
+{
+    close();
+}
+
+int fisheyeStreamStitcher::open(streamStitchParams *pParams)
+{
+    if (mIsOpen || pParams == NULL || pParams->pFisheyePanoParams == NULL)
+        return -1;
+
+    mFisheyeW = pParams->pFisheyePanoParams->stFisheyePanoParamsCore.fisheyeImgW;
+    mFisheyeH = pParams->pFisheyePanoParams->stFisheyePanoParamsCore.fisheyeImgH;
+
+    // every slot is either in a queue or held by one stage, so the queues can never overflow
+    for (int i = 0; i != STREAM_QUEUE_DEPTH; ++i)
+    {
+        initImageFrame(&mInputFrames[i][0], mFisheyeW, mFisheyeH, PIXELCOLORSPACE_RGB);
+        initImageFrame(&mInputFrames[i][1], mFisheyeW, mFisheyeH, PIXELCOLORSPACE_RGB);
+        initImageFrame(&mPanoFrames[i], pParams->panoW, pParams->panoH, pParams->outputFormat);
+        mInputFree.tryPush(i);
+        mPanoFree.tryPush(i);
+    }
+    mPulledSlot = -1;
+
+    mInitResult = 1;
+    mEndOfStream = false;
+    mStop = false;
+    mDrained = false;
+    mStitchThread = std::thread(&fisheyeStreamStitcher::stitchLoop, this, *pParams);
+    mIsOpen = true;
+
+    // the GLES context is created on the stitch thread, wait for it
+    while (mInitResult == 1)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    if (mInitResult != 0)
+    {
+        std::cout << "fisheyeStreamStitcher: stitcher init failed" << std::endl;
+        close();
+        return -1;
+    }
+
+    return 0;
+}
+
+int fisheyeStreamStitcher::pushFrame(imageFrame front, imageFrame back, long long pts, int timeoutMs)
+{
+    if (!mIsOpen || mEndOfStream)
+        return -1;
+
+    imageFrame *pSrc[2] = { &front, &back };
+    for (int i = 0; i != 2; ++i)
+    {
+        if (pSrc[i]->pxlColorFormat != PIXELCOLORSPACE_RGB || pSrc[i]->imageW != mFisheyeW || pSrc[i]->imageH != mFisheyeH)
+        {
+            std::cout << "fisheyeStreamStitcher::pushFrame: expect " << mFisheyeW << "x" << mFisheyeH << " RGB frames" << std::endl;
+            return -1;
+        }
+    }
+
+    int slot;
+    if (!mInputFree.waitPop(&slot, timeoutMs))
+        return 1;
+
+    // the caller's buffers are reused for its next decode, so the pixels are copied into the slot
+    for (int i = 0; i != 2; ++i)
+    {
+        imageFrame *pDst = &mInputFrames[slot][i];
+        for (int h = 0; h != mFisheyeH; ++h)
+            memcpy(pDst->plane[0] + h * pDst->strides[0], pSrc[i]->plane[0] + h * pSrc[i]->strides[0], mFisheyeW * 3);
+    }
+
+    streamFrame frame = { slot, pts };
+    mInputReady.tryPush(frame);
+    return 0;
+}
+
+int fisheyeStreamStitcher::endOfStream()
+{
+    if (!mIsOpen)
+        return -1;
+
+    mEndOfStream = true;
+    return 0;
+}
+
+int fisheyeStreamStitcher::pullPano(imageFrame *pPanoImage, long long *pPts, int timeoutMs)
+{
+    if (!mIsOpen)
+        return -1;
+
+    // the pano handed out by the last call goes back to the stitch thread
+    if (mPulledSlot >= 0)
+    {
+        mPanoFree.tryPush(mPulledSlot);
+        mPulledSlot = -1;
+    }
+
+    streamFrame frame;
+    if (!mPanoReady.waitPop(&frame, timeoutMs))
+    {
+        // drained is set after the last push, so an empty queue now means there is nothing left
+        if (mDrained && mPanoReady.empty())
+            return -1;
+        return 1;
+    }
+
+    mPulledSlot = frame.slot;
+    *pPanoImage = mPanoFrames[frame.slot];
+    if (pPts != NULL)
+        *pPts = frame.pts;
+    return 0;
+}
+
+int fisheyeStreamStitcher::close()
+{
+    if (!mIsOpen)
+        return 0;
+
+    mStop = true;
+    if (mStitchThread.joinable())
+        mStitchThread.join();
+
+    // empty the queues so the session can be opened again
+    int slot;
+    streamFrame frame;
+    while (mInputFree.tryPop(&slot));
+    while (mInputReady.tryPop(&frame));
+    while (mPanoFree.tryPop(&slot));
+    while (mPanoReady.tryPop(&frame));
+
+    for (int i = 0; i != STREAM_QUEUE_DEPTH; ++i)
+    {
+        dinitImageFrame(&mInputFrames[i][0]);
+        dinitImageFrame(&mInputFrames[i][1]);
+        dinitImageFrame(&mPanoFrames[i]);
+    }
+    mPulledSlot = -1;
+    mIsOpen = false;
+
+    framePoolStats stats;
+    FramePool::getDefault()->getStats(&stats);
+    std::cout << "fisheyeStreamStitcher: frame pool peak " << stats.peakBytesInUse / (1024 * 1024) << " MB in use, "
+        << stats.allocations << " allocations, " << stats.reuses << " reuses" << std::endl;
+#if STITCH_PROFILING
+    StitchProfiler::getDefault()->printStats();
+#endif
+
+    return 0;
+}
+
+int fisheyeStreamStitcher::popPanoSlot(int *pSlot)
+{// the consumer lagging behind stalls the GPU here, which in turn fills the input queue
+    while (!mStop)
+    {
+        if (mPanoFree.waitPop(pSlot, STREAM_WAIT_MS))
+            return 0;
+    }
+    return -1;
+}
+
+void fisheyeStreamStitcher::stitchLoop(streamStitchParams params)
+{
+    mStitcher.setGLESSessionMode(glesPersistent);
+    mStitcher.setGLESRenderMode(params.renderMode);
+    mStitcher.setPipelineDepth(params.pipelineDepth);
+    mStitcher.setWarpTableCacheDir(params.warpTableCacheDir);
+    mStitcher.setSeamOptFlow(params.seamOptFlow);
+    int result = mStitcher.setOutputFormat(params.outputFormat);
+    if (result == 0)
+    {
+        result = mStitcher.init(params.pFisheyePanoParams, normal, params.panoW, params.panoH, params.maskPath);
+        if (result != 0)
+            mStitcher.dinit();
+    }
+    if (result != 0)
+    {
+        mDrained = true;
+        mInitResult = -1;
+        return;
+    }
+    mInitResult = 0;
+
+    // pts of the frames on the GPU, the pano imageStitch returns belongs to the oldest one
+    long long ptsInFlight[STITCH_PIPELINE_MAX_DEPTH];
+    int ptsHead = 0;
+    int ptsCount = 0;
+    int panoSlot = -1;
+
+    while (!mStop)
+    {
+        streamFrame input;
+        if (!mInputReady.waitPop(&input, STREAM_WAIT_MS))
+        {
+            if (mEndOfStream && mInputReady.empty())
+                break;
+            continue;
+        }
+
+        if (panoSlot < 0 && popPanoSlot(&panoSlot) != 0)
+            break;
+
+        result = mStitcher.imageStitch(mInputFrames[input.slot], mPanoFrames[panoSlot]);
+
+        // the fisheye pixels are in the upload buffers once imageStitch returns, the slot can be refilled
+        mInputFree.tryPush(input.slot);
+
+        if (result < 0)
+        {
+            std::cout << "fisheyeStreamStitcher: imageStitch failed, frame " << input.pts << " dropped" << std::endl;
+            continue;
+        }
+
+        ptsInFlight[(ptsHead + ptsCount) % STITCH_PIPELINE_MAX_DEPTH] = input.pts;
+        ++ptsCount;
+        if (result == 0)
+        {
+            streamFrame pano = { panoSlot, ptsInFlight[ptsHead] };
+            ptsHead = (ptsHead + 1) % STITCH_PIPELINE_MAX_DEPTH;
+            --ptsCount;
+            mPanoReady.tryPush(pano);
+            panoSlot = -1;
+        }
+    }
+
+    // end of stream: read back the frames still in flight
+    while (!mStop && ptsCount > 0)
+    {
+        if (panoSlot < 0 && popPanoSlot(&panoSlot) != 0)
+            break;
+        if (mStitcher.flushStitch(mPanoFrames[panoSlot]) != 0)
+            break;
+
+        streamFrame pano = { panoSlot, ptsInFlight[ptsHead] };
+        ptsHead = (ptsHead + 1) % STITCH_PIPELINE_MAX_DEPTH;
+        --ptsCount;
+        mPanoReady.tryPush(pano);
+        panoSlot = -1;
+    }
+
+    // the GLES context lives on this thread, so it is released here too
+    mStitcher.dinit();
+    mDrained = true;
+}
+
+}   // namespace fisheyePano
+}   // namespace YiPanorama
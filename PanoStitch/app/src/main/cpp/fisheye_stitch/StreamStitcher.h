@@ -0,0 +1,105 @@
+/************************************************************************/
+/* Streaming stitch session for dual fisheye video:                     */
+/* the producer pushes fisheye pairs, a dedicated GLES thread stitches  */
+/* them and the consumer pulls the panos, stages are linked by bounded  */
+/* lock free queues                                                     */
+/************************************************************************/
+#pragma once
+#ifndef _STREAM_STITCHER_H
+#define _STREAM_STITCHER_H
+
+#include "FisheyePanoStitcherComp.h"
+#include "FrameQueue.h"
+
+#include <thread>
+#include <atomic>
+
+#define STREAM_QUEUE_DEPTH 4    // fisheye pairs waiting for the GPU, and panos waiting for the consumer
+
+namespace YiPanorama {
+namespace fisheyePano {
+
+struct streamStitchParams
+{// the pointers are only read until open() returns
+    fisheyePanoParams *pFisheyePanoParams;
+    int panoW;
+    int panoH;
+    const char *maskPath;           // blend mask file, as for fisheyePanoStitcherComp::init
+    ePixelColorSpace outputFormat;  // PIXELCOLORSPACE_RGB, RGBA, YUV420PYV or NV12
+    int pipelineDepth;              // GPU frames in flight, 1 ~ STITCH_PIPELINE_MAX_DEPTH
+    glesRenderMode renderMode;
+    const char *warpTableCacheDir;  // NULL or "" always generates the warp tables
+    bool seamOptFlow;               // align the seams by optical flow, warm started frame to frame
+
+    streamStitchParams() :
+        pFisheyePanoParams(NULL),
+        panoW(0),
+        panoH(0),
+        maskPath(NULL),
+        outputFormat(PIXELCOLORSPACE_RGB),
+        pipelineDepth(2),
+        renderMode(glesQuadrants),
+        warpTableCacheDir(NULL),
+        seamOptFlow(false)
+    {
+    }
+};
+
+class fisheyeStreamStitcher
+{
+public:
+    fisheyeStreamStitcher();
+    ~fisheyeStreamStitcher();
+
+    // start the stitch thread, which owns the GLES context. returns -1 if the stitcher failed to initialize
+    int open(streamStitchParams *pParams);
+
+    // copy a RGB fisheye pair into the input queue. returns 1 when the queue stayed full for timeoutMs,
+    // the frame is not taken then; -1 when the session is not open or the frames don't match the params
+    int pushFrame(imageFrame front, imageFrame back, long long pts, int timeoutMs = 0);
+
+    // no more pushFrame calls, the frames still queued and in flight are stitched and can be pulled
+    int endOfStream();
+
+    // next pano in push order. the planes stay valid until the next pullPano or close.
+    // returns 1 when no pano came within timeoutMs, -1 after the last pano of an ended stream
+    int pullPano(imageFrame *pPanoImage, long long *pPts, int timeoutMs = 0);
+
+    // stop the stitch thread and release everything, frames not pulled yet are dropped
+    int close();
+
+private:
+    struct streamFrame
+    {
+        int slot;
+        long long pts;
+    };
+
+    void stitchLoop(streamStitchParams params);
+    int popPanoSlot(int *pSlot);    // a free pano slot for the stitch thread, -1 once stopping
+
+    fisheyePanoStitcherComp mStitcher;
+
+    imageFrame mInputFrames[STREAM_QUEUE_DEPTH][2];
+    imageFrame mPanoFrames[STREAM_QUEUE_DEPTH];
+
+    FrameQueue<int, STREAM_QUEUE_DEPTH> mInputFree;             // stitch thread -> producer
+    FrameQueue<streamFrame, STREAM_QUEUE_DEPTH> mInputReady;    // producer -> stitch thread
+    FrameQueue<int, STREAM_QUEUE_DEPTH> mPanoFree;              // consumer -> stitch thread
+    FrameQueue<streamFrame, STREAM_QUEUE_DEPTH> mPanoReady;     // stitch thread -> consumer
+
+    std::thread mStitchThread;
+    std::atomic<int> mInitResult;   // 1 while the stitch thread is initializing
+    std::atomic<bool> mEndOfStream;
+    std::atomic<bool> mStop;
+    std::atomic<bool> mDrained;     // the stitch thread delivered its last pano
+    bool mIsOpen;
+    int mPulledSlot;                // pano slot the consumer holds, returned on the next pull
+    int mFisheyeW;
+    int mFisheyeH;
+};
+
+}   // namespace fisheyePano
+}   // namespace YiPanorama
+
+#endif  //!_STREAM_STITCHER_H
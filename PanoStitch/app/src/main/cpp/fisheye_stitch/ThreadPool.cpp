@@ -0,0 +1,194 @@
+#include "ThreadPool.h"
+
+#include <iostream>
+
+namespace YiPanorama {
+namespace util {
+
+    static thread_local int sBandDepth = 0;    // > 0 while this thread runs a band, nested parallelFor calls run inline
+
+    ThreadPool::ThreadPool() :
+        mPJobFunc(NULL),
+        mJobBegin(0),
+        mJobEnd(0),
+        mJobBand(1),
+        mJobBandNum(0),
+        mNextBand(0),
+        mBandsDone(0),
+        mJobId(0),
+        mStop(false),
+        mActive(0)
+    {
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        dinit();
+    }
+
+int ThreadPool::init(int threadNum)
+{
+    if (!mWorkers.empty())
+        dinit();
+
+    if (threadNum <= 0)
+        threadNum = std::thread::hardware_concurrency();
+    if (threadNum <= 0)
+        threadNum = 1;
+
+    mStop = false;
+    for (int i = 0; i < threadNum - 1; i++)
+        mWorkers.push_back(std::thread(&ThreadPool::workerLoop, this));
+
+    return 0;
+}
+
+int ThreadPool::dinit()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWakeCond.notify_all();
+
+    for (size_t i = 0; i < mWorkers.size(); i++)
+        mWorkers[i].join();
+    mWorkers.clear();
+
+    return 0;
+}
+
+int ThreadPool::getThreadNum()
+{
+    return (int)mWorkers.size() + 1;
+}
+
+bool ThreadPool::isWorkerThread()
+{
+    std::thread::id self = std::this_thread::get_id();
+    for (size_t i = 0; i < mWorkers.size(); i++)
+    {
+        if (mWorkers[i].get_id() == self)
+            return true;
+    }
+    return false;
+}
+
+int ThreadPool::parallelFor(int begin, int end, const std::function<void(int, int)> &func, int minBand)
+{
+    int length = end - begin;
+    if (length <= 0)
+        return 0;
+    if (minBand < 1)
+        minBand = 1;
+
+    // a few bands per thread so uneven rows (fisheye borders) still balance
+    int bandNum = getThreadNum() * 4;
+    if (bandNum > (length + minBand - 1) / minBand)
+        bandNum = (length + minBand - 1) / minBand;
+
+    if (bandNum <= 1 || mWorkers.empty() || sBandDepth > 0 || isWorkerThread())
+    {
+        func(begin, end);
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> jobLock(mJobMutex);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mPJobFunc = &func;
+        mJobBegin = begin;
+        mJobEnd = end;
+        mJobBand = (length + bandNum - 1) / bandNum;
+        mJobBandNum = (length + mJobBand - 1) / mJobBand;
+        mNextBand = 0;
+        mBandsDone = 0;
+        mJobId++;
+    }
+    mWakeCond.notify_all();
+
+    runBands(&func, begin, end, mJobBand, mJobBandNum);
+
+    // wait until every band is finished and no worker still holds this job
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mBandsDone != mJobBandNum || mActive != 0)
+        mDoneCond.wait(lock);
+    mPJobFunc = NULL;
+
+    return 0;
+}
+
+void ThreadPool::runBands(const std::function<void(int, int)> *pFunc, int begin, int end, int band, int bandNum)
+{
+    int done = 0;
+    for (;;)
+    {
+        int b = mNextBand++;
+        if (b >= bandNum)
+            break;
+
+        int bandBegin = begin + b * band;
+        int bandEnd = (bandBegin + band < end) ? bandBegin + band : end;
+        sBandDepth++;
+        (*pFunc)(bandBegin, bandEnd);
+        sBandDepth--;
+        done++;
+    }
+
+    if (done)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mBandsDone += done;
+    }
+    mDoneCond.notify_all();
+}
+
+void ThreadPool::workerLoop()
+{
+    unsigned int seenJob = 0;
+    for (;;)
+    {
+        const std::function<void(int, int)> *pFunc;
+        int begin, end, band, bandNum;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while (!mStop && seenJob == mJobId)
+                mWakeCond.wait(lock);
+            if (mStop)
+                return;
+
+            seenJob = mJobId;
+            if (mPJobFunc == NULL)
+                continue;   // woke up after the job was already finished
+
+            pFunc = mPJobFunc;
+            begin = mJobBegin;
+            end = mJobEnd;
+            band = mJobBand;
+            bandNum = mJobBandNum;
+            mActive++;
+        }
+
+        runBands(pFunc, begin, end, band, bandNum);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mActive--;
+        }
+        mDoneCond.notify_all();
+    }
+}
+
+ThreadPool *ThreadPool::getDefault()
+{
+    static ThreadPool *pPool = NULL;
+    static std::once_flag flag;
+    std::call_once(flag, []() {
+        pPool = new ThreadPool();
+        pPool->init(0);
+    });
+    return pPool;
+}
+
+}   // namespace util
+}   // namespace YiPanorama
@@ -0,0 +1,65 @@
+/************************************************************************/
+/* Fixed size worker pool for splitting image rows across cores         */
+/************************************************************************/
+#pragma once
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+namespace YiPanorama {
+namespace util {
+
+class ThreadPool
+{// workers sleep until parallelFor hands them a range, the calling thread works on the range too
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    // start threadNum - 1 workers, threadNum <= 0 means one thread per core
+    int init(int threadNum);
+
+    // stop and join the workers
+    int dinit();
+
+    int getThreadNum();
+
+    // call func(bandBegin, bandEnd) on consecutive bands covering [begin, end), returns when all bands are done.
+    // bands are at least minBand long; calls from inside a band run inline
+    int parallelFor(int begin, int end, const std::function<void(int, int)> &func, int minBand = 1);
+
+    // process wide pool shared by the warper, blender and converters, created on first use
+    static ThreadPool *getDefault();
+
+private:
+    void workerLoop();
+    void runBands(const std::function<void(int, int)> *pFunc, int begin, int end, int band, int bandNum);
+    bool isWorkerThread();
+
+    std::vector<std::thread> mWorkers;
+    std::mutex mJobMutex;       // one parallelFor at a time
+    std::mutex mMutex;
+    std::condition_variable mWakeCond;
+    std::condition_variable mDoneCond;
+
+    const std::function<void(int, int)> *mPJobFunc;
+    int mJobBegin;
+    int mJobEnd;
+    int mJobBand;
+    int mJobBandNum;
+    std::atomic<int> mNextBand;
+    int mBandsDone;
+    unsigned int mJobId;
+    bool mStop;
+    int mActive;                // workers currently holding the job
+};
+
+}   // namespace util
+}   // namespace YiPanorama
+
+#endif  //!_THREAD_POOL_H
@@ -0,0 +1,510 @@
+#include "WarpMesh.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+#define WARP_MESH_SAMPLES   7   // error samples per triangle
+
+namespace YiPanorama {
+namespace warper {
+
+// barycentric weights of the error samples: edge midpoints, the centroid and the points halfway to the corners
+static const double meshSampleWeights[WARP_MESH_SAMPLES][3] = {
+    { 0.5, 0.5, 0.0 }, { 0.0, 0.5, 0.5 }, { 0.5, 0.0, 0.5 },
+    { 1.0 / 3, 1.0 / 3, 1.0 / 3 },
+    { 2.0 / 3, 1.0 / 6, 1.0 / 6 }, { 1.0 / 6, 2.0 / 3, 1.0 / 6 }, { 1.0 / 6, 1.0 / 6, 2.0 / 3 } };
+
+static inline long long edgeKey(int major, int minor)
+{
+    return ((long long)major << 32) | (unsigned int)minor;
+}
+
+static bool mapPanoPoint(imageWarpTable *pTable, cameraMetadata *pCamera, int sphereRadius, double x, double y, double img[2])
+{// the exact mapping of roi pixel x, y as genWarperCamPrecise does it; false when it falls out of the image
+    double panoCoords[2] = { pTable->mWarpImgDstRoi.roiY + y, pTable->mWarpImgDstRoi.roiX + x };
+    pTable->coordTransPanoToFisheye(img, panoCoords, sphereRadius, pCamera);
+    return img[0] >= 1 && img[0] <= pCamera->getOcamImgH() - 1 && img[1] >= 1 && img[1] <= pCamera->getOcamImgW() - 1;
+}
+
+    warpMesh::warpMesh() :
+        mTableNum(0), mVertexNum(0)
+    {
+        memset(&mStats, 0, sizeof(warpMeshStats));
+    }
+
+    warpMesh::~warpMesh()
+    {
+    }
+
+int warpMesh::dinit()
+{
+    mTableNum = 0;
+    mVertexNum = 0;
+    mPos.clear();
+    for (int t = 0; t != WARP_MESH_MAX_TABLES; ++t)
+        mMaps[t].clear();
+    mIndices.clear();
+    mPanoXY.clear();
+    mValid.clear();
+    mRowVertices.clear();
+    mColVertices.clear();
+    mLeaves.clear();
+    memset(&mStats, 0, sizeof(warpMeshStats));
+    return 0;
+}
+
+int warpMesh::setTables(imageWarpTable *pTables[], int tableNum)
+{
+    if (tableNum < 1 || tableNum > WARP_MESH_MAX_TABLES)
+        return -1;
+
+    imageRoi *pRoi = &pTables[0]->mWarpImgDstRoi;
+    for (int t = 1; t < tableNum; ++t)
+    {
+        imageRoi *pOther = &pTables[t]->mWarpImgDstRoi;
+        if (pOther->roiX != pRoi->roiX || pOther->roiY != pRoi->roiY || pOther->roiW != pRoi->roiW || pOther->roiH != pRoi->roiH ||
+            pTables[t]->mTableW != pTables[0]->mTableW || pTables[t]->mTableH != pTables[0]->mTableH)
+        {
+            std::cout << "warpMesh: the tables of a mesh must share roi and step" << std::endl;
+            return -1;
+        }
+    }
+
+    dinit();
+    mTableNum = tableNum;
+    mRoi = *pRoi;
+    mProStepX = pTables[0]->mProStepX;
+    mProStepY = pTables[0]->mProStepY;
+    mStats.uniformVertexNum = pTables[0]->mTableW * pTables[0]->mTableH;
+    return 0;
+}
+
+int warpMesh::genUniform(imageWarpTable *pTables[], int tableNum)
+{
+    if (setTables(pTables, tableNum) != 0)
+        return -1;
+
+    int TableW = pTables[0]->mTableW;
+    int TableH = pTables[0]->mTableH;
+    mVertexNum = TableW * TableH;
+    mPos.resize(2 * mVertexNum);
+    mPanoXY.resize(2 * mVertexNum);
+    mValid.assign(mVertexNum, 0);
+    for (int t = 0; t != mTableNum; ++t)
+        mMaps[t].resize(3 * mVertexNum);
+
+    for (int i = 0; i != mVertexNum; ++i)
+    {
+        int x = (i % TableW) * mProStepX;
+        int y = (i / TableW) * mProStepY;
+        mPanoXY[2 * i] = (x < mRoi.roiW) ? x : mRoi.roiW;     // the last node is clamped to the roi border
+        mPanoXY[2 * i + 1] = (y < mRoi.roiH) ? y : mRoi.roiH;
+        mPos[2 * i] = pTables[0]->mPposX[i];
+        mPos[2 * i + 1] = pTables[0]->mPposY[i];
+        for (int t = 0; t != mTableNum; ++t)
+        {
+            imageWarpTable *pTable = pTables[t];
+            mMaps[t][3 * i] = pTable->mPmapX[i];
+            mMaps[t][3 * i + 1] = pTable->mPmapY[i];
+            mMaps[t][3 * i + 2] = pTable->mHasVC ? pTable->mPvcfr[i] : 1.0f;
+            if (pTable->mPmapX[i] != 0 || pTable->mPmapY[i] != 0)
+                mValid[i] |= 1 << t;
+        }
+    }
+
+    mIndices.resize((TableH - 1) * (TableW - 1) * 6);
+    unsigned int *pVerIdx = mIndices.empty() ? NULL : &mIndices[0];
+    for (int h = 0; h != TableH - 1; ++h)
+    {
+        for (int w = 0; w != TableW - 1; ++w)
+        {
+            unsigned int idx = h * TableW + w;
+            *(pVerIdx++) = idx;
+            *(pVerIdx++) = idx + TableW;
+            *(pVerIdx++) = idx + 1;
+            *(pVerIdx++) = idx + 1;
+            *(pVerIdx++) = idx + TableW;
+            *(pVerIdx++) = idx + TableW + 1;
+        }
+    }
+
+    mStats.vertexNum = mVertexNum;
+    mStats.triangleNum = (int)mIndices.size() / 3;
+    return 0;
+}
+
+warpMesh::meshPoint warpMesh::evalPoint(double x, double y, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius)
+{
+    meshPoint point;
+    point.x = x;
+    point.y = y;
+    point.valid = 0;
+    for (int t = 0; t != mTableNum; ++t)
+    {
+        double img[2];
+        if (mapPanoPoint(pTables[t], pCameras[t], sphereRadius, x, y, img))
+        {
+            point.valid |= 1 << t;
+            point.map[t][0] = (float)img[1];
+            point.map[t][1] = (float)img[0];
+        }
+        else
+        {// pointed to the head, as in the tables
+            point.map[t][0] = 0.0f;
+            point.map[t][1] = 0.0f;
+        }
+    }
+    return point;
+}
+
+warpMesh::meshPoint warpMesh::vertexPoint(int idx)
+{
+    meshPoint point;
+    point.x = mPanoXY[2 * idx];
+    point.y = mPanoXY[2 * idx + 1];
+    point.valid = mValid[idx];
+    for (int t = 0; t != mTableNum; ++t)
+    {
+        point.map[t][0] = mMaps[t][3 * idx];
+        point.map[t][1] = mMaps[t][3 * idx + 1];
+    }
+    return point;
+}
+
+int warpMesh::addVertex(double x, double y, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius)
+{
+    meshPoint point = evalPoint(x, y, pTables, pCameras, sphereRadius);
+    int idx = mVertexNum++;
+    mPos.push_back((float)(-1.0 + 2.0 * x / mRoi.roiW));
+    mPos.push_back((float)(1.0 - 2.0 * y / mRoi.roiH));
+    mPanoXY.push_back(x);
+    mPanoXY.push_back(y);
+    mValid.push_back(point.valid);
+
+    for (int t = 0; t != mTableNum; ++t)
+    {
+        float vcf = 1.0f;
+        if ((point.valid & (1 << t)) != 0 && pTables[t]->mHasVC)
+        {
+            double img[2] = { point.map[t][1], point.map[t][0] };
+            vcf = (float)pCameras[t]->vignettCorrectionFactor(img);
+        }
+        mMaps[t].push_back(point.map[t][0]);
+        mMaps[t].push_back(point.map[t][1]);
+        mMaps[t].push_back(vcf);
+    }
+    return idx;
+}
+
+int warpMesh::cornerVertex(int x, int y, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius)
+{
+    std::map<long long, int>::iterator it = mRowVertices.find(edgeKey(y, x));
+    if (it != mRowVertices.end())
+        return it->second;
+
+    int idx = addVertex(x, y, pTables, pCameras, sphereRadius);
+    mRowVertices[edgeKey(y, x)] = idx;
+    mColVertices[edgeKey(x, y)] = idx;
+    return idx;
+}
+
+float warpMesh::triangleError(const meshPoint *pTri[3], int table, imageWarpTable *pTable, cameraMetadata *pCamera, int sphereRadius, bool *pIsValid)
+{// largest distance between the exact mapping and the linear interpolation the rasterizer does, over the samples
+    *pIsValid = false;
+    for (int i = 0; i != 3; ++i)
+    {
+        if ((pTri[i]->valid & (1 << table)) == 0)
+            return 0.0f;
+    }
+    *pIsValid = true;
+
+    float maxError = 0.0f;
+    for (int s = 0; s != WARP_MESH_SAMPLES; ++s)
+    {
+        const double *w = meshSampleWeights[s];
+        double x = 0, y = 0, mapX = 0, mapY = 0;
+        for (int i = 0; i != 3; ++i)
+        {
+            x += w[i] * pTri[i]->x;
+            y += w[i] * pTri[i]->y;
+            mapX += w[i] * pTri[i]->map[table][0];
+            mapY += w[i] * pTri[i]->map[table][1];
+        }
+
+        double img[2];
+        if (!mapPanoPoint(pTable, pCamera, sphereRadius, x, y, img))
+            continue;   // a corner of the image circle, not drawn anyway
+        float error = (float)sqrt((img[1] - mapX) * (img[1] - mapX) + (img[0] - mapY) * (img[0] - mapY));
+        maxError = (error > maxError) ? error : maxError;
+    }
+    return maxError;
+}
+
+bool warpMesh::isCellSplit(meshCell cell, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius)
+{// every triangle the cell may end up with: the 2 of the grid, and the fan around the center to the corners with
+ // or without the edge midpoints
+    int cellW = cell.x1 - cell.x0;
+    int cellH = cell.y1 - cell.y0;
+    double xm = (cell.x0 + cell.x1) / 2.0;
+    double ym = (cell.y0 + cell.y1) / 2.0;
+
+    meshPoint corners[4] = {
+        vertexPoint(cornerVertex(cell.x0, cell.y0, pTables, pCameras, sphereRadius)),
+        vertexPoint(cornerVertex(cell.x1, cell.y0, pTables, pCameras, sphereRadius)),
+        vertexPoint(cornerVertex(cell.x1, cell.y1, pTables, pCameras, sphereRadius)),
+        vertexPoint(cornerVertex(cell.x0, cell.y1, pTables, pCameras, sphereRadius)) };
+    meshPoint midpoints[4] = {
+        evalPoint(xm, cell.y0, pTables, pCameras, sphereRadius),
+        evalPoint(cell.x1, ym, pTables, pCameras, sphereRadius),
+        evalPoint(xm, cell.y1, pTables, pCameras, sphereRadius),
+        evalPoint(cell.x0, ym, pTables, pCameras, sphereRadius) };
+    meshPoint center = evalPoint(xm, ym, pTables, pCameras, sphereRadius);
+
+    // clockwise around the cell from the top left corner, a midpoint after each corner
+    const meshPoint *pRing[8];
+    unsigned char allValid = center.valid;
+    unsigned char anyValid = center.valid;
+    for (int k = 0; k != 4; ++k)
+    {
+        pRing[2 * k] = &corners[k];
+        pRing[2 * k + 1] = &midpoints[k];
+        allValid &= corners[k].valid & midpoints[k].valid;
+        anyValid |= corners[k].valid | midpoints[k].valid;
+    }
+
+    const meshPoint *pTris[14][3] = {
+        { &corners[0], &corners[3], &corners[1] }, { &corners[1], &corners[3], &corners[2] } };
+    for (int k = 0; k != 8; ++k)
+    {
+        pTris[2 + k][0] = &center;
+        pTris[2 + k][1] = pRing[(k + 1) % 8];
+        pTris[2 + k][2] = pRing[k];
+    }
+    for (int k = 0; k != 4; ++k)
+    {
+        pTris[10 + k][0] = &center;
+        pTris[10 + k][1] = pRing[(2 * k + 2) % 8];
+        pTris[10 + k][2] = pRing[2 * k];
+    }
+
+    for (int t = 0; t != mTableNum; ++t)
+    {
+        unsigned char bit = 1 << t;
+        if ((allValid & bit) == 0 && (anyValid & bit) != 0 && (cellW > mProStepX || cellH > mProStepY))
+            return true;    // the image circle crosses the cell, or passes near it: the border gets the table step
+
+        // then the triangles inside the circle, the others are not checked
+        for (int k = 0; k != 14; ++k)
+        {
+            bool isValid;
+            if (triangleError(pTris[k], t, pTables[t], pCameras[t], sphereRadius, &isValid) > mTolerance)
+                return true;
+        }
+    }
+    return false;
+}
+
+int warpMesh::refineCell(meshCell cell, int depth, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius)
+{
+    mStats.depth = (depth > mStats.depth) ? depth : mStats.depth;
+    bool isSplit = depth < mMaxDepth && cell.x1 - cell.x0 >= 2 && cell.y1 - cell.y0 >= 2 &&
+                   isCellSplit(cell, pTables, pCameras, sphereRadius);
+    if (!isSplit)
+    {// the edge walks need the corners of every leaf
+        cornerVertex(cell.x0, cell.y0, pTables, pCameras, sphereRadius);
+        cornerVertex(cell.x1, cell.y0, pTables, pCameras, sphereRadius);
+        cornerVertex(cell.x0, cell.y1, pTables, pCameras, sphereRadius);
+        cornerVertex(cell.x1, cell.y1, pTables, pCameras, sphereRadius);
+        mLeaves.push_back(cell);
+        return 0;
+    }
+
+    int xm = (cell.x0 + cell.x1) / 2;
+    int ym = (cell.y0 + cell.y1) / 2;
+    meshCell children[4] = {
+        { cell.x0, cell.y0, xm, ym }, { xm, cell.y0, cell.x1, ym },
+        { cell.x0, ym, xm, cell.y1 }, { xm, ym, cell.x1, cell.y1 } };
+    for (int i = 0; i != 4; ++i)
+        refineCell(children[i], depth + 1, pTables, pCameras, sphereRadius);
+    return 0;
+}
+
+int warpMesh::edgeVertices(meshCell cell, int edge, std::vector<unsigned int> *pLoop)
+{// vertices of an edge in the clockwise order around the cell, from its first corner up to the next corner (excluded).
+ // edges 0 ~ 3 are top, right, bottom, left
+    std::map<long long, int>::iterator it, end;
+    size_t start = pLoop->size();
+    switch (edge)
+    {
+    case 0:
+        end = mRowVertices.find(edgeKey(cell.y0, cell.x1));
+        for (it = mRowVertices.find(edgeKey(cell.y0, cell.x0)); it != end; ++it)
+            pLoop->push_back(it->second);
+        break;
+    case 1:
+        end = mColVertices.find(edgeKey(cell.x1, cell.y1));
+        for (it = mColVertices.find(edgeKey(cell.x1, cell.y0)); it != end; ++it)
+            pLoop->push_back(it->second);
+        break;
+    case 2:
+        end = mRowVertices.upper_bound(edgeKey(cell.y1, cell.x1));
+        for (it = mRowVertices.upper_bound(edgeKey(cell.y1, cell.x0)); it != end; ++it)
+            pLoop->push_back(it->second);
+        std::reverse(pLoop->begin() + start, pLoop->end());
+        break;
+    default:
+        end = mColVertices.upper_bound(edgeKey(cell.x0, cell.y1));
+        for (it = mColVertices.upper_bound(edgeKey(cell.x0, cell.y0)); it != end; ++it)
+            pLoop->push_back(it->second);
+        std::reverse(pLoop->begin() + start, pLoop->end());
+        break;
+    }
+    return (int)(pLoop->size() - start);
+}
+
+int warpMesh::balanceLeaves(imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius)
+{// split leaves with more than one hanging vertex on an edge, until no neighbours differ by more than one level
+    bool isChanged = true;
+    std::vector<unsigned int> edge;
+    while (isChanged)
+    {
+        isChanged = false;
+        for (size_t i = 0; i < mLeaves.size(); ++i)
+        {
+            meshCell cell = mLeaves[i];
+            bool isSplit = false;
+            for (int e = 0; e != 4 && !isSplit; ++e)
+            {
+                edge.clear();
+                isSplit = edgeVertices(cell, e, &edge) > 2;
+            }
+            if (!isSplit)
+                continue;
+
+            int xm = (cell.x0 + cell.x1) / 2;
+            int ym = (cell.y0 + cell.y1) / 2;
+            meshCell children[4] = {
+                { cell.x0, cell.y0, xm, ym }, { xm, cell.y0, cell.x1, ym },
+                { cell.x0, ym, xm, cell.y1 }, { xm, ym, cell.x1, cell.y1 } };
+            for (int k = 0; k != 4; ++k)
+            {
+                cornerVertex(children[k].x0, children[k].y0, pTables, pCameras, sphereRadius);
+                cornerVertex(children[k].x1, children[k].y1, pTables, pCameras, sphereRadius);
+                cornerVertex(children[k].x1, children[k].y0, pTables, pCameras, sphereRadius);
+                cornerVertex(children[k].x0, children[k].y1, pTables, pCameras, sphereRadius);
+            }
+            mLeaves[i] = children[0];
+            mLeaves.insert(mLeaves.end(), children + 1, children + 4);
+            isChanged = true;
+        }
+    }
+    return 0;
+}
+
+int warpMesh::triangulateCell(meshCell cell, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius)
+{// the corners and the hanging vertices of finer neighbours, clockwise from the top left corner in roi pixels
+    std::vector<unsigned int> loop;
+    for (int e = 0; e != 4; ++e)
+        edgeVertices(cell, e, &loop);
+
+    if (loop.size() == 4)
+    {// the 2 triangles of the uniform grid
+        unsigned int tl = loop[0], tr = loop[1], br = loop[2], bl = loop[3];
+        unsigned int tris[6] = { tl, bl, tr, tr, bl, br };
+        mIndices.insert(mIndices.end(), tris, tris + 6);
+        return 0;
+    }
+
+    // a fan around the cell center closes the t-junctions, so neither position nor mapping has cracks
+    unsigned int center = addVertex((cell.x0 + cell.x1) / 2.0, (cell.y0 + cell.y1) / 2.0, pTables, pCameras, sphereRadius);
+    for (size_t i = 0; i != loop.size(); ++i)
+    {
+        mIndices.push_back(center);
+        mIndices.push_back(loop[(i + 1) % loop.size()]);
+        mIndices.push_back(loop[i]);
+    }
+    return 0;
+}
+
+int warpMesh::genAdaptive(imageWarpTable *pTables[], cameraMetadata *pCameras[], int tableNum, int sphereRadius,
+    float tolerance, int rootStep, int maxDepth)
+{
+    if (rootStep < 2 || maxDepth < 0 || setTables(pTables, tableNum) != 0)
+        return -1;
+    mTolerance = tolerance;
+    mMaxDepth = maxDepth;
+
+    for (int y = 0; y < mRoi.roiH; y += rootStep)
+    {
+        for (int x = 0; x < mRoi.roiW; x += rootStep)
+        {
+            meshCell root = { x, y, (x + rootStep < mRoi.roiW) ? x + rootStep : mRoi.roiW, (y + rootStep < mRoi.roiH) ? y + rootStep : mRoi.roiH };
+            refineCell(root, 0, pTables, pCameras, sphereRadius);
+        }
+    }
+
+    // all corners exist now, so each leaf sees its hanging vertices
+    balanceLeaves(pTables, pCameras, sphereRadius);
+    for (size_t i = 0; i != mLeaves.size(); ++i)
+        triangulateCell(mLeaves[i], pTables, pCameras, sphereRadius);
+
+    mRowVertices.clear();
+    mColVertices.clear();
+    mLeaves.clear();
+
+    mStats.vertexNum = mVertexNum;
+    mStats.triangleNum = (int)mIndices.size() / 3;
+    return measureError(pTables, pCameras, sphereRadius);
+}
+
+int warpMesh::measureError(imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius)
+{
+    double errorSum = 0.0;
+    mStats.maxError = 0.0f;
+    mStats.measuredTriangles = 0;
+    for (size_t i = 0; i + 3 <= mIndices.size(); i += 3)
+    {
+        for (int t = 0; t != mTableNum; ++t)
+        {
+            meshPoint tri[3] = { vertexPoint(mIndices[i]), vertexPoint(mIndices[i + 1]), vertexPoint(mIndices[i + 2]) };
+            const meshPoint *pTri[3] = { &tri[0], &tri[1], &tri[2] };
+            bool isValid;
+            float error = triangleError(pTri, t, pTables[t], pCameras[t], sphereRadius, &isValid);
+            if (!isValid)
+                continue;
+            mStats.measuredTriangles++;
+            errorSum += error;
+            mStats.maxError = (error > mStats.maxError) ? error : mStats.maxError;
+        }
+    }
+    mStats.meanError = (mStats.measuredTriangles > 0) ? (float)(errorSum / mStats.measuredTriangles) : 0.0f;
+    return 0;
+}
+
+bool warpMesh::isIndex16()
+{
+    return mVertexNum <= WARP_MESH_INDEX16_MAX;
+}
+
+int warpMesh::getIndices16(unsigned short *pIndices, unsigned int base)
+{
+    if (base + mVertexNum > WARP_MESH_INDEX16_MAX)
+        return -1;
+    for (size_t i = 0; i != mIndices.size(); ++i)
+        pIndices[i] = (unsigned short)(mIndices[i] + base);
+    return 0;
+}
+
+int warpMesh::printStats(const char *name)
+{
+    printf("warpMesh %s: %d vertices (uniform grid %d), %d triangles, %d bit indices, depth %d, error max %.3f mean %.3f px\n",
+        name, mStats.vertexNum, mStats.uniformVertexNum, mStats.triangleNum, isIndex16() ? 16 : 32, mStats.depth,
+        mStats.maxError, mStats.meanError);
+    return 0;
+}
+
+}   // namespace warper
+}   // namespace YiPanorama
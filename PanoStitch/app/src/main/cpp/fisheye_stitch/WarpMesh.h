@@ -0,0 +1,107 @@
+/************************************************************************/
+/* Indexed warp meshes for the GLES warpers                             */
+/* either the uniform grid of a sparse table, or an adaptive mesh whose */
+/* cells are split where the lens mapping bends away from its linear    */
+/* interpolation                                                        */
+/************************************************************************/
+#pragma once
+#ifndef _WARP_MESH_H
+#define _WARP_MESH_H
+
+#include "ImageWarpTable.h"
+
+#include <vector>
+#include <map>
+
+#define WARP_MESH_MAX_TABLES    2       // tables sharing one mesh: a warper, or the front and back warpers of a pano quadrant
+#define WARP_MESH_INDEX16_MAX   65536   // vertices addressable by 16 bit indices
+
+namespace YiPanorama {
+namespace warper {
+
+struct warpMeshStats
+{// errors are source pixel distances between the exact mapping and its interpolation over the mesh triangles,
+ // sampled inside every triangle. triangles with a corner outside the image circle are not measured
+    int vertexNum;
+    int triangleNum;
+    int uniformVertexNum;   // vertices of the sparse table grid over the same roi
+    int depth;              // deepest subdivision of the root cells
+    int measuredTriangles;
+    float maxError;
+    float meanError;
+};
+
+class warpMesh
+{// the vertices carry the position in the roi clip space (-1 ~ 1) and, per table, the source image position
+ // (x = column, y = row, in pixels) and the vignette factor. triangles are counter clockwise in clip space
+public:
+    warpMesh();
+    ~warpMesh();
+
+    // the grid of the sparse tables as it is, 2 triangles per table cell. all tables need the same roi and step
+    int genUniform(imageWarpTable *pTables[], int tableNum);
+
+    // root cells of rootStep pano pixels are split into 4 until, for every table, the exact mapping of its camera
+    // is within tolerance pixels of the interpolation inside both triangles of the cell, or maxDepth is reached.
+    // the check covers the fan around the cell center too, which closes the hanging vertices of finer neighbours:
+    // the cells are balanced to at most one of them per edge. cells crossing the image circle are split down to the table step
+    int genAdaptive(imageWarpTable *pTables[], cameraMetadata *pCameras[], int tableNum, int sphereRadius,
+        float tolerance, int rootStep, int maxDepth);
+
+    // sample the error of the current mesh against the exact mapping into mStats
+    int measureError(imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius);
+
+    int dinit();
+
+    bool isIndex16();   // all vertices are reachable by 16 bit indices
+    int getIndices16(unsigned short *pIndices, unsigned int base);    // the indices offset by base, which must stay below WARP_MESH_INDEX16_MAX
+    int printStats(const char *name);
+
+    int mTableNum;
+    int mVertexNum;
+    std::vector<float> mPos;                        // x, y per vertex, roi clip space
+    std::vector<float> mMaps[WARP_MESH_MAX_TABLES]; // x, y, vcf per vertex
+    std::vector<unsigned int> mIndices;             // 3 per triangle
+    warpMeshStats mStats;
+
+private:
+    struct meshCell
+    {
+        int x0, y0, x1, y1;     // roi pixels
+    };
+
+    struct meshPoint
+    {// a vertex, or a point the error is checked at
+        double x, y;                            // roi pixels
+        float map[WARP_MESH_MAX_TABLES][2];     // source x, y
+        unsigned char valid;                    // bit t: inside the image of table t
+    };
+
+    int setTables(imageWarpTable *pTables[], int tableNum);
+    meshPoint evalPoint(double x, double y, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius);
+    meshPoint vertexPoint(int idx);
+    int addVertex(double x, double y, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius);
+    int cornerVertex(int x, int y, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius);
+    bool isCellSplit(meshCell cell, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius);
+    int refineCell(meshCell cell, int depth, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius);
+    int edgeVertices(meshCell cell, int edge, std::vector<unsigned int> *pLoop);
+    int balanceLeaves(imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius);
+    int triangulateCell(meshCell cell, imageWarpTable *pTables[], cameraMetadata *pCameras[], int sphereRadius);
+    float triangleError(const meshPoint *pTri[3], int table, imageWarpTable *pTable, cameraMetadata *pCamera, int sphereRadius, bool *pIsValid);
+
+    imageRoi mRoi;              // pano roi of the tables
+    int mProStepX;              // cells crossing the image circle stop at the table step
+    int mProStepY;
+    float mTolerance;
+    int mMaxDepth;
+    std::vector<double> mPanoXY;                // roi pixel position per vertex, the error samples are placed by it
+    std::vector<unsigned char> mValid;          // bit t: the vertex is inside the image of table t
+    std::map<long long, int> mRowVertices;      // corner vertices by (y, x), to walk horizontal cell edges in order
+    std::map<long long, int> mColVertices;      // and by (x, y) for the vertical ones
+    std::vector<meshCell> mLeaves;
+};
+
+}   // namespace warper
+}   // namespace YiPanorama
+
+#endif  // !_WARP_MESH_H
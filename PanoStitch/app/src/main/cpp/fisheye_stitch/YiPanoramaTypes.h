@@ -18,6 +18,8 @@ enum ePixelColorSpace
     PIXELCOLORSPACE_MONO = 0,
     PIXELCOLORSPACE_YUV420PYV,
     PIXELCOLORSPACE_RGB,
+    PIXELCOLORSPACE_RGBA,       // interleaved, 4 bytes per pixel
+    PIXELCOLORSPACE_NV12,       // Y plane followed by an interleaved U/V plane
 };
 
 struct imageRoi
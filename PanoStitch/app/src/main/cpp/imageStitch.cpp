@@ -3,6 +3,7 @@
 #include "fisheye_stitch/ImageIOConverter.h"
 #include "fisheye_stitch/FisheyePanoStitcherComp.h"
 #include "fisheye_stitch/FisheyePanoParams.h"
+#include "fisheye_stitch/StreamStitcher.h"
 
 
 #include <android/log.h>
@@ -17,9 +18,9 @@ using namespace fisheyePano;
 
 extern "C"
 void saveRGBImage(const char* path, imageFrame panoImage){
-    cv::Mat imageMat(panoImage.imageH, panoImage.imageW, CV_8UC3);
-    memcpy(imageMat.data, panoImage.plane[0], sizeof(unsigned char) * panoImage.imageH * panoImage.imageW * 3);
-    cvtColor(imageMat, imageMat, CV_BGR2RGB);
+    // the pano rows are padded, the swap reads them in place
+    cv::Mat imageMat;
+    cvtColor(cv::Mat(panoImage.imageH, panoImage.imageW, CV_8UC3, panoImage.plane[0], panoImage.strides[0]), imageMat, CV_BGR2RGB);
     imwrite(path, imageMat);
 }
 
@@ -198,6 +199,7 @@ Java_com_Stitcher_imageStitch(JNIEnv *env, jobject instance, jstring src_,
 
     fisheyePanoParams stParams;
     fisheyePanoStitcherComp stStitherComp;
+    imageFrame fisheyePair;     // the decoded file, fisheyeImages are views of its two lenses
     imageFrame fisheyeImages[2];
     imageFrame panoImage;
 
@@ -214,7 +216,7 @@ Java_com_Stitcher_imageStitch(JNIEnv *env, jobject instance, jstring src_,
     initImageFrame(&panoImage, panoWidth, panoHeight, PIXELCOLORSPACE_RGB);
 
     LOGEE("image stitch load fisheye pair");
-    loadImageDataFisheyePair(src, fisheyeImages, overAndUnder);
+    loadImageDataFisheyePair(src, &fisheyePair, fisheyeImages, overAndUnder, stParams.staOcamModels[0].width, stParams.staOcamModels[0].height);
 
     LOGEE("image stitch do stitch");
     stStitherComp.imageStitch(fisheyeImages, panoImage);
@@ -224,8 +226,7 @@ Java_com_Stitcher_imageStitch(JNIEnv *env, jobject instance, jstring src_,
     saveRGBImage(dst, panoImage);
 
     LOGEE("image stitch dinit");
-    dinitImageFrame(&fisheyeImages[0]);
-    dinitImageFrame(&fisheyeImages[1]);
+    dinitImageFrame(&fisheyePair);
     dinitImageFrame(&panoImage);
     stStitherComp.dinit();
 
@@ -233,3 +234,98 @@ Java_com_Stitcher_imageStitch(JNIEnv *env, jobject instance, jstring src_,
     env->ReleaseStringUTFChars(dst_, dst);
     env->ReleaseStringUTFChars(datPath_, datPath);
 }
+
+// streaming session, the handle is a fisheyeStreamStitcher; frames travel in direct ByteBuffers of RGB pixels
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_com_Stitcher_streamOpen(JNIEnv *env, jobject instance, jobject params, jstring datPath_) {
+    const char *datPath = env->GetStringUTFChars(datPath_, 0);
+
+    fisheyePanoParams stParams;
+    transJparamToCparam(env, params, &stParams);
+
+    streamStitchParams stStreamParams;
+    stStreamParams.pFisheyePanoParams = &stParams;
+    stStreamParams.panoW = stParams.stFisheyePanoParamsCore.panoImgW;
+    stStreamParams.panoH = stParams.stFisheyePanoParamsCore.panoImgH;
+    stStreamParams.maskPath = datPath;
+    stStreamParams.outputFormat = PIXELCOLORSPACE_RGB;
+
+    fisheyeStreamStitcher *pStream = new fisheyeStreamStitcher();
+    if (pStream->open(&stStreamParams) != 0) {
+        LOGEE("stream stitch open failed");
+        delete pStream;
+        pStream = NULL;
+    }
+
+    env->ReleaseStringUTFChars(datPath_, datPath);
+    return (jlong) pStream;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_Stitcher_streamPushFrame(JNIEnv *env, jobject instance, jlong handle, jobject front, jobject back,
+                                  jint fisheyeW, jint fisheyeH, jlong pts, jint timeoutMs) {
+    fisheyeStreamStitcher *pStream = (fisheyeStreamStitcher *) handle;
+    if (pStream == NULL)
+        return -1;
+
+    imageFrame fisheyeImages[2];
+    jobject buffers[2] = { front, back };
+    for (int i = 0; i != 2; ++i) {
+        fisheyeImages[i].imageW = fisheyeW;
+        fisheyeImages[i].imageH = fisheyeH;
+        fisheyeImages[i].pxlColorFormat = PIXELCOLORSPACE_RGB;
+        fisheyeImages[i].plane[0] = (unsigned char *) env->GetDirectBufferAddress(buffers[i]);
+        fisheyeImages[i].strides[0] = fisheyeW * 3;
+        if (fisheyeImages[i].plane[0] == NULL || env->GetDirectBufferCapacity(buffers[i]) < (jlong) fisheyeW * fisheyeH * 3)
+            return -1;
+    }
+
+    return pStream->pushFrame(fisheyeImages[0], fisheyeImages[1], pts, timeoutMs);
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_Stitcher_streamEnd(JNIEnv *env, jobject instance, jlong handle) {
+    fisheyeStreamStitcher *pStream = (fisheyeStreamStitcher *) handle;
+    if (pStream == NULL)
+        return -1;
+    return pStream->endOfStream();
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_Stitcher_streamPullPano(JNIEnv *env, jobject instance, jlong handle, jobject pano, jlongArray pts_,
+                                 jint timeoutMs) {
+    fisheyeStreamStitcher *pStream = (fisheyeStreamStitcher *) handle;
+    if (pStream == NULL)
+        return -1;
+
+    imageFrame panoImage;
+    long long pts = 0;
+    int result = pStream->pullPano(&panoImage, &pts, timeoutMs);
+    if (result != 0)
+        return result;
+
+    unsigned char *pDst = (unsigned char *) env->GetDirectBufferAddress(pano);
+    int rowBytes = panoImage.imageW * 3;
+    if (pDst == NULL || env->GetDirectBufferCapacity(pano) < (jlong) rowBytes * panoImage.imageH)
+        return -1;
+    for (int h = 0; h != panoImage.imageH; ++h)
+        memcpy(pDst + h * rowBytes, panoImage.plane[0] + h * panoImage.strides[0], rowBytes);
+
+    jlong ptsOut = pts;
+    env->SetLongArrayRegion(pts_, 0, 1, &ptsOut);
+    return 0;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_Stitcher_streamClose(JNIEnv *env, jobject instance, jlong handle) {
+    fisheyeStreamStitcher *pStream = (fisheyeStreamStitcher *) handle;
+    if (pStream == NULL)
+        return;
+    pStream->close();
+    delete pStream;
+}
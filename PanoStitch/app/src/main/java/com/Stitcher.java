@@ -28,4 +28,13 @@ public class Stitcher {
 
     public native void imageStitch(String src, String dst, CombineParams params, String datPath);
 
+    // streaming session: push RGB fisheye pairs in direct ByteBuffers, pull RGB panos in push order.
+    // push returns 1 when the input queue is full, pull returns 1 when no pano is ready and -1 after the last one
+    public native long streamOpen(CombineParams params, String datPath);
+    public native int streamPushFrame(long handle, java.nio.ByteBuffer front, java.nio.ByteBuffer back,
+                                      int fisheyeWidth, int fisheyeHeight, long pts, int timeoutMs);
+    public native int streamEnd(long handle);
+    public native int streamPullPano(long handle, java.nio.ByteBuffer pano, long[] pts, int timeoutMs);
+    public native void streamClose(long handle);
+
 }